@@ -784,6 +784,108 @@ UndoCmdWritePointer (
     ));
 }
 
+/**
+  Undo the QEMU_LOADER_WRITE_POINTER commands that have been successfully
+  processed by ProcessCmdWritePointer(), in reverse order.
+
+  The pointers are revoked with a single QemuFwCfgTransfer() call. If the list
+  of operations cannot be allocated, the commands are undone one by one with
+  UndoCmdWritePointer().
+
+  @param[in] LoaderStart            The first command of the QEMU
+                                    linker/loader script.
+
+  @param[in] WritePointerSubsetEnd  One past the last QEMU_LOADER_WRITE_POINTER
+                                    command that has been successfully
+                                    processed.
+**/
+STATIC
+VOID
+UndoCmdWritePointers (
+  IN CONST QEMU_LOADER_ENTRY  *LoaderStart,
+  IN CONST QEMU_LOADER_ENTRY  *WritePointerSubsetEnd
+  )
+{
+  CONST QEMU_LOADER_ENTRY          *LoaderEntry;
+  CONST QEMU_LOADER_WRITE_POINTER  *WritePointer;
+  QEMU_FW_CFG_TRANSFER             *Transfers;
+  UINTN                            Count;
+  UINTN                            PointerItemSize;
+  UINT64                           PointerValue;
+  RETURN_STATUS                    Status;
+
+  Count = 0;
+  for (LoaderEntry = LoaderStart;
+       LoaderEntry < WritePointerSubsetEnd;
+       ++LoaderEntry)
+  {
+    if (LoaderEntry->Type == QemuLoaderCmdWritePointer) {
+      ++Count;
+    }
+  }
+
+  if (Count == 0) {
+    return;
+  }
+
+  Transfers = AllocatePool (Count * sizeof *Transfers);
+  if (Transfers == NULL) {
+    LoaderEntry = WritePointerSubsetEnd;
+    while (LoaderEntry > LoaderStart) {
+      --LoaderEntry;
+      if (LoaderEntry->Type == QemuLoaderCmdWritePointer) {
+        UndoCmdWritePointer (&LoaderEntry->Command.WritePointer);
+      }
+    }
+
+    return;
+  }
+
+  PointerValue = 0;
+  Count        = 0;
+  LoaderEntry  = WritePointerSubsetEnd;
+  while (LoaderEntry > LoaderStart) {
+    --LoaderEntry;
+    if (LoaderEntry->Type != QemuLoaderCmdWritePointer) {
+      continue;
+    }
+
+    WritePointer = &LoaderEntry->Command.WritePointer;
+    Status       = QemuFwCfgFindFile (
+                     (CONST CHAR8 *)WritePointer->PointerFile,
+                     &Transfers[Count].Item,
+                     &PointerItemSize
+                     );
+    ASSERT_RETURN_ERROR (Status);
+
+    Transfers[Count].Type   = QemuFwCfgTransferWrite;
+    Transfers[Count].Offset = WritePointer->PointerOffset;
+    Transfers[Count].Size   = WritePointer->PointerSize;
+    Transfers[Count].Buffer = &PointerValue;
+    ++Count;
+  }
+
+  Status = QemuFwCfgTransfer (Transfers, Count);
+  if (RETURN_ERROR (Status)) {
+    DEBUG ((
+      DEBUG_ERROR,
+      "%a: failed to revoke %Lu pointer(s): %r\n",
+      __FUNCTION__,
+      (UINT64)Count,
+      Status
+      ));
+  } else {
+    DEBUG ((
+      DEBUG_VERBOSE,
+      "%a: revoked %Lu pointer(s)\n",
+      __FUNCTION__,
+      (UINT64)Count
+      ));
+  }
+
+  FreePool (Transfers);
+}
+
 //
 // We'll be saving the keys of installed tables so that we can roll them back
 // in case of failure. 128 tables should be enough for anyone (TM).
@@ -1233,13 +1335,7 @@ RollbackWritePointersAndFreeTracker:
   // to QEMU previously, before we release all the blobs.
   //
   if (EFI_ERROR (Status)) {
-    LoaderEntry = WritePointerSubsetEnd;
-    while (LoaderEntry > LoaderStart) {
-      --LoaderEntry;
-      if (LoaderEntry->Type == QemuLoaderCmdWritePointer) {
-        UndoCmdWritePointer (&LoaderEntry->Command.WritePointer);
-      }
-    }
+    UndoCmdWritePointers (LoaderStart, WritePointerSubsetEnd);
   }
 
   //
@@ -0,0 +1,53 @@
+/** @file
+  GUID and layout of the HOB in which the PEI instance of QemuFwCfgLib
+  publishes the fw_cfg file directory, indexed by name, so that later phases
+  can look up fw_cfg files without accessing fw_cfg.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#ifndef QEMU_FW_CFG_FILE_DIR_CACHE_H_
+#define QEMU_FW_CFG_FILE_DIR_CACHE_H_
+
+#include <IndustryStandard/QemuFwCfg.h>
+
+#define QEMU_FW_CFG_FILE_DIR_CACHE_GUID \
+  {0x70a37dc6, 0xf664, 0x458f, {0xaf, 0x82, 0x02, 0x7c, 0x22, 0x87, 0x9d, 0x66}}
+
+//
+// The number of hash buckets in the index, and the file index that
+// terminates a bucket.
+//
+#define QEMU_FW_CFG_FILE_DIR_BUCKETS  128
+#define QEMU_FW_CFG_FILE_DIR_END      MAX_UINT16
+
+#pragma pack (1)
+//
+// One file of the fw_cfg directory. The layout matches an entry of the
+// QemuFwCfgItemFileDir item, so that the directory can be read in place, but
+// Size and Select are in CPU byte order, and the reserved field links the
+// files of a hash bucket.
+//
+typedef struct {
+  UINT32    Size;
+  UINT16    Select;
+  UINT16    Next;
+  CHAR8     Name[QEMU_FW_CFG_FNAME_SIZE];
+} QEMU_FW_CFG_CACHED_FILE;
+
+//
+// The HOB data. Count QEMU_FW_CFG_CACHED_FILE elements, in directory order,
+// follow the structure. Each bucket holds the index of its first file, or
+// QEMU_FW_CFG_FILE_DIR_END.
+//
+typedef struct {
+  UINT32    Count;
+  UINT16    Bucket[QEMU_FW_CFG_FILE_DIR_BUCKETS];
+} QEMU_FW_CFG_FILE_DIR_CACHE;
+#pragma pack ()
+
+extern EFI_GUID  gQemuFwCfgFileDirCacheGuid;
+
+#endif
@@ -31,3 +31,66 @@ VerifyBlob (
 {
   return EFI_SUCCESS;
 }
+
+/**
+  Start verifying a blob from an external source incrementally, as its data
+  arrives.
+
+  @param[in]  BlobName          The name of the blob
+  @param[in]  BlobSize          The size of the blob in bytes
+  @param[out] Context           The verification context, to be passed to
+                                VerifyBlobUpdate() and VerifyBlobFinish()
+
+  @retval EFI_SUCCESS           Context has been set up.
+  @retval EFI_OUT_OF_RESOURCES  Context could not be allocated.
+**/
+EFI_STATUS
+EFIAPI
+VerifyBlobStart (
+  IN  CONST CHAR16  *BlobName,
+  IN  UINT32        BlobSize,
+  OUT VOID          **Context
+  )
+{
+  *Context = NULL;
+  return EFI_SUCCESS;
+}
+
+/**
+  Feed the next part of a blob to an incremental verification.
+
+  @param[in] Context            The context from VerifyBlobStart()
+  @param[in] Buf                The next part of the blob
+  @param[in] BufSize            The size of the part in bytes
+
+  @retval EFI_SUCCESS           The data has been processed.
+  @retval EFI_ACCESS_DENIED     The blob can already be seen not to verify.
+**/
+EFI_STATUS
+EFIAPI
+VerifyBlobUpdate (
+  IN  VOID          *Context,
+  IN  CONST VOID    *Buf,
+  IN  UINT32        BufSize
+  )
+{
+  return EFI_SUCCESS;
+}
+
+/**
+  Complete an incremental verification, and release its context.
+
+  @param[in] Context            The context from VerifyBlobStart()
+
+  @retval EFI_SUCCESS           The blob was verified successfully.
+  @retval EFI_ACCESS_DENIED     The blob could not be verified, and therefore
+                                should be considered non-secure.
+**/
+EFI_STATUS
+EFIAPI
+VerifyBlobFinish (
+  IN  VOID          *Context
+  )
+{
+  return EFI_SUCCESS;
+}
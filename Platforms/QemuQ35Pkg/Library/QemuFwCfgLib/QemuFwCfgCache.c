@@ -0,0 +1,146 @@
+/** @file
+
+  Name index of the fw_cfg file directory, shared by the QemuFwCfgLib
+  instances in QemuQ35Pkg.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Uefi.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/QemuFwCfgLib.h>
+
+#include "QemuFwCfgLibInternal.h"
+
+/**
+  Hash an fw_cfg file name (FNV-1a) to a bucket of the directory index.
+
+  @param[in] Name  The NUL-terminated file name.
+
+  @return  The bucket of Name.
+**/
+STATIC
+UINT32
+HashFileName (
+  IN CONST CHAR8  *Name
+  )
+{
+  UINT32  Hash;
+
+  Hash = 0x811C9DC5;
+  while (*Name != '\0') {
+    Hash = (Hash ^ (UINT8)*Name++) * 0x01000193;
+  }
+
+  return Hash % QEMU_FW_CFG_FILE_DIR_BUCKETS;
+}
+
+/**
+  Calculate the size of the directory index for a number of files.
+
+  @param[in] Count  The number of files in the fw_cfg directory.
+
+  @return  The size of the index in bytes, or zero if Count is too large to
+           be indexed.
+**/
+UINTN
+InternalQemuFwCfgFileDirCacheSize (
+  IN UINT32  Count
+  )
+{
+  if (Count >= QEMU_FW_CFG_FILE_DIR_END) {
+    return 0;
+  }
+
+  return sizeof (QEMU_FW_CFG_FILE_DIR_CACHE) +
+         Count * sizeof (QEMU_FW_CFG_CACHED_FILE);
+}
+
+/**
+  Read the fw_cfg file directory into memory, and index it by name.
+
+  The entries are fetched with a single QemuFwCfgReadBytes() call, that is,
+  with one DMA transfer if QEMU offers DMA.
+
+  @param[out] Cache  The index to fill in, InternalQemuFwCfgFileDirCacheSize()
+                     bytes in size.
+
+  @param[in]  Count  The number of files in the directory. QemuFwCfgItemFileDir
+                     must be selected, with the file count read already.
+**/
+VOID
+InternalQemuFwCfgFileDirCacheFill (
+  OUT QEMU_FW_CFG_FILE_DIR_CACHE  *Cache,
+  IN  UINT32                      Count
+  )
+{
+  QEMU_FW_CFG_CACHED_FILE  *File;
+  QEMU_FW_CFG_CACHED_FILE  *Entry;
+  UINT32                   Idx;
+  UINT32                   Bucket;
+
+  File = (QEMU_FW_CFG_CACHED_FILE *)(Cache + 1);
+  QemuFwCfgReadBytes (Count * sizeof *File, File);
+
+  Cache->Count = Count;
+  SetMem16 (Cache->Bucket, sizeof Cache->Bucket, QEMU_FW_CFG_FILE_DIR_END);
+
+  //
+  // Link the files backwards, so that each bucket lists its files in
+  // directory order. Like the directory walk, a lookup then finds the first
+  // of any duplicate names.
+  //
+  for (Idx = Count; Idx > 0; --Idx) {
+    Entry         = &File[Idx - 1];
+    Entry->Size   = SwapBytes32 (Entry->Size);
+    Entry->Select = SwapBytes16 (Entry->Select);
+
+    Entry->Name[QEMU_FW_CFG_FNAME_SIZE - 1] = '\0';
+
+    Bucket                = HashFileName (Entry->Name);
+    Entry->Next           = Cache->Bucket[Bucket];
+    Cache->Bucket[Bucket] = (UINT16)(Idx - 1);
+  }
+}
+
+/**
+  Look up an fw_cfg file in the directory index.
+
+  @param[in]  Cache  The index built by InternalQemuFwCfgFileDirCacheFill().
+  @param[in]  Name   Name of file to look up.
+  @param[out] Item   Configuration item corresponding to the file, to be
+                     passed to QemuFwCfgSelectItem ().
+  @param[out] Size   Number of bytes in the file.
+
+  @return    RETURN_SUCCESS       If file is found.
+             RETURN_NOT_FOUND     If file is not found.
+**/
+RETURN_STATUS
+InternalQemuFwCfgFileDirCacheLookup (
+  IN  CONST QEMU_FW_CFG_FILE_DIR_CACHE  *Cache,
+  IN  CONST CHAR8                       *Name,
+  OUT FIRMWARE_CONFIG_ITEM              *Item,
+  OUT UINTN                             *Size
+  )
+{
+  CONST QEMU_FW_CFG_CACHED_FILE  *File;
+  UINT32                         Idx;
+
+  File = (CONST QEMU_FW_CFG_CACHED_FILE *)(Cache + 1);
+  for (Idx = Cache->Bucket[HashFileName (Name)];
+       Idx < Cache->Count;
+       Idx = File[Idx].Next)
+  {
+    if (AsciiStrCmp (Name, File[Idx].Name) == 0) {
+      *Item = (FIRMWARE_CONFIG_ITEM)File[Idx].Select;
+      *Size = File[Idx].Size;
+      return RETURN_SUCCESS;
+    }
+  }
+
+  return RETURN_NOT_FOUND;
+}
@@ -12,11 +12,14 @@
 #include <Uefi.h>
 
 #include <Protocol/IoMmu.h>
+#include <Protocol/LoadedImage.h>
 
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/IoLib.h>
 #include <Library/DebugLib.h>
+#include <Library/HobLib.h>
+#include <Library/MemoryAllocationLib.h>
 #include <Library/QemuFwCfgLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/MemEncryptSevLib.h>
@@ -28,6 +31,84 @@ STATIC BOOLEAN  mQemuFwCfgDmaSupported;
 
 STATIC EDKII_IOMMU_PROTOCOL  *mIoMmuProtocol;
 
+//
+// With SEV, the FW_CFG_DMA_ACCESS structure of every transfer, allocated and
+// mapped on first use.
+//
+STATIC volatile FW_CFG_DMA_ACCESS  *mDmaAccess;
+STATIC VOID                        *mDmaAccessMapping;
+
+//
+// The name index of the fw_cfg file directory, owned by the client module.
+//
+STATIC QEMU_FW_CFG_FILE_DIR_CACHE  *mFileDirCache;
+
+/**
+  Set up the name index of the fw_cfg file directory for the client module.
+
+  The index published by the PEI instance in a GUID HOB is copied, or, if
+  there is no such HOB, the directory is read. Neither the HOB list nor the
+  boot services pool remain accessible to runtime drivers after
+  ExitBootServices(), so the index is allocated from runtime pool for them.
+  SMM drivers get their copy from SMRAM, rather than keep using the HOB list,
+  which the OS can overwrite.
+**/
+STATIC
+VOID
+InitFileDirCache (
+  VOID
+  )
+{
+  EFI_STATUS                  Status;
+  EFI_LOADED_IMAGE_PROTOCOL   *LoadedImage;
+  BOOLEAN                     Runtime;
+  EFI_HOB_GUID_TYPE           *GuidHob;
+  QEMU_FW_CFG_FILE_DIR_CACHE  *Cache;
+  UINT32                      Count;
+  UINTN                       CacheSize;
+
+  Status = gBS->HandleProtocol (
+                  gImageHandle,
+                  &gEfiLoadedImageProtocolGuid,
+                  (VOID **)&LoadedImage
+                  );
+  Runtime = (BOOLEAN)(!EFI_ERROR (Status) &&
+                      (LoadedImage->ImageDataType == EfiRuntimeServicesData));
+
+  GuidHob = GetFirstGuidHob (&gQemuFwCfgFileDirCacheGuid);
+  if (GuidHob != NULL) {
+    CacheSize = GET_GUID_HOB_DATA_SIZE (GuidHob);
+    if (Runtime) {
+      Cache = AllocateRuntimeCopyPool (CacheSize, GET_GUID_HOB_DATA (GuidHob));
+    } else {
+      Cache = AllocateCopyPool (CacheSize, GET_GUID_HOB_DATA (GuidHob));
+    }
+
+    mFileDirCache = Cache;
+    return;
+  }
+
+  QemuFwCfgSelectItem (QemuFwCfgItemFileDir);
+  Count     = SwapBytes32 (QemuFwCfgRead32 ());
+  CacheSize = InternalQemuFwCfgFileDirCacheSize (Count);
+  if (CacheSize == 0) {
+    return;
+  }
+
+  if (Runtime) {
+    Cache = AllocateRuntimePool (CacheSize);
+  } else {
+    Cache = AllocatePool (CacheSize);
+  }
+
+  if (Cache == NULL) {
+    return;
+  }
+
+  InternalQemuFwCfgFileDirCacheFill (Cache, Count);
+  mFileDirCache = Cache;
+}
+
 /**
   Returns a boolean indicating if the firmware configuration interface
   is available or not.
@@ -109,6 +190,7 @@ QemuFwCfgInitialize (
     }
   }
 
+  InitFileDirCache ();
   return RETURN_SUCCESS;
 }
 
@@ -283,6 +365,33 @@ FreeFwCfgDmaAccessBuffer (
   }
 }
 
+/**
+  Release the FW_CFG_DMA_ACCESS structure that InternalQemuFwCfgDmaBytes()
+  keeps for SEV, and the file directory index, when the client module is
+  unloaded.
+
+  @retval RETURN_SUCCESS  Always.
+**/
+RETURN_STATUS
+EFIAPI
+QemuFwCfgUninitialize (
+  VOID
+  )
+{
+  if (mDmaAccess != NULL) {
+    FreeFwCfgDmaAccessBuffer ((VOID *)mDmaAccess, mDmaAccessMapping);
+    mDmaAccess        = NULL;
+    mDmaAccessMapping = NULL;
+  }
+
+  if (mFileDirCache != NULL) {
+    FreePool (mFileDirCache);
+    mFileDirCache = NULL;
+  }
+
+  return RETURN_SUCCESS;
+}
+
 /**
   Function is used for mapping host address to device address. The buffer must
   be unmapped with UnmapDmaDataBuffer ().
@@ -381,6 +490,9 @@ UnmapFwCfgDmaDataBuffer (
                           FW_CFG_DMA_CTL_WRITE - write to fw_cfg from Buffer.
                           FW_CFG_DMA_CTL_READ  - read from fw_cfg into Buffer.
                           FW_CFG_DMA_CTL_SKIP  - skip bytes in fw_cfg.
+                          Optionally combined with FW_CFG_DMA_CTL_SELECT and
+                          the item in the high 16 bits, to select the item
+                          first; Size may then be zero.
 **/
 VOID
 InternalQemuFwCfgDmaBytes (
@@ -393,22 +505,22 @@ InternalQemuFwCfgDmaBytes (
   volatile FW_CFG_DMA_ACCESS  *Access;
   UINT32                      AccessHigh, AccessLow;
   UINT32                      Status;
-  VOID                        *AccessMapping, *DataMapping;
+  VOID                        *DataMapping;
   VOID                        *DataBuffer;
 
   ASSERT (
-    Control == FW_CFG_DMA_CTL_WRITE || Control == FW_CFG_DMA_CTL_READ ||
-    Control == FW_CFG_DMA_CTL_SKIP
+    FW_CFG_DMA_CTL_OPERATION (Control) == FW_CFG_DMA_CTL_WRITE ||
+    FW_CFG_DMA_CTL_OPERATION (Control) == FW_CFG_DMA_CTL_READ ||
+    FW_CFG_DMA_CTL_OPERATION (Control) == FW_CFG_DMA_CTL_SKIP
     );
 
-  if (Size == 0) {
+  if ((Size == 0) && ((Control & FW_CFG_DMA_CTL_SELECT) == 0)) {
     return;
   }
 
-  Access        = &LocalAccess;
-  AccessMapping = NULL;
-  DataMapping   = NULL;
-  DataBuffer    = Buffer;
+  Access      = &LocalAccess;
+  DataMapping = NULL;
+  DataBuffer  = Buffer;
 
   //
   // When SEV is enabled, map Buffer to DMA address before issuing the DMA
@@ -419,18 +531,25 @@ InternalQemuFwCfgDmaBytes (
     EFI_PHYSICAL_ADDRESS  DataBufferAddress;
 
     //
-    // Allocate DMA Access buffer
+    // Allocate the DMA Access buffer on the first transfer, and reuse it for
+    // the rest, so that a transfer costs no allocation and no mapping beyond
+    // that of the data buffer.
     //
-    AllocFwCfgDmaAccessBuffer (&AccessBuffer, &AccessMapping);
+    if (mDmaAccess == NULL) {
+      AllocFwCfgDmaAccessBuffer (&AccessBuffer, &mDmaAccessMapping);
+      mDmaAccess = AccessBuffer;
+    }
 
-    Access = AccessBuffer;
+    Access = mDmaAccess;
 
     //
     // Map actual data buffer
     //
-    if (Control != FW_CFG_DMA_CTL_SKIP) {
+    if ((Size > 0) &&
+        (FW_CFG_DMA_CTL_OPERATION (Control) != FW_CFG_DMA_CTL_SKIP))
+    {
       MapFwCfgDmaDataBuffer (
-        Control == FW_CFG_DMA_CTL_WRITE,
+        FW_CFG_DMA_CTL_OPERATION (Control) == FW_CFG_DMA_CTL_WRITE,
         Buffer,
         Size,
         &DataBufferAddress,
@@ -477,13 +596,6 @@ InternalQemuFwCfgDmaBytes (
   //
   MemoryFence ();
 
-  //
-  // If Access buffer was dynamically allocated then free it.
-  //
-  if (AccessMapping != NULL) {
-    FreeFwCfgDmaAccessBuffer ((VOID *)Access, AccessMapping);
-  }
-
   //
   // If DataBuffer was mapped then unmap it.
   //
@@ -491,3 +603,20 @@ InternalQemuFwCfgDmaBytes (
     UnmapFwCfgDmaDataBuffer (DataMapping);
   }
 }
+
+/**
+  Return the name index of the fw_cfg file directory, building it on first
+  use if the phase allows.
+
+  This instance sets up the index in its constructor; see InitFileDirCache().
+
+  @return  The index, or NULL if QemuFwCfgFindFile() has to walk the
+           directory.
+**/
+CONST QEMU_FW_CFG_FILE_DIR_CACHE *
+InternalQemuFwCfgGetFileDirCache (
+  VOID
+  )
+{
+  return mFileDirCache;
+}
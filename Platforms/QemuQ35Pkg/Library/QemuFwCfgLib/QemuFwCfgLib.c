@@ -253,13 +253,19 @@ QemuFwCfgFindFile (
   OUT  UINTN                 *Size
   )
 {
-  UINT32  Count;
-  UINT32  Idx;
+  CONST QEMU_FW_CFG_FILE_DIR_CACHE  *Cache;
+  UINT32                            Count;
+  UINT32                            Idx;
 
   if (!InternalQemuFwCfgIsAvailable ()) {
     return RETURN_UNSUPPORTED;
   }
 
+  Cache = InternalQemuFwCfgGetFileDirCache ();
+  if (Cache != NULL) {
+    return InternalQemuFwCfgFileDirCacheLookup (Cache, Name, Item, Size);
+  }
+
   QemuFwCfgSelectItem (QemuFwCfgItemFileDir);
   Count = SwapBytes32 (QemuFwCfgRead32 ());
 
@@ -284,3 +290,111 @@ QemuFwCfgFindFile (
 
   return RETURN_NOT_FOUND;
 }
+
+/**
+  Perform a list of select / skip / transfer operations on fw_cfg.
+
+  With the DMA access method, the item selection and the initial skip of each
+  operation are folded into the DMA control words, so that an operation costs
+  one DMA submission, or two if Offset is nonzero.
+
+  Following this call, the item of the last operation remains selected, and
+  further reads, writes or skips continue where that operation ended.
+
+  @param[in] Transfers  The operations to perform, in order.
+  @param[in] Count      The number of elements in Transfers.
+
+  @return    RETURN_SUCCESS            All operations have been performed.
+             RETURN_INVALID_PARAMETER  Transfers is NULL and Count is nonzero,
+                                       or an operation has an unknown Type, or
+                                       a NULL Buffer for a nonzero read or
+                                       write. No operation has been performed.
+             RETURN_UNSUPPORTED        If firmware configuration is
+                                       unavailable.
+
+**/
+RETURN_STATUS
+EFIAPI
+QemuFwCfgTransfer (
+  IN CONST QEMU_FW_CFG_TRANSFER  *Transfers,
+  IN UINTN                       Count
+  )
+{
+  CONST QEMU_FW_CFG_TRANSFER  *Transfer;
+  UINTN                       Idx;
+  UINT32                      Control;
+
+  if (!InternalQemuFwCfgIsAvailable ()) {
+    return RETURN_UNSUPPORTED;
+  }
+
+  if ((Transfers == NULL) && (Count > 0)) {
+    return RETURN_INVALID_PARAMETER;
+  }
+
+  for (Idx = 0; Idx < Count; ++Idx) {
+    Transfer = &Transfers[Idx];
+    if ((Transfer->Type > QemuFwCfgTransferSkip) ||
+        ((Transfer->Type != QemuFwCfgTransferSkip) &&
+         (Transfer->Size > 0) && (Transfer->Buffer == NULL)))
+    {
+      return RETURN_INVALID_PARAMETER;
+    }
+  }
+
+  for (Idx = 0; Idx < Count; ++Idx) {
+    Transfer = &Transfers[Idx];
+
+    if (!InternalQemuFwCfgDmaIsAvailable ()) {
+      QemuFwCfgSelectItem (Transfer->Item);
+      QemuFwCfgSkipBytes (Transfer->Offset);
+      switch (Transfer->Type) {
+        case QemuFwCfgTransferRead:
+          InternalQemuFwCfgReadBytes (Transfer->Size, Transfer->Buffer);
+          break;
+        case QemuFwCfgTransferWrite:
+          QemuFwCfgWriteBytes (Transfer->Size, Transfer->Buffer);
+          break;
+        default:
+          QemuFwCfgSkipBytes (Transfer->Size);
+          break;
+      }
+
+      continue;
+    }
+
+    //
+    // Select the item with the first DMA submission of the operation. If
+    // there is nothing to skip or transfer, select it with a zero-length skip.
+    //
+    Control = FW_CFG_DMA_CTL_SELECT | ((UINT32)(UINT16)Transfer->Item << 16);
+    if ((Transfer->Offset > 0) || (Transfer->Size == 0)) {
+      InternalQemuFwCfgDmaBytes (
+        Transfer->Offset,
+        NULL,
+        Control | FW_CFG_DMA_CTL_SKIP
+        );
+      Control = 0;
+    }
+
+    if (Transfer->Size == 0) {
+      continue;
+    }
+
+    switch (Transfer->Type) {
+      case QemuFwCfgTransferRead:
+        Control |= FW_CFG_DMA_CTL_READ;
+        break;
+      case QemuFwCfgTransferWrite:
+        Control |= FW_CFG_DMA_CTL_WRITE;
+        break;
+      default:
+        Control |= FW_CFG_DMA_CTL_SKIP;
+        break;
+    }
+
+    InternalQemuFwCfgDmaBytes (Transfer->Size, Transfer->Buffer, Control);
+  }
+
+  return RETURN_SUCCESS;
+}
@@ -11,6 +11,15 @@
 #ifndef __QEMU_FW_CFG_LIB_INTERNAL_H__
 #define __QEMU_FW_CFG_LIB_INTERNAL_H__
 
+#include <Guid/QemuFwCfgFileDirCache.h>
+
+//
+// The operation in a DMA control word, without the optional item selection.
+//
+#define FW_CFG_DMA_CTL_OPERATION(Control)                 \
+  ((Control) & (FW_CFG_DMA_CTL_READ | FW_CFG_DMA_CTL_SKIP | \
+                FW_CFG_DMA_CTL_WRITE))
+
 /**
   Returns a boolean indicating if the firmware configuration interface is
   available for library-internal purposes.
@@ -51,6 +60,9 @@ InternalQemuFwCfgDmaIsAvailable (
                           FW_CFG_DMA_CTL_WRITE - write to fw_cfg from Buffer.
                           FW_CFG_DMA_CTL_READ  - read from fw_cfg into Buffer.
                           FW_CFG_DMA_CTL_SKIP  - skip bytes in fw_cfg.
+                          Optionally combined with FW_CFG_DMA_CTL_SELECT and
+                          the item in the high 16 bits, to select the item
+                          first; Size may then be zero.
 **/
 VOID
 InternalQemuFwCfgDmaBytes (
@@ -59,4 +71,63 @@ InternalQemuFwCfgDmaBytes (
   IN     UINT32  Control
   );
 
+/**
+  Return the name index of the fw_cfg file directory, building it on first
+  use if the phase allows.
+
+  @return  The index, or NULL if QemuFwCfgFindFile() has to walk the
+           directory.
+**/
+CONST QEMU_FW_CFG_FILE_DIR_CACHE *
+InternalQemuFwCfgGetFileDirCache (
+  VOID
+  );
+
+/**
+  Calculate the size of the directory index for a number of files.
+
+  @param[in] Count  The number of files in the fw_cfg directory.
+
+  @return  The size of the index in bytes, or zero if Count is too large to
+           be indexed.
+**/
+UINTN
+InternalQemuFwCfgFileDirCacheSize (
+  IN UINT32  Count
+  );
+
+/**
+  Read the fw_cfg file directory into memory, and index it by name.
+
+  @param[out] Cache  The index to fill in, InternalQemuFwCfgFileDirCacheSize()
+                     bytes in size.
+
+  @param[in]  Count  The number of files in the directory. QemuFwCfgItemFileDir
+                     must be selected, with the file count read already.
+**/
+VOID
+InternalQemuFwCfgFileDirCacheFill (
+  OUT QEMU_FW_CFG_FILE_DIR_CACHE  *Cache,
+  IN  UINT32                      Count
+  );
+
+/**
+  Look up an fw_cfg file in the directory index.
+
+  @param[in]  Cache  The index built by InternalQemuFwCfgFileDirCacheFill().
+  @param[in]  Name   Name of file to look up.
+  @param[out] Item   Configuration item corresponding to the file.
+  @param[out] Size   Number of bytes in the file.
+
+  @return    RETURN_SUCCESS       If file is found.
+             RETURN_NOT_FOUND     If file is not found.
+**/
+RETURN_STATUS
+InternalQemuFwCfgFileDirCacheLookup (
+  IN  CONST QEMU_FW_CFG_FILE_DIR_CACHE  *Cache,
+  IN  CONST CHAR8                       *Name,
+  OUT FIRMWARE_CONFIG_ITEM              *Item,
+  OUT UINTN                             *Size
+  );
+
 #endif
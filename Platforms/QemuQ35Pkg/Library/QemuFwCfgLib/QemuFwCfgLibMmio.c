@@ -15,15 +15,20 @@
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 #include <Library/IoLib.h>
+#include <Library/MemoryAllocationLib.h>
 #include <Library/QemuFwCfgLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 
 #include <Protocol/FdtClient.h>
 
+#include "QemuFwCfgLibInternal.h"
+
 STATIC UINTN  mFwCfgSelectorAddress;
 STATIC UINTN  mFwCfgDataAddress;
 STATIC UINTN  mFwCfgDmaAddress;
 
+STATIC CONST QEMU_FW_CFG_FILE_DIR_CACHE  *mFileDirCache;
+
 /**
   Reads firmware configuration bytes into a buffer
 
@@ -305,6 +310,9 @@ MmioReadBytes (
                           FW_CFG_DMA_CTL_WRITE - write to fw_cfg from Buffer.
                           FW_CFG_DMA_CTL_READ  - read from fw_cfg into Buffer.
                           FW_CFG_DMA_CTL_SKIP  - skip bytes in fw_cfg.
+                          Optionally combined with FW_CFG_DMA_CTL_SELECT and
+                          the item in the high 16 bits, to select the item
+                          first; Size may then be zero.
 **/
 STATIC
 VOID
@@ -318,11 +326,12 @@ DmaTransferBytes (
   UINT32                      Status;
 
   ASSERT (
-    Control == FW_CFG_DMA_CTL_WRITE || Control == FW_CFG_DMA_CTL_READ ||
-    Control == FW_CFG_DMA_CTL_SKIP
+    FW_CFG_DMA_CTL_OPERATION (Control) == FW_CFG_DMA_CTL_WRITE ||
+    FW_CFG_DMA_CTL_OPERATION (Control) == FW_CFG_DMA_CTL_READ ||
+    FW_CFG_DMA_CTL_OPERATION (Control) == FW_CFG_DMA_CTL_SKIP
     );
 
-  if (Size == 0) {
+  if ((Size == 0) && ((Control & FW_CFG_DMA_CTL_SELECT) == 0)) {
     return;
   }
 
@@ -586,6 +595,46 @@ QemuFwCfgRead64 (
   return Result;
 }
 
+/**
+  Return the name index of the fw_cfg file directory, building it on first
+  use.
+
+  There is no earlier phase to publish the index on the platforms this
+  instance serves, so each module reads the directory into a private copy.
+
+  @return  The index, or NULL if QemuFwCfgFindFile() has to walk the
+           directory.
+**/
+CONST QEMU_FW_CFG_FILE_DIR_CACHE *
+InternalQemuFwCfgGetFileDirCache (
+  VOID
+  )
+{
+  QEMU_FW_CFG_FILE_DIR_CACHE  *Cache;
+  UINT32                      Count;
+  UINTN                       CacheSize;
+
+  if (mFileDirCache != NULL) {
+    return mFileDirCache;
+  }
+
+  QemuFwCfgSelectItem (QemuFwCfgItemFileDir);
+  Count     = SwapBytes32 (QemuFwCfgRead32 ());
+  CacheSize = InternalQemuFwCfgFileDirCacheSize (Count);
+  if (CacheSize == 0) {
+    return NULL;
+  }
+
+  Cache = AllocatePool (CacheSize);
+  if (Cache == NULL) {
+    return NULL;
+  }
+
+  InternalQemuFwCfgFileDirCacheFill (Cache, Count);
+  mFileDirCache = Cache;
+  return mFileDirCache;
+}
+
 /**
   Find the configuration item corresponding to the firmware configuration file.
 
@@ -607,13 +656,19 @@ QemuFwCfgFindFile (
   OUT  UINTN                 *Size
   )
 {
-  UINT32  Count;
-  UINT32  Idx;
+  CONST QEMU_FW_CFG_FILE_DIR_CACHE  *Cache;
+  UINT32                            Count;
+  UINT32                            Idx;
 
   if (!QemuFwCfgIsAvailable ()) {
     return RETURN_UNSUPPORTED;
   }
 
+  Cache = InternalQemuFwCfgGetFileDirCache ();
+  if (Cache != NULL) {
+    return InternalQemuFwCfgFileDirCacheLookup (Cache, Name, Item, Size);
+  }
+
   QemuFwCfgSelectItem (QemuFwCfgItemFileDir);
   Count = SwapBytes32 (QemuFwCfgRead32 ());
 
@@ -636,3 +691,104 @@ QemuFwCfgFindFile (
 
   return RETURN_NOT_FOUND;
 }
+
+/**
+  Perform a list of select / skip / transfer operations on fw_cfg.
+
+  With the DMA access method, the item selection and the initial skip of each
+  operation are folded into the DMA control words, so that an operation costs
+  one DMA submission, or two if Offset is nonzero.
+
+  @param[in] Transfers  The operations to perform, in order.
+  @param[in] Count      The number of elements in Transfers.
+
+  @return    RETURN_SUCCESS            All operations have been performed.
+             RETURN_INVALID_PARAMETER  Transfers is NULL and Count is nonzero,
+                                       or an operation has an unknown Type, or
+                                       a NULL Buffer for a nonzero read or
+                                       write. No operation has been performed.
+             RETURN_UNSUPPORTED        If firmware configuration is
+                                       unavailable.
+
+**/
+RETURN_STATUS
+EFIAPI
+QemuFwCfgTransfer (
+  IN CONST QEMU_FW_CFG_TRANSFER  *Transfers,
+  IN UINTN                       Count
+  )
+{
+  CONST QEMU_FW_CFG_TRANSFER  *Transfer;
+  UINTN                       Idx;
+  UINT32                      Control;
+
+  if (!QemuFwCfgIsAvailable ()) {
+    return RETURN_UNSUPPORTED;
+  }
+
+  if ((Transfers == NULL) && (Count > 0)) {
+    return RETURN_INVALID_PARAMETER;
+  }
+
+  for (Idx = 0; Idx < Count; ++Idx) {
+    Transfer = &Transfers[Idx];
+    if ((Transfer->Type > QemuFwCfgTransferSkip) ||
+        ((Transfer->Type != QemuFwCfgTransferSkip) &&
+         (Transfer->Size > 0) && (Transfer->Buffer == NULL)))
+    {
+      return RETURN_INVALID_PARAMETER;
+    }
+  }
+
+  for (Idx = 0; Idx < Count; ++Idx) {
+    Transfer = &Transfers[Idx];
+
+    if (InternalQemuFwCfgReadBytes != DmaReadBytes) {
+      QemuFwCfgSelectItem (Transfer->Item);
+      InternalQemuFwCfgSkipBytes (Transfer->Offset);
+      switch (Transfer->Type) {
+        case QemuFwCfgTransferRead:
+          InternalQemuFwCfgReadBytes (Transfer->Size, Transfer->Buffer);
+          break;
+        case QemuFwCfgTransferWrite:
+          InternalQemuFwCfgWriteBytes (Transfer->Size, Transfer->Buffer);
+          break;
+        default:
+          InternalQemuFwCfgSkipBytes (Transfer->Size);
+          break;
+      }
+
+      continue;
+    }
+
+    //
+    // Select the item with the first DMA submission of the operation. If
+    // there is nothing to skip or transfer, select it with a zero-length skip.
+    //
+    Control = FW_CFG_DMA_CTL_SELECT | ((UINT32)(UINT16)Transfer->Item << 16);
+    if ((Transfer->Offset > 0) || (Transfer->Size == 0)) {
+      DmaTransferBytes (Transfer->Offset, NULL, Control | FW_CFG_DMA_CTL_SKIP);
+      Control = 0;
+    }
+
+    if (Transfer->Size == 0) {
+      continue;
+    }
+
+    switch (Transfer->Type) {
+      case QemuFwCfgTransferRead:
+        Control |= FW_CFG_DMA_CTL_READ;
+        break;
+      case QemuFwCfgTransferWrite:
+        Control |= FW_CFG_DMA_CTL_WRITE;
+        break;
+      default:
+        Control |= FW_CFG_DMA_CTL_SKIP;
+        break;
+    }
+
+    DmaTransferBytes (Transfer->Size, Transfer->Buffer, Control);
+  }
+
+  return RETURN_SUCCESS;
+}
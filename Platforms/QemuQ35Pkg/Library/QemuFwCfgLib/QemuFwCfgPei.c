@@ -9,11 +9,15 @@
   SPDX-License-Identifier: BSD-2-Clause-Patent
 **/
 
+#include <PiPei.h>
+
 #include <Library/BaseLib.h>
 #include <Library/IoLib.h>
 #include <Library/DebugLib.h>
+#include <Library/HobLib.h>
 #include <Library/QemuFwCfgLib.h>
 #include <Library/MemEncryptSevLib.h>
+#include <Library/PeiServicesLib.h>
 
 #include "QemuFwCfgLibInternal.h"
 
@@ -136,6 +140,9 @@ InternalQemuFwCfgDmaIsAvailable (
                           FW_CFG_DMA_CTL_WRITE - write to fw_cfg from Buffer.
                           FW_CFG_DMA_CTL_READ  - read from fw_cfg into Buffer.
                           FW_CFG_DMA_CTL_SKIP  - skip bytes in fw_cfg.
+                          Optionally combined with FW_CFG_DMA_CTL_SELECT and
+                          the item in the high 16 bits, to select the item
+                          first; Size may then be zero.
 **/
 VOID
 InternalQemuFwCfgDmaBytes (
@@ -149,11 +156,12 @@ InternalQemuFwCfgDmaBytes (
   UINT32                      Status;
 
   ASSERT (
-    Control == FW_CFG_DMA_CTL_WRITE || Control == FW_CFG_DMA_CTL_READ ||
-    Control == FW_CFG_DMA_CTL_SKIP
+    FW_CFG_DMA_CTL_OPERATION (Control) == FW_CFG_DMA_CTL_WRITE ||
+    FW_CFG_DMA_CTL_OPERATION (Control) == FW_CFG_DMA_CTL_READ ||
+    FW_CFG_DMA_CTL_OPERATION (Control) == FW_CFG_DMA_CTL_SKIP
     );
 
-  if (Size == 0) {
+  if ((Size == 0) && ((Control & FW_CFG_DMA_CTL_SELECT) == 0)) {
     return;
   }
 
@@ -199,3 +207,64 @@ InternalQemuFwCfgDmaBytes (
   //
   MemoryFence ();
 }
+
+/**
+  Return the name index of the fw_cfg file directory, building it on first
+  use if the phase allows.
+
+  The index lives in a GUID HOB, so that the DXE instance can pick it up. The
+  HOB is built only once permanent memory is installed, as the temporary RAM
+  is too scarce to hold the index; it is looked up on every call, as the HOB
+  list may still move until then.
+
+  @return  The index, or NULL if QemuFwCfgFindFile() has to walk the
+           directory.
+**/
+CONST QEMU_FW_CFG_FILE_DIR_CACHE *
+InternalQemuFwCfgGetFileDirCache (
+  VOID
+  )
+{
+  EFI_HOB_GUID_TYPE           *GuidHob;
+  QEMU_FW_CFG_FILE_DIR_CACHE  *Cache;
+  UINT32                      Count;
+  UINTN                       CacheSize;
+  EFI_STATUS                  Status;
+
+  GuidHob = GetFirstGuidHob (&gQemuFwCfgFileDirCacheGuid);
+  if (GuidHob != NULL) {
+    return GET_GUID_HOB_DATA (GuidHob);
+  }
+
+  Status = PeiServicesLocatePpi (
+             &gEfiPeiMemoryDiscoveredPpiGuid,
+             0,
+             NULL,
+             NULL
+             );
+  if (EFI_ERROR (Status)) {
+    return NULL;
+  }
+
+  QemuFwCfgSelectItem (QemuFwCfgItemFileDir);
+  Count     = SwapBytes32 (QemuFwCfgRead32 ());
+  CacheSize = InternalQemuFwCfgFileDirCacheSize (Count);
+
+  //
+  // The data of a HOB is limited to less than 64KB.
+  //
+  if ((CacheSize == 0) ||
+      (CacheSize > 0xFFF8 - sizeof (EFI_HOB_GUID_TYPE)))
+  {
+    return NULL;
+  }
+
+  Cache = BuildGuidHob (&gQemuFwCfgFileDirCacheGuid, CacheSize);
+  if (Cache == NULL) {
+    return NULL;
+  }
+
+  InternalQemuFwCfgFileDirCacheFill (Cache, Count);
+  DEBUG ((DEBUG_INFO, "%a: %u fw_cfg file(s) indexed\n", __FUNCTION__, Count));
+  return Cache;
+}
@@ -105,6 +105,9 @@ InternalQemuFwCfgDmaIsAvailable (
                           FW_CFG_DMA_CTL_WRITE - write to fw_cfg from Buffer.
                           FW_CFG_DMA_CTL_READ  - read from fw_cfg into Buffer.
                           FW_CFG_DMA_CTL_SKIP  - skip bytes in fw_cfg.
+                          Optionally combined with FW_CFG_DMA_CTL_SELECT and
+                          the item in the high 16 bits, to select the item
+                          first; Size may then be zero.
 **/
 VOID
 InternalQemuFwCfgDmaBytes (
@@ -119,3 +122,20 @@ InternalQemuFwCfgDmaBytes (
   ASSERT (FALSE);
   CpuDeadLoop ();
 }
+
+/**
+  Return the name index of the fw_cfg file directory, building it on first
+  use if the phase allows.
+
+  SEC has neither permanent memory nor a HOB list to keep the index in, so
+  QemuFwCfgFindFile() walks the directory.
+
+  @return  NULL.
+**/
+CONST QEMU_FW_CFG_FILE_DIR_CACHE *
+InternalQemuFwCfgGetFileDirCache (
+  VOID
+  )
+{
+  return NULL;
+}
@@ -19,16 +19,48 @@
 #define CLEAR_STATUS_CMD         0x50
 #define READ_STATUS_CMD          0x70
 #define READ_DEVID_CMD           0x90
+#define CFI_QUERY_CMD            0x98
 #define BLOCK_ERASE_CONFIRM_CMD  0xd0
+#define WRITE_BUFFER_CMD         0xe8
+#define BUFFER_CONFIRM_CMD       0xd0
 #define READ_ARRAY_CMD           0xff
 
 #define CLEARED_ARRAY_STATUS  0x00
 
+//
+// Status register bits
+//
+#define STATUS_READY          BIT7
+#define STATUS_PROGRAM_ERROR  BIT4
+#define STATUS_VPP_ERROR      BIT3
+#define STATUS_BLOCK_LOCKED   BIT1
+#define STATUS_ERRORS         (STATUS_PROGRAM_ERROR | STATUS_VPP_ERROR | \
+                               STATUS_BLOCK_LOCKED)
+
+//
+// Offsets into the CFI query table of a byte-wide bank
+//
+#define CFI_QUERY_SIGNATURE     0x10
+#define CFI_WRITE_BUFFER_SHIFT  0x2a
+
+//
+// The word count of a buffered program command is a single byte on a
+// byte-wide bank, limiting the write buffer to 256 bytes.
+//
+#define MAX_WRITE_BUFFER_SIZE  256
+#define MAX_STATUS_POLLS       0x100000
+
 UINT8  *mFlashBase;
 
 STATIC UINTN  mFdBlockSize  = 0;
 STATIC UINTN  mFdBlockCount = 0;
 
+//
+// Size of the write buffer used for buffered programming; zero if the flash
+// has to be programmed one byte at a time.
+//
+STATIC UINTN  mWriteBufferSize = 0;
+
 STATIC
 volatile UINT8 *
 QemuFlashPtr (
@@ -128,6 +160,120 @@ QemuFlashDetected (
   return FlashDetected;
 }
 
+/**
+  Query the size of the write buffer of the flash device, to enable buffered
+  programming in QemuFlashWrite().
+
+  Buffered programming polls the status register, which is not attempted
+  under SEV-ES, for the same reason as in QemuFlashDetected().
+
+**/
+STATIC
+VOID
+QemuFlashProbeWriteBuffer (
+  VOID
+  )
+{
+  volatile UINT8  *Ptr;
+  UINT8           Shift;
+
+  if (MemEncryptSevEsIsEnabled ()) {
+    return;
+  }
+
+  Ptr = QemuFlashPtr (0, 0);
+  QemuFlashPtrWrite (Ptr, CFI_QUERY_CMD);
+  if ((Ptr[CFI_QUERY_SIGNATURE] == 'Q') &&
+      (Ptr[CFI_QUERY_SIGNATURE + 1] == 'R') &&
+      (Ptr[CFI_QUERY_SIGNATURE + 2] == 'Y'))
+  {
+    Shift = Ptr[CFI_WRITE_BUFFER_SHIFT];
+    if ((Shift > 0) && (Shift < 16)) {
+      mWriteBufferSize = MIN ((UINTN)1 << Shift, MAX_WRITE_BUFFER_SIZE);
+    }
+  }
+
+  QemuFlashPtrWrite (Ptr, READ_ARRAY_CMD);
+
+  DEBUG ((
+    DEBUG_INFO,
+    "QEMU Flash: write buffer size %Lu\n",
+    (UINT64)mWriteBufferSize
+    ));
+}
+
+/**
+  Program a range of the flash with a single buffered program command.
+
+  @param[in] Ptr     The flash address to program. The range must not cross a
+                     mWriteBufferSize boundary.
+  @param[in] Buffer  The data to program.
+  @param[in] Count   The number of bytes to program, between 1 and
+                     mWriteBufferSize.
+
+  @retval EFI_SUCCESS       The range has been programmed.
+  @retval EFI_DEVICE_ERROR  The write buffer did not become available, or the
+                            program operation failed.
+
+**/
+STATIC
+EFI_STATUS
+QemuFlashWriteBuffer (
+  IN volatile UINT8  *Ptr,
+  IN CONST UINT8     *Buffer,
+  IN UINTN           Count
+  )
+{
+  UINTN  Polls;
+  UINTN  Idx;
+  UINT8  Status;
+
+  //
+  // Wait for the write buffer to become available
+  //
+  Polls = 0;
+  do {
+    QemuFlashPtrWrite (Ptr, WRITE_BUFFER_CMD);
+    Status = *Ptr;
+  } while (((Status & STATUS_READY) == 0) && (++Polls < MAX_STATUS_POLLS));
+
+  if ((Status & STATUS_READY) == 0) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  //
+  // Fill the buffer, and start programming
+  //
+  QemuFlashPtrWrite (Ptr, (UINT8)(Count - 1));
+  for (Idx = 0; Idx < Count; Idx++) {
+    QemuFlashPtrWrite (Ptr + Idx, Buffer[Idx]);
+  }
+
+  QemuFlashPtrWrite (Ptr, BUFFER_CONFIRM_CMD);
+
+  //
+  // The device is in read status mode until programming completes
+  //
+  Polls = 0;
+  do {
+    Status = *Ptr;
+  } while (((Status & STATUS_READY) == 0) && (++Polls < MAX_STATUS_POLLS));
+
+  if (((Status & STATUS_READY) == 0) || ((Status & STATUS_ERRORS) != 0)) {
+    DEBUG ((
+      DEBUG_ERROR,
+      "%a: status 0x%x programming %p\n",
+      __FUNCTION__,
+      Status,
+      Ptr
+      ));
+    QemuFlashPtrWrite (Ptr, CLEAR_STATUS_CMD);
+    return EFI_DEVICE_ERROR;
+  }
+
+  return EFI_SUCCESS;
+}
+
 /**
   Read from QEMU Flash
 
@@ -175,6 +321,11 @@ QemuFlashRead (
                       output, indicates the actual number of bytes written
   @param[in] Buffer   Pointer to the data to write.
 
+  @retval EFI_SUCCESS            The data has been written.
+  @retval EFI_INVALID_PARAMETER  Lba is out of range.
+  @retval EFI_DEVICE_ERROR       Buffered programming failed; NumBytes has
+                                 been set to the number of bytes written.
+
 **/
 EFI_STATUS
 QemuFlashWrite (
@@ -186,6 +337,9 @@ QemuFlashWrite (
 {
   volatile UINT8  *Ptr;
   UINTN           Loop;
+  UINTN           FlashOffset;
+  UINTN           Chunk;
+  EFI_STATUS      Status;
 
   //
   // Only write to the first 64k. We don't bother saving the FTW Spare
@@ -196,9 +350,32 @@ QemuFlashWrite (
   }
 
   //
-  // Program flash
+  // Program flash, through the write buffer if the device has one. Each
+  // buffered program command covers the part of the range that falls into
+  // one mWriteBufferSize-aligned window.
   //
   Ptr = QemuFlashPtr (Lba, Offset);
+  if (mWriteBufferSize > 0) {
+    Status      = EFI_SUCCESS;
+    FlashOffset = (UINTN)Lba * mFdBlockSize + Offset;
+    for (Loop = 0; Loop < *NumBytes; Loop += Chunk) {
+      Chunk  = mWriteBufferSize -
+               ((FlashOffset + Loop) & (mWriteBufferSize - 1));
+      Chunk  = MIN (Chunk, *NumBytes - Loop);
+      Status = QemuFlashWriteBuffer (Ptr + Loop, Buffer + Loop, Chunk);
+      if (EFI_ERROR (Status)) {
+        break;
+      }
+    }
+
+    if (*NumBytes > 0) {
+      QemuFlashPtrWrite (Ptr, READ_ARRAY_CMD);
+    }
+
+    *NumBytes = Loop;
+    return Status;
+  }
+
   for (Loop = 0; Loop < *NumBytes; Loop++) {
     QemuFlashPtrWrite (Ptr, WRITE_BYTE_CMD);
     QemuFlashPtrWrite (Ptr, Buffer[Loop]);
@@ -270,5 +447,7 @@ QemuFlashInitialize (
     return EFI_WRITE_PROTECTED;
   }
 
+  QemuFlashProbeWriteBuffer ();
+
   return EFI_SUCCESS;
 }
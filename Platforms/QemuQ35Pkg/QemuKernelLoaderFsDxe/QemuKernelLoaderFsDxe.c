@@ -21,11 +21,14 @@
 #include <Library/DebugLib.h>
 #include <Library/DevicePathLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
 #include <Library/QemuFwCfgLib.h>
+#include <Library/SynchronizationLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiRuntimeServicesTableLib.h>
 #include <Protocol/DevicePath.h>
 #include <Protocol/LoadFile2.h>
+#include <Protocol/MpService.h>
 #include <Protocol/SimpleFileSystem.h>
 
 //
@@ -46,7 +49,8 @@ typedef struct {
     UINT32                        Size;
   }                             FwCfgItem[2];
   UINT32          Size;
-  UINT8           *Data;
+  UINT8           *Data;    // The verified copy of a blob that has been read
+                            // in parts, or NULL. See FetchBlob().
 } KERNEL_BLOB;
 
 STATIC KERNEL_BLOB  mKernelBlob[KernelBlobTypeMax] = {
@@ -71,6 +75,47 @@ STATIC KERNEL_BLOB  mKernelBlob[KernelBlobTypeMax] = {
 
 STATIC UINT64  mTotalBlobBytes;
 
+//
+// State shared between the processor that downloads a blob, and the one that
+// verifies it. The downloading processor advances Fetched after each chunk;
+// the verifying one catches up with it, and sets Done once it has consumed
+// Size bytes.
+//
+// Owner is claimed with a compare-exchange, either by the AP when it starts
+// the verification, or by the BSP if the AP has not started it by the time
+// the MP services time the AP out.
+//
+typedef struct {
+  VOID                *Verifier;
+  CONST UINT8         *Data;
+  UINT32              Size;
+  volatile UINT32     Fetched;
+  volatile BOOLEAN    Done;
+  volatile UINT32     Owner;
+  EFI_STATUS          Status;
+  BOOLEAN             OnAp;
+} BLOB_PIPELINE;
+
+#define BLOB_PIPELINE_OWNER_NONE  0
+#define BLOB_PIPELINE_OWNER_AP    1
+#define BLOB_PIPELINE_OWNER_BSP   2
+
+//
+// The time the verifier AP is given, from its start, to verify a blob: 10
+// seconds, plus 100 milliseconds per MB for the download and the hashing.
+//
+#define VERIFIER_AP_TIMEOUT_US(Size)  (10000000 + ((Size) >> 20) * 100000)
+
+//
+// The application processor that verifies blobs, looked up on the first
+// download. mMpServices is NULL if there is none, and blobs are then verified
+// on the BSP, chunk by chunk.
+//
+STATIC BOOLEAN                   mVerifierApLookedUp;
+STATIC EFI_MP_SERVICES_PROTOCOL  *mMpServices;
+STATIC UINTN                     mVerifierAp;
+STATIC EFI_EVENT                 mVerifierApEvent;
+
 //
 // Device path for the handle that incorporates our "EFI stub filesystem".
 //
@@ -107,6 +152,520 @@ STATIC CONST SINGLE_VENMEDIA_NODE_DEVPATH  mInitrdDevicePath = {
   }
 };
 
+//
+// Utility functions.
+//
+
+/**
+  Read the sizes of the fw_cfg items that make up a blob in mKernelBlob.
+
+  @param[in,out] Blob  Pointer to the KERNEL_BLOB element in mKernelBlob whose
+                       sizes are to be read from fw_cfg.
+**/
+STATIC
+VOID
+FetchBlobSize (
+  IN OUT KERNEL_BLOB  *Blob
+  )
+{
+  UINTN  Idx;
+
+  Blob->Size = 0;
+  for (Idx = 0; Idx < ARRAY_SIZE (Blob->FwCfgItem); Idx++) {
+    if (Blob->FwCfgItem[Idx].SizeKey == 0) {
+      break;
+    }
+
+    QemuFwCfgSelectItem (Blob->FwCfgItem[Idx].SizeKey);
+    Blob->FwCfgItem[Idx].Size = QemuFwCfgRead32 ();
+    Blob->Size               += Blob->FwCfgItem[Idx].Size;
+  }
+}
+
+/**
+  Verify the chunks of a blob on an application processor, as the BSP
+  downloads them.
+
+  @param[in,out] Buffer  The BLOB_PIPELINE of the download.
+**/
+STATIC
+VOID
+EFIAPI
+VerifyBlobOnAp (
+  IN OUT VOID  *Buffer
+  )
+{
+  BLOB_PIPELINE  *Pipeline;
+  UINT32         Verified;
+  UINT32         Fetched;
+  EFI_STATUS     Status;
+
+  Pipeline = Buffer;
+  if (InterlockedCompareExchange32 (
+        &Pipeline->Owner,
+        BLOB_PIPELINE_OWNER_NONE,
+        BLOB_PIPELINE_OWNER_AP
+        ) != BLOB_PIPELINE_OWNER_NONE)
+  {
+    return;
+  }
+
+  Verified = 0;
+  Status   = EFI_SUCCESS;
+  while (Verified < Pipeline->Size) {
+    Fetched = Pipeline->Fetched;
+    if (Fetched == Verified) {
+      CpuPause ();
+      continue;
+    }
+
+    //
+    // Don't look at the chunk before seeing it published.
+    //
+    MemoryFence ();
+
+    if (!EFI_ERROR (Status)) {
+      Status = VerifyBlobUpdate (
+                 Pipeline->Verifier,
+                 Pipeline->Data + Verified,
+                 Fetched - Verified
+                 );
+    }
+
+    Verified = Fetched;
+  }
+
+  Pipeline->Status = Status;
+  MemoryFence ();
+  Pipeline->Done = TRUE;
+}
+
+/**
+  Pass a downloaded chunk of a blob on to verification.
+
+  @param[in,out] Pipeline  The BLOB_PIPELINE of the download.
+  @param[in]     Chunk     The size of the chunk, which follows the data
+                           passed on so far.
+**/
+STATIC
+VOID
+BlobPipelineChunkFetched (
+  IN OUT BLOB_PIPELINE  *Pipeline,
+  IN     UINT32         Chunk
+  )
+{
+  if (!Pipeline->OnAp) {
+    if (!EFI_ERROR (Pipeline->Status)) {
+      Pipeline->Status = VerifyBlobUpdate (
+                           Pipeline->Verifier,
+                           Pipeline->Data + Pipeline->Fetched,
+                           Chunk
+                           );
+    }
+
+    Pipeline->Fetched += Chunk;
+    return;
+  }
+
+  //
+  // Publish the chunk only after the DMA into it has completed.
+  //
+  MemoryFence ();
+  Pipeline->Fetched += Chunk;
+}
+
+/**
+  Find an enabled application processor to verify blobs on, and set
+  mMpServices, mVerifierAp and mVerifierApEvent. Leave mMpServices NULL if
+  there is none.
+**/
+STATIC
+VOID
+LookUpVerifierAp (
+  VOID
+  )
+{
+  EFI_MP_SERVICES_PROTOCOL   *MpServices;
+  UINTN                      NumberOfProcessors;
+  UINTN                      NumberOfEnabledProcessors;
+  UINTN                      Idx;
+  EFI_PROCESSOR_INFORMATION  Info;
+  EFI_STATUS                 Status;
+
+  mVerifierApLookedUp = TRUE;
+
+  Status = gBS->LocateProtocol (
+                  &gEfiMpServiceProtocolGuid,
+                  NULL,
+                  (VOID **)&MpServices
+                  );
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  Status = MpServices->GetNumberOfProcessors (
+                         MpServices,
+                         &NumberOfProcessors,
+                         &NumberOfEnabledProcessors
+                         );
+  if (EFI_ERROR (Status) || (NumberOfEnabledProcessors < 2)) {
+    return;
+  }
+
+  for (Idx = 0; Idx < NumberOfProcessors; Idx++) {
+    Status = MpServices->GetProcessorInfo (MpServices, Idx, &Info);
+    if (!EFI_ERROR (Status) &&
+        ((Info.StatusFlag & PROCESSOR_ENABLED_BIT) != 0) &&
+        ((Info.StatusFlag & PROCESSOR_AS_BSP_BIT) == 0))
+    {
+      break;
+    }
+  }
+
+  if (Idx == NumberOfProcessors) {
+    return;
+  }
+
+  //
+  // StartupThisAP() is non-blocking with an event. VerifyBlobOnAp() reports
+  // its completion in the BLOB_PIPELINE; the event only tells the BSP that
+  // the AP has timed out instead.
+  //
+  Status = gBS->CreateEvent (0, TPL_CALLBACK, NULL, NULL, &mVerifierApEvent);
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  mMpServices = MpServices;
+  mVerifierAp = Idx;
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: verifying blobs on processor %Lu\n",
+    __FUNCTION__,
+    (UINT64)Idx
+    ));
+}
+
+/**
+  Read a range of a blob from fw_cfg.
+
+  The start of the range is reached with a DMA skip, and the range is read in
+  chunks of at most 1 MB, so that the buffer that the IOMMU bounces DMA
+  through with SEV stays small.
+
+  @param[in]     Blob      The blob to read from.
+  @param[in]     Offset    The offset of the range in the blob.
+  @param[in]     Size      The size of the range. Offset + Size must not
+                           exceed Blob->Size.
+  @param[out]    Buffer    The buffer to read the range into.
+  @param[in,out] Pipeline  If not NULL, the verification that each chunk is
+                           passed on to once downloaded.
+**/
+STATIC
+VOID
+ReadBlobRange (
+  IN     CONST KERNEL_BLOB  *Blob,
+  IN     UINT32             Offset,
+  IN     UINT32             Size,
+  OUT    UINT8              *Buffer,
+  IN OUT BLOB_PIPELINE      *Pipeline OPTIONAL
+  )
+{
+  QEMU_FW_CFG_TRANSFER  Transfer;
+  UINTN                 Idx;
+  UINT32                Left;
+  UINT32                Chunk;
+  RETURN_STATUS         Status;
+
+  ASSERT (Size <= Blob->Size && Offset <= Blob->Size - Size);
+
+  for (Idx = 0; Idx < ARRAY_SIZE (Blob->FwCfgItem) && Size > 0; Idx++) {
+    if (Offset >= Blob->FwCfgItem[Idx].Size) {
+      Offset -= Blob->FwCfgItem[Idx].Size;
+      continue;
+    }
+
+    Left = MIN (Size, Blob->FwCfgItem[Idx].Size - Offset);
+    Size = Size - Left;
+
+    //
+    // Select the item and seek to the range with the first chunk; the rest
+    // continue where the previous one ended.
+    //
+    Transfer.Item   = Blob->FwCfgItem[Idx].DataKey;
+    Transfer.Type   = QemuFwCfgTransferRead;
+    Transfer.Offset = Offset;
+    Transfer.Size   = MIN (Left, SIZE_1MB);
+    Transfer.Buffer = Buffer;
+    Status          = QemuFwCfgTransfer (&Transfer, 1);
+    ASSERT_RETURN_ERROR (Status);
+
+    Chunk   = Transfer.Size;
+    Offset  = 0;
+    for ( ; ;) {
+      if (Pipeline != NULL) {
+        BlobPipelineChunkFetched (Pipeline, Chunk);
+      }
+
+      Buffer += Chunk;
+      Left   -= Chunk;
+      DEBUG ((
+        DEBUG_VERBOSE,
+        "%a: %Ld bytes remaining for \"%s\" (%d)\n",
+        __FUNCTION__,
+        (INT64)Left,
+        Blob->Name,
+        (INT32)Idx
+        ));
+      if (Left == 0) {
+        break;
+      }
+
+      Chunk = MIN (Left, SIZE_1MB);
+      QemuFwCfgReadBytes (Chunk, Buffer);
+    }
+  }
+}
+
+/**
+  Download a whole blob, and verify it while it is being downloaded.
+
+  Each chunk is verified as soon as it has arrived: on an application
+  processor, in parallel with the download of the next chunk, if there is one,
+  and on the BSP between chunk downloads otherwise.
+
+  @param[in]  Blob    The blob to download. Blob->Size must be nonzero.
+  @param[out] Buffer  The buffer to download the blob into, Blob->Size bytes
+                      in size.
+
+  @retval EFI_SUCCESS  The blob has been downloaded and verified.
+
+  @retval EFI_TIMEOUT  The verifier AP timed out in the middle of the
+                       verification.
+
+  @return              Error codes from VerifyBlobStart(), VerifyBlobUpdate()
+                       or VerifyBlobFinish().
+**/
+STATIC
+EFI_STATUS
+FetchAndVerifyBlob (
+  IN  CONST KERNEL_BLOB  *Blob,
+  OUT UINT8              *Buffer
+  )
+{
+  BLOB_PIPELINE  Pipeline;
+  EFI_STATUS     Status;
+
+  Status = VerifyBlobStart (Blob->Name, Blob->Size, &Pipeline.Verifier);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Pipeline.Data    = Buffer;
+  Pipeline.Size    = Blob->Size;
+  Pipeline.Fetched = 0;
+  Pipeline.Done    = FALSE;
+  Pipeline.Owner   = BLOB_PIPELINE_OWNER_NONE;
+  Pipeline.Status  = EFI_SUCCESS;
+  Pipeline.OnAp    = FALSE;
+
+  if (!mVerifierApLookedUp) {
+    LookUpVerifierAp ();
+  }
+
+  //
+  // If the AP is still busy with the previous blob, as far as the MP
+  // services are concerned, verify this one on the BSP.
+  //
+  if (mMpServices != NULL) {
+    //
+    // Consume the signal of the previous blob's completion, if any, so that
+    // the event only reports this one.
+    //
+    gBS->CheckEvent (mVerifierApEvent);
+    Status = mMpServices->StartupThisAP (
+                            mMpServices,
+                            VerifyBlobOnAp,
+                            mVerifierAp,
+                            mVerifierApEvent,
+                            VERIFIER_AP_TIMEOUT_US (Blob->Size),
+                            &Pipeline,
+                            NULL
+                            );
+    Pipeline.OnAp = !EFI_ERROR (Status);
+  }
+
+  ReadBlobRange (Blob, 0, Blob->Size, Buffer, &Pipeline);
+
+  if (Pipeline.OnAp) {
+    Status = EFI_NOT_READY;
+    while (!Pipeline.Done && (Status == EFI_NOT_READY)) {
+      CpuPause ();
+      Status = gBS->CheckEvent (mVerifierApEvent);
+    }
+
+    MemoryFence ();
+    if (!Pipeline.Done) {
+      //
+      // The AP has been timed out. If it never started, verify the whole blob
+      // here; otherwise the state of the verifier is unknown.
+      //
+      if (InterlockedCompareExchange32 (
+            &Pipeline.Owner,
+            BLOB_PIPELINE_OWNER_NONE,
+            BLOB_PIPELINE_OWNER_BSP
+            ) == BLOB_PIPELINE_OWNER_NONE)
+      {
+        DEBUG ((
+          DEBUG_WARN,
+          "%a: \"%s\": verifier AP did not start, verifying on the BSP\n",
+          __FUNCTION__,
+          Blob->Name
+          ));
+        Pipeline.Status = VerifyBlobUpdate (
+                            Pipeline.Verifier,
+                            Pipeline.Data,
+                            Pipeline.Size
+                            );
+      } else {
+        Pipeline.Status = EFI_TIMEOUT;
+      }
+    }
+  }
+
+  Status = VerifyBlobFinish (Pipeline.Verifier);
+  if (EFI_ERROR (Pipeline.Status)) {
+    Status = Pipeline.Status;
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((
+      DEBUG_ERROR,
+      "%a: \"%s\": verification failed: %r\n",
+      __FUNCTION__,
+      Blob->Name,
+      Status
+      ));
+  }
+
+  return Status;
+}
+
+/**
+  Download and verify a whole blob in mKernelBlob, for serving partial reads
+  of it.
+
+  @param[in,out] Blob  Pointer to the KERNEL_BLOB element in mKernelBlob that
+                       is to be filled from fw_cfg. Blob->Size must be
+                       nonzero.
+
+  @retval EFI_SUCCESS           Blob->Data has been populated.
+
+  @retval EFI_OUT_OF_RESOURCES  Failed to allocate memory for Blob->Data.
+
+  @return                       Error codes from FetchAndVerifyBlob().
+**/
+STATIC
+EFI_STATUS
+FetchBlob (
+  IN OUT KERNEL_BLOB  *Blob
+  )
+{
+  EFI_STATUS  Status;
+
+  ASSERT (Blob->Size > 0);
+
+  Blob->Data = AllocatePool (Blob->Size);
+  if (Blob->Data == NULL) {
+    DEBUG ((
+      DEBUG_ERROR,
+      "%a: failed to allocate %Ld bytes for \"%s\"\n",
+      __FUNCTION__,
+      (INT64)Blob->Size,
+      Blob->Name
+      ));
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: loading %Ld bytes for \"%s\"\n",
+    __FUNCTION__,
+    (INT64)Blob->Size,
+    Blob->Name
+    ));
+
+  Status = FetchAndVerifyBlob (Blob, Blob->Data);
+  if (EFI_ERROR (Status)) {
+    FreePool (Blob->Data);
+    Blob->Data = NULL;
+  }
+
+  return Status;
+}
+
+/**
+  Read from a blob in mKernelBlob, on behalf of a file read or a LoadFile2
+  call.
+
+  A read of the whole blob goes from fw_cfg directly into Buffer, and is
+  verified there. Other reads are served from fw_cfg with
+  PcdQemuKernelLoaderFsStreamBlobs, and from the copy that FetchBlob() makes
+  otherwise.
+
+  @param[in,out] Blob      The blob to read from.
+  @param[in]     Position  The offset in the blob to read from. It must not
+                           exceed Blob->Size.
+  @param[in]     Size      The number of bytes to read. Position + Size must
+                           not exceed Blob->Size.
+  @param[out]    Buffer    The buffer to read into.
+
+  @retval EFI_SUCCESS  The data has been read.
+
+  @return              Error codes from FetchBlob() or FetchAndVerifyBlob().
+                       Buffer has been zeroed.
+**/
+STATIC
+EFI_STATUS
+ReadBlob (
+  IN OUT KERNEL_BLOB  *Blob,
+  IN     UINT64       Position,
+  IN     UINTN        Size,
+  OUT    VOID         *Buffer
+  )
+{
+  EFI_STATUS  Status;
+
+  if (Size == 0) {
+    return EFI_SUCCESS;
+  }
+
+  if (Blob->Data == NULL) {
+    if ((Position == 0) && (Size == Blob->Size)) {
+      Status = FetchAndVerifyBlob (Blob, Buffer);
+      if (EFI_ERROR (Status)) {
+        ZeroMem (Buffer, Size);
+      }
+
+      return Status;
+    }
+
+    if (FixedPcdGetBool (PcdQemuKernelLoaderFsStreamBlobs)) {
+      ReadBlobRange (Blob, (UINT32)Position, (UINT32)Size, Buffer, NULL);
+      return EFI_SUCCESS;
+    }
+
+    Status = FetchBlob (Blob);
+    if (EFI_ERROR (Status)) {
+      ZeroMem (Buffer, Size);
+      return Status;
+    }
+  }
+
+  CopyMem (Buffer, Blob->Data + Position, Size);
+  return EFI_SUCCESS;
+}
+
 //
 // The "file in the EFI stub filesystem" abstraction.
 //
@@ -355,9 +914,10 @@ StubFileRead (
   OUT VOID              *Buffer
   )
 {
-  STUB_FILE          *StubFile;
-  CONST KERNEL_BLOB  *Blob;
-  UINT64             Left;
+  STUB_FILE    *StubFile;
+  KERNEL_BLOB  *Blob;
+  UINT64       Left;
+  EFI_STATUS   Status;
 
   StubFile = STUB_FILE_FROM_FILE (This);
 
@@ -365,8 +925,6 @@ StubFileRead (
   // Scanning the root directory?
   //
   if (StubFile->BlobType == KernelBlobTypeMax) {
-    EFI_STATUS  Status;
-
     if (StubFile->Position == KernelBlobTypeMax) {
       //
       // Scanning complete.
@@ -401,8 +959,10 @@ StubFileRead (
     *BufferSize = (UINTN)Left;
   }
 
-  if (Blob->Data != NULL) {
-    CopyMem (Buffer, Blob->Data + StubFile->Position, *BufferSize);
+  Status = ReadBlob (Blob, StubFile->Position, *BufferSize, Buffer);
+  if (EFI_ERROR (Status)) {
+    *BufferSize = 0;
+    return EFI_DEVICE_ERROR;
   }
 
   StubFile->Position += *BufferSize;
@@ -883,7 +1443,8 @@ InitrdLoadFile2 (
   OUT     VOID                      *Buffer     OPTIONAL
   )
 {
-  CONST KERNEL_BLOB  *InitrdBlob = &mKernelBlob[KernelBlobTypeInitrd];
+  KERNEL_BLOB  *InitrdBlob = &mKernelBlob[KernelBlobTypeInitrd];
+  EFI_STATUS   Status;
 
   ASSERT (InitrdBlob->Size > 0);
 
@@ -906,7 +1467,13 @@ InitrdLoadFile2 (
     return EFI_BUFFER_TOO_SMALL;
   }
 
-  CopyMem (Buffer, InitrdBlob->Data, InitrdBlob->Size);
+  //
+  // The whole initrd goes straight into the caller's buffer.
+  //
+  Status = ReadBlob (InitrdBlob, 0, InitrdBlob->Size, Buffer);
+  if (EFI_ERROR (Status)) {
+    return EFI_DEVICE_ERROR;
+  }
 
   *BufferSize = InitrdBlob->Size;
   return EFI_SUCCESS;
@@ -916,115 +1483,16 @@ STATIC CONST EFI_LOAD_FILE2_PROTOCOL  mInitrdLoadFile2 = {
   InitrdLoadFile2,
 };
 
-//
-// Utility functions.
-//
-
-/**
-  Populate a blob in mKernelBlob.
-
-  param[in,out] Blob  Pointer to the KERNEL_BLOB element in mKernelBlob that is
-                      to be filled from fw_cfg.
-
-  @retval EFI_SUCCESS           Blob has been populated. If fw_cfg reported a
-                                size of zero for the blob, then Blob->Data has
-                                been left unchanged.
-
-  @retval EFI_OUT_OF_RESOURCES  Failed to allocate memory for Blob->Data.
-**/
-STATIC
-EFI_STATUS
-FetchBlob (
-  IN OUT KERNEL_BLOB  *Blob
-  )
-{
-  UINT32  Left;
-  UINTN   Idx;
-  UINT8   *ChunkData;
-
-  //
-  // Read blob size.
-  //
-  Blob->Size = 0;
-  for (Idx = 0; Idx < ARRAY_SIZE (Blob->FwCfgItem); Idx++) {
-    if (Blob->FwCfgItem[Idx].SizeKey == 0) {
-      break;
-    }
-
-    QemuFwCfgSelectItem (Blob->FwCfgItem[Idx].SizeKey);
-    Blob->FwCfgItem[Idx].Size = QemuFwCfgRead32 ();
-    Blob->Size               += Blob->FwCfgItem[Idx].Size;
-  }
-
-  if (Blob->Size == 0) {
-    return EFI_SUCCESS;
-  }
-
-  //
-  // Read blob.
-  //
-  Blob->Data = AllocatePool (Blob->Size);
-  if (Blob->Data == NULL) {
-    DEBUG ((
-      DEBUG_ERROR,
-      "%a: failed to allocate %Ld bytes for \"%s\"\n",
-      __FUNCTION__,
-      (INT64)Blob->Size,
-      Blob->Name
-      ));
-    return EFI_OUT_OF_RESOURCES;
-  }
-
-  DEBUG ((
-    DEBUG_INFO,
-    "%a: loading %Ld bytes for \"%s\"\n",
-    __FUNCTION__,
-    (INT64)Blob->Size,
-    Blob->Name
-    ));
-
-  ChunkData = Blob->Data;
-  for (Idx = 0; Idx < ARRAY_SIZE (Blob->FwCfgItem); Idx++) {
-    if (Blob->FwCfgItem[Idx].DataKey == 0) {
-      break;
-    }
-
-    QemuFwCfgSelectItem (Blob->FwCfgItem[Idx].DataKey);
-
-    Left = Blob->FwCfgItem[Idx].Size;
-    while (Left > 0) {
-      UINT32  Chunk;
-
-      Chunk = (Left < SIZE_1MB) ? Left : SIZE_1MB;
-      QemuFwCfgReadBytes (Chunk, ChunkData + Blob->FwCfgItem[Idx].Size - Left);
-      Left -= Chunk;
-      DEBUG ((
-        DEBUG_VERBOSE,
-        "%a: %Ld bytes remaining for \"%s\" (%d)\n",
-        __FUNCTION__,
-        (INT64)Left,
-        Blob->Name,
-        (INT32)Idx
-        ));
-    }
-
-    ChunkData += Blob->FwCfgItem[Idx].Size;
-  }
-
-  return EFI_SUCCESS;
-}
-
 //
 // The entry point of the feature.
 //
 
 /**
-  Download the kernel, the initial ramdisk, and the kernel command line from
-  QEMU's fw_cfg. Construct a minimal SimpleFileSystem that contains the two
-  image files.
+  Look up the sizes of the kernel, the initial ramdisk, and the kernel command
+  line in QEMU's fw_cfg. Construct a minimal SimpleFileSystem that contains the
+  two image files, and that downloads them from fw_cfg when they are read.
 
   @retval EFI_NOT_FOUND         Kernel image was not found.
-  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
   @retval EFI_PROTOCOL_ERROR    Unterminated kernel command line.
 
   @return                       Error codes from any of the underlying
@@ -1056,22 +1524,18 @@ QemuKernelLoaderFsDxeEntrypoint (
   }
 
   //
-  // Fetch all blobs.
+  // Look up all blobs. Their contents are downloaded, and verified, when they
+  // are read; missing blobs are verified here.
   //
   for (BlobType = 0; BlobType < KernelBlobTypeMax; ++BlobType) {
     CurrentBlob = &mKernelBlob[BlobType];
-    Status      = FetchBlob (CurrentBlob);
-    if (EFI_ERROR (Status)) {
-      goto FreeBlobs;
-    }
+    FetchBlobSize (CurrentBlob);
 
-    Status = VerifyBlob (
-               CurrentBlob->Name,
-               CurrentBlob->Data,
-               CurrentBlob->Size
-               );
-    if (EFI_ERROR (Status)) {
-      goto FreeBlobs;
+    if (CurrentBlob->Size == 0) {
+      Status = VerifyBlob (CurrentBlob->Name, NULL, 0);
+      if (EFI_ERROR (Status)) {
+        return Status;
+      }
     }
 
     mTotalBlobBytes += CurrentBlob->Size;
@@ -1079,9 +1543,8 @@ QemuKernelLoaderFsDxeEntrypoint (
 
   KernelBlob = &mKernelBlob[KernelBlobTypeKernel];
 
-  if (KernelBlob->Data == NULL) {
-    Status = EFI_NOT_FOUND;
-    goto FreeBlobs;
+  if (KernelBlob->Size == 0) {
+    return EFI_NOT_FOUND;
   }
 
   //
@@ -1104,7 +1567,7 @@ QemuKernelLoaderFsDxeEntrypoint (
       __FUNCTION__,
       Status
       ));
-    goto FreeBlobs;
+    return Status;
   }
 
   if (KernelBlob[KernelBlobTypeInitrd].Size > 0) {
@@ -1141,15 +1604,5 @@ UninstallFileSystemHandle:
                   );
   ASSERT_EFI_ERROR (Status);
 
-FreeBlobs:
-  while (BlobType > 0) {
-    CurrentBlob = &mKernelBlob[--BlobType];
-    if (CurrentBlob->Data != NULL) {
-      FreePool (CurrentBlob->Data);
-      CurrentBlob->Size = 0;
-      CurrentBlob->Data = NULL;
-    }
-  }
-
   return Status;
 }
@@ -127,7 +127,7 @@ typedef struct {
 //
 #define VRING_DESC_F_NEXT      BIT0 // more descriptors in this request
 #define VRING_DESC_F_WRITE     BIT1 // buffer to be written *by the host*
-#define VRING_DESC_F_INDIRECT  BIT2 // unused
+#define VRING_DESC_F_INDIRECT  BIT2 // buffer is a table of descriptors
 
 #pragma pack(1)
 typedef struct {
@@ -145,6 +145,7 @@ typedef struct {
   VRING_AVAIL            Avail;
   VRING_USED             Used;
   UINT16                 QueueSize;
+  BOOLEAN                Packed; // VIRTIO_F_RING_PACKED layout, see Virtio10.h
 } VRING;
 
 //
@@ -80,6 +80,42 @@ typedef struct {
 //
 #define VIRTIO_F_VERSION_1       BIT32
 #define VIRTIO_F_IOMMU_PLATFORM  BIT33
+#define VIRTIO_F_RING_PACKED     BIT34
+
+//
+// Packed virtqueue layout, from VirtIo 1.1 (2.7 Packed Virtqueues). The
+// descriptor ring replaces both the descriptor table and the available / used
+// rings of the split layout; the driver and the device event suppression
+// structures take the places of the available and used rings when the queue
+// address is reported.
+//
+#pragma pack (1)
+typedef struct {
+  UINT64    Addr;
+  UINT32    Len;
+  UINT16    Id;
+  UINT16    Flags;
+} VRING_PACKED_DESC;
+
+typedef struct {
+  UINT16    OffWrap;
+  UINT16    Flags;
+} VRING_PACKED_DESC_EVENT;
+#pragma pack ()
+
+//
+// VRING_PACKED_DESC.Flags bits, in addition to VRING_DESC_F_NEXT,
+// VRING_DESC_F_WRITE and VRING_DESC_F_INDIRECT
+//
+#define VRING_PACKED_DESC_F_AVAIL  BIT7
+#define VRING_PACKED_DESC_F_USED   BIT15
+
+//
+// Values for VRING_PACKED_DESC_EVENT.Flags
+//
+#define VRING_PACKED_EVENT_FLAG_ENABLE   0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE  0x1
+#define VRING_PACKED_EVENT_FLAG_DESC     0x2
 
 //
 // MMIO VirtIo Header Offsets
@@ -23,4 +23,10 @@ typedef struct {
 } VIRTIO_1_0_NET_REQ;
 #pragma pack ()
 
+//
+// Additional bit in VIRTIO_NET_REQ.Flags: the host has validated the checksums
+// of a received packet (VIRTIO_NET_F_GUEST_CSUM)
+//
+#define VIRTIO_NET_HDR_F_DATA_VALID  BIT1
+
 #endif // _VIRTIO_1_0_NET_H_
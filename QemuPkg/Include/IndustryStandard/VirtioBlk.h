@@ -34,6 +34,22 @@ typedef struct {
   UINT8                  Sectors;
   UINT32                 BlkSize;
   VIRTIO_BLK_TOPOLOGY    Topology;
+  //
+  // virtio-1.0, 5.2.4 Device configuration layout
+  //
+  UINT8                  WritebackCache;
+  UINT8                  Unused0;
+  UINT16                 NumQueues;        // with VIRTIO_BLK_F_MQ
+  //
+  // virtio-1.1, 5.2.4 Device configuration layout
+  //
+  UINT32                 MaxDiscardSectors;      // with VIRTIO_BLK_F_DISCARD
+  UINT32                 MaxDiscardSeg;
+  UINT32                 DiscardSectorAlignment;
+  UINT32                 MaxWriteZeroesSectors;  // with
+  UINT32                 MaxWriteZeroesSeg;      // VIRTIO_BLK_F_WRITE_ZEROES
+  UINT8                  WriteZeroesMayUnmap;
+  UINT8                  Unused1[3];
 } VIRTIO_BLK_CONFIG;
 #pragma pack()
 
@@ -53,6 +69,9 @@ typedef struct {
 #define VIRTIO_BLK_F_SCSI      BIT7
 #define VIRTIO_BLK_F_FLUSH     BIT9  // identical to "write cache enabled"
 #define VIRTIO_BLK_F_TOPOLOGY  BIT10 // information on optimal I/O alignment
+#define VIRTIO_BLK_F_MQ        BIT12 // virtio-1.0: multiple request queues
+#define VIRTIO_BLK_F_DISCARD       BIT13 // virtio-1.1: discard requests
+#define VIRTIO_BLK_F_WRITE_ZEROES  BIT14 // virtio-1.1: write zeroes requests
 
 //
 // We keep the status byte separate from the rest of the virtio-blk request
@@ -73,8 +92,25 @@ typedef struct {
 #define VIRTIO_BLK_T_SCSI_CMD_OUT  0x00000003
 #define VIRTIO_BLK_T_FLUSH         0x00000004
 #define VIRTIO_BLK_T_FLUSH_OUT     0x00000005
+#define VIRTIO_BLK_T_DISCARD       0x0000000B
+#define VIRTIO_BLK_T_WRITE_ZEROES  0x0000000D
 #define VIRTIO_BLK_T_BARRIER       BIT31
 
+//
+// virtio-1.1, 5.2.6 Device Operation: the data of VIRTIO_BLK_T_DISCARD and
+// VIRTIO_BLK_T_WRITE_ZEROES requests is an array of ranges, in 512-byte
+// sectors.
+//
+#pragma pack(1)
+typedef struct {
+  UINT64    Sector;
+  UINT32    NumSectors;
+  UINT32    Flags;
+} VIRTIO_BLK_DISCARD_WRITE_ZEROES;
+#pragma pack()
+
+#define VIRTIO_BLK_WRITE_ZEROES_F_UNMAP  BIT0
+
 #define VIRTIO_BLK_S_OK      0x00
 #define VIRTIO_BLK_S_IOERR   0x01
 #define VIRTIO_BLK_S_UNSUPP  0x02
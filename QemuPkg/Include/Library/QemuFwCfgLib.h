@@ -13,6 +13,28 @@
 
 #include <IndustryStandard/QemuFwCfg.h>
 
+//
+// The kinds of operation that QemuFwCfgTransfer() performs.
+//
+typedef enum {
+  QemuFwCfgTransferRead,
+  QemuFwCfgTransferWrite,
+  QemuFwCfgTransferSkip
+} QEMU_FW_CFG_TRANSFER_TYPE;
+
+//
+// One operation of QemuFwCfgTransfer(): select Item, skip Offset bytes of it,
+// then read Size bytes into Buffer, write Size bytes from Buffer, or skip Size
+// bytes. Buffer is ignored, and may be NULL, for QemuFwCfgTransferSkip.
+//
+typedef struct {
+  FIRMWARE_CONFIG_ITEM         Item;
+  QEMU_FW_CFG_TRANSFER_TYPE    Type;
+  UINT32                       Offset;
+  UINT32                       Size;
+  VOID                         *Buffer;
+} QEMU_FW_CFG_TRANSFER;
+
 /**
   Returns a boolean indicating if the firmware configuration interface
   is available or not.
@@ -164,4 +186,33 @@ QemuFwCfgFindFile (
   OUT  UINTN                 *Size
   );
 
+/**
+  Perform a list of select / skip / transfer operations on fw_cfg.
+
+  With the DMA access method, the item selection and the initial skip of each
+  operation are folded into the DMA control words, so that an operation costs
+  one DMA submission, or two if Offset is nonzero.
+
+  Following this call, the item of the last operation remains selected, and
+  further reads, writes or skips continue where that operation ended.
+
+  @param[in] Transfers  The operations to perform, in order.
+  @param[in] Count      The number of elements in Transfers.
+
+  @return    RETURN_SUCCESS            All operations have been performed.
+             RETURN_INVALID_PARAMETER  Transfers is NULL and Count is nonzero,
+                                       or an operation has an unknown Type, or
+                                       a NULL Buffer for a nonzero read or
+                                       write. No operation has been performed.
+             RETURN_UNSUPPORTED        If firmware configuration is
+                                       unavailable.
+
+**/
+RETURN_STATUS
+EFIAPI
+QemuFwCfgTransfer (
+  IN CONST QEMU_FW_CFG_TRANSFER  *Transfers,
+  IN UINTN                       Count
+  );
+
 #endif
@@ -51,6 +51,43 @@ VirtioRingInit (
   OUT VRING                   *Ring
   );
 
+/**
+
+  Configure a virtio ring with the packed layout (VIRTIO_F_RING_PACKED).
+
+  The descriptor ring is placed at the start of the allocation, followed by
+  the driver and the device event suppression structures. Ring->Desc,
+  Ring->Avail.Flags and Ring->Used.Flags point to these three areas
+  respectively, so that VIRTIO_DEVICE_PROTOCOL.SetQueueAddress() reports them
+  in place of the descriptor table, the available ring and the used ring. No
+  other pointers of the split layout are set.
+
+  A packed ring can only be driven through VIRTIO_REQUEST_QUEUE; the
+  lock-step VirtioPrepare() / VirtioAppendDesc() / VirtioFlush() helpers are
+  not supported on it.
+
+  @param[in]  VirtIo     The virtio device which will use the ring.
+
+  @param[in]  QueueSize  The number of descriptors to allocate for the virtio
+                         ring, as requested by the host.
+
+  @param[out] Ring       The virtio ring to set up.
+
+  @return                Status codes propagated from
+                         VirtIo->AllocateSharedPages().
+
+  @retval EFI_SUCCESS    Allocation and setup successful. Ring->Base (and
+                         nothing else) is responsible for deallocation.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioPackedRingInit (
+  IN  VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN  UINT16                  QueueSize,
+  OUT VRING                   *Ring
+  );
+
 /**
 
   Map the ring buffer so that it can be accessed equally by both guest
@@ -152,9 +189,10 @@ VirtioPrepare (
                                     caller computes this mask dependent on
                                     further buffers to append and transfer
                                     direction. VRING_DESC_F_INDIRECT is
-                                    unsupported. The VRING_DESC.Next field is
-                                    always set, but the host only interprets
-                                    it dependent on VRING_DESC_F_NEXT.
+                                    set by VirtioAppendIndirect() only. The
+                                    VRING_DESC.Next field is always set, but
+                                    the host only interprets it dependent on
+                                    VRING_DESC_F_NEXT.
 
   @param[in,out] Indices            Indices->HeadDescIdx is not accessed.
                                     On input, Indices->NextDescIdx identifies
@@ -210,6 +248,1057 @@ VirtioFlush (
   OUT    UINT32                  *UsedLen    OPTIONAL
   );
 
+//
+// Statistics collected while waiting for the host to return descriptor
+// chains. Times are estimates derived from the calibrated CpuPause() cost and
+// the requested Stall() periods, so that collecting them costs no timer
+// accesses.
+//
+typedef struct {
+  UINT64    Waits;      // waits that had to spin or sleep at all
+  UINT64    Spins;      // CpuPause() iterations
+  UINT64    Sleeps;     // Stall() calls
+  UINT64    SpinNs;     // estimated time spent spinning
+  UINT64    SleepUsecs; // time requested from Stall()
+} VIRTIO_WAIT_STATS;
+
+//
+// Per-device strategy for waiting on the host. The waiter first spins on the
+// used ring index with CpuPause() for up to SpinIterations rounds, and only
+// then falls back to Stall() with exponential backoff, capped at slightly
+// above 1 ms. A zero SpinIterations selects pure backoff.
+//
+typedef struct {
+  UINT32               SpinIterations;
+  UINT32               PausePicoSecs; // calibrated cost of one CpuPause()
+  VIRTIO_WAIT_STATS    Stats;
+} VIRTIO_WAIT_POLICY;
+
+/**
+
+  Initialize a VIRTIO_WAIT_POLICY, and calibrate its spin budget.
+
+  The cost of CpuPause() is measured once with TimerLib, and the spin budget
+  is converted to a number of CpuPause() iterations, so that the wait loops
+  themselves need not read the (possibly trapping) performance counter.
+
+  @param[out] Policy     The wait policy to initialize. Statistics are
+                         cleared.
+
+  @param[in]  SpinUsecs  The number of microseconds to spin before falling
+                         back to Stall(). Zero selects pure backoff.
+
+**/
+VOID
+EFIAPI
+VirtioWaitPolicyInit (
+  OUT VIRTIO_WAIT_POLICY  *Policy,
+  IN  UINT32              SpinUsecs
+  );
+
+/**
+
+  Log the statistics of a VIRTIO_WAIT_POLICY with DEBUG_INFO level.
+
+  @param[in] Caller  Name of the calling function or device, to prefix the
+                     message with.
+
+  @param[in] Policy  The wait policy whose statistics should be logged.
+
+**/
+VOID
+EFIAPI
+VirtioWaitPolicyLogStats (
+  IN CONST CHAR8               *Caller,
+  IN CONST VIRTIO_WAIT_POLICY  *Policy
+  );
+
+/**
+
+  Full memory barrier between publishing an available ring index and reading
+  the notification suppression fields of the host.
+
+  MemoryFence() only orders the accesses of the compiler on IA32 and X64; the
+  CPU may still perform the later load before the earlier store becomes
+  visible to the host. The host may then re-enable notifications, find no new
+  buffers, and go idle, while the driver skips the notification.
+
+**/
+VOID
+EFIAPI
+VirtioMb (
+  VOID
+  );
+
+/**
+
+  Notify the host about the descriptor chain just built, and wait until the
+  host processes it, according to a wait policy.
+
+  This function is identical to VirtioFlush(), except for the Policy
+  parameter.
+
+  @param[in] VirtIo       The target virtio device to notify.
+
+  @param[in] VirtQueueId  Identifies the queue for the target device.
+
+  @param[in,out] Ring     The virtio ring with descriptors to submit.
+
+  @param[in] Indices      Indices->NextDescIdx is not accessed.
+                          Indices->HeadDescIdx identifies the head descriptor
+                          of the descriptor chain.
+
+  @param[out] UsedLen     On success, the total number of bytes the host
+                          wrote. May be NULL.
+
+  @param[in,out] Policy   The wait policy to apply, and to update the
+                          statistics of. If NULL, the host is polled with
+                          Stall() backoff only, and no statistics are
+                          collected.
+
+  @return              Error code from VirtIo->SetQueueNotify() if it fails.
+
+  @retval EFI_SUCCESS  Otherwise, the host processed all descriptors.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioFlushEx (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN     UINT16                  VirtQueueId,
+  IN OUT VRING                   *Ring,
+  IN     DESC_INDICES            *Indices,
+  OUT    UINT32                  *UsedLen    OPTIONAL,
+  IN OUT VIRTIO_WAIT_POLICY      *Policy     OPTIONAL
+  );
+
+//
+// Bookkeeping for a virtio ring that carries several descriptor chains in
+// flight at the same time.
+//
+// Free descriptors are kept on a singly linked list, and each submitted head
+// descriptor is associated with an opaque caller token that is handed back
+// when the host returns the chain in the used ring. The links are kept in
+// guest-private memory, so the host cannot corrupt the bookkeeping by
+// rewriting the descriptor table.
+//
+// A ring is driven either through VIRTIO_REQUEST_QUEUE, or through the
+// lock-step VirtioPrepare() / VirtioAppendDesc() / VirtioFlush() sequence,
+// but never both. Callers are responsible for serializing access to a
+// VIRTIO_REQUEST_QUEUE, for example by raising the TPL.
+//
+// On a ring set up with VirtioPackedRingInit(), a chain occupies consecutive
+// slots of the descriptor ring, and the free list holds buffer IDs instead of
+// descriptors; one ID identifies each chain. NumFree still counts free
+// descriptor slots. Chains must be submitted (or cancelled) one at a time,
+// in the order they were reserved.
+//
+typedef struct {
+  VRING      *Ring;
+  UINT16     NumFree;      // descriptors on the free list
+  UINT16     FreeHead;     // first descriptor on the free list
+  UINT16     NumInFlight;  // chains submitted but not yet returned by the host
+  UINT16     NextAvailIdx; // free-running, mirrors *Ring->Avail.Idx (packed: slot)
+  UINT16     LastUsedIdx;  // free-running, next used element (packed: slot)
+  UINT16     *NextDesc;    // QueueSize elements, free list and chain links
+  UINT16     *ChainLen;    // QueueSize elements, nonzero for reserved heads
+  VOID       **Token;      // QueueSize elements, indexed by head descriptor
+  BOOLEAN    AvailWrap;    // packed ring: driver ring wrap counter
+  BOOLEAN    UsedWrap;     // packed ring: device ring wrap counter
+  UINT16     HeadFlags;    // packed ring: flags of the reserved chain's head
+  UINT16     NumAdded;     // available entries (packed: slots) not yet
+                           // announced with VirtioRequestNotify()
+  BOOLEAN    EventIdx;     // VIRTIO_F_RING_EVENT_IDX is in effect
+} VIRTIO_REQUEST_QUEUE;
+
+/**
+
+  Set up multi-request tracking for a virtio ring that has been configured
+  with VirtioRingInit().
+
+  All descriptors of the ring are placed on the free list, and interrupt
+  notifications from the host are turned off, as completions are polled.
+
+  @param[in]  Ring   The virtio ring to track. The ring must not have any
+                     descriptor chains in flight.
+
+  @param[out] Queue  The VIRTIO_REQUEST_QUEUE structure to initialize.
+
+  @retval EFI_SUCCESS           Tracking structures set up.
+
+  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestQueueInit (
+  IN  VRING                 *Ring,
+  OUT VIRTIO_REQUEST_QUEUE  *Queue
+  );
+
+/**
+
+  Switch a VIRTIO_REQUEST_QUEUE to the notification suppression scheme of
+  VIRTIO_F_RING_EVENT_IDX. Call it right after VirtioRequestQueueInit(), if
+  the feature has been negotiated.
+
+  @param[in,out] Queue  The request queue to update.
+
+**/
+VOID
+EFIAPI
+VirtioRequestEnableEventIdx (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue
+  );
+
+/**
+
+  Release the tracking structures of a VIRTIO_REQUEST_QUEUE.
+
+  The caller is responsible for stopping the host from using the underlying
+  ring first. Tokens of chains that are still in flight are forgotten.
+
+  @param[in,out] Queue  The VIRTIO_REQUEST_QUEUE to clean up.
+
+**/
+VOID
+EFIAPI
+VirtioRequestQueueUninit (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue
+  );
+
+/**
+
+  Take a chain of free descriptors off the free list, and prepare for
+  appending buffers to it with VirtioRequestAppendDesc().
+
+  @param[in,out] Queue      The request queue to allocate descriptors from.
+
+  @param[in]     DescCount  The number of descriptors the chain will consist
+                            of.
+
+  @param[out]    Indices    On success, Indices->HeadDescIdx identifies the
+                            head of the reserved chain, and
+                            Indices->NextDescIdx equals it.
+
+  @retval EFI_SUCCESS            DescCount descriptors have been reserved.
+
+  @retval EFI_INVALID_PARAMETER  DescCount is zero, or exceeds the size of the
+                                 ring.
+
+  @retval EFI_OUT_OF_RESOURCES   Not enough descriptors are free at the
+                                 moment. The caller should reap completions
+                                 with VirtioRequestPoll(), and retry.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestReserve (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     UINT16                DescCount,
+  OUT    DESC_INDICES          *Indices
+  );
+
+/**
+
+  Fill in the next descriptor of a chain reserved with
+  VirtioRequestReserve().
+
+  The calling convention matches VirtioAppendDesc(), except that consecutive
+  descriptors of the chain need not be adjacent in the descriptor table. The
+  caller must not append more descriptors than it reserved.
+
+  @param[in,out] Queue              The request queue owning the chain.
+
+  @param[in] BufferDeviceAddress    (Bus master device) start address of the
+                                    transmit / receive buffer.
+
+  @param[in] BufferSize             Number of bytes to transmit or receive.
+
+  @param[in] Flags                  A bitmask of VRING_DESC_F_* flags, as in
+                                    VirtioAppendDesc().
+
+  @param[in,out] Indices            On input, Indices->NextDescIdx identifies
+                                    the descriptor to carry the buffer. On
+                                    output, it identifies the following
+                                    descriptor of the chain.
+
+**/
+VOID
+EFIAPI
+VirtioRequestAppendDesc (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     UINT64                BufferDeviceAddress,
+  IN     UINT32                BufferSize,
+  IN     UINT16                Flags,
+  IN OUT DESC_INDICES          *Indices
+  );
+
+/**
+
+  Return a reserved, but not yet submitted, descriptor chain to the free
+  list. This is useful on error paths between VirtioRequestReserve() and
+  VirtioRequestSubmit().
+
+  @param[in,out] Queue    The request queue owning the chain.
+
+  @param[in]     Indices  Indices->HeadDescIdx identifies the chain.
+
+**/
+VOID
+EFIAPI
+VirtioRequestCancel (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     DESC_INDICES          *Indices
+  );
+
+/**
+
+  Expose a fully built descriptor chain to the host through the available
+  ring.
+
+  The host is not notified; call VirtioRequestNotify() after submitting one or
+  more chains.
+
+  @param[in,out] Queue    The request queue owning the chain.
+
+  @param[in]     Indices  Indices->HeadDescIdx identifies the chain.
+
+  @param[in]     Token    Opaque value returned by VirtioRequestPoll() when
+                          the host completes the chain.
+
+**/
+VOID
+EFIAPI
+VirtioRequestSubmit (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     DESC_INDICES          *Indices,
+  IN     VOID                  *Token
+  );
+
+/**
+
+  Notify the host about descriptor chains submitted with
+  VirtioRequestSubmit(), unless the host has asked not to be notified.
+
+  @param[in] VirtIo       The target virtio device to notify.
+
+  @param[in] VirtQueueId  Identifies the queue for the target device.
+
+  @param[in,out] Queue    The request queue whose chains have been submitted.
+
+  @retval EFI_SUCCESS  The host has been notified, or it does not need to be.
+
+  @return              Status code from VirtIo->SetQueueNotify().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestNotify (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN     UINT16                  VirtQueueId,
+  IN OUT VIRTIO_REQUEST_QUEUE    *Queue
+  );
+
+/**
+
+  Reap one descriptor chain that the host has returned in the used ring, and
+  put its descriptors back on the free list.
+
+  Chains may complete in any order.
+
+  @param[in,out] Queue    The request queue to check for completions.
+
+  @param[out]    Token    On success, the token passed to
+                          VirtioRequestSubmit() for the completed chain.
+
+  @param[out]    UsedLen  On success, the total number of bytes the host wrote
+                          across the buffers of the completed chain. May be
+                          NULL.
+
+  @retval EFI_SUCCESS         One chain has been reaped.
+
+  @retval EFI_NOT_READY       The host has not completed any chain since the
+                              last call.
+
+  @retval EFI_PROTOCOL_ERROR  The host returned a descriptor index that does
+                              not identify an in-flight chain. The used element
+                              has been skipped.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestPoll (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  OUT    VOID                  **Token,
+  OUT    UINT32                *UsedLen OPTIONAL
+  );
+
+/**
+
+  Wait until the host returns at least one descriptor chain submitted with
+  VirtioRequestSubmit(), according to a wait policy.
+
+  @param[in]     Queue   The request queue to wait on.
+
+  @param[in,out] Policy  The wait policy to apply, and to update the
+                         statistics of. If NULL, the host is polled with
+                         Stall() backoff only.
+
+  @retval EFI_SUCCESS    A completion is pending; reap it with
+                         VirtioRequestPoll().
+
+  @retval EFI_NOT_READY  No chains are in flight; there is nothing to wait
+                         for.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestWait (
+  IN     VIRTIO_REQUEST_QUEUE  *Queue,
+  IN OUT VIRTIO_WAIT_POLICY    *Policy OPTIONAL
+  );
+
+//
+// The position in the used ring of a VIRTIO_REQUEST_QUEUE where the next
+// completion is going to appear, recorded with VirtioRequestMark().
+//
+// VirtioRequestWait() reads the queue state, so it must be serialized with
+// VirtioRequestPoll(). A mark only refers to the shared ring, hence
+// VirtioRequestWaitMark() may run at a lower TPL than the code reaping the
+// queue: if completions are reaped meanwhile, the host has already moved
+// past the mark, and the wait ends at once.
+//
+typedef struct {
+  volatile CONST UINT16    *Word;
+  UINT16                   Mask;
+  UINT16                   Value;
+} VIRTIO_REQUEST_MARK;
+
+/**
+
+  Record where the next completion of a request queue is going to appear.
+
+  @param[in]  Queue  The request queue to wait on.
+
+  @param[out] Mark   The position to pass to VirtioRequestWaitMark().
+
+  @retval EFI_SUCCESS    Mark has been set.
+
+  @retval EFI_NOT_READY  No chains are in flight; there is nothing to wait
+                         for.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestMark (
+  IN  VIRTIO_REQUEST_QUEUE  *Queue,
+  OUT VIRTIO_REQUEST_MARK   *Mark
+  );
+
+/**
+
+  Wait until the host returns a descriptor chain at or past a position
+  recorded with VirtioRequestMark(), according to a wait policy.
+
+  @param[in]     Mark    The position to wait for.
+
+  @param[in,out] Policy  The wait policy to apply, and to update the
+                         statistics of. If NULL, the host is polled with
+                         Stall() backoff only.
+
+**/
+VOID
+EFIAPI
+VirtioRequestWaitMark (
+  IN     CONST VIRTIO_REQUEST_MARK  *Mark,
+  IN OUT VIRTIO_WAIT_POLICY         *Policy OPTIONAL
+  );
+
+//
+// Called by VirtioRequestProcessCompletions() for each descriptor chain that
+// the host has completed on a request queue of a VIRTIO_REQUEST_QUEUE_SET.
+//
+// Context is the value passed to VirtioRequestQueueSetInit(), QueueIndex
+// identifies the request queue within the set, and Token is the value passed
+// to VirtioRequestSubmit() for the chain.
+//
+typedef
+VOID
+(EFIAPI *VIRTIO_REQUEST_COMPLETE)(
+  IN VOID    *Context,
+  IN UINT16  QueueIndex,
+  IN VOID    *Token
+  );
+
+//
+// The request queues of a multi-queue device, spread out in an array of
+// driver-specific per-queue structures.
+//
+// The set picks the queue for each new request, reaps completions on all
+// queues, and waits for the host. All functions taking a set must be called
+// at TPL_NOTIFY.
+//
+// Requests whose submitters do not wait for them are reaped by a periodic
+// timer of the driver. The timer only runs while such requests are in
+// flight, see VirtioRequestPollTimerHold().
+//
+typedef struct {
+  UINT8                      *Queues;    // VIRTIO_REQUEST_QUEUE of queue #0
+  UINTN                      Stride;     // bytes between consecutive queues
+  UINT16                     NumQueues;
+  UINT16                     NextQueue;  // where VirtioRequestSelectQueue()
+                                         // starts looking
+  VIRTIO_WAIT_POLICY         *WaitPolicy;
+  VIRTIO_REQUEST_COMPLETE    Complete;
+  VOID                       *Context;
+  EFI_EVENT                  PollTimer;  // NULL until
+                                         // VirtioRequestPollTimerInit()
+  UINT64                     PollPeriod; // in 100ns units
+  UINTN                      NumPolled;  // holds on PollTimer
+} VIRTIO_REQUEST_QUEUE_SET;
+
+/**
+
+  Initialize a set of request queues.
+
+  @param[out] Set         The VIRTIO_REQUEST_QUEUE_SET structure to
+                          initialize.
+
+  @param[in]  Queues      The VIRTIO_REQUEST_QUEUE of the first queue, in the
+                          first element of the driver's array of per-queue
+                          structures.
+
+  @param[in]  Stride      The size of one element of the array, in bytes.
+
+  @param[in]  NumQueues   The number of elements in the array; at least one.
+
+  @param[in]  WaitPolicy  The wait policy to apply when waiting for the host.
+                          May be NULL, see VirtioRequestWaitMark().
+
+  @param[in]  Complete    The function to call for each completed chain.
+
+  @param[in]  Context     The value to pass to Complete.
+
+**/
+VOID
+EFIAPI
+VirtioRequestQueueSetInit (
+  OUT VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN  VIRTIO_REQUEST_QUEUE      *Queues,
+  IN  UINTN                     Stride,
+  IN  UINT16                    NumQueues,
+  IN  VIRTIO_WAIT_POLICY        *WaitPolicy OPTIONAL,
+  IN  VIRTIO_REQUEST_COMPLETE   Complete,
+  IN  VOID                      *Context
+  );
+
+/**
+
+  Look up a request queue of a set.
+
+  @param[in] Set         The set of request queues.
+
+  @param[in] QueueIndex  Identifies the queue within Set.
+
+  @return  The request queue.
+
+**/
+VIRTIO_REQUEST_QUEUE *
+EFIAPI
+VirtioRequestQueueSetGet (
+  IN VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN UINT16                    QueueIndex
+  );
+
+/**
+
+  Pick the request queue for a new request.
+
+  Starting from the queue after the one picked last, the queue with the
+  fewest requests in flight is chosen, so that consecutive requests spread
+  over all queues (and the host I/O threads serving them), while a queue
+  that the host is slow to drain receives less work.
+
+  @param[in,out] Set  The set of request queues.
+
+  @return  The index of the chosen queue within Set.
+
+**/
+UINT16
+EFIAPI
+VirtioRequestSelectQueue (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set
+  );
+
+/**
+
+  Reap all descriptor chains that the host has completed since the last
+  call, on all queues of a set, and pass their tokens to Set->Complete.
+
+  Used elements that do not identify an in-flight chain are skipped.
+
+  @param[in,out] Set  The set of request queues to check for completions.
+
+**/
+VOID
+EFIAPI
+VirtioRequestProcessCompletions (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set
+  );
+
+/**
+
+  Wait until the host completes a chain on one queue of a set, then reap the
+  completions of the set.
+
+  The wait itself takes place at WaitTpl, so that other events (such as a
+  timer reaping the completion first) are not held off for the host round
+  trip.
+
+  @param[in,out] Set         The set of request queues.
+
+  @param[in]     QueueIndex  Identifies the queue to wait on within Set.
+
+  @param[in]     WaitTpl     The TPL to wait at; at most TPL_NOTIFY.
+
+  @retval TRUE   The host has completed a chain, and completions have been
+                 reaped.
+
+  @retval FALSE  No chains are in flight on the queue.
+
+**/
+BOOLEAN
+EFIAPI
+VirtioRequestWaitForQueue (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN     UINT16                    QueueIndex,
+  IN     EFI_TPL                   WaitTpl
+  );
+
+/**
+
+  Wait until the host completes a chain on any queue of a set that has chains
+  in flight, then reap the completions of the set.
+
+  @param[in,out] Set      The set of request queues.
+
+  @param[in]     WaitTpl  The TPL to wait at, see VirtioRequestWaitForQueue().
+
+  @retval TRUE   The host has completed a chain, and completions have been
+                 reaped.
+
+  @retval FALSE  No chains are in flight on any queue of Set.
+
+**/
+BOOLEAN
+EFIAPI
+VirtioRequestWaitForAny (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN     EFI_TPL                   WaitTpl
+  );
+
+/**
+
+  Wait until the host has completed every chain in flight, on all queues of a
+  set, and reap the completions.
+
+  @param[in,out] Set      The set of request queues to drain.
+
+  @param[in]     WaitTpl  The TPL to wait at, see VirtioRequestWaitForQueue().
+
+**/
+VOID
+EFIAPI
+VirtioRequestDrain (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN     EFI_TPL                   WaitTpl
+  );
+
+/**
+
+  Associate a set of request queues with the periodic timer that reaps its
+  completions.
+
+  The timer is left alone until VirtioRequestPollTimerHold() is called.
+
+  @param[in,out] Set         The set of request queues.
+
+  @param[in]     PollTimer   A timer event whose notification function calls
+                             VirtioRequestProcessCompletions() for Set.
+
+  @param[in]     PollPeriod  The period to arm PollTimer with, in 100ns units.
+
+**/
+VOID
+EFIAPI
+VirtioRequestPollTimerInit (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN     EFI_EVENT                 PollTimer,
+  IN     UINT64                    PollPeriod
+  );
+
+/**
+
+  Note that a request nobody waits for is in flight, arming the poll timer
+  if it is the first one.
+
+  @param[in,out] Set  The set of request queues the request belongs to.
+
+**/
+VOID
+EFIAPI
+VirtioRequestPollTimerHold (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set
+  );
+
+/**
+
+  Note that a request accounted for with VirtioRequestPollTimerHold() has
+  completed, cancelling the poll timer if it was the last one.
+
+  @param[in,out] Set  The set of request queues the request belongs to.
+
+**/
+VOID
+EFIAPI
+VirtioRequestPollTimerRelease (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set
+  );
+
+//
+// A set of indirect descriptor tables (virtio-0.9.5, 2.4.1.3.1 Indirect
+// Descriptors) in one host-visible buffer.
+//
+// With VIRTIO_F_RING_INDIRECT_DESC negotiated, a driver can build a
+// descriptor chain in one of these tables instead of in the descriptor table
+// of the ring, and then place the chain into the ring as a single descriptor.
+// This way each request takes up one ring slot, regardless of how many
+// buffers it consists of.
+//
+// Tables are identified by index. Drivers typically allocate one table per
+// ring descriptor, and use the table whose index equals the head descriptor
+// of the ring chain; that table is then guaranteed to be free.
+//
+typedef struct {
+  volatile VRING_DESC    *Desc;         // NumTables * TableSize elements
+  UINT64                 DeviceAddress; // bus master address of Desc[0]
+  VOID                   *Mapping;
+  UINTN                  NumPages;
+  UINT16                 NumTables;
+  UINT16                 TableSize;     // descriptors per table
+} VIRTIO_INDIRECT_POOL;
+
+/**
+
+  Allocate and map a pool of indirect descriptor tables.
+
+  @param[in]  VirtIo     The virtio device that will access the tables.
+
+  @param[in]  NumTables  The number of tables to allocate.
+
+  @param[in]  TableSize  The number of descriptors in each table; the longest
+                         chain that a table can hold.
+
+  @param[out] Pool       The VIRTIO_INDIRECT_POOL structure to initialize.
+
+  @retval EFI_SUCCESS            The pool is ready for use.
+
+  @retval EFI_INVALID_PARAMETER  NumTables or TableSize is zero.
+
+  @return                        Error codes from
+                                 VirtIo->AllocateSharedPages() or
+                                 VirtioMapAllBytesInSharedBuffer().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioIndirectPoolInit (
+  IN  VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN  UINT16                  NumTables,
+  IN  UINT16                  TableSize,
+  OUT VIRTIO_INDIRECT_POOL    *Pool
+  );
+
+/**
+
+  Unmap and release a pool of indirect descriptor tables.
+
+  The caller is responsible for stopping the host from using the tables
+  first.
+
+  @param[in]     VirtIo  The virtio device that accessed the tables.
+
+  @param[in,out] Pool    The pool to release.
+
+**/
+VOID
+EFIAPI
+VirtioIndirectPoolUninit (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN OUT VIRTIO_INDIRECT_POOL    *Pool
+  );
+
+/**
+
+  Prepare for building a descriptor chain in an indirect descriptor table.
+
+  @param[in]  Pool          The pool owning the table.
+
+  @param[in]  TableIdx      Identifies the table within Pool. The caller is
+                            responsible for the table not being in use by the
+                            host.
+
+  @param[out] TableIndices  The DESC_INDICES structure to initialize for
+                            VirtioIndirectAppendDesc().
+
+**/
+VOID
+EFIAPI
+VirtioIndirectPrepare (
+  IN  VIRTIO_INDIRECT_POOL  *Pool,
+  IN  UINT16                TableIdx,
+  OUT DESC_INDICES          *TableIndices
+  );
+
+/**
+
+  Append a contiguous buffer to the descriptor chain being built in an
+  indirect descriptor table.
+
+  The calling convention matches VirtioAppendDesc(). The caller must not
+  append more descriptors than Pool->TableSize, and must not pass
+  VRING_DESC_F_INDIRECT in Flags.
+
+  @param[in]     Pool                 The pool owning the table.
+
+  @param[in]     BufferDeviceAddress  (Bus master device) start address of
+                                      the transmit / receive buffer.
+
+  @param[in]     BufferSize           Number of bytes to transmit or receive.
+
+  @param[in]     Flags                A bitmask of VRING_DESC_F_NEXT and
+                                      VRING_DESC_F_WRITE.
+
+  @param[in,out] TableIndices         Initialized by VirtioIndirectPrepare();
+                                      advanced by one descriptor on output.
+
+**/
+VOID
+EFIAPI
+VirtioIndirectAppendDesc (
+  IN     VIRTIO_INDIRECT_POOL  *Pool,
+  IN     UINT64                BufferDeviceAddress,
+  IN     UINT32                BufferSize,
+  IN     UINT16                Flags,
+  IN OUT DESC_INDICES          *TableIndices
+  );
+
+/**
+
+  Place a descriptor chain built in an indirect descriptor table into a
+  virtio ring as a single descriptor, in lock-step mode.
+
+  The calling convention matches VirtioAppendDesc(). The ring descriptor
+  terminates the ring chain; the caller should submit it with VirtioFlush()
+  or VirtioFlushEx().
+
+  @param[in,out] Ring          The virtio ring to append the descriptor to.
+
+  @param[in]     Pool          The pool owning the table.
+
+  @param[in]     TableIndices  Identifies the chain built with
+                               VirtioIndirectAppendDesc().
+
+  @param[in,out] Indices       As in VirtioAppendDesc().
+
+**/
+VOID
+EFIAPI
+VirtioAppendIndirect (
+  IN OUT VRING                 *Ring,
+  IN     VIRTIO_INDIRECT_POOL  *Pool,
+  IN     DESC_INDICES          *TableIndices,
+  IN OUT DESC_INDICES          *Indices
+  );
+
+/**
+
+  Place a descriptor chain built in an indirect descriptor table into a
+  chain reserved with VirtioRequestReserve(), as a single descriptor.
+
+  The calling convention matches VirtioRequestAppendDesc(). The descriptor
+  terminates the reserved chain, which therefore normally consists of this
+  one descriptor.
+
+  @param[in,out] Queue         The request queue owning the reserved chain.
+
+  @param[in]     Pool          The pool owning the table.
+
+  @param[in]     TableIndices  Identifies the chain built with
+                               VirtioIndirectAppendDesc().
+
+  @param[in,out] Indices       As in VirtioRequestAppendDesc().
+
+**/
+VOID
+EFIAPI
+VirtioRequestAppendIndirect (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     VIRTIO_INDIRECT_POOL  *Pool,
+  IN     DESC_INDICES          *TableIndices,
+  IN OUT DESC_INDICES          *Indices
+  );
+
+/**
+
+  Append a contiguous buffer to the descriptor chain being built for a
+  request queue, either directly in the chain reserved with
+  VirtioRequestReserve(), or in an indirect descriptor table.
+
+  @param[in,out] Queue                The request queue of the chain.
+
+  @param[in]     Pool                 If not NULL, the chain is built in a
+                                      table of this pool, prepared with
+                                      VirtioIndirectPrepare(); see
+                                      VirtioIndirectAppendDesc(). If NULL,
+                                      see VirtioRequestAppendDesc().
+
+  @param[in]     BufferDeviceAddress  (Bus master device) start address of
+                                      the buffer.
+
+  @param[in]     BufferSize           Number of bytes to transfer.
+
+  @param[in]     Flags                VRING_DESC_F_NEXT and / or
+                                      VRING_DESC_F_WRITE.
+
+  @param[in,out] ChainIndices         The chain being built.
+
+**/
+VOID
+EFIAPI
+VirtioRequestAppendChainDesc (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     VIRTIO_INDIRECT_POOL  *Pool OPTIONAL,
+  IN     UINT64                BufferDeviceAddress,
+  IN     UINT32                BufferSize,
+  IN     UINT16                Flags,
+  IN OUT DESC_INDICES          *ChainIndices
+  );
+
+//
+// A slab of equally sized, small structures shared with the host, such as
+// request headers and status bytes. The whole slab is allocated and mapped
+// once, so that taking an element and returning it costs neither a page
+// allocation nor an IOMMU map / unmap call. Callers are responsible for
+// serializing access, for example by raising the TPL.
+//
+typedef struct {
+  VOID      *Base;         // processor address of element #0
+  UINT64    DeviceAddress; // bus master address of element #0
+  VOID      *Mapping;
+  UINTN     NumPages;
+  UINT32    ElementSize;   // multiple of 8 bytes
+  UINT16    NumElements;
+  UINT16    NumFree;
+  UINT16    FreeHead;
+  UINT16    *NextFree;     // NumElements elements, free list links
+} VIRTIO_DMA_SLAB;
+
+/**
+
+  Allocate and map a slab of equally sized shared elements.
+
+  @param[in]  VirtIo       The virtio device that will access the elements.
+
+  @param[in]  NumElements  The number of elements to allocate.
+
+  @param[in]  ElementSize  The size of each element, in bytes. It is rounded
+                           up to a multiple of 8 bytes.
+
+  @param[out] Slab         The VIRTIO_DMA_SLAB structure to initialize.
+
+  @retval EFI_SUCCESS            The slab is ready for use.
+
+  @retval EFI_INVALID_PARAMETER  NumElements or ElementSize is zero.
+
+  @retval EFI_OUT_OF_RESOURCES   Memory allocation failed.
+
+  @return                        Error codes from
+                                 VirtIo->AllocateSharedPages() or
+                                 VirtioMapAllBytesInSharedBuffer().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioDmaSlabInit (
+  IN  VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN  UINT16                  NumElements,
+  IN  UINT32                  ElementSize,
+  OUT VIRTIO_DMA_SLAB         *Slab
+  );
+
+/**
+
+  Unmap and release a slab of shared elements.
+
+  The caller is responsible for stopping the host from using the elements
+  first.
+
+  @param[in]     VirtIo  The virtio device that accessed the elements.
+
+  @param[in,out] Slab    The slab to release.
+
+**/
+VOID
+EFIAPI
+VirtioDmaSlabUninit (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN OUT VIRTIO_DMA_SLAB         *Slab
+  );
+
+/**
+
+  Take a zeroed element off the free list of a slab.
+
+  @param[in,out] Slab           The slab to allocate from.
+
+  @param[out]    HostAddress    On success, the address of the element for
+                                the processor.
+
+  @param[out]    DeviceAddress  On success, the address of the element for
+                                the bus master.
+
+  @retval EFI_SUCCESS           The element has been allocated.
+
+  @retval EFI_OUT_OF_RESOURCES  All elements are in use.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioDmaSlabAlloc (
+  IN OUT VIRTIO_DMA_SLAB       *Slab,
+  OUT    VOID                  **HostAddress,
+  OUT    EFI_PHYSICAL_ADDRESS  *DeviceAddress
+  );
+
+/**
+
+  Return an element to the free list of its slab.
+
+  @param[in,out] Slab         The slab the element was allocated from.
+
+  @param[in]     HostAddress  The processor address of the element, as
+                              returned by VirtioDmaSlabAlloc().
+
+**/
+VOID
+EFIAPI
+VirtioDmaSlabFree (
+  IN OUT VIRTIO_DMA_SLAB  *Slab,
+  IN     VOID             *HostAddress
+  );
+
 /**
 
   Report the feature bits to the VirtIo 1.0 device that the VirtIo 1.0 driver
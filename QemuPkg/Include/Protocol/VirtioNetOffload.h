@@ -0,0 +1,134 @@
+/** @file
+  Virtio-net Offload Protocol
+
+  VirtioNetDxe installs this protocol next to EFI_SIMPLE_NETWORK_PROTOCOL, for
+  network stacks that can delegate checksum calculation and TCP segmentation
+  to the host. Both protocols share the device state and the queues: packets
+  sent with Transmit() are reported by EFI_SIMPLE_NETWORK_PROTOCOL.GetStatus(),
+  and Receive() fetches from the same RX queue as
+  EFI_SIMPLE_NETWORK_PROTOCOL.Receive().
+
+  DISCLAIMER: the VIRTIO_NET_OFFLOAD_PROTOCOL introduced here is a work in
+  progress, and should not be used outside of the EDK II tree.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef __VIRTIO_NET_OFFLOAD_H__
+#define __VIRTIO_NET_OFFLOAD_H__
+
+#include <IndustryStandard/VirtioNet.h>
+
+#define VIRTIO_NET_OFFLOAD_PROTOCOL_GUID  {\
+  0x295094a3, 0x2b19, 0x4aea, {0xb9, 0x43, 0x5a, 0xe3, 0x03, 0x7f, 0x07, 0x21 }\
+  }
+
+typedef struct _VIRTIO_NET_OFFLOAD_PROTOCOL VIRTIO_NET_OFFLOAD_PROTOCOL;
+
+//
+// Bits in VIRTIO_NET_OFFLOAD_PROTOCOL.Capabilities
+//
+#define VIRTIO_NET_OFFLOAD_TX_CSUM  BIT0  // VIRTIO_NET_HDR_F_NEEDS_CSUM on TX
+#define VIRTIO_NET_OFFLOAD_RX_CSUM  BIT1  // host validates RX checksums
+#define VIRTIO_NET_OFFLOAD_TSO4     BIT2  // VIRTIO_NET_HDR_GSO_TCPV4 on TX
+#define VIRTIO_NET_OFFLOAD_TSO6     BIT3  // VIRTIO_NET_HDR_GSO_TCPV6 on TX
+
+/**
+  Place a packet, with offload requests, in the transmit queue.
+
+  @param[in] This        This instance of VIRTIO_NET_OFFLOAD_PROTOCOL.
+
+  @param[in] Offload     The virtio-net request header to send the packet
+                         with. Flags may only contain
+                         VIRTIO_NET_HDR_F_NEEDS_CSUM, with the
+                         VIRTIO_NET_OFFLOAD_TX_CSUM capability. GsoType may
+                         be VIRTIO_NET_HDR_GSO_TCPV4 or
+                         VIRTIO_NET_HDR_GSO_TCPV6 with the matching TSO
+                         capability; segmentation requires
+                         VIRTIO_NET_HDR_F_NEEDS_CSUM. All offsets are relative
+                         to the start of the media header.
+
+  @param[in] BufferSize  The size of the packet, including the media header.
+                         At most MaxTransmitSize with segmentation, and at most
+                         one full size frame without.
+
+  @param[in] Buffer      The packet, with the media header filled in. It must
+                         be left intact until
+                         EFI_SIMPLE_NETWORK_PROTOCOL.GetStatus() returns it.
+
+  @retval EFI_SUCCESS            The packet was placed on the transmit queue.
+  @retval EFI_NOT_STARTED        The network interface is not initialized.
+  @retval EFI_NOT_READY          The transmit queue is full.
+  @retval EFI_UNSUPPORTED        Offload requests beyond Capabilities.
+  @retval EFI_INVALID_PARAMETER  One or more of the parameters has an
+                                 unsupported value.
+  @retval EFI_DEVICE_ERROR       The packet could not be sent.
+
+**/
+typedef
+EFI_STATUS
+(EFIAPI *VIRTIO_NET_OFFLOAD_TRANSMIT)(
+  IN VIRTIO_NET_OFFLOAD_PROTOCOL  *This,
+  IN CONST VIRTIO_NET_REQ         *Offload,
+  IN UINTN                        BufferSize,
+  IN VOID                         *Buffer
+  );
+
+/**
+  Receive a packet, and learn whether its checksums need verification.
+
+  Partial checksums, which the host may leave for the guest to complete, are
+  always completed before the packet is returned.
+
+  @param[in]     This           This instance of VIRTIO_NET_OFFLOAD_PROTOCOL.
+
+  @param[in,out] BufferSize     On input, the size of Buffer. On output, the
+                                size of the packet, including the media header.
+
+  @param[out]    Buffer         The buffer to receive the packet.
+
+  @param[out]    ChecksumValid  Set to TRUE if the IP, TCP and UDP checksums of
+                                the packet need not be verified.
+
+  @retval EFI_SUCCESS            A packet has been received.
+  @retval EFI_NOT_STARTED        The network interface is not initialized.
+  @retval EFI_NOT_READY          No packet has been received.
+  @retval EFI_BUFFER_TOO_SMALL   BufferSize is too small; it has been updated.
+  @retval EFI_INVALID_PARAMETER  One or more of the parameters is NULL.
+  @retval EFI_DEVICE_ERROR       A malformed packet has been dropped.
+
+**/
+typedef
+EFI_STATUS
+(EFIAPI *VIRTIO_NET_OFFLOAD_RECEIVE)(
+  IN     VIRTIO_NET_OFFLOAD_PROTOCOL  *This,
+  IN OUT UINTN                        *BufferSize,
+  OUT    VOID                         *Buffer,
+  OUT    BOOLEAN                      *ChecksumValid
+  );
+
+///
+///  This protocol exposes the checksum and segmentation offloads of a
+///  virtio-net device.
+///
+struct _VIRTIO_NET_OFFLOAD_PROTOCOL {
+  //
+  // VIRTIO_NET_OFFLOAD_* bits that the device supports
+  //
+  UINT32                         Capabilities;
+  //
+  // The largest packet, including the media header, that Transmit() accepts
+  // with segmentation
+  //
+  UINT32                         MaxTransmitSize;
+
+  VIRTIO_NET_OFFLOAD_TRANSMIT    Transmit;
+  VIRTIO_NET_OFFLOAD_RECEIVE     Receive;
+};
+
+extern EFI_GUID  gVirtioNetOffloadProtocolGuid;
+
+#endif
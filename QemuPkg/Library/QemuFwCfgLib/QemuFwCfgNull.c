@@ -197,3 +197,22 @@ QemuFwCfgFindFile (
 {
   return RETURN_UNSUPPORTED;
 }
+
+/**
+  Perform a list of select / skip / transfer operations on fw_cfg.
+
+  @param[in] Transfers  The operations to perform, in order.
+  @param[in] Count      The number of elements in Transfers.
+
+  @return    RETURN_UNSUPPORTED   Firmware configuration is unavailable.
+
+**/
+RETURN_STATUS
+EFIAPI
+QemuFwCfgTransfer (
+  IN CONST QEMU_FW_CFG_TRANSFER  *Transfers,
+  IN UINTN                       Count
+  )
+{
+  return RETURN_UNSUPPORTED;
+}
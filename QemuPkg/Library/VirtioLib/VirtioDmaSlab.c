@@ -0,0 +1,218 @@
+/** @file
+
+  Pre-mapped slabs of small guest-host shared structures.
+
+  Request headers and status bytes are only a few bytes each, but allocating
+  and mapping them per request costs a page allocation and, with an IOMMU,
+  map / unmap round trips on every I/O. A slab allocates and maps all the
+  elements a device can have in flight once, and hands them out from a free
+  list.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include "VirtioLibInternal.h"
+
+/**
+
+  Allocate and map a slab of equally sized shared elements.
+
+  @param[in]  VirtIo       The virtio device that will access the elements.
+
+  @param[in]  NumElements  The number of elements to allocate.
+
+  @param[in]  ElementSize  The size of each element, in bytes. It is rounded
+                           up to a multiple of 8 bytes.
+
+  @param[out] Slab         The VIRTIO_DMA_SLAB structure to initialize.
+
+  @retval EFI_SUCCESS            The slab is ready for use.
+
+  @retval EFI_INVALID_PARAMETER  NumElements or ElementSize is zero.
+
+  @retval EFI_OUT_OF_RESOURCES   Memory allocation failed.
+
+  @return                        Error codes from
+                                 VirtIo->AllocateSharedPages() or
+                                 VirtioMapAllBytesInSharedBuffer().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioDmaSlabInit (
+  IN  VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN  UINT16                  NumElements,
+  IN  UINT32                  ElementSize,
+  OUT VIRTIO_DMA_SLAB         *Slab
+  )
+{
+  EFI_STATUS            Status;
+  UINTN                 SlabSize;
+  VOID                  *Buffer;
+  EFI_PHYSICAL_ADDRESS  DeviceAddress;
+  UINT16                Idx;
+
+  if ((NumElements == 0) || (ElementSize == 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Slab->NextFree = AllocatePool (NumElements * sizeof *Slab->NextFree);
+  if (Slab->NextFree == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Slab->ElementSize = (UINT32)ALIGN_VALUE (ElementSize, sizeof (UINT64));
+  SlabSize          = (UINTN)NumElements * Slab->ElementSize;
+  Slab->NumPages    = EFI_SIZE_TO_PAGES (SlabSize);
+  Status            = VirtIo->AllocateSharedPages (
+                                VirtIo,
+                                Slab->NumPages,
+                                &Buffer
+                                );
+  if (EFI_ERROR (Status)) {
+    goto FreeNextFree;
+  }
+
+  ZeroMem (Buffer, SlabSize);
+
+  //
+  // Elements carry both host-read headers and host-written status, and are
+  // reused for many requests, so map them as a common buffer.
+  //
+  Status = VirtioMapAllBytesInSharedBuffer (
+             VirtIo,
+             VirtioOperationBusMasterCommonBuffer,
+             Buffer,
+             EFI_PAGES_TO_SIZE (Slab->NumPages),
+             &DeviceAddress,
+             &Slab->Mapping
+             );
+  if (EFI_ERROR (Status)) {
+    goto FreeBuffer;
+  }
+
+  for (Idx = 0; Idx < NumElements; Idx++) {
+    Slab->NextFree[Idx] = (UINT16)(Idx + 1);
+  }
+
+  Slab->Base          = Buffer;
+  Slab->DeviceAddress = DeviceAddress;
+  Slab->NumElements   = NumElements;
+  Slab->NumFree       = NumElements;
+  Slab->FreeHead      = 0;
+  return EFI_SUCCESS;
+
+FreeBuffer:
+  VirtIo->FreeSharedPages (VirtIo, Slab->NumPages, Buffer);
+
+FreeNextFree:
+  FreePool (Slab->NextFree);
+  SetMem (Slab, sizeof *Slab, 0x00);
+  return Status;
+}
+
+/**
+
+  Unmap and release a slab of shared elements.
+
+  The caller is responsible for stopping the host from using the elements
+  first.
+
+  @param[in]     VirtIo  The virtio device that accessed the elements.
+
+  @param[in,out] Slab    The slab to release.
+
+**/
+VOID
+EFIAPI
+VirtioDmaSlabUninit (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN OUT VIRTIO_DMA_SLAB         *Slab
+  )
+{
+  VirtIo->UnmapSharedBuffer (VirtIo, Slab->Mapping);
+  VirtIo->FreeSharedPages (VirtIo, Slab->NumPages, Slab->Base);
+  FreePool (Slab->NextFree);
+  SetMem (Slab, sizeof *Slab, 0x00);
+}
+
+/**
+
+  Take a zeroed element off the free list of a slab.
+
+  @param[in,out] Slab           The slab to allocate from.
+
+  @param[out]    HostAddress    On success, the address of the element for
+                                the processor.
+
+  @param[out]    DeviceAddress  On success, the address of the element for
+                                the bus master.
+
+  @retval EFI_SUCCESS           The element has been allocated.
+
+  @retval EFI_OUT_OF_RESOURCES  All elements are in use.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioDmaSlabAlloc (
+  IN OUT VIRTIO_DMA_SLAB       *Slab,
+  OUT    VOID                  **HostAddress,
+  OUT    EFI_PHYSICAL_ADDRESS  *DeviceAddress
+  )
+{
+  UINT16  Idx;
+  UINTN   Offset;
+
+  if (Slab->NumFree == 0) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Idx            = Slab->FreeHead;
+  Slab->FreeHead = Slab->NextFree[Idx];
+  Slab->NumFree--;
+
+  Offset         = (UINTN)Idx * Slab->ElementSize;
+  *HostAddress   = (UINT8 *)Slab->Base + Offset;
+  *DeviceAddress = Slab->DeviceAddress + Offset;
+  ZeroMem (*HostAddress, Slab->ElementSize);
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Return an element to the free list of its slab.
+
+  @param[in,out] Slab         The slab the element was allocated from.
+
+  @param[in]     HostAddress  The processor address of the element, as
+                              returned by VirtioDmaSlabAlloc().
+
+**/
+VOID
+EFIAPI
+VirtioDmaSlabFree (
+  IN OUT VIRTIO_DMA_SLAB  *Slab,
+  IN     VOID             *HostAddress
+  )
+{
+  UINTN   Offset;
+  UINT16  Idx;
+
+  Offset = (UINTN)((UINT8 *)HostAddress - (UINT8 *)Slab->Base);
+  ASSERT (Offset % Slab->ElementSize == 0);
+  Idx = (UINT16)(Offset / Slab->ElementSize);
+  ASSERT (Idx < Slab->NumElements);
+
+  Slab->NextFree[Idx] = Slab->FreeHead;
+  Slab->FreeHead      = Idx;
+  Slab->NumFree++;
+}
@@ -0,0 +1,388 @@
+/** @file
+
+  Indirect descriptor tables for virtio rings.
+
+  See virtio-0.9.5, 2.4.1.3.1 Indirect Descriptors. A chain built in an
+  indirect table occupies a single descriptor of the ring, so a ring of a
+  given size can carry more requests at the same time, and requests are no
+  longer limited in length by the ring size.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+
+#include "VirtioLibInternal.h"
+
+/**
+
+  Allocate and map a pool of indirect descriptor tables.
+
+  @param[in]  VirtIo     The virtio device that will access the tables.
+
+  @param[in]  NumTables  The number of tables to allocate.
+
+  @param[in]  TableSize  The number of descriptors in each table; the longest
+                         chain that a table can hold.
+
+  @param[out] Pool       The VIRTIO_INDIRECT_POOL structure to initialize.
+
+  @retval EFI_SUCCESS            The pool is ready for use.
+
+  @retval EFI_INVALID_PARAMETER  NumTables or TableSize is zero.
+
+  @return                        Error codes from
+                                 VirtIo->AllocateSharedPages() or
+                                 VirtioMapAllBytesInSharedBuffer().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioIndirectPoolInit (
+  IN  VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN  UINT16                  NumTables,
+  IN  UINT16                  TableSize,
+  OUT VIRTIO_INDIRECT_POOL    *Pool
+  )
+{
+  EFI_STATUS            Status;
+  UINTN                 PoolSize;
+  VOID                  *Buffer;
+  EFI_PHYSICAL_ADDRESS  DeviceAddress;
+
+  if ((NumTables == 0) || (TableSize == 0)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  PoolSize       = (UINTN)NumTables * TableSize * sizeof *Pool->Desc;
+  Pool->NumPages = EFI_SIZE_TO_PAGES (PoolSize);
+  Status         = VirtIo->AllocateSharedPages (
+                             VirtIo,
+                             Pool->NumPages,
+                             &Buffer
+                             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  ZeroMem (Buffer, PoolSize);
+
+  //
+  // The host reads the tables, and the guest rewrites them between requests,
+  // so map them as a common buffer.
+  //
+  Status = VirtioMapAllBytesInSharedBuffer (
+             VirtIo,
+             VirtioOperationBusMasterCommonBuffer,
+             Buffer,
+             EFI_PAGES_TO_SIZE (Pool->NumPages),
+             &DeviceAddress,
+             &Pool->Mapping
+             );
+  if (EFI_ERROR (Status)) {
+    VirtIo->FreeSharedPages (VirtIo, Pool->NumPages, Buffer);
+    return Status;
+  }
+
+  Pool->Desc          = Buffer;
+  Pool->DeviceAddress = DeviceAddress;
+  Pool->NumTables     = NumTables;
+  Pool->TableSize     = TableSize;
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Unmap and release a pool of indirect descriptor tables.
+
+  The caller is responsible for stopping the host from using the tables
+  first.
+
+  @param[in]     VirtIo  The virtio device that accessed the tables.
+
+  @param[in,out] Pool    The pool to release.
+
+**/
+VOID
+EFIAPI
+VirtioIndirectPoolUninit (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN OUT VIRTIO_INDIRECT_POOL    *Pool
+  )
+{
+  VirtIo->UnmapSharedBuffer (VirtIo, Pool->Mapping);
+  VirtIo->FreeSharedPages (VirtIo, Pool->NumPages, (VOID *)Pool->Desc);
+  SetMem (Pool, sizeof *Pool, 0x00);
+}
+
+/**
+
+  Prepare for building a descriptor chain in an indirect descriptor table.
+
+  @param[in]  Pool          The pool owning the table.
+
+  @param[in]  TableIdx      Identifies the table within Pool. The caller is
+                            responsible for the table not being in use by the
+                            host.
+
+  @param[out] TableIndices  The DESC_INDICES structure to initialize for
+                            VirtioIndirectAppendDesc().
+
+**/
+VOID
+EFIAPI
+VirtioIndirectPrepare (
+  IN  VIRTIO_INDIRECT_POOL  *Pool,
+  IN  UINT16                TableIdx,
+  OUT DESC_INDICES          *TableIndices
+  )
+{
+  ASSERT (TableIdx < Pool->NumTables);
+
+  //
+  // Within an indirect table, descriptors are linked by their indices
+  // relative to the start of the table. Track the table in HeadDescIdx, and
+  // the relative index of the next descriptor in NextDescIdx.
+  //
+  TableIndices->HeadDescIdx = TableIdx;
+  TableIndices->NextDescIdx = 0;
+}
+
+/**
+
+  Append a contiguous buffer to the descriptor chain being built in an
+  indirect descriptor table.
+
+  The calling convention matches VirtioAppendDesc(). The caller must not
+  append more descriptors than Pool->TableSize, and must not pass
+  VRING_DESC_F_INDIRECT in Flags.
+
+  @param[in]     Pool                 The pool owning the table.
+
+  @param[in]     BufferDeviceAddress  (Bus master device) start address of
+                                      the transmit / receive buffer.
+
+  @param[in]     BufferSize           Number of bytes to transmit or receive.
+
+  @param[in]     Flags                A bitmask of VRING_DESC_F_NEXT and
+                                      VRING_DESC_F_WRITE.
+
+  @param[in,out] TableIndices         Initialized by VirtioIndirectPrepare();
+                                      advanced by one descriptor on output.
+
+**/
+VOID
+EFIAPI
+VirtioIndirectAppendDesc (
+  IN     VIRTIO_INDIRECT_POOL  *Pool,
+  IN     UINT64                BufferDeviceAddress,
+  IN     UINT32                BufferSize,
+  IN     UINT16                Flags,
+  IN OUT DESC_INDICES          *TableIndices
+  )
+{
+  volatile VRING_DESC  *Desc;
+
+  //
+  // virtio-0.9.5, 2.4.1.3.1: "A single indirect descriptor table can include
+  // both read-only and write-only descriptors", but never another indirect
+  // one.
+  //
+  ASSERT ((Flags & VRING_DESC_F_INDIRECT) == 0);
+  ASSERT (TableIndices->NextDescIdx < Pool->TableSize);
+
+  Desc = &Pool->Desc[(UINTN)TableIndices->HeadDescIdx * Pool->TableSize +
+                     TableIndices->NextDescIdx++];
+  Desc->Addr  = BufferDeviceAddress;
+  Desc->Len   = BufferSize;
+  Desc->Flags = Flags;
+  Desc->Next  = TableIndices->NextDescIdx;
+}
+
+/**
+
+  Compute the bus master address and the size of the descriptor chain built
+  in an indirect descriptor table.
+
+  @param[in]  Pool          The pool owning the table.
+
+  @param[in]  TableIndices  Identifies the chain built with
+                            VirtioIndirectAppendDesc().
+
+  @param[out] TableAddress  The bus master address of the first descriptor of
+                            the table.
+
+  @return  The size of the chain in bytes.
+
+**/
+STATIC
+UINT32
+GetIndirectTable (
+  IN  VIRTIO_INDIRECT_POOL  *Pool,
+  IN  DESC_INDICES          *TableIndices,
+  OUT UINT64                *TableAddress
+  )
+{
+  ASSERT (TableIndices->NextDescIdx > 0);
+  ASSERT (
+    (Pool->Desc[(UINTN)TableIndices->HeadDescIdx * Pool->TableSize +
+                TableIndices->NextDescIdx - 1].Flags & VRING_DESC_F_NEXT) == 0
+    );
+
+  *TableAddress = Pool->DeviceAddress +
+                  (UINT64)TableIndices->HeadDescIdx * Pool->TableSize *
+                  sizeof *Pool->Desc;
+  return (UINT32)(TableIndices->NextDescIdx * sizeof *Pool->Desc);
+}
+
+/**
+
+  Place a descriptor chain built in an indirect descriptor table into a
+  virtio ring as a single descriptor, in lock-step mode.
+
+  The calling convention matches VirtioAppendDesc(). The ring descriptor
+  terminates the ring chain; the caller should submit it with VirtioFlush()
+  or VirtioFlushEx().
+
+  @param[in,out] Ring          The virtio ring to append the descriptor to.
+
+  @param[in]     Pool          The pool owning the table.
+
+  @param[in]     TableIndices  Identifies the chain built with
+                               VirtioIndirectAppendDesc().
+
+  @param[in,out] Indices       As in VirtioAppendDesc().
+
+**/
+VOID
+EFIAPI
+VirtioAppendIndirect (
+  IN OUT VRING                 *Ring,
+  IN     VIRTIO_INDIRECT_POOL  *Pool,
+  IN     DESC_INDICES          *TableIndices,
+  IN OUT DESC_INDICES          *Indices
+  )
+{
+  UINT64  TableAddress;
+  UINT32  TableLen;
+
+  TableLen = GetIndirectTable (Pool, TableIndices, &TableAddress);
+
+  //
+  // virtio-1.0, 2.4.5.3.1: the driver must not set VRING_DESC_F_NEXT together
+  // with VRING_DESC_F_INDIRECT.
+  //
+  VirtioAppendDesc (
+    Ring,
+    TableAddress,
+    TableLen,
+    VRING_DESC_F_INDIRECT,
+    Indices
+    );
+}
+
+/**
+
+  Place a descriptor chain built in an indirect descriptor table into a
+  chain reserved with VirtioRequestReserve(), as a single descriptor.
+
+  The calling convention matches VirtioRequestAppendDesc(). The descriptor
+  terminates the reserved chain, which therefore normally consists of this
+  one descriptor.
+
+  @param[in,out] Queue         The request queue owning the reserved chain.
+
+  @param[in]     Pool          The pool owning the table.
+
+  @param[in]     TableIndices  Identifies the chain built with
+                               VirtioIndirectAppendDesc().
+
+  @param[in,out] Indices       As in VirtioRequestAppendDesc().
+
+**/
+VOID
+EFIAPI
+VirtioRequestAppendIndirect (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     VIRTIO_INDIRECT_POOL  *Pool,
+  IN     DESC_INDICES          *TableIndices,
+  IN OUT DESC_INDICES          *Indices
+  )
+{
+  UINT64  TableAddress;
+  UINT32  TableLen;
+
+  //
+  // The tables use the split descriptor format.
+  //
+  ASSERT (!Queue->Ring->Packed);
+
+  TableLen = GetIndirectTable (Pool, TableIndices, &TableAddress);
+  VirtioRequestAppendDesc (
+    Queue,
+    TableAddress,
+    TableLen,
+    VRING_DESC_F_INDIRECT,
+    Indices
+    );
+}
+
+/**
+
+  Append a contiguous buffer to the descriptor chain being built for a
+  request queue, either directly in the chain reserved with
+  VirtioRequestReserve(), or in an indirect descriptor table.
+
+  @param[in,out] Queue                The request queue of the chain.
+
+  @param[in]     Pool                 If not NULL, the chain is built in a
+                                      table of this pool, prepared with
+                                      VirtioIndirectPrepare(); see
+                                      VirtioIndirectAppendDesc(). If NULL,
+                                      see VirtioRequestAppendDesc().
+
+  @param[in]     BufferDeviceAddress  (Bus master device) start address of
+                                      the buffer.
+
+  @param[in]     BufferSize           Number of bytes to transfer.
+
+  @param[in]     Flags                VRING_DESC_F_NEXT and / or
+                                      VRING_DESC_F_WRITE.
+
+  @param[in,out] ChainIndices         The chain being built.
+
+**/
+VOID
+EFIAPI
+VirtioRequestAppendChainDesc (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     VIRTIO_INDIRECT_POOL  *Pool OPTIONAL,
+  IN     UINT64                BufferDeviceAddress,
+  IN     UINT32                BufferSize,
+  IN     UINT16                Flags,
+  IN OUT DESC_INDICES          *ChainIndices
+  )
+{
+  if (Pool != NULL) {
+    VirtioIndirectAppendDesc (
+      Pool,
+      BufferDeviceAddress,
+      BufferSize,
+      Flags,
+      ChainIndices
+      );
+  } else {
+    VirtioRequestAppendDesc (
+      Queue,
+      BufferDeviceAddress,
+      BufferSize,
+      Flags,
+      ChainIndices
+      );
+  }
+}
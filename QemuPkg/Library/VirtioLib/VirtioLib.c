@@ -13,9 +13,22 @@
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
+#include <Library/SynchronizationLib.h>
+#include <Library/TimerLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 
-#include <Library/VirtioLib.h>
+#include "VirtioLibInternal.h"
+
+//
+// The number of CpuPause() iterations timed by VirtioWaitPolicyInit().
+//
+#define VIRTIO_WAIT_CALIBRATION_PAUSES  4096
+
+//
+// The packed ring keeps the driver and the device event suppression
+// structures on cache lines of their own, apart from the descriptor ring.
+//
+#define VIRTIO_PACKED_EVENT_ALIGN  64
 
 /**
 
@@ -123,6 +136,80 @@ VirtioRingInit (
   RingPagesPtr         += sizeof *Ring->Used.AvailEvent;
 
   Ring->QueueSize = QueueSize;
+  Ring->Packed    = FALSE;
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Configure a virtio ring with the packed layout (VIRTIO_F_RING_PACKED).
+
+  The descriptor ring is placed at the start of the allocation, followed by
+  the driver and the device event suppression structures. Ring->Desc,
+  Ring->Avail.Flags and Ring->Used.Flags point to these three areas
+  respectively, so that VIRTIO_DEVICE_PROTOCOL.SetQueueAddress() reports them
+  in place of the descriptor table, the available ring and the used ring. No
+  other pointers of the split layout are set.
+
+  A packed ring can only be driven through VIRTIO_REQUEST_QUEUE; the
+  lock-step VirtioPrepare() / VirtioAppendDesc() / VirtioFlush() helpers are
+  not supported on it.
+
+  @param[in]  VirtIo     The virtio device which will use the ring.
+
+  @param[in]  QueueSize  The number of descriptors to allocate for the virtio
+                         ring, as requested by the host.
+
+  @param[out] Ring       The virtio ring to set up.
+
+  @return                Status codes propagated from
+                         VirtIo->AllocateSharedPages().
+
+  @retval EFI_SUCCESS    Allocation and setup successful. Ring->Base (and
+                         nothing else) is responsible for deallocation.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioPackedRingInit (
+  IN  VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN  UINT16                  QueueSize,
+  OUT VRING                   *Ring
+  )
+{
+  EFI_STATUS      Status;
+  UINTN           DescSize;
+  UINTN           RingSize;
+  volatile UINT8  *RingPagesPtr;
+
+  DescSize = ALIGN_VALUE (
+               sizeof (VRING_PACKED_DESC) * QueueSize,
+               VIRTIO_PACKED_EVENT_ALIGN
+               );
+  RingSize = DescSize + 2 * VIRTIO_PACKED_EVENT_ALIGN;
+
+  Ring->NumPages = EFI_SIZE_TO_PAGES (RingSize);
+  Status         = VirtIo->AllocateSharedPages (
+                             VirtIo,
+                             Ring->NumPages,
+                             &Ring->Base
+                             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  SetMem (Ring->Base, EFI_PAGES_TO_SIZE (Ring->NumPages), 0x00);
+  SetMem (&Ring->Avail, sizeof Ring->Avail, 0x00);
+  SetMem (&Ring->Used, sizeof Ring->Used, 0x00);
+  RingPagesPtr = Ring->Base;
+
+  Ring->Desc        = (volatile VOID *)RingPagesPtr;
+  Ring->Avail.Flags = (volatile VOID *)(RingPagesPtr + DescSize);
+  Ring->Used.Flags  = (volatile VOID *)(RingPagesPtr + DescSize +
+                                        VIRTIO_PACKED_EVENT_ALIGN);
+
+  Ring->QueueSize = QueueSize;
+  Ring->Packed    = TRUE;
   return EFI_SUCCESS;
 }
 
@@ -278,11 +365,284 @@ VirtioFlush (
   IN     DESC_INDICES            *Indices,
   OUT    UINT32                  *UsedLen    OPTIONAL
   )
+{
+  return VirtioFlushEx (VirtIo, VirtQueueId, Ring, Indices, UsedLen, NULL);
+}
+
+/**
+
+  Initialize a VIRTIO_WAIT_POLICY, and calibrate its spin budget.
+
+  The cost of CpuPause() is measured once with TimerLib, and the spin budget
+  is converted to a number of CpuPause() iterations, so that the wait loops
+  themselves need not read the (possibly trapping) performance counter.
+
+  @param[out] Policy     The wait policy to initialize. Statistics are
+                         cleared.
+
+  @param[in]  SpinUsecs  The number of microseconds to spin before falling
+                         back to Stall(). Zero selects pure backoff.
+
+**/
+VOID
+EFIAPI
+VirtioWaitPolicyInit (
+  OUT VIRTIO_WAIT_POLICY  *Policy,
+  IN  UINT32              SpinUsecs
+  )
+{
+  UINT64  CounterStart;
+  UINT64  CounterEnd;
+  UINT64  Begin;
+  UINT64  End;
+  UINT64  Ticks;
+  UINT64  ElapsedNs;
+  UINT64  PicoSecs;
+  UINTN   Idx;
+
+  SetMem (Policy, sizeof *Policy, 0x00);
+  if (SpinUsecs == 0) {
+    return;
+  }
+
+  GetPerformanceCounterProperties (&CounterStart, &CounterEnd);
+  Begin = GetPerformanceCounter ();
+  for (Idx = 0; Idx < VIRTIO_WAIT_CALIBRATION_PAUSES; Idx++) {
+    CpuPause ();
+  }
+
+  End = GetPerformanceCounter ();
+
+  //
+  // Account for the direction of the counter, and for one wraparound.
+  //
+  if (CounterStart < CounterEnd) {
+    Ticks = (End >= Begin) ?
+            End - Begin :
+            (CounterEnd - Begin) + (End - CounterStart);
+  } else {
+    Ticks = (Begin >= End) ?
+            Begin - End :
+            (Begin - CounterEnd) + (CounterStart - End);
+  }
+
+  ElapsedNs = GetTimeInNanoSecond (Ticks);
+  PicoSecs  = DivU64x32 (
+                MultU64x32 (ElapsedNs, 1000),
+                VIRTIO_WAIT_CALIBRATION_PAUSES
+                );
+
+  //
+  // Guard against a counter too coarse to resolve the calibration loop, and
+  // against absurd results.
+  //
+  if (PicoSecs == 0) {
+    PicoSecs = 1;
+  } else if (PicoSecs > MAX_UINT32) {
+    PicoSecs = MAX_UINT32;
+  }
+
+  Policy->PausePicoSecs  = (UINT32)PicoSecs;
+  Policy->SpinIterations = (UINT32)MIN (
+                                     DivU64x32 (
+                                       MultU64x32 (SpinUsecs, 1000000),
+                                       Policy->PausePicoSecs
+                                       ),
+                                     MAX_UINT32
+                                     );
+
+  DEBUG ((
+    DEBUG_VERBOSE,
+    "%a: SpinUsecs=%u PausePicoSecs=%u SpinIterations=%u\n",
+    __FUNCTION__,
+    SpinUsecs,
+    Policy->PausePicoSecs,
+    Policy->SpinIterations
+    ));
+}
+
+/**
+
+  Log the statistics of a VIRTIO_WAIT_POLICY with DEBUG_INFO level.
+
+  @param[in] Caller  Name of the calling function or device, to prefix the
+                     message with.
+
+  @param[in] Policy  The wait policy whose statistics should be logged.
+
+**/
+VOID
+EFIAPI
+VirtioWaitPolicyLogStats (
+  IN CONST CHAR8               *Caller,
+  IN CONST VIRTIO_WAIT_POLICY  *Policy
+  )
+{
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: waits=%Lu spins=%Lu sleeps=%Lu spin=%Luus sleep=%Luus\n",
+    Caller,
+    Policy->Stats.Waits,
+    Policy->Stats.Spins,
+    Policy->Stats.Sleeps,
+    DivU64x32 (Policy->Stats.SpinNs, 1000),
+    Policy->Stats.SleepUsecs
+    ));
+}
+
+/**
+
+  Wait while selected bits of a word in guest-host shared memory equal a
+  given value.
+
+  For the split ring, the word is the used ring index; for the packed ring, it
+  is the flags field of the next descriptor the device is going to mark used.
+
+  @param[in]     Word     The shared word to watch.
+
+  @param[in]     Mask     The bits of *Word to compare.
+
+  @param[in]     Value    Return as soon as (*Word & Mask) differs from this
+                          value.
+
+  @param[in,out] Policy   The wait policy to apply, and to update the
+                          statistics of. If NULL, the host is polled with
+                          Stall() backoff only.
+
+**/
+VOID
+InternalVirtioWaitWhile (
+  IN     volatile CONST UINT16  *Word,
+  IN     UINT16                 Mask,
+  IN     UINT16                 Value,
+  IN OUT VIRTIO_WAIT_POLICY     *Policy OPTIONAL
+  )
+{
+  UINT32  Spins;
+  UINT32  Sleeps;
+  UINTN   PollPeriodUsecs;
+  UINT64  SleepUsecs;
+
+  MemoryFence ();
+  if ((*Word & Mask) != Value) {
+    return;
+  }
+
+  //
+  // Spin for the calibrated budget first: under a hypervisor, the host
+  // usually answers within a few tens of microseconds, which is much shorter
+  // than our coarsest sleep.
+  //
+  Spins = 0;
+  if (Policy != NULL) {
+    while (Spins < Policy->SpinIterations) {
+      CpuPause ();
+      Spins++;
+      MemoryFence ();
+      if ((*Word & Mask) != Value) {
+        break;
+      }
+    }
+  }
+
+  //
+  // Keep slowing down until we reach a poll period of slightly above 1 ms.
+  //
+  Sleeps          = 0;
+  SleepUsecs      = 0;
+  PollPeriodUsecs = 1;
+  MemoryFence ();
+  while ((*Word & Mask) == Value) {
+    gBS->Stall (PollPeriodUsecs); // calls AcpiTimerLib::MicroSecondDelay
+    Sleeps++;
+    SleepUsecs += PollPeriodUsecs;
+
+    if (PollPeriodUsecs < 1024) {
+      PollPeriodUsecs *= 2;
+    }
+
+    MemoryFence ();
+  }
+
+  if (Policy != NULL) {
+    Policy->Stats.Waits++;
+    Policy->Stats.Spins      += Spins;
+    Policy->Stats.Sleeps     += Sleeps;
+    Policy->Stats.SpinNs     += DivU64x32 (
+                                  MultU64x32 (Spins, Policy->PausePicoSecs),
+                                  1000
+                                  );
+    Policy->Stats.SleepUsecs += SleepUsecs;
+  }
+}
+
+/**
+
+  Full memory barrier between publishing an available ring index and reading
+  the notification suppression fields of the host.
+
+  A locked read-modify-write is a full barrier on IA32 and X64, and
+  InterlockedCompareExchange32() brackets the exclusive access with full
+  barriers on ARM and AARCH64.
+
+**/
+VOID
+EFIAPI
+VirtioMb (
+  VOID
+  )
+{
+  volatile UINT32  Word;
+
+  Word = 0;
+  InterlockedCompareExchange32 (&Word, 0, 0);
+}
+
+/**
+
+  Notify the host about the descriptor chain just built, and wait until the
+  host processes it, according to a wait policy.
+
+  This function is identical to VirtioFlush(), except for the Policy
+  parameter.
+
+  @param[in] VirtIo       The target virtio device to notify.
+
+  @param[in] VirtQueueId  Identifies the queue for the target device.
+
+  @param[in,out] Ring     The virtio ring with descriptors to submit.
+
+  @param[in] Indices      Indices->NextDescIdx is not accessed.
+                          Indices->HeadDescIdx identifies the head descriptor
+                          of the descriptor chain.
+
+  @param[out] UsedLen     On success, the total number of bytes the host
+                          wrote. May be NULL.
+
+  @param[in,out] Policy   The wait policy to apply, and to update the
+                          statistics of. If NULL, the host is polled with
+                          Stall() backoff only, and no statistics are
+                          collected.
+
+  @return              Error code from VirtIo->SetQueueNotify() if it fails.
+
+  @retval EFI_SUCCESS  Otherwise, the host processed all descriptors.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioFlushEx (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN     UINT16                  VirtQueueId,
+  IN OUT VRING                   *Ring,
+  IN     DESC_INDICES            *Indices,
+  OUT    UINT32                  *UsedLen    OPTIONAL,
+  IN OUT VIRTIO_WAIT_POLICY      *Policy     OPTIONAL
+  )
 {
   UINT16      NextAvailIdx;
   UINT16      LastUsedIdx;
   EFI_STATUS  Status;
-  UINTN       PollPeriodUsecs;
 
   //
   // virtio-0.9.5, 2.4.1.2 Updating the Available Ring
@@ -308,33 +668,27 @@ VirtioFlush (
 
   //
   // virtio-0.9.5, 2.4.1.4 Notifying the Device -- gratuitous notifications are
-  // OK.
+  // OK, but the host may also tell us that it does not need them. (The
+  // lock-step helpers are not used with VIRTIO_F_RING_EVENT_IDX.) The
+  // index update must be visible before the flags are read.
   //
-  MemoryFence ();
-  Status = VirtIo->SetQueueNotify (VirtIo, VirtQueueId);
-  if (EFI_ERROR (Status)) {
-    return Status;
+  VirtioMb ();
+  if ((*Ring->Used.Flags & VRING_USED_F_NO_NOTIFY) == 0) {
+    Status = VirtIo->SetQueueNotify (VirtIo, VirtQueueId);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
   }
 
   //
   // virtio-0.9.5, 2.4.2 Receiving Used Buffers From the Device
   // Wait until the host processes and acknowledges our descriptor chain. The
   // condition we use for polling is greatly simplified and relies on the
-  // synchronous, lock-step progress.
-  //
-  // Keep slowing down until we reach a poll period of slightly above 1 ms.
+  // synchronous, lock-step progress: the used index can only move from
+  // LastUsedIdx to NextAvailIdx.
   //
-  PollPeriodUsecs = 1;
-  MemoryFence ();
-  while (*Ring->Used.Idx != NextAvailIdx) {
-    gBS->Stall (PollPeriodUsecs); // calls AcpiTimerLib::MicroSecondDelay
-
-    if (PollPeriodUsecs < 1024) {
-      PollPeriodUsecs *= 2;
-    }
-
-    MemoryFence ();
-  }
+  InternalVirtioWaitWhile (Ring->Used.Idx, MAX_UINT16, LastUsedIdx, Policy);
+  ASSERT (*Ring->Used.Idx == NextAvailIdx);
 
   MemoryFence ();
 
@@ -0,0 +1,44 @@
+/** @file
+
+  Internal declarations shared between the source files of VirtioLib.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef _VIRTIO_LIB_INTERNAL_H_
+#define _VIRTIO_LIB_INTERNAL_H_
+
+#include <Library/VirtioLib.h>
+
+/**
+
+  Wait while selected bits of a word in guest-host shared memory equal a
+  given value.
+
+  For the split ring, the word is the used ring index; for the packed ring, it
+  is the flags field of the next descriptor the device is going to mark used.
+
+  @param[in]     Word     The shared word to watch.
+
+  @param[in]     Mask     The bits of *Word to compare.
+
+  @param[in]     Value    Return as soon as (*Word & Mask) differs from this
+                          value.
+
+  @param[in,out] Policy   The wait policy to apply, and to update the
+                          statistics of. If NULL, the host is polled with
+                          Stall() backoff only.
+
+**/
+VOID
+InternalVirtioWaitWhile (
+  IN     volatile CONST UINT16  *Word,
+  IN     UINT16                 Mask,
+  IN     UINT16                 Value,
+  IN OUT VIRTIO_WAIT_POLICY     *Policy OPTIONAL
+  );
+
+#endif // _VIRTIO_LIB_INTERNAL_H_
@@ -0,0 +1,932 @@
+/** @file
+
+  Tracking of multiple in-flight descriptor chains on a virtio ring.
+
+  The lock-step helpers in VirtioLib.c always build the single outstanding
+  chain at descriptor #0, and wait for the host before the next request. The
+  functions in this file manage the descriptor table with a free list instead,
+  so that a driver may keep as many chains in flight as the ring can hold,
+  and reap completions in whatever order the host produces them.
+
+  Rings with the packed layout (VIRTIO_F_RING_PACKED) are supported through
+  the same interface; there the free list tracks buffer IDs, and chains are
+  laid out in consecutive slots of the descriptor ring.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include "VirtioLibInternal.h"
+
+/**
+
+  Set up multi-request tracking for a virtio ring that has been configured
+  with VirtioRingInit() or VirtioPackedRingInit().
+
+  All descriptors of the ring are placed on the free list, and interrupt
+  notifications from the host are turned off, as completions are polled.
+
+  @param[in]  Ring   The virtio ring to track. The ring must not have any
+                     descriptor chains in flight.
+
+  @param[out] Queue  The VIRTIO_REQUEST_QUEUE structure to initialize.
+
+  @retval EFI_SUCCESS           Tracking structures set up.
+
+  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestQueueInit (
+  IN  VRING                 *Ring,
+  OUT VIRTIO_REQUEST_QUEUE  *Queue
+  )
+{
+  UINT16  Idx;
+
+  ASSERT (Ring->QueueSize > 0);
+
+  Queue->NextDesc = AllocatePool (Ring->QueueSize * sizeof *Queue->NextDesc);
+  if (Queue->NextDesc == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Queue->ChainLen = AllocateZeroPool (
+                      Ring->QueueSize * sizeof *Queue->ChainLen
+                      );
+  if (Queue->ChainLen == NULL) {
+    goto FreeNextDesc;
+  }
+
+  Queue->Token = AllocateZeroPool (Ring->QueueSize * sizeof *Queue->Token);
+  if (Queue->Token == NULL) {
+    goto FreeChainLen;
+  }
+
+  //
+  // Link all descriptors (buffer IDs on a packed ring) into the free list, in
+  // ascending order. The link of the last descriptor is never followed, as
+  // NumFree bounds the list.
+  //
+  for (Idx = 0; Idx < Ring->QueueSize; Idx++) {
+    Queue->NextDesc[Idx] = (UINT16)((Idx + 1) % Ring->QueueSize);
+  }
+
+  Queue->Ring        = Ring;
+  Queue->NumFree     = Ring->QueueSize;
+  Queue->FreeHead    = 0;
+  Queue->NumInFlight = 0;
+  Queue->NumAdded    = 0;
+  Queue->EventIdx    = FALSE;
+
+  if (Ring->Packed) {
+    //
+    // virtio-1.1, 2.7.1 Driver and Device Ring Wrap Counters: both start at 1.
+    // The descriptor ring is all zeros, so no slot looks used. We're going to
+    // poll for completions; disable used buffer notifications.
+    //
+    ((volatile VRING_PACKED_DESC_EVENT *)Ring->Avail.Flags)->Flags =
+      VRING_PACKED_EVENT_FLAG_DISABLE;
+    Queue->NextAvailIdx = 0;
+    Queue->LastUsedIdx  = 0;
+    Queue->AvailWrap    = TRUE;
+    Queue->UsedWrap     = TRUE;
+    return EFI_SUCCESS;
+  }
+
+  //
+  // virtio-0.9.5, 2.4.2 Receiving Used Buffers From the Device: we're going
+  // to poll for completions, the host should not send an interrupt.
+  //
+  *Ring->Avail.Flags  = (UINT16)VRING_AVAIL_F_NO_INTERRUPT;
+  Queue->NextAvailIdx = *Ring->Avail.Idx;
+  Queue->LastUsedIdx  = *Ring->Used.Idx;
+  return EFI_SUCCESS;
+
+FreeChainLen:
+  FreePool (Queue->ChainLen);
+
+FreeNextDesc:
+  FreePool (Queue->NextDesc);
+
+  SetMem (Queue, sizeof *Queue, 0x00);
+  return EFI_OUT_OF_RESOURCES;
+}
+
+/**
+
+  Switch a VIRTIO_REQUEST_QUEUE to the notification suppression scheme of
+  VIRTIO_F_RING_EVENT_IDX. Call it right after VirtioRequestQueueInit(), if
+  the feature has been negotiated.
+
+  @param[in,out] Queue  The request queue to update.
+
+**/
+VOID
+EFIAPI
+VirtioRequestEnableEventIdx (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue
+  )
+{
+  VRING  *Ring;
+
+  Ring            = Queue->Ring;
+  Queue->EventIdx = TRUE;
+  if (Ring->Packed) {
+    //
+    // The driver event suppression structure stays disabled.
+    //
+    return;
+  }
+
+  //
+  // virtio-1.0, 2.4.7.2 Driver Requirements: Virtqueue Notification
+  // Suppression -- the flags must be zero now, and the used event index takes
+  // their role. We poll, so ask for an interrupt only once the used index
+  // wraps around.
+  //
+  *Ring->Avail.Flags     = 0;
+  *Ring->Avail.UsedEvent = (UINT16)(Queue->LastUsedIdx - 1);
+}
+
+/**
+
+  Release the tracking structures of a VIRTIO_REQUEST_QUEUE.
+
+  The caller is responsible for stopping the host from using the underlying
+  ring first. Tokens of chains that are still in flight are forgotten.
+
+  @param[in,out] Queue  The VIRTIO_REQUEST_QUEUE to clean up.
+
+**/
+VOID
+EFIAPI
+VirtioRequestQueueUninit (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue
+  )
+{
+  FreePool (Queue->Token);
+  FreePool (Queue->ChainLen);
+  FreePool (Queue->NextDesc);
+  SetMem (Queue, sizeof *Queue, 0x00);
+}
+
+/**
+
+  Take a chain of free descriptors off the free list, and prepare for
+  appending buffers to it with VirtioRequestAppendDesc().
+
+  @param[in,out] Queue      The request queue to allocate descriptors from.
+
+  @param[in]     DescCount  The number of descriptors the chain will consist
+                            of.
+
+  @param[out]    Indices    On success, Indices->HeadDescIdx identifies the
+                            head of the reserved chain, and
+                            Indices->NextDescIdx equals it. On a packed ring,
+                            Indices->HeadDescIdx is the buffer ID of the
+                            chain, and Indices->NextDescIdx is the ring slot
+                            of its head.
+
+  @retval EFI_SUCCESS            DescCount descriptors have been reserved.
+
+  @retval EFI_INVALID_PARAMETER  DescCount is zero, or exceeds the size of the
+                                 ring.
+
+  @retval EFI_OUT_OF_RESOURCES   Not enough descriptors are free at the
+                                 moment. The caller should reap completions
+                                 with VirtioRequestPoll(), and retry.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestReserve (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     UINT16                DescCount,
+  OUT    DESC_INDICES          *Indices
+  )
+{
+  UINT16  Head;
+  UINT16  Tail;
+  UINT16  Count;
+
+  if ((DescCount == 0) || (DescCount > Queue->Ring->QueueSize)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (DescCount > Queue->NumFree) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  if (Queue->Ring->Packed) {
+    //
+    // The chain will take the next DescCount slots of the descriptor ring, and
+    // a single buffer ID. IDs cannot run out before slots do.
+    //
+    Head                  = Queue->FreeHead;
+    Queue->FreeHead       = Queue->NextDesc[Head];
+    Queue->NumFree       -= DescCount;
+    Queue->ChainLen[Head] = DescCount;
+    Queue->Token[Head]    = NULL;
+
+    Indices->HeadDescIdx = Head;
+    Indices->NextDescIdx = Queue->NextAvailIdx;
+    return EFI_SUCCESS;
+  }
+
+  //
+  // The first DescCount entries of the free list are already linked in the
+  // order we need; detach them as a whole.
+  //
+  Head = Queue->FreeHead;
+  Tail = Head;
+  for (Count = 1; Count < DescCount; Count++) {
+    Tail = Queue->NextDesc[Tail];
+  }
+
+  Queue->FreeHead       = Queue->NextDesc[Tail];
+  Queue->NumFree       -= DescCount;
+  Queue->ChainLen[Head] = DescCount;
+  Queue->Token[Head]    = NULL;
+
+  Indices->HeadDescIdx = Head;
+  Indices->NextDescIdx = Head;
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Move a slot index of a packed descriptor ring forward, flipping the
+  associated wrap counter when the index passes the end of the ring.
+
+  @param[in]     QueueSize  The number of slots in the ring.
+
+  @param[in]     Count      The number of slots to advance by; at most
+                            QueueSize.
+
+  @param[in,out] Idx        The slot index to advance.
+
+  @param[in,out] Wrap       The wrap counter belonging to Idx.
+
+**/
+STATIC
+VOID
+PackedAdvance (
+  IN     UINT16   QueueSize,
+  IN     UINT16   Count,
+  IN OUT UINT16   *Idx,
+  IN OUT BOOLEAN  *Wrap
+  )
+{
+  UINT32  Next;
+
+  Next = (UINT32)*Idx + Count;
+  if (Next >= QueueSize) {
+    Next -= QueueSize;
+    *Wrap = (BOOLEAN)!*Wrap;
+  }
+
+  *Idx = (UINT16)Next;
+}
+
+/**
+
+  Fill in the next descriptor of a chain reserved on a packed ring.
+
+  The flags of the head descriptor are only recorded; VirtioRequestSubmit()
+  writes them, making the whole chain available at once.
+
+  @param[in,out] Queue              The request queue owning the chain.
+
+  @param[in] BufferDeviceAddress    (Bus master device) start address of the
+                                    transmit / receive buffer.
+
+  @param[in] BufferSize             Number of bytes to transmit or receive.
+
+  @param[in] Flags                  A bitmask of VRING_DESC_F_NEXT and
+                                    VRING_DESC_F_WRITE.
+
+  @param[in,out] Indices            As in VirtioRequestAppendDesc().
+
+**/
+STATIC
+VOID
+PackedAppendDesc (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     UINT64                BufferDeviceAddress,
+  IN     UINT32                BufferSize,
+  IN     UINT16                Flags,
+  IN OUT DESC_INDICES          *Indices
+  )
+{
+  volatile VRING_PACKED_DESC  *Desc;
+  UINT16                      Slot;
+  BOOLEAN                     Wrap;
+
+  Slot = Indices->NextDescIdx;
+
+  //
+  // Slots before NextAvailIdx belong to the next lap of the ring. An available
+  // descriptor has its AVAIL bit equal to the wrap counter, and its USED bit
+  // inverted.
+  //
+  Wrap   = (BOOLEAN)(Queue->AvailWrap != (Slot < Queue->NextAvailIdx));
+  Flags |= Wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+
+  Desc       = (volatile VRING_PACKED_DESC *)Queue->Ring->Desc + Slot;
+  Desc->Addr = BufferDeviceAddress;
+  Desc->Len  = BufferSize;
+  Desc->Id   = Indices->HeadDescIdx;
+  if (Slot == Queue->NextAvailIdx) {
+    Queue->HeadFlags = Flags;
+  } else {
+    Desc->Flags = Flags;
+  }
+
+  Indices->NextDescIdx = (UINT16)((Slot + 1) % Queue->Ring->QueueSize);
+}
+
+/**
+
+  Fill in the next descriptor of a chain reserved with
+  VirtioRequestReserve().
+
+  The calling convention matches VirtioAppendDesc(), except that consecutive
+  descriptors of the chain need not be adjacent in the descriptor table. The
+  caller must not append more descriptors than it reserved.
+
+  @param[in,out] Queue              The request queue owning the chain.
+
+  @param[in] BufferDeviceAddress    (Bus master device) start address of the
+                                    transmit / receive buffer.
+
+  @param[in] BufferSize             Number of bytes to transmit or receive.
+
+  @param[in] Flags                  A bitmask of VRING_DESC_F_* flags, as in
+                                    VirtioAppendDesc().
+
+  @param[in,out] Indices            On input, Indices->NextDescIdx identifies
+                                    the descriptor to carry the buffer. On
+                                    output, it identifies the following
+                                    descriptor of the chain.
+
+**/
+VOID
+EFIAPI
+VirtioRequestAppendDesc (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     UINT64                BufferDeviceAddress,
+  IN     UINT32                BufferSize,
+  IN     UINT16                Flags,
+  IN OUT DESC_INDICES          *Indices
+  )
+{
+  volatile VRING_DESC  *Desc;
+
+  ASSERT (Indices->NextDescIdx < Queue->Ring->QueueSize);
+
+  if (Queue->Ring->Packed) {
+    PackedAppendDesc (Queue, BufferDeviceAddress, BufferSize, Flags, Indices);
+    return;
+  }
+
+  Desc        = &Queue->Ring->Desc[Indices->NextDescIdx];
+  Desc->Addr  = BufferDeviceAddress;
+  Desc->Len   = BufferSize;
+  Desc->Flags = Flags;
+  Desc->Next  = Queue->NextDesc[Indices->NextDescIdx];
+
+  Indices->NextDescIdx = Desc->Next;
+}
+
+/**
+
+  Put the descriptors of a chain back on the free list.
+
+  @param[in,out] Queue  The request queue owning the chain.
+
+  @param[in]     Head   The head descriptor of the chain.
+
+**/
+STATIC
+VOID
+ReleaseChain (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     UINT16                Head
+  )
+{
+  UINT16  Tail;
+  UINT16  Count;
+
+  ASSERT (Queue->ChainLen[Head] > 0);
+
+  //
+  // On a packed ring, the chain holds a single buffer ID.
+  //
+  Tail = Head;
+  for (Count = 1;
+       !Queue->Ring->Packed && Count < Queue->ChainLen[Head];
+       Count++)
+  {
+    Tail = Queue->NextDesc[Tail];
+  }
+
+  Queue->NextDesc[Tail] = Queue->FreeHead;
+  Queue->FreeHead       = Head;
+  Queue->NumFree       += Queue->ChainLen[Head];
+  Queue->ChainLen[Head] = 0;
+  Queue->Token[Head]    = NULL;
+}
+
+/**
+
+  Return a reserved, but not yet submitted, descriptor chain to the free
+  list. This is useful on error paths between VirtioRequestReserve() and
+  VirtioRequestSubmit().
+
+  @param[in,out] Queue    The request queue owning the chain.
+
+  @param[in]     Indices  Indices->HeadDescIdx identifies the chain.
+
+**/
+VOID
+EFIAPI
+VirtioRequestCancel (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     DESC_INDICES          *Indices
+  )
+{
+  ReleaseChain (Queue, Indices->HeadDescIdx);
+}
+
+/**
+
+  Expose a fully built descriptor chain to the host through the available
+  ring.
+
+  The host is not notified; call VirtioRequestNotify() after submitting one or
+  more chains.
+
+  @param[in,out] Queue    The request queue owning the chain.
+
+  @param[in]     Indices  Indices->HeadDescIdx identifies the chain.
+
+  @param[in]     Token    Opaque value returned by VirtioRequestPoll() when
+                          the host completes the chain.
+
+**/
+VOID
+EFIAPI
+VirtioRequestSubmit (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  IN     DESC_INDICES          *Indices,
+  IN     VOID                  *Token
+  )
+{
+  VRING                       *Ring;
+  volatile VRING_PACKED_DESC  *Head;
+
+  Ring = Queue->Ring;
+  ASSERT (Queue->ChainLen[Indices->HeadDescIdx] > 0);
+
+  Queue->Token[Indices->HeadDescIdx] = Token;
+  Queue->NumInFlight++;
+  Queue->NumAdded += Ring->Packed ? Queue->ChainLen[Indices->HeadDescIdx] : 1;
+
+  if (Ring->Packed) {
+    //
+    // virtio-1.1, 2.7.13 Supplying Buffers to The Device: the flags of the
+    // head descriptor are written last, after all other descriptors of the
+    // chain.
+    //
+    Head = (volatile VRING_PACKED_DESC *)Ring->Desc + Queue->NextAvailIdx;
+    MemoryFence ();
+    Head->Flags = Queue->HeadFlags;
+
+    PackedAdvance (
+      Ring->QueueSize,
+      Queue->ChainLen[Indices->HeadDescIdx],
+      &Queue->NextAvailIdx,
+      &Queue->AvailWrap
+      );
+    return;
+  }
+
+  //
+  // virtio-0.9.5, 2.4.1.2 Updating the Available Ring
+  //
+  Ring->Avail.Ring[Queue->NextAvailIdx++ % Ring->QueueSize] =
+    Indices->HeadDescIdx;
+
+  //
+  // virtio-0.9.5, 2.4.1.3 Updating the Index Field
+  //
+  MemoryFence ();
+  *Ring->Avail.Idx = Queue->NextAvailIdx;
+}
+
+/**
+
+  Check whether an event index lies in the window of available entries (or
+  slots) that have been added since the last notification.
+
+  This is vring_need_event() from the virtio specification.
+
+  @param[in] Event  The index the host asked to be notified at.
+
+  @param[in] New    The index following the last added entry.
+
+  @param[in] Old    The index following the entries announced last time.
+
+  @retval TRUE   The host should be notified.
+
+  @retval FALSE  Otherwise.
+
+**/
+STATIC
+BOOLEAN
+NeedEvent (
+  IN UINT16  Event,
+  IN UINT16  New,
+  IN UINT16  Old
+  )
+{
+  return (BOOLEAN)((UINT16)(New - Event - 1) < (UINT16)(New - Old));
+}
+
+/**
+
+  Decide, from the event suppression settings of the host, whether it needs
+  to be notified about the chains submitted since the last notification.
+
+  @param[in] Queue  The request queue whose chains have been submitted.
+
+  @retval TRUE   The host should be notified.
+
+  @retval FALSE  The host is going to find the chains without a
+                 notification.
+
+**/
+STATIC
+BOOLEAN
+NeedNotify (
+  IN VIRTIO_REQUEST_QUEUE  *Queue
+  )
+{
+  VRING                             *Ring;
+  volatile VRING_PACKED_DESC_EVENT  *DeviceEvent;
+  UINT16                            OffWrap;
+  UINT16                            Event;
+  UINT16                            Old;
+
+  Ring = Queue->Ring;
+  Old  = (UINT16)(Queue->NextAvailIdx - Queue->NumAdded);
+
+  if (Ring->Packed) {
+    //
+    // virtio-1.1, 2.7.10 Driver and Device Event Suppression
+    //
+    DeviceEvent = (volatile VRING_PACKED_DESC_EVENT *)Ring->Used.Flags;
+    switch (DeviceEvent->Flags & 0x3) {
+      case VRING_PACKED_EVENT_FLAG_DISABLE:
+        return FALSE;
+
+      case VRING_PACKED_EVENT_FLAG_DESC:
+        if (!Queue->EventIdx) {
+          return TRUE;
+        }
+
+        //
+        // Bits 0-14 are a slot index, and bit 15 is the wrap counter that the
+        // host expects at that slot. A slot of the previous lap lies a whole
+        // ring before NextAvailIdx.
+        //
+        OffWrap = DeviceEvent->OffWrap;
+        Event   = OffWrap & (UINT16) ~BIT15;
+        if (((OffWrap & BIT15) != 0) != Queue->AvailWrap) {
+          Event = (UINT16)(Event - Ring->QueueSize);
+        }
+
+        return NeedEvent (Event, Queue->NextAvailIdx, Old);
+
+      default:
+        return TRUE;
+    }
+  }
+
+  //
+  // virtio-1.0, 2.4.7.2 Driver Requirements: Virtqueue Notification
+  // Suppression
+  //
+  if (Queue->EventIdx) {
+    return NeedEvent (*Ring->Used.AvailEvent, Queue->NextAvailIdx, Old);
+  }
+
+  return (BOOLEAN)((*Ring->Used.Flags & VRING_USED_F_NO_NOTIFY) == 0);
+}
+
+/**
+
+  Notify the host about descriptor chains submitted with
+  VirtioRequestSubmit(), unless the host has asked not to be notified.
+
+  While the host is still processing earlier chains, it typically suppresses
+  notifications, and picks up the new chains on its own; a notification
+  would only cost a VM exit then.
+
+  @param[in] VirtIo       The target virtio device to notify.
+
+  @param[in] VirtQueueId  Identifies the queue for the target device.
+
+  @param[in,out] Queue    The request queue whose chains have been submitted.
+
+  @retval EFI_SUCCESS  The host has been notified, or it does not need to be.
+
+  @return              Status code from VirtIo->SetQueueNotify().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestNotify (
+  IN     VIRTIO_DEVICE_PROTOCOL  *VirtIo,
+  IN     UINT16                  VirtQueueId,
+  IN OUT VIRTIO_REQUEST_QUEUE    *Queue
+  )
+{
+  BOOLEAN  Notify;
+
+  //
+  // virtio-0.9.5, 2.4.1.4 Notifying the Device -- the update of the available
+  // index must be visible to the host before we look at its suppression
+  // settings. Gratuitous notifications are OK.
+  //
+  VirtioMb ();
+  Notify          = NeedNotify (Queue);
+  Queue->NumAdded = 0;
+
+  if (!Notify) {
+    return EFI_SUCCESS;
+  }
+
+  return VirtIo->SetQueueNotify (VirtIo, VirtQueueId);
+}
+
+/**
+
+  Reap one descriptor chain that the host has marked used in a packed ring.
+
+  @param[in,out] Queue    The request queue to check for completions.
+
+  @param[out]    Token    As in VirtioRequestPoll().
+
+  @param[out]    UsedLen  As in VirtioRequestPoll().
+
+  @return  As in VirtioRequestPoll(). On EFI_PROTOCOL_ERROR, a single slot has
+           been skipped.
+
+**/
+STATIC
+EFI_STATUS
+PackedPoll (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  OUT    VOID                  **Token,
+  OUT    UINT32                *UsedLen OPTIONAL
+  )
+{
+  VRING                             *Ring;
+  volatile CONST VRING_PACKED_DESC  *Desc;
+  UINT16                            Flags;
+  UINT16                            Id;
+  UINT32                            Len;
+
+  Ring = Queue->Ring;
+  Desc = (volatile CONST VRING_PACKED_DESC *)Ring->Desc + Queue->LastUsedIdx;
+
+  //
+  // virtio-1.1, 2.7.14 Receiving Used Buffers From the Device: a used
+  // descriptor has both its AVAIL and USED bits equal to the wrap counter.
+  // Only then may the rest of the descriptor be read.
+  //
+  MemoryFence ();
+  Flags = Desc->Flags & (VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED);
+  if (Flags != (Queue->UsedWrap ?
+                (VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED) : 0))
+  {
+    return EFI_NOT_READY;
+  }
+
+  MemoryFence ();
+  Id  = Desc->Id;
+  Len = Desc->Len;
+
+  if ((Id >= Ring->QueueSize) || (Queue->ChainLen[Id] == 0)) {
+    DEBUG ((DEBUG_ERROR, "%a: bogus used Id %u\n", __FUNCTION__, Id));
+    PackedAdvance (Ring->QueueSize, 1, &Queue->LastUsedIdx, &Queue->UsedWrap);
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  //
+  // The device skips as many slots as the chain occupied.
+  //
+  PackedAdvance (
+    Ring->QueueSize,
+    Queue->ChainLen[Id],
+    &Queue->LastUsedIdx,
+    &Queue->UsedWrap
+    );
+
+  *Token = Queue->Token[Id];
+  if (UsedLen != NULL) {
+    *UsedLen = Len;
+  }
+
+  ReleaseChain (Queue, Id);
+  Queue->NumInFlight--;
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Reap one descriptor chain that the host has returned in the used ring, and
+  put its descriptors back on the free list.
+
+  Chains may complete in any order.
+
+  @param[in,out] Queue    The request queue to check for completions.
+
+  @param[out]    Token    On success, the token passed to
+                          VirtioRequestSubmit() for the completed chain.
+
+  @param[out]    UsedLen  On success, the total number of bytes the host wrote
+                          across the buffers of the completed chain. May be
+                          NULL.
+
+  @retval EFI_SUCCESS         One chain has been reaped.
+
+  @retval EFI_NOT_READY       The host has not completed any chain since the
+                              last call.
+
+  @retval EFI_PROTOCOL_ERROR  The host returned a descriptor index that does
+                              not identify an in-flight chain. The used element
+                              has been skipped.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestPoll (
+  IN OUT VIRTIO_REQUEST_QUEUE  *Queue,
+  OUT    VOID                  **Token,
+  OUT    UINT32                *UsedLen OPTIONAL
+  )
+{
+  VRING                           *Ring;
+  volatile CONST VRING_USED_ELEM  *UsedElem;
+  UINT32                          Head;
+  UINT32                          Len;
+
+  if (Queue->Ring->Packed) {
+    return PackedPoll (Queue, Token, UsedLen);
+  }
+
+  Ring = Queue->Ring;
+
+  MemoryFence ();
+  if (*Ring->Used.Idx == Queue->LastUsedIdx) {
+    return EFI_NOT_READY;
+  }
+
+  //
+  // virtio-0.9.5, 2.4.2 Receiving Used Buffers From the Device: read the used
+  // element only after having seen the index that covers it.
+  //
+  MemoryFence ();
+  UsedElem = &Ring->Used.UsedElem[Queue->LastUsedIdx++ % Ring->QueueSize];
+  Head     = UsedElem->Id;
+  Len      = UsedElem->Len;
+
+  if ((Head >= Ring->QueueSize) || (Queue->ChainLen[Head] == 0)) {
+    DEBUG ((DEBUG_ERROR, "%a: bogus used Id %u\n", __FUNCTION__, Head));
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  *Token = Queue->Token[Head];
+  if (UsedLen != NULL) {
+    *UsedLen = Len;
+  }
+
+  ReleaseChain (Queue, (UINT16)Head);
+  Queue->NumInFlight--;
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Wait until the host returns at least one descriptor chain submitted with
+  VirtioRequestSubmit(), according to a wait policy.
+
+  @param[in]     Queue   The request queue to wait on.
+
+  @param[in,out] Policy  The wait policy to apply, and to update the
+                         statistics of. If NULL, the host is polled with
+                         Stall() backoff only.
+
+  @retval EFI_SUCCESS    A completion is pending; reap it with
+                         VirtioRequestPoll().
+
+  @retval EFI_NOT_READY  No chains are in flight; there is nothing to wait
+                         for.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestWait (
+  IN     VIRTIO_REQUEST_QUEUE  *Queue,
+  IN OUT VIRTIO_WAIT_POLICY    *Policy OPTIONAL
+  )
+{
+  VIRTIO_REQUEST_MARK  Mark;
+  EFI_STATUS           Status;
+
+  Status = VirtioRequestMark (Queue, &Mark);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  VirtioRequestWaitMark (&Mark, Policy);
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Record where the next completion of a request queue is going to appear.
+
+  @param[in]  Queue  The request queue to wait on.
+
+  @param[out] Mark   The position to pass to VirtioRequestWaitMark().
+
+  @retval EFI_SUCCESS    Mark has been set.
+
+  @retval EFI_NOT_READY  No chains are in flight; there is nothing to wait
+                         for.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioRequestMark (
+  IN  VIRTIO_REQUEST_QUEUE  *Queue,
+  OUT VIRTIO_REQUEST_MARK   *Mark
+  )
+{
+  if (Queue->NumInFlight == 0) {
+    return EFI_NOT_READY;
+  }
+
+  if (Queue->Ring->Packed) {
+    //
+    // Until the device marks the slot used, its USED bit stays the inverse of
+    // the wrap counter. Should the slot be reaped and made available again
+    // before the wait, the driver sets the USED bit to the new wrap counter,
+    // which also ends the wait.
+    //
+    Mark->Word  = &((volatile CONST VRING_PACKED_DESC *)Queue->Ring->Desc +
+                    Queue->LastUsedIdx)->Flags;
+    Mark->Mask  = VRING_PACKED_DESC_F_USED;
+    Mark->Value = Queue->UsedWrap ? 0 : VRING_PACKED_DESC_F_USED;
+    return EFI_SUCCESS;
+  }
+
+  Mark->Word  = Queue->Ring->Used.Idx;
+  Mark->Mask  = MAX_UINT16;
+  Mark->Value = Queue->LastUsedIdx;
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Wait until the host returns a descriptor chain at or past a position
+  recorded with VirtioRequestMark(), according to a wait policy.
+
+  @param[in]     Mark    The position to wait for.
+
+  @param[in,out] Policy  The wait policy to apply, and to update the
+                         statistics of. If NULL, the host is polled with
+                         Stall() backoff only.
+
+**/
+VOID
+EFIAPI
+VirtioRequestWaitMark (
+  IN     CONST VIRTIO_REQUEST_MARK  *Mark,
+  IN OUT VIRTIO_WAIT_POLICY         *Policy OPTIONAL
+  )
+{
+  InternalVirtioWaitWhile (Mark->Word, Mark->Mask, Mark->Value, Policy);
+}
@@ -0,0 +1,363 @@
+/** @file
+
+  Multi-queue request tracking on top of VIRTIO_REQUEST_QUEUE.
+
+  Devices with several request queues (virtio-blk VIRTIO_BLK_F_MQ, the
+  request queues of virtio-scsi) spread their requests over all queues, and
+  need to reap completions and wait for the host across them. The functions
+  in this file do that for an array of driver-specific per-queue structures,
+  each embedding a VIRTIO_REQUEST_QUEUE, and hand completed requests back to
+  the driver through a callback, and keep the driver's poll timer armed only
+  while requests that nobody waits for are in flight.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "VirtioLibInternal.h"
+
+/**
+
+  Initialize a set of request queues.
+
+  @param[out] Set         The VIRTIO_REQUEST_QUEUE_SET structure to
+                          initialize.
+
+  @param[in]  Queues      The VIRTIO_REQUEST_QUEUE of the first queue, in the
+                          first element of the driver's array of per-queue
+                          structures.
+
+  @param[in]  Stride      The size of one element of the array, in bytes.
+
+  @param[in]  NumQueues   The number of elements in the array; at least one.
+
+  @param[in]  WaitPolicy  The wait policy to apply when waiting for the host.
+                          May be NULL, see VirtioRequestWaitMark().
+
+  @param[in]  Complete    The function to call for each completed chain.
+
+  @param[in]  Context     The value to pass to Complete.
+
+**/
+VOID
+EFIAPI
+VirtioRequestQueueSetInit (
+  OUT VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN  VIRTIO_REQUEST_QUEUE      *Queues,
+  IN  UINTN                     Stride,
+  IN  UINT16                    NumQueues,
+  IN  VIRTIO_WAIT_POLICY        *WaitPolicy OPTIONAL,
+  IN  VIRTIO_REQUEST_COMPLETE   Complete,
+  IN  VOID                      *Context
+  )
+{
+  ASSERT (NumQueues > 0);
+  ASSERT (NumQueues == 1 || Stride >= sizeof *Queues);
+
+  Set->Queues     = (UINT8 *)Queues;
+  Set->Stride     = Stride;
+  Set->NumQueues  = NumQueues;
+  Set->NextQueue  = 0;
+  Set->WaitPolicy = WaitPolicy;
+  Set->Complete   = Complete;
+  Set->Context    = Context;
+  Set->PollTimer  = NULL;
+  Set->PollPeriod = 0;
+  Set->NumPolled  = 0;
+}
+
+/**
+
+  Look up a request queue of a set.
+
+  @param[in] Set         The set of request queues.
+
+  @param[in] QueueIndex  Identifies the queue within Set.
+
+  @return  The request queue.
+
+**/
+VIRTIO_REQUEST_QUEUE *
+EFIAPI
+VirtioRequestQueueSetGet (
+  IN VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN UINT16                    QueueIndex
+  )
+{
+  ASSERT (QueueIndex < Set->NumQueues);
+  return (VIRTIO_REQUEST_QUEUE *)(Set->Queues + QueueIndex * Set->Stride);
+}
+
+/**
+
+  Pick the request queue for a new request.
+
+  Starting from the queue after the one picked last, the queue with the
+  fewest requests in flight is chosen, so that consecutive requests spread
+  over all queues (and the host I/O threads serving them), while a queue
+  that the host is slow to drain receives less work.
+
+  @param[in,out] Set  The set of request queues.
+
+  @return  The index of the chosen queue within Set.
+
+**/
+UINT16
+EFIAPI
+VirtioRequestSelectQueue (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set
+  )
+{
+  UINT16  Best;
+  UINT16  Candidate;
+  UINT16  Count;
+
+  Best      = Set->NextQueue;
+  Candidate = Best;
+  for (Count = 1; Count < Set->NumQueues; Count++) {
+    Candidate = (UINT16)((Candidate + 1) % Set->NumQueues);
+    if (VirtioRequestQueueSetGet (Set, Candidate)->NumInFlight <
+        VirtioRequestQueueSetGet (Set, Best)->NumInFlight)
+    {
+      Best = Candidate;
+    }
+  }
+
+  Set->NextQueue = (UINT16)((Best + 1) % Set->NumQueues);
+  return Best;
+}
+
+/**
+
+  Reap all descriptor chains that the host has completed since the last
+  call, on all queues of a set, and pass their tokens to Set->Complete.
+
+  Used elements that do not identify an in-flight chain are skipped.
+
+  @param[in,out] Set  The set of request queues to check for completions.
+
+**/
+VOID
+EFIAPI
+VirtioRequestProcessCompletions (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set
+  )
+{
+  UINT16      QueueIndex;
+  EFI_STATUS  Status;
+  VOID        *Token;
+
+  for (QueueIndex = 0; QueueIndex < Set->NumQueues; QueueIndex++) {
+    for ( ; ;) {
+      Status = VirtioRequestPoll (
+                 VirtioRequestQueueSetGet (Set, QueueIndex),
+                 &Token,
+                 NULL
+                 );
+      if (Status == EFI_NOT_READY) {
+        break;
+      }
+
+      if (EFI_ERROR (Status)) {
+        continue;
+      }
+
+      Set->Complete (Set->Context, QueueIndex, Token);
+    }
+  }
+}
+
+/**
+
+  Wait until the host completes a chain on one queue of a set, then reap the
+  completions of the set.
+
+  The wait itself takes place at WaitTpl, so that other events (such as a
+  timer reaping the completion first) are not held off for the host round
+  trip.
+
+  @param[in,out] Set         The set of request queues.
+
+  @param[in]     QueueIndex  Identifies the queue to wait on within Set.
+
+  @param[in]     WaitTpl     The TPL to wait at; at most TPL_NOTIFY.
+
+  @retval TRUE   The host has completed a chain, and completions have been
+                 reaped.
+
+  @retval FALSE  No chains are in flight on the queue.
+
+**/
+BOOLEAN
+EFIAPI
+VirtioRequestWaitForQueue (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN     UINT16                    QueueIndex,
+  IN     EFI_TPL                   WaitTpl
+  )
+{
+  VIRTIO_REQUEST_MARK  Mark;
+
+  if (VirtioRequestMark (
+        VirtioRequestQueueSetGet (Set, QueueIndex),
+        &Mark
+        ) != EFI_SUCCESS)
+  {
+    return FALSE;
+  }
+
+  gBS->RestoreTPL (WaitTpl);
+  VirtioRequestWaitMark (&Mark, Set->WaitPolicy);
+  gBS->RaiseTPL (TPL_NOTIFY);
+
+  VirtioRequestProcessCompletions (Set);
+  return TRUE;
+}
+
+/**
+
+  Wait until the host completes a chain on any queue of a set that has chains
+  in flight, then reap the completions of the set.
+
+  @param[in,out] Set      The set of request queues.
+
+  @param[in]     WaitTpl  The TPL to wait at, see VirtioRequestWaitForQueue().
+
+  @retval TRUE   The host has completed a chain, and completions have been
+                 reaped.
+
+  @retval FALSE  No chains are in flight on any queue of Set.
+
+**/
+BOOLEAN
+EFIAPI
+VirtioRequestWaitForAny (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN     EFI_TPL                   WaitTpl
+  )
+{
+  UINT16  QueueIndex;
+
+  for (QueueIndex = 0; QueueIndex < Set->NumQueues; QueueIndex++) {
+    if (VirtioRequestWaitForQueue (Set, QueueIndex, WaitTpl)) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+
+  Wait until the host has completed every chain in flight, on all queues of a
+  set, and reap the completions.
+
+  @param[in,out] Set      The set of request queues to drain.
+
+  @param[in]     WaitTpl  The TPL to wait at, see VirtioRequestWaitForQueue().
+
+**/
+VOID
+EFIAPI
+VirtioRequestDrain (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN     EFI_TPL                   WaitTpl
+  )
+{
+  UINT16  QueueIndex;
+
+  VirtioRequestProcessCompletions (Set);
+  for (QueueIndex = 0; QueueIndex < Set->NumQueues; QueueIndex++) {
+    while (VirtioRequestWaitForQueue (Set, QueueIndex, WaitTpl)) {
+    }
+  }
+}
+
+/**
+
+  Associate a set of request queues with the periodic timer that reaps its
+  completions.
+
+  The timer is left alone until VirtioRequestPollTimerHold() is called.
+
+  @param[in,out] Set         The set of request queues.
+
+  @param[in]     PollTimer   A timer event whose notification function calls
+                             VirtioRequestProcessCompletions() for Set.
+
+  @param[in]     PollPeriod  The period to arm PollTimer with, in 100ns units.
+
+**/
+VOID
+EFIAPI
+VirtioRequestPollTimerInit (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set,
+  IN     EFI_EVENT                 PollTimer,
+  IN     UINT64                    PollPeriod
+  )
+{
+  ASSERT (Set->NumPolled == 0);
+
+  Set->PollTimer  = PollTimer;
+  Set->PollPeriod = PollPeriod;
+}
+
+/**
+
+  Note that a request nobody waits for is in flight, arming the poll timer
+  if it is the first one.
+
+  @param[in,out] Set  The set of request queues the request belongs to.
+
+**/
+VOID
+EFIAPI
+VirtioRequestPollTimerHold (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set
+  )
+{
+  EFI_STATUS  Status;
+
+  ASSERT (Set->PollTimer != NULL);
+
+  Set->NumPolled++;
+  if (Set->NumPolled > 1) {
+    return;
+  }
+
+  Status = gBS->SetTimer (Set->PollTimer, TimerPeriodic, Set->PollPeriod);
+  ASSERT_EFI_ERROR (Status);
+}
+
+/**
+
+  Note that a request accounted for with VirtioRequestPollTimerHold() has
+  completed, cancelling the poll timer if it was the last one.
+
+  @param[in,out] Set  The set of request queues the request belongs to.
+
+**/
+VOID
+EFIAPI
+VirtioRequestPollTimerRelease (
+  IN OUT VIRTIO_REQUEST_QUEUE_SET  *Set
+  )
+{
+  EFI_STATUS  Status;
+
+  ASSERT (Set->NumPolled > 0);
+
+  Set->NumPolled--;
+  if (Set->NumPolled > 0) {
+    return;
+  }
+
+  Status = gBS->SetTimer (Set->PollTimer, TimerCancel, 0);
+  ASSERT_EFI_ERROR (Status);
+}
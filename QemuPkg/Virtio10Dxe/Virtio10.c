@@ -490,6 +490,7 @@ Virtio10SetQueueAddress (
   EFI_STATUS      Status;
   UINT64          Address;
   UINT16          Enable;
+  UINT16          NotifyOffset;
 
   Dev = VIRTIO_1_0_FROM_VIRTIO_DEVICE (This);
 
@@ -544,7 +545,32 @@ Virtio10SetQueueAddress (
              sizeof Enable,
              &Enable
              );
-  return Status;
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // The queue is selected now; look up its doorbell once, so that
+  // Virtio10SetQueueNotify() can kick it with a single register write.
+  //
+  if (Dev->QueueSelect < Dev->NumQueues) {
+    Status = Virtio10Transfer (
+               Dev->PciIo,
+               &Dev->CommonConfig,
+               FALSE,
+               OFFSET_OF (VIRTIO_PCI_COMMON_CFG, QueueNotifyOff),
+               sizeof NotifyOffset,
+               &NotifyOffset
+               );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    Dev->DoorbellOffsets[Dev->QueueSelect] =
+      NotifyOffset * Dev->NotifyOffsetMultiplier;
+  }
+
+  return EFI_SUCCESS;
 }
 
 STATIC
@@ -568,6 +594,10 @@ Virtio10SetQueueSel (
              sizeof Index,
              &Index
              );
+  if (!EFI_ERROR (Status)) {
+    Dev->QueueSelect = Index;
+  }
+
   return Status;
 }
 
@@ -586,6 +616,23 @@ Virtio10SetQueueNotify (
 
   Dev = VIRTIO_1_0_FROM_VIRTIO_DEVICE (This);
 
+  //
+  // Fast path: the doorbell of the queue was looked up when the queue was
+  // set up, so a kick is a single register write (a single VM exit).
+  //
+  if ((Index < Dev->NumQueues) &&
+      (Dev->DoorbellOffsets[Index] != VIRTIO_1_0_NO_DOORBELL))
+  {
+    return Virtio10Transfer (
+             Dev->PciIo,
+             &Dev->NotifyConfig,
+             TRUE,
+             Dev->DoorbellOffsets[Index],
+             sizeof Index,
+             &Index
+             );
+  }
+
   //
   // Read NotifyOffset first. NotifyOffset is queue specific, so we have
   // to stash & restore the current queue selector around it.
@@ -1129,6 +1176,39 @@ Virtio10BindingStart (
     goto ClosePciIo;
   }
 
+  //
+  // Prepare the doorbell cache; the doorbells themselves are looked up in
+  // Virtio10SetQueueAddress().
+  //
+  Status = Virtio10Transfer (
+             Device->PciIo,
+             &Device->CommonConfig,
+             FALSE,
+             OFFSET_OF (VIRTIO_PCI_COMMON_CFG, NumQueues),
+             sizeof Device->NumQueues,
+             &Device->NumQueues
+             );
+  if (EFI_ERROR (Status)) {
+    goto RestorePciAttributes;
+  }
+
+  if (Device->NumQueues > 0) {
+    Device->DoorbellOffsets = AllocatePool (
+                                Device->NumQueues *
+                                sizeof *Device->DoorbellOffsets
+                                );
+    if (Device->DoorbellOffsets == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      goto RestorePciAttributes;
+    }
+
+    SetMem32 (
+      Device->DoorbellOffsets,
+      Device->NumQueues * sizeof *Device->DoorbellOffsets,
+      VIRTIO_1_0_NO_DOORBELL
+      );
+  }
+
   Status = gBS->InstallProtocolInterface (
                   &DeviceHandle,
                   &gVirtioDeviceProtocolGuid,
@@ -1136,11 +1216,16 @@ Virtio10BindingStart (
                   &Device->VirtIo
                   );
   if (EFI_ERROR (Status)) {
-    goto RestorePciAttributes;
+    goto FreeDoorbellOffsets;
   }
 
   return EFI_SUCCESS;
 
+FreeDoorbellOffsets:
+  if (Device->DoorbellOffsets != NULL) {
+    FreePool (Device->DoorbellOffsets);
+  }
+
 RestorePciAttributes:
   Device->PciIo->Attributes (
                    Device->PciIo,
@@ -1212,6 +1297,10 @@ Virtio10BindingStop (
          This->DriverBindingHandle,
          DeviceHandle
          );
+  if (Device->DoorbellOffsets != NULL) {
+    FreePool (Device->DoorbellOffsets);
+  }
+
   FreePool (Device);
 
   return EFI_SUCCESS;
@@ -42,8 +42,17 @@ typedef struct {
   VIRTIO_1_0_CONFIG         NotifyConfig;        // Notifications
   UINT32                    NotifyOffsetMultiplier;
   VIRTIO_1_0_CONFIG         SpecificConfig;      // Device specific settings
+  UINT16                    QueueSelect;         // last value written
+  UINT16                    NumQueues;
+  UINT32                    *DoorbellOffsets;    // NumQueues elements
 } VIRTIO_1_0_DEV;
 
+//
+// Value of VIRTIO_1_0_DEV.DoorbellOffsets[Index] while queue Index has not
+// been set up.
+//
+#define VIRTIO_1_0_NO_DOORBELL  MAX_UINT32
+
 #define VIRTIO_1_0_FROM_VIRTIO_DEVICE(Device) \
           CR (Device, VIRTIO_1_0_DEV, VirtIo, VIRTIO_1_0_SIGNATURE)
 
@@ -6,9 +6,13 @@
 
   - No attach/detach (ie. removable media).
 
-  - Although the non-blocking interfaces of EFI_BLOCK_IO2_PROTOCOL could be a
-    good match for multiple in-flight virtio-blk requests, we stick to
-    synchronous requests and EFI_BLOCK_IO_PROTOCOL for now.
+  - Both EFI_BLOCK_IO_PROTOCOL and EFI_BLOCK_IO2_PROTOCOL are produced. Each
+    virtqueue of the device has its own VBLK_QUEUE, with a request queue that
+    tracks several in-flight requests; requests are spread over the queues,
+    and the blocking interfaces simply wait for their own request.
+
+  - EFI_ERASE_BLOCK_PROTOCOL is produced if the device supports write zeroes
+    or discard requests.
 
   Copyright (C) 2012, Red Hat, Inc.
   Copyright (c) 2012 - 2018, Intel Corporation. All rights reserved.<BR>
@@ -22,6 +26,7 @@
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiLib.h>
 #include <Library/VirtioLib.h>
@@ -106,9 +111,9 @@ VirtioBlkReset (
     - 24.2.2. ReadBlocks() and ReadBlocksEx() Implementation
     - 24.2.3 WriteBlocks() and WriteBlockEx() Implementation
 
-  Request sizes are limited to 1 GB (checked). This is not a practical
-  limitation, just conformance to virtio-0.9.5, 2.3.2 Descriptor Table: "no
-  descriptor chain may be more than 2^32 bytes long in total".
+  Request sizes are not limited here: SubmitIo() splits transfers that exceed
+  the device limits, or virtio-0.9.5, 2.3.2 Descriptor Table: "no descriptor
+  chain may be more than 2^32 bytes long in total".
 
   Some Media characteristics are hardcoded in VirtioBlkInit() below (like
   non-removable media, no restriction on buffer alignment etc); we rely on
@@ -152,9 +157,7 @@ VerifyReadWriteRequest (
 
   ASSERT (PositiveBufferSize > 0);
 
-  if ((PositiveBufferSize > SIZE_1GB) ||
-      (PositiveBufferSize % Media->BlockSize > 0))
-  {
+  if (PositiveBufferSize % Media->BlockSize > 0) {
     return EFI_BAD_BUFFER_SIZE;
   }
 
@@ -176,20 +179,256 @@ VerifyReadWriteRequest (
 
 /**
 
-  Format a read / write / flush request as three consecutive virtio
-  descriptors, push them to the host, and poll for the response.
+  Release the resources of a request that the host has completed (or that
+  was never submitted), and compute its outcome.
 
-  This is the main workhorse function. Two use cases are supported, read/write
-  and flush. The function may only be called after the request parameters have
-  been verified by
-  - specific checks in ReadBlocks() / WriteBlocks() / FlushBlocks(), and
-  - VerifyReadWriteRequest() (for read/write only).
+  @param[in] Dev  The virtio-blk device the request was targeted at.
+
+  @param[in] Req  The request to finalize. Req->Shared and the data buffer
+                  mapping must have been set up.
+
+  @retval EFI_SUCCESS       The host reported success, and the data reached
+                            the caller's buffer.
+
+  @retval EFI_DEVICE_ERROR  Otherwise.
+
+**/
+STATIC
+EFI_STATUS
+FinalizeRequest (
+  IN VBLK_DEV  *Dev,
+  IN VBLK_REQ  *Req
+  )
+{
+  EFI_STATUS  Status;
+  EFI_STATUS  UnmapStatus;
+
+  Status = (Req->Shared->HostStatus == VIRTIO_BLK_S_OK) ?
+           EFI_SUCCESS :
+           EFI_DEVICE_ERROR;
+
+  if (Req->BufferSize > 0) {
+    UnmapStatus = Dev->VirtIo->UnmapSharedBuffer (
+                                 Dev->VirtIo,
+                                 Req->BufferMapping
+                                 );
+    if (EFI_ERROR (UnmapStatus) && !Req->RequestIsWrite && !EFI_ERROR (Status)) {
+      //
+      // Data from the bus master may not reach the caller; fail the request.
+      //
+      Status = EFI_DEVICE_ERROR;
+    }
+  }
+
+  VirtioDmaSlabFree (
+    &Dev->Queues[Req->QueueIndex].ReqSlab,
+    (VOID *)Req->Shared
+    );
+  return Status;
+}
+
+/**
+
+  Account for one request of a Block I/O (2) call having completed (or for
+  the submission of all its requests having finished).
+
+  When nothing is pending any longer, a non-blocking call's token is signaled
+  and its tracking structure is released, and the call stops holding the poll
+  timer. A blocking call's submitter releases the structure itself, once it
+  sees Io->Pending at zero.
+
+  @param[in] Dev  The virtio-blk device the call is targeted at.
+
+  @param[in] Io   The call to update.
+
+**/
+STATIC
+VOID
+ReleaseIo (
+  IN VBLK_DEV  *Dev,
+  IN VBLK_IO   *Io
+  )
+{
+  ASSERT (Io->Signature == VBLK_IO_SIG);
+  ASSERT (Io->Pending > 0);
+
+  Io->Pending--;
+  if ((Io->Pending > 0) || (Io->Token == NULL)) {
+    return;
+  }
+
+  Io->Token->TransactionStatus = Io->Status;
+  gBS->SignalEvent (Io->Token->Event);
+  FreePool (Io);
+
+  VirtioRequestPollTimerRelease (&Dev->Requests);
+}
+
+/**
+
+  Drop the contents of the read-ahead cache, because the disk has changed
+  underneath it.
+
+  The caller is responsible for running at TPL_NOTIFY.
+
+  @param[in] Dev  The virtio-blk device whose cache to invalidate.
+
+**/
+STATIC
+VOID
+ReadAheadInvalidate (
+  IN VBLK_DEV  *Dev
+  )
+{
+  Dev->ReadAhead.Length = 0;
+  Dev->ReadAhead.Generation++;
+}
+
+/**
+
+  Log the read-ahead cache statistics of a virtio-blk device.
+
+  @param[in] Caller  The name of the calling function, for the log.
+
+  @param[in] Dev     The virtio-blk device.
+
+**/
+STATIC
+VOID
+ReadAheadLogStats (
+  IN CONST CHAR8  *Caller,
+  IN VBLK_DEV     *Dev
+  )
+{
+  if (Dev->ReadAhead.Buffer == NULL) {
+    return;
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: read-ahead hits=%Lu misses=%Lu\n",
+    Caller,
+    Dev->ReadAhead.Hits,
+    Dev->ReadAhead.Misses
+    ));
+}
+
+/**
+
+  Finalize and release a request that the host has completed, and account
+  for it in the Block I/O (2) call it belongs to with ReleaseIo(). Completed
+  writes and erases invalidate the read-ahead cache.
+
+  Called by VirtioRequestProcessCompletions() at TPL_NOTIFY.
+
+  @param[in] Context     The virtio-blk device (VBLK_DEV).
+
+  @param[in] QueueIndex  The request queue the request was submitted to.
+
+  @param[in] Token       The completed request (VBLK_REQ).
+
+**/
+STATIC
+VOID
+EFIAPI
+CompleteRequest (
+  IN VOID    *Context,
+  IN UINT16  QueueIndex,
+  IN VOID    *Token
+  )
+{
+  VBLK_DEV    *Dev;
+  VBLK_REQ    *Req;
+  VBLK_IO     *Io;
+  EFI_STATUS  Status;
+
+  Dev = Context;
+  Req = Token;
+  ASSERT (Req->Signature == VBLK_REQ_SIG);
+  ASSERT (Req->QueueIndex == QueueIndex);
+
+  if (Req->RequestIsWrite &&
+      (Req->Shared->Request.Type != VIRTIO_BLK_T_FLUSH))
+  {
+    ReadAheadInvalidate (Dev);
+  }
+
+  Status = FinalizeRequest (Dev, Req);
+  Io     = Req->Io;
+  FreePool (Req);
+
+  if (EFI_ERROR (Status) && !EFI_ERROR (Io->Status)) {
+    Io->Status = Status;
+  }
+
+  ReleaseIo (Dev, Io);
+}
+
+/**
+
+  Wait until no more than a given number of requests of a Block I/O (2) call
+  remain pending.
+
+  The caller is responsible for running at TPL_NOTIFY.
+
+  @param[in] Dev      The virtio-blk device the call is targeted at.
+
+  @param[in] Io       The call to wait for. It must not be completed (and
+                      released) by ReleaseIo() while waiting, hence it is
+                      either blocking, or Pending exceeds zero.
+
+  @param[in] Pending  Return once Io->Pending is at most this value.
+
+  @param[in] WaitTpl  The TPL to wait for the host at, see
+                      VirtioRequestWaitForQueue().
+
+**/
+STATIC
+VOID
+WaitForIo (
+  IN VBLK_DEV  *Dev,
+  IN VBLK_IO   *Io,
+  IN UINTN     Pending,
+  IN EFI_TPL   WaitTpl
+  )
+{
+  //
+  // Other requests in flight may complete before ours; CompleteRequest()
+  // retires them on the way. The requests of the call may be spread over
+  // several queues; wait on any queue that has work in flight.
+  //
+  VirtioRequestProcessCompletions (&Dev->Requests);
+  while (Io->Pending > Pending) {
+    VirtioRequestWaitForAny (&Dev->Requests, WaitTpl);
+  }
+}
+
+/**
+
+  Format one read / write / flush / erase request as a chain of descriptors
+  (header, data segments, status), and submit it to the host without waiting
+  for completion.
+
+  The data buffer is mapped as a whole, and split into segments of at most
+  Dev->SizeMax bytes. If VIRTIO_F_RING_INDIRECT_DESC has been negotiated, the
+  chain is placed in an indirect descriptor table, and takes up a single ring
+  descriptor.
+
+  The caller is responsible for running at TPL_NOTIFY.
 
   Parameters handled commonly:
 
     @param[in] Dev             The virtio-blk device the request is targeted
                                at.
 
+    @param[in] Io              The Block I/O (2) call the request belongs to.
+                               On success, Io->Pending is incremented; the
+                               request is accounted to Io with ReleaseIo()
+                               when the host completes it.
+
+    @param[in] WaitTpl         The TPL to wait at if the ring is full, see
+                               VirtioRequestWaitForQueue().
+
   Flush request:
 
     @param[in] Lba             Must be zero.
@@ -198,7 +437,7 @@ VerifyReadWriteRequest (
 
     @param[in out] Buffer      Ignored by the function.
 
-    @param[in] RequestIsWrite  Must be TRUE.
+    @param[in] RequestType     Must be VIRTIO_BLK_T_FLUSH.
 
   Read/Write request:
 
@@ -207,59 +446,69 @@ VerifyReadWriteRequest (
 
     @param[in] BufferSize      Size of buffer to transfer, in bytes. The caller
                                is responsible to ensure this parameter is
-                               positive.
+                               positive, and at most Dev->MaxTransfer.
 
     @param[in out] Buffer      The guest side area to read data from the device
                                into, or write data to the device from.
 
-    @param[in] RequestIsWrite  TRUE iff data transfer goes from guest to
-                               device.
+    @param[in] RequestType     VIRTIO_BLK_T_IN, or VIRTIO_BLK_T_OUT for data
+                               transfer from guest to device.
 
-  Return values are common to both use cases, and are appropriate to be
-  forwarded by the EFI_BLOCK_IO_PROTOCOL functions (ReadBlocks(),
-  WriteBlocks(), FlushBlocks()).
+  Discard/Write zeroes request:
 
+    @param[in] Lba             The first logical block to erase.
 
-  @retval EFI_SUCCESS          Transfer complete.
+    @param[in] BufferSize      Size of the range to erase, in bytes. The caller
+                               is responsible to ensure this parameter is
+                               positive, and at most Dev->MaxErase.
 
-  @retval EFI_DEVICE_ERROR     Failed to notify host side via VirtIo write, or
-                               unable to parse host response, or host response
-                               is not VIRTIO_BLK_S_OK or failed to map Buffer
-                               for a bus master operation.
+    @param[in out] Buffer      Ignored by the function.
+
+    @param[in] RequestType     Dev->EraseType.
+
+  @retval EFI_SUCCESS           The request has been submitted.
+
+  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
+
+  @retval EFI_DEVICE_ERROR      Failed to map a buffer for a bus master
+                                operation.
 
 **/
 STATIC
 EFI_STATUS
-EFIAPI
-SynchronousRequest (
+SubmitRequest (
   IN              VBLK_DEV  *Dev,
+  IN              VBLK_IO   *Io,
+  IN              EFI_TPL   WaitTpl,
   IN              EFI_LBA   Lba,
   IN              UINTN     BufferSize,
   IN OUT volatile VOID      *Buffer,
-  IN              BOOLEAN   RequestIsWrite
+  IN              UINT32    RequestType
   )
 {
-  UINT32                   BlockSize;
-  volatile VIRTIO_BLK_REQ  Request;
-  volatile UINT8           *HostStatus;
-  VOID                     *HostStatusBuffer;
-  DESC_INDICES             Indices;
-  VOID                     *RequestMapping;
-  VOID                     *StatusMapping;
-  VOID                     *BufferMapping;
-  EFI_PHYSICAL_ADDRESS     BufferDeviceAddress;
-  EFI_PHYSICAL_ADDRESS     HostStatusDeviceAddress;
-  EFI_PHYSICAL_ADDRESS     RequestDeviceAddress;
-  EFI_STATUS               Status;
-  EFI_STATUS               UnmapStatus;
-
-  BlockSize = Dev->BlockIoMedia.BlockSize;
-
-  //
-  // Set BufferMapping and BufferDeviceAddress to suppress incorrect
-  // compiler/analyzer warnings.
+  UINT32                BlockSize;
+  BOOLEAN               RequestIsWrite;
+  BOOLEAN               RequestIsErase;
+  VBLK_REQ              *NewReq;
+  VBLK_QUEUE            *Queue;
+  VIRTIO_INDIRECT_POOL  *Pool;
+  VOID                  *Shared;
+  UINT16                NumSegments;
+  UINTN                 Offset;
+  UINT32                SegmentSize;
+  DESC_INDICES          Indices;
+  DESC_INDICES          ChainIndices;
+  EFI_PHYSICAL_ADDRESS  BufferDeviceAddress;
+  EFI_STATUS            Status;
+
+  BlockSize      = Dev->BlockIoMedia.BlockSize;
+  RequestIsWrite = (BOOLEAN)(RequestType != VIRTIO_BLK_T_IN);
+  RequestIsErase = (BOOLEAN)(RequestType == VIRTIO_BLK_T_DISCARD ||
+                             RequestType == VIRTIO_BLK_T_WRITE_ZEROES);
+
+  //
+  // Set BufferDeviceAddress to suppress incorrect compiler/analyzer warnings.
   //
-  BufferMapping       = NULL;
   BufferDeviceAddress = 0;
 
   //
@@ -269,57 +518,40 @@ SynchronousRequest (
   ASSERT (BlockSize % 512 == 0);
 
   //
-  // ensured by contract above, plus VerifyReadWriteRequest()
+  // ensured by contract above, plus VerifyReadWriteRequest() and SubmitIo()
   //
   ASSERT (BufferSize % BlockSize == 0);
+  ASSERT (BufferSize <= (RequestIsErase ? Dev->MaxErase : Dev->MaxTransfer));
 
   //
-  // Prepare virtio-blk request header, setting zero size for flush.
-  // IO Priority is homogeneously 0.
-  //
-  Request.Type = RequestIsWrite ?
-                 (BufferSize == 0 ? VIRTIO_BLK_T_FLUSH : VIRTIO_BLK_T_OUT) :
-                 VIRTIO_BLK_T_IN;
-  Request.IoPrio = 0;
-  Request.Sector = MultU64x32 (Lba, BlockSize / 512);
-
+  // From virtio-0.9.5, 2.3.2 Descriptor Table:
+  // "no descriptor chain may be more than 2^32 bytes long in total".
   //
-  // Host status is bi-directional (we preset with a value and expect the
-  // device to update it). Allocate a host status buffer which can be mapped
-  // to access equally by both processor and the device.
+  // VirtioBlkInit() keeps Dev->MaxTransfer at or below 1 GB, which also
+  // implies that converting segment sizes to UINT32 will not truncate them.
+  // An erase request carries a single range descriptor instead of data.
   //
-  Status = Dev->VirtIo->AllocateSharedPages (
-                          Dev->VirtIo,
-                          EFI_SIZE_TO_PAGES (sizeof *HostStatus),
-                          &HostStatusBuffer
-                          );
-  if (EFI_ERROR (Status)) {
-    return EFI_DEVICE_ERROR;
+  if (RequestIsErase) {
+    NumSegments = 1;
+  } else {
+    NumSegments = (UINT16)((BufferSize + Dev->SizeMax - 1) / Dev->SizeMax);
+    ASSERT (NumSegments <= Dev->SegMax);
   }
 
-  HostStatus = HostStatusBuffer;
-
-  //
-  // Map virtio-blk request header (must be done after request header is
-  // populated)
-  //
-  Status = VirtioMapAllBytesInSharedBuffer (
-             Dev->VirtIo,
-             VirtioOperationBusMasterRead,
-             (VOID *)&Request,
-             sizeof Request,
-             &RequestDeviceAddress,
-             &RequestMapping
-             );
-  if (EFI_ERROR (Status)) {
-    Status = EFI_DEVICE_ERROR;
-    goto FreeHostStatusBuffer;
+  NewReq = AllocateZeroPool (sizeof *NewReq);
+  if (NewReq == NULL) {
+    return EFI_OUT_OF_RESOURCES;
   }
 
+  NewReq->Signature      = VBLK_REQ_SIG;
+  NewReq->Io             = Io;
+  NewReq->RequestIsWrite = RequestIsWrite;
+  NewReq->BufferSize     = RequestIsErase ? 0 : BufferSize;
+
   //
   // Map data buffer
   //
-  if (BufferSize > 0) {
+  if (NewReq->BufferSize > 0) {
     Status = VirtioMapAllBytesInSharedBuffer (
                Dev->VirtIo,
                (RequestIsWrite ?
@@ -328,195 +560,598 @@ SynchronousRequest (
                (VOID *)Buffer,
                BufferSize,
                &BufferDeviceAddress,
-               &BufferMapping
+               &NewReq->BufferMapping
                );
     if (EFI_ERROR (Status)) {
       Status = EFI_DEVICE_ERROR;
-      goto UnmapRequestBuffer;
+      goto FreeReq;
     }
   }
 
   //
-  // preset a host status for ourselves that we do not accept as success
+  // Reserve the descriptors; if the ring is full, make room by reaping
+  // completions. VirtioBlkInitQueue() ensures each ring fits at least one
+  // chain.
   //
-  *HostStatus = VIRTIO_BLK_S_IOERR;
+  NewReq->QueueIndex = VirtioRequestSelectQueue (&Dev->Requests);
+  Queue              = &Dev->Queues[NewReq->QueueIndex];
+  Pool               = Dev->IndirectDesc ? &Queue->Indirect : NULL;
+  for ( ; ;) {
+    Status = VirtioRequestReserve (
+               &Queue->ReqQueue,
+               (Pool != NULL) ? 1 : NumSegments + 2,
+               &Indices
+               );
+    if (Status != EFI_OUT_OF_RESOURCES) {
+      break;
+    }
+
+    VirtioRequestWaitForQueue (&Dev->Requests, NewReq->QueueIndex, WaitTpl);
+  }
+
+  ASSERT_EFI_ERROR (Status);
 
   //
-  // Map the Status Buffer with VirtioOperationBusMasterCommonBuffer so that
-  // both processor and device can access it.
+  // The slab has an element per ring descriptor, and each request in flight
+  // holds at least one descriptor, so an element is free now.
   //
-  Status = VirtioMapAllBytesInSharedBuffer (
-             Dev->VirtIo,
-             VirtioOperationBusMasterCommonBuffer,
-             HostStatusBuffer,
-             sizeof *HostStatus,
-             &HostStatusDeviceAddress,
-             &StatusMapping
+  Status = VirtioDmaSlabAlloc (
+             &Queue->ReqSlab,
+             &Shared,
+             &NewReq->SharedDeviceAddress
              );
-  if (EFI_ERROR (Status)) {
-    Status = EFI_DEVICE_ERROR;
-    goto UnmapDataBuffer;
+  ASSERT_EFI_ERROR (Status);
+  NewReq->Shared = Shared;
+
+  //
+  // Prepare virtio-blk request header. IO Priority is homogeneously 0. The
+  // sector of an erase request is carried in its range instead.
+  //
+  NewReq->Shared->Request.Type   = RequestType;
+  NewReq->Shared->Request.IoPrio = 0;
+  if (RequestIsErase) {
+    NewReq->Shared->Request.Sector   = 0;
+    NewReq->Shared->Range.Sector     = MultU64x32 (Lba, BlockSize / 512);
+    NewReq->Shared->Range.NumSectors = (UINT32)(BufferSize / 512);
+    NewReq->Shared->Range.Flags      = Dev->EraseFlags;
+  } else {
+    NewReq->Shared->Request.Sector = MultU64x32 (Lba, BlockSize / 512);
   }
 
-  VirtioPrepare (&Dev->Ring, &Indices);
+  //
+  // preset a host status for ourselves that we do not accept as success
+  //
+  NewReq->Shared->HostStatus = VIRTIO_BLK_S_IOERR;
 
   //
-  // ensured by VirtioBlkInit() -- this predicate, in combination with the
-  // lock-step progress, ensures we don't have to track free descriptors.
+  // With indirect descriptors, the chain is built in the table that belongs
+  // to the single reserved ring descriptor.
   //
-  ASSERT (Dev->Ring.QueueSize >= 3);
+  if (Pool != NULL) {
+    VirtioIndirectPrepare (Pool, Indices.HeadDescIdx, &ChainIndices);
+  } else {
+    ChainIndices = Indices;
+  }
 
   //
   // virtio-blk header in first desc
   //
-  VirtioAppendDesc (
-    &Dev->Ring,
-    RequestDeviceAddress,
-    sizeof Request,
+  VirtioRequestAppendChainDesc (
+    &Queue->ReqQueue,
+    Pool,
+    NewReq->SharedDeviceAddress + OFFSET_OF (VBLK_SHARED_REQ, Request),
+    sizeof NewReq->Shared->Request,
     VRING_DESC_F_NEXT,
-    &Indices
+    &ChainIndices
     );
 
   //
-  // data buffer for read/write in second desc
+  // range for discard/write zeroes in the second desc
   //
-  if (BufferSize > 0) {
-    //
-    // From virtio-0.9.5, 2.3.2 Descriptor Table:
-    // "no descriptor chain may be more than 2^32 bytes long in total".
-    //
-    // The predicate is ensured by the call contract above (for flush), or
-    // VerifyReadWriteRequest() (for read/write). It also implies that
-    // converting BufferSize to UINT32 will not truncate it.
-    //
-    ASSERT (BufferSize <= SIZE_1GB);
+  if (RequestIsErase) {
+    VirtioRequestAppendChainDesc (
+      &Queue->ReqQueue,
+      Pool,
+      NewReq->SharedDeviceAddress + OFFSET_OF (VBLK_SHARED_REQ, Range),
+      sizeof NewReq->Shared->Range,
+      VRING_DESC_F_NEXT,
+      &ChainIndices
+      );
+  }
+
+  //
+  // data segments for read/write in the following descriptors
+  //
+  for (Offset = 0; Offset < NewReq->BufferSize; Offset += SegmentSize) {
+    SegmentSize = (UINT32)MIN (BufferSize - Offset, Dev->SizeMax);
 
     //
     // VRING_DESC_F_WRITE is interpreted from the host's point of view.
     //
-    VirtioAppendDesc (
-      &Dev->Ring,
-      BufferDeviceAddress,
-      (UINT32)BufferSize,
+    VirtioRequestAppendChainDesc (
+      &Queue->ReqQueue,
+      Pool,
+      BufferDeviceAddress + Offset,
+      SegmentSize,
       VRING_DESC_F_NEXT | (RequestIsWrite ? 0 : VRING_DESC_F_WRITE),
-      &Indices
+      &ChainIndices
       );
   }
 
   //
-  // host status in last (second or third) desc
+  // host status in last desc
   //
-  VirtioAppendDesc (
-    &Dev->Ring,
-    HostStatusDeviceAddress,
-    sizeof *HostStatus,
+  VirtioRequestAppendChainDesc (
+    &Queue->ReqQueue,
+    Pool,
+    NewReq->SharedDeviceAddress + OFFSET_OF (VBLK_SHARED_REQ, HostStatus),
+    sizeof NewReq->Shared->HostStatus,
     VRING_DESC_F_WRITE,
-    &Indices
+    &ChainIndices
     );
 
-  //
-  // virtio-blk's only virtqueue is #0, called "requestq" (see Appendix D).
-  //
-  if ((VirtioFlush (
-         Dev->VirtIo,
-         0,
-         &Dev->Ring,
-         &Indices,
-         NULL
-         ) == EFI_SUCCESS) &&
-      (*HostStatus == VIRTIO_BLK_S_OK))
-  {
-    Status = EFI_SUCCESS;
-  } else {
-    Status = EFI_DEVICE_ERROR;
+  if (Pool != NULL) {
+    VirtioRequestAppendIndirect (
+      &Queue->ReqQueue,
+      Pool,
+      &ChainIndices,
+      &Indices
+      );
   }
 
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, StatusMapping);
+  Io->Pending++;
+  VirtioRequestSubmit (&Queue->ReqQueue, &Indices, NewReq);
 
-UnmapDataBuffer:
-  if (BufferSize > 0) {
-    UnmapStatus = Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, BufferMapping);
-    if (EFI_ERROR (UnmapStatus) && !RequestIsWrite && !EFI_ERROR (Status)) {
-      //
-      // Data from the bus master may not reach the caller; fail the request.
-      //
-      Status = EFI_DEVICE_ERROR;
-    }
+  //
+  // The request queues are virtqueues #0 to #(NumQueues - 1) (see Appendix
+  // D, and virtio-1.0, 5.2.2 Virtqueues). Once the chain is visible to the
+  // host, it may complete at any time, so it is reaped (and never unwound
+  // here) even if the notification fails.
+  //
+  Status = VirtioRequestNotify (
+             Dev->VirtIo,
+             NewReq->QueueIndex,
+             &Queue->ReqQueue
+             );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a: SetQueueNotify: %r\n", __FUNCTION__, Status));
   }
 
-UnmapRequestBuffer:
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, RequestMapping);
+  return EFI_SUCCESS;
 
-FreeHostStatusBuffer:
-  Dev->VirtIo->FreeSharedPages (
-                 Dev->VirtIo,
-                 EFI_SIZE_TO_PAGES (sizeof *HostStatus),
-                 HostStatusBuffer
-                 );
+FreeReq:
+  FreePool (NewReq);
 
   return Status;
 }
 
 /**
 
-  ReadBlocks() operation for virtio-blk.
+  Start a read / write / flush / erase call, splitting the transfer into
+  requests of at most Dev->MaxTransfer bytes (the range to erase into
+  requests of at most Dev->MaxErase bytes). The requests are submitted back to
+  back, so
+  that they are pipelined through the rings (and spread over the request
+  queues) rather than carried out one after the other.
+
+  The function may only be called after the request parameters have been
+  verified by
+  - specific checks in ReadBlocks() / WriteBlocks() / FlushBlocks() and their
+    Ex() counterparts, and
+  - VerifyReadWriteRequest() (for read/write only).
 
-  See
-  - UEFI Spec 2.3.1 + Errata C, 12.8 EFI Block I/O Protocol, 12.8 EFI Block I/O
-    Protocol, EFI_BLOCK_IO_PROTOCOL.ReadBlocks().
-  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.2. ReadBlocks() and
-    ReadBlocksEx() Implementation.
+  The caller is responsible for running at TPL_NOTIFY.
 
-  Parameter checks and conformant return values are implemented in
-  VerifyReadWriteRequest() and SynchronousRequest().
+  Parameters are documented at SubmitRequest(), except for:
 
-  A zero BufferSize doesn't seem to be prohibited, so do nothing in that case,
-  successfully.
+  @param[in]  Token  If NULL, the call is blocking: the caller will wait for
+                     (*Io)->Pending to drop to zero, and release *Io.
+                     Otherwise, Token->Event is signaled and the tracking
+                     structure is released when the host completes the last
+                     request; *Io must not be accessed.
+
+  @param[out] Io     On success, the tracking structure of the call.
+
+  While the function waits for the host (for ring space, or after a
+  failure), the TPL is lowered to WaitTpl, so other calls may be submitted
+  in the meantime.
+
+  @retval EFI_SUCCESS  All requests have been submitted.
+
+  @return              Error codes from SubmitRequest(). Requests submitted
+                       before the failure have been waited for, so the
+                       caller's buffer is no longer in use, and Token->Event
+                       is not signaled.
 
 **/
+STATIC
 EFI_STATUS
-EFIAPI
-VirtioBlkReadBlocks (
-  IN  EFI_BLOCK_IO_PROTOCOL  *This,
-  IN  UINT32                 MediaId,
-  IN  EFI_LBA                Lba,
-  IN  UINTN                  BufferSize,
-  OUT VOID                   *Buffer
+SubmitIo (
+  IN              VBLK_DEV             *Dev,
+  IN              EFI_LBA              Lba,
+  IN              UINTN                BufferSize,
+  IN OUT volatile VOID                 *Buffer,
+  IN              UINT32               RequestType,
+  IN              EFI_BLOCK_IO2_TOKEN  *Token OPTIONAL,
+  IN              EFI_TPL              WaitTpl,
+  OUT             VBLK_IO              **Io
   )
 {
-  VBLK_DEV    *Dev;
+  VBLK_IO     *NewIo;
+  UINTN       MaxRequestSize;
+  UINTN       Offset;
+  UINTN       RequestSize;
   EFI_STATUS  Status;
 
-  if (BufferSize == 0) {
-    return EFI_SUCCESS;
+  MaxRequestSize = (RequestType == VIRTIO_BLK_T_DISCARD ||
+                    RequestType == VIRTIO_BLK_T_WRITE_ZEROES) ?
+                   Dev->MaxErase :
+                   Dev->MaxTransfer;
+
+  NewIo = AllocateZeroPool (sizeof *NewIo);
+  if (NewIo == NULL) {
+    return EFI_OUT_OF_RESOURCES;
   }
 
-  Dev    = VIRTIO_BLK_FROM_BLOCK_IO (This);
-  Status = VerifyReadWriteRequest (
-             &Dev->BlockIoMedia,
-             Lba,
-             BufferSize,
-             FALSE               // RequestIsWrite
-             );
-  if (EFI_ERROR (Status)) {
-    return Status;
+  //
+  // Hold one reference while submitting, so that the call cannot complete
+  // until all of its requests are in flight.
+  //
+  NewIo->Signature = VBLK_IO_SIG;
+  NewIo->Token     = Token;
+  NewIo->Pending   = 1;
+  NewIo->Status    = EFI_SUCCESS;
+
+  //
+  // A flush carries no data, but it is still one request.
+  //
+  Offset = 0;
+  do {
+    RequestSize = MIN (BufferSize - Offset, MaxRequestSize);
+    Status      = SubmitRequest (
+                    Dev,
+                    NewIo,
+                    WaitTpl,
+                    Lba + Offset / Dev->BlockIoMedia.BlockSize,
+                    RequestSize,
+                    (volatile UINT8 *)Buffer + Offset,
+                    RequestType
+                    );
+    if (EFI_ERROR (Status)) {
+      //
+      // Requests already submitted cannot be recalled; let them finish
+      // before reporting the failure.
+      //
+      NewIo->Token = NULL;
+      WaitForIo (Dev, NewIo, 1, WaitTpl);
+      FreePool (NewIo);
+      return Status;
+    }
+
+    Offset += RequestSize;
+  } while (Offset < BufferSize);
+
+  //
+  // Nobody waits for a non-blocking call; the poll timer reaps its requests
+  // until ReleaseIo() signals the token.
+  //
+  if (Token != NULL) {
+    VirtioRequestPollTimerHold (&Dev->Requests);
   }
 
-  return SynchronousRequest (
-           Dev,
-           Lba,
-           BufferSize,
-           Buffer,
-           FALSE       // RequestIsWrite
-           );
+  *Io = NewIo;
+  ReleaseIo (Dev, NewIo);
+  return EFI_SUCCESS;
 }
 
 /**
 
-  WriteBlocks() operation for virtio-blk.
+  Submit a read / write / flush request to the host, and poll for the
+  response.
 
-  See
-  - UEFI Spec 2.3.1 + Errata C, 12.8 EFI Block I/O Protocol, 12.8 EFI Block I/O
+  This is the main workhorse function of the blocking interfaces. Parameters
+  are documented at SubmitRequest().
+
+  Return values are appropriate to be forwarded by the EFI_BLOCK_IO_PROTOCOL
+  functions (ReadBlocks(), WriteBlocks(), FlushBlocks()).
+
+  The TPL is raised to TPL_NOTIFY only while the rings are manipulated; the
+  host is waited for at the caller's TPL.
+
+
+  @retval EFI_SUCCESS          Transfer complete.
+
+  @retval EFI_DEVICE_ERROR     Failed to notify host side via VirtIo write, or
+                               unable to parse host response, or host response
+                               is not VIRTIO_BLK_S_OK or failed to map Buffer
+                               for a bus master operation.
+
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+SynchronousRequest (
+  IN              VBLK_DEV  *Dev,
+  IN              EFI_LBA   Lba,
+  IN              UINTN     BufferSize,
+  IN OUT volatile VOID      *Buffer,
+  IN              UINT32    RequestType
+  )
+{
+  EFI_TPL     OldTpl;
+  VBLK_IO     *Io;
+  EFI_STATUS  Status;
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+
+  Status = SubmitIo (
+             Dev,
+             Lba,
+             BufferSize,
+             Buffer,
+             RequestType,
+             NULL,
+             OldTpl,
+             &Io
+             );
+  if (EFI_ERROR (Status)) {
+    gBS->RestoreTPL (OldTpl);
+    return (Status == EFI_OUT_OF_RESOURCES) ? Status : EFI_DEVICE_ERROR;
+  }
+
+  WaitForIo (Dev, Io, 0, OldTpl);
+
+  gBS->RestoreTPL (OldTpl);
+
+  Status = Io->Status;
+  FreePool (Io);
+  return Status;
+}
+
+/**
+
+  Queue a read / write / flush request for EFI_BLOCK_IO2_PROTOCOL, or carry it
+  out synchronously if the caller asked for blocking I/O.
+
+  Parameters are documented at SubmitIo().
+
+  @retval EFI_SUCCESS  The request has been queued, or completed successfully
+                       in the blocking case.
+
+  @return              Error codes from SubmitIo() or SynchronousRequest().
+
+**/
+STATIC
+EFI_STATUS
+AsynchronousRequest (
+  IN              VBLK_DEV             *Dev,
+  IN              EFI_LBA              Lba,
+  IN              UINTN                BufferSize,
+  IN OUT volatile VOID                 *Buffer,
+  IN              UINT32               RequestType,
+  IN OUT          EFI_BLOCK_IO2_TOKEN  *Token OPTIONAL
+  )
+{
+  EFI_TPL     OldTpl;
+  VBLK_IO     *Io;
+  EFI_STATUS  Status;
+
+  if ((Token == NULL) || (Token->Event == NULL)) {
+    return SynchronousRequest (Dev, Lba, BufferSize, Buffer, RequestType);
+  }
+
+  Token->TransactionStatus = EFI_SUCCESS;
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  Status = SubmitIo (
+             Dev,
+             Lba,
+             BufferSize,
+             Buffer,
+             RequestType,
+             Token,
+             OldTpl,
+             &Io
+             );
+  gBS->RestoreTPL (OldTpl);
+
+  return Status;
+}
+
+/**
+
+  Carry out a blocking read through the read-ahead cache.
+
+  A read that the cache holds entirely is served from memory. Otherwise, if
+  the read continues where the previous one ended, the cache is refilled from
+  the first block of the read, with as much of the disk as fits, and the read
+  is served from it. Other reads, and reads issued while the cache is being
+  filled (from an event that interrupted the filling read), go to the device
+  directly.
+
+  Parameters are documented at SubmitRequest(), for a read request.
+
+  @retval EFI_SUCCESS  The data has been read.
+
+  @return              Error codes from SynchronousRequest().
+
+**/
+STATIC
+EFI_STATUS
+ReadAheadRead (
+  IN  VBLK_DEV  *Dev,
+  IN  EFI_LBA   Lba,
+  IN  UINTN     BufferSize,
+  OUT VOID      *Buffer
+  )
+{
+  VBLK_READ_AHEAD  *ReadAhead;
+  UINT32           BlockSize;
+  BOOLEAN          Sequential;
+  UINTN            FillSize;
+  UINT32           Generation;
+  EFI_TPL          OldTpl;
+  EFI_STATUS       Status;
+
+  ReadAhead = &Dev->ReadAhead;
+  BlockSize = Dev->BlockIoMedia.BlockSize;
+
+  if (ReadAhead->Buffer == NULL) {
+    return SynchronousRequest (Dev, Lba, BufferSize, Buffer, VIRTIO_BLK_T_IN);
+  }
+
+  //
+  // Completions reaped from the poll timer invalidate the cache, so keep it
+  // stable while we look it up.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+
+  if ((Lba >= ReadAhead->Lba) &&
+      (BufferSize <= ReadAhead->Length) &&
+      (Lba - ReadAhead->Lba <= (ReadAhead->Length - BufferSize) / BlockSize))
+  {
+    CopyMem (
+      Buffer,
+      ReadAhead->Buffer + (UINTN)(Lba - ReadAhead->Lba) * BlockSize,
+      BufferSize
+      );
+    ReadAhead->Hits++;
+    ReadAhead->NextLba = Lba + BufferSize / BlockSize;
+    gBS->RestoreTPL (OldTpl);
+    return EFI_SUCCESS;
+  }
+
+  ReadAhead->Misses++;
+  Sequential         = (BOOLEAN)(Lba == ReadAhead->NextLba);
+  ReadAhead->NextLba = Lba + BufferSize / BlockSize;
+
+  if (!Sequential || (BufferSize >= ReadAhead->Size) || ReadAhead->Filling) {
+    gBS->RestoreTPL (OldTpl);
+    return SynchronousRequest (Dev, Lba, BufferSize, Buffer, VIRTIO_BLK_T_IN);
+  }
+
+  //
+  // VerifyReadWriteRequest() ensures that the read fits on the disk, hence
+  // FillSize covers it.
+  //
+  FillSize = (UINTN)MIN (
+                      ReadAhead->Size,
+                      MultU64x32 (Dev->BlockIoMedia.LastBlock - Lba + 1, BlockSize)
+                      );
+  ASSERT (FillSize >= BufferSize);
+
+  //
+  // A write that completes while the cache is being filled may or may not
+  // be reflected in the data read; keep the data only if none did. The fill
+  // runs at the caller's TPL, with Filling keeping other readers away from
+  // the buffer.
+  //
+  ReadAheadInvalidate (Dev);
+  Generation         = ReadAhead->Generation;
+  ReadAhead->Filling = TRUE;
+  gBS->RestoreTPL (OldTpl);
+
+  Status = SynchronousRequest (
+             Dev,
+             Lba,
+             FillSize,
+             ReadAhead->Buffer,
+             VIRTIO_BLK_T_IN
+             );
+  if (!EFI_ERROR (Status)) {
+    CopyMem (Buffer, ReadAhead->Buffer, BufferSize);
+  }
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  if (!EFI_ERROR (Status) && (ReadAhead->Generation == Generation)) {
+    ReadAhead->Lba    = Lba;
+    ReadAhead->Length = FillSize;
+  }
+
+  ReadAhead->Filling = FALSE;
+  gBS->RestoreTPL (OldTpl);
+  return Status;
+}
+
+/**
+
+  Periodic timer callback reaping the non-blocking requests that the host has
+  completed.
+
+  @param[in] Event    Event whose notification function is being invoked.
+
+  @param[in] Context  Pointer to the VBLK_DEV structure.
+
+**/
+STATIC
+VOID
+EFIAPI
+VirtioBlkPollTimer (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  VBLK_DEV  *Dev;
+
+  Dev = Context;
+  VirtioRequestProcessCompletions (&Dev->Requests);
+}
+
+/**
+
+  ReadBlocks() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.8 EFI Block I/O Protocol, 12.8 EFI Block I/O
+    Protocol, EFI_BLOCK_IO_PROTOCOL.ReadBlocks().
+  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.2. ReadBlocks() and
+    ReadBlocksEx() Implementation.
+
+  Parameter checks and conformant return values are implemented in
+  VerifyReadWriteRequest() and SynchronousRequest(). Sequential reads are
+  served through the read-ahead cache, see ReadAheadRead().
+
+  A zero BufferSize doesn't seem to be prohibited, so do nothing in that case,
+  successfully.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkReadBlocks (
+  IN  EFI_BLOCK_IO_PROTOCOL  *This,
+  IN  UINT32                 MediaId,
+  IN  EFI_LBA                Lba,
+  IN  UINTN                  BufferSize,
+  OUT VOID                   *Buffer
+  )
+{
+  VBLK_DEV    *Dev;
+  EFI_STATUS  Status;
+
+  if (BufferSize == 0) {
+    return EFI_SUCCESS;
+  }
+
+  Dev    = VIRTIO_BLK_FROM_BLOCK_IO (This);
+  Status = VerifyReadWriteRequest (
+             &Dev->BlockIoMedia,
+             Lba,
+             BufferSize,
+             FALSE               // RequestIsWrite
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return ReadAheadRead (Dev, Lba, BufferSize, Buffer);
+}
+
+/**
+
+  WriteBlocks() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.8 EFI Block I/O Protocol, 12.8 EFI Block I/O
     Protocol, EFI_BLOCK_IO_PROTOCOL.WriteBlocks().
   - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.3 WriteBlocks() and
     WriteBlockEx() Implementation.
@@ -553,135 +1188,614 @@ VirtioBlkWriteBlocks (
              TRUE                // RequestIsWrite
              );
   if (EFI_ERROR (Status)) {
-    return Status;
+    return Status;
+  }
+
+  return SynchronousRequest (
+           Dev,
+           Lba,
+           BufferSize,
+           Buffer,
+           VIRTIO_BLK_T_OUT    // RequestType
+           );
+}
+
+/**
+
+  FlushBlocks() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.8 EFI Block I/O Protocol, 12.8 EFI Block I/O
+    Protocol, EFI_BLOCK_IO_PROTOCOL.FlushBlocks().
+  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.4 FlushBlocks() and
+    FlushBlocksEx() Implementation.
+
+  If the underlying virtio-blk device doesn't support flushing (ie.
+  write-caching), then this function should not be called by higher layers,
+  according to EFI_BLOCK_IO_MEDIA characteristics set in VirtioBlkInit().
+  Should they do nonetheless, we do nothing, successfully.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkFlushBlocks (
+  IN EFI_BLOCK_IO_PROTOCOL  *This
+  )
+{
+  VBLK_DEV  *Dev;
+
+  Dev = VIRTIO_BLK_FROM_BLOCK_IO (This);
+  return Dev->BlockIoMedia.WriteCaching ?
+         SynchronousRequest (
+           Dev,
+           0,                 // Lba
+           0,                 // BufferSize
+           NULL,              // Buffer
+           VIRTIO_BLK_T_FLUSH // RequestType
+           ) :
+         EFI_SUCCESS;
+}
+
+//
+// UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol
+// Driver Writer's Guide for UEFI 2.3.1 v1.01,
+//   24.3 Block I/O 2 Protocol Implementations
+//
+// Non-blocking requests are spread over the VBLK_QUEUE instances of the
+// device, side by side with blocking ones. The host may complete them in any
+// order; they are reaped either by a periodic timer, or on the way by any
+// other request that waits for the same queue.
+//
+
+/**
+
+  Reset() operation for EFI_BLOCK_IO2_PROTOCOL.
+
+  All outstanding non-blocking requests are completed (rather than aborted),
+  because the device cannot recall a request that it has already seen.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkResetEx (
+  IN EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN BOOLEAN                 ExtendedVerification
+  )
+{
+  VBLK_DEV  *Dev;
+  EFI_TPL   OldTpl;
+
+  Dev    = VIRTIO_BLK_FROM_BLOCK_IO2 (This);
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  VirtioRequestDrain (&Dev->Requests, OldTpl);
+  gBS->RestoreTPL (OldTpl);
+
+  return EFI_SUCCESS;
+}
+
+/**
+
+  ReadBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.ReadBlocksEx().
+  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.2. ReadBlocks() and
+    ReadBlocksEx() Implementation.
+
+  Parameter checks and conformant return values are implemented in
+  VerifyReadWriteRequest() and AsynchronousRequest().
+
+  A zero BufferSize completes the token immediately, successfully.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkReadBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  OUT    VOID                    *Buffer
+  )
+{
+  VBLK_DEV    *Dev;
+  EFI_STATUS  Status;
+
+  if (BufferSize == 0) {
+    if ((Token != NULL) && (Token->Event != NULL)) {
+      Token->TransactionStatus = EFI_SUCCESS;
+      gBS->SignalEvent (Token->Event);
+    }
+
+    return EFI_SUCCESS;
+  }
+
+  Dev    = VIRTIO_BLK_FROM_BLOCK_IO2 (This);
+  Status = VerifyReadWriteRequest (
+             &Dev->BlockIoMedia,
+             Lba,
+             BufferSize,
+             FALSE               // RequestIsWrite
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return AsynchronousRequest (
+           Dev,
+           Lba,
+           BufferSize,
+           Buffer,
+           VIRTIO_BLK_T_IN,    // RequestType
+           Token
+           );
+}
+
+/**
+
+  WriteBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.WriteBlocksEx().
+  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.3 WriteBlocks() and
+    WriteBlockEx() Implementation.
+
+  Parameter checks and conformant return values are implemented in
+  VerifyReadWriteRequest() and AsynchronousRequest().
+
+  A zero BufferSize completes the token immediately, successfully.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkWriteBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  IN     VOID                    *Buffer
+  )
+{
+  VBLK_DEV    *Dev;
+  EFI_STATUS  Status;
+
+  if (BufferSize == 0) {
+    if ((Token != NULL) && (Token->Event != NULL)) {
+      Token->TransactionStatus = EFI_SUCCESS;
+      gBS->SignalEvent (Token->Event);
+    }
+
+    return EFI_SUCCESS;
+  }
+
+  Dev    = VIRTIO_BLK_FROM_BLOCK_IO2 (This);
+  Status = VerifyReadWriteRequest (
+             &Dev->BlockIoMedia,
+             Lba,
+             BufferSize,
+             TRUE                // RequestIsWrite
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  return AsynchronousRequest (
+           Dev,
+           Lba,
+           BufferSize,
+           Buffer,
+           VIRTIO_BLK_T_OUT,   // RequestType
+           Token
+           );
+}
+
+/**
+
+  FlushBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.FlushBlocksEx().
+  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.4 FlushBlocks() and
+    FlushBlocksEx() Implementation.
+
+  The virtio-blk flush request only covers writes that the host has
+  completed, hence all requests in flight are drained first. The flush itself
+  is then queued like any other request.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkFlushBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token
+  )
+{
+  VBLK_DEV  *Dev;
+  EFI_TPL   OldTpl;
+
+  Dev    = VIRTIO_BLK_FROM_BLOCK_IO2 (This);
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  VirtioRequestDrain (&Dev->Requests, OldTpl);
+  gBS->RestoreTPL (OldTpl);
+
+  if (!Dev->BlockIoMedia.WriteCaching) {
+    if ((Token != NULL) && (Token->Event != NULL)) {
+      Token->TransactionStatus = EFI_SUCCESS;
+      gBS->SignalEvent (Token->Event);
+    }
+
+    return EFI_SUCCESS;
+  }
+
+  return AsynchronousRequest (
+           Dev,
+           0,                  // Lba
+           0,                  // BufferSize
+           NULL,               // Buffer
+           VIRTIO_BLK_T_FLUSH, // RequestType
+           Token
+           );
+}
+
+//
+// UEFI Spec 2.6, EFI Erase Block Protocol
+//
+// The tokens of EraseBlocks() are tracked by VBLK_IO like those of the Block
+// I/O 2 interface; the layouts are the same.
+//
+STATIC_ASSERT (
+  sizeof (EFI_ERASE_BLOCK_TOKEN) == sizeof (EFI_BLOCK_IO2_TOKEN),
+  "EFI_ERASE_BLOCK_TOKEN differs from EFI_BLOCK_IO2_TOKEN"
+  );
+STATIC_ASSERT (
+  OFFSET_OF (EFI_ERASE_BLOCK_TOKEN, TransactionStatus) ==
+  OFFSET_OF (EFI_BLOCK_IO2_TOKEN, TransactionStatus),
+  "EFI_ERASE_BLOCK_TOKEN differs from EFI_BLOCK_IO2_TOKEN"
+  );
+
+/**
+
+  EraseBlocks() operation for virtio-blk.
+
+  See UEFI Spec 2.6, EFI Erase Block Protocol,
+  EFI_ERASE_BLOCK_PROTOCOL.EraseBlocks().
+
+  Parameter checks are shared with WriteBlocks(), in VerifyReadWriteRequest().
+  The range is split into requests of at most Dev->MaxErase bytes, which the
+  host carries out as metadata operations where it can.
+
+  A zero Size completes the token immediately, successfully.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkEraseBlocks (
+  IN     EFI_ERASE_BLOCK_PROTOCOL  *This,
+  IN     UINT32                    MediaId,
+  IN     EFI_LBA                   Lba,
+  IN OUT EFI_ERASE_BLOCK_TOKEN     *Token,
+  IN     UINTN                     Size
+  )
+{
+  VBLK_DEV    *Dev;
+  EFI_STATUS  Status;
+
+  if (Size == 0) {
+    if ((Token != NULL) && (Token->Event != NULL)) {
+      Token->TransactionStatus = EFI_SUCCESS;
+      gBS->SignalEvent (Token->Event);
+    }
+
+    return EFI_SUCCESS;
+  }
+
+  Dev    = VIRTIO_BLK_FROM_ERASE_BLOCK (This);
+  Status = VerifyReadWriteRequest (
+             &Dev->BlockIoMedia,
+             Lba,
+             Size,
+             TRUE                // RequestIsWrite
+             );
+  if (EFI_ERROR (Status)) {
+    //
+    // EraseBlocks() has no EFI_BAD_BUFFER_SIZE return value.
+    //
+    return (Status == EFI_BAD_BUFFER_SIZE) ? EFI_INVALID_PARAMETER : Status;
+  }
+
+  return AsynchronousRequest (
+           Dev,
+           Lba,
+           Size,
+           NULL,                         // Buffer
+           Dev->EraseType,               // RequestType
+           (EFI_BLOCK_IO2_TOKEN *)Token
+           );
+}
+
+/**
+
+  Device probe function for this driver.
+
+  The DXE core calls this function for any given device in order to see if the
+  driver can drive the device.
+
+  Specs relevant in the general sense:
+
+  - UEFI Spec 2.3.1 + Errata C:
+    - 6.3 Protocol Handler Services -- for accessing the underlying device
+    - 10.1 EFI Driver Binding Protocol -- for exporting ourselves
+
+  - Driver Writer's Guide for UEFI 2.3.1 v1.01:
+    - 5.1.3.4 OpenProtocol() and CloseProtocol() -- for accessing the
+      underlying device
+    - 9 Driver Binding Protocol -- for exporting ourselves
+
+  @param[in]  This                The EFI_DRIVER_BINDING_PROTOCOL object
+                                  incorporating this driver (independently of
+                                  any device).
+
+  @param[in] DeviceHandle         The device to probe.
+
+  @param[in] RemainingDevicePath  Relevant only for bus drivers, ignored.
+
+
+  @retval EFI_SUCCESS      The driver supports the device being probed.
+
+  @retval EFI_UNSUPPORTED  Based on virtio-blk discovery, we do not support
+                           the device.
+
+  @return                  Error codes from the OpenProtocol() boot service or
+                           the VirtIo protocol.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkDriverBindingSupported (
+  IN EFI_DRIVER_BINDING_PROTOCOL  *This,
+  IN EFI_HANDLE                   DeviceHandle,
+  IN EFI_DEVICE_PATH_PROTOCOL     *RemainingDevicePath
+  )
+{
+  EFI_STATUS              Status;
+  VIRTIO_DEVICE_PROTOCOL  *VirtIo;
+
+  //
+  // Attempt to open the device with the VirtIo set of interfaces. On success,
+  // the protocol is "instantiated" for the VirtIo device. Covers duplicate
+  // open attempts (EFI_ALREADY_STARTED).
+  //
+  Status = gBS->OpenProtocol (
+                  DeviceHandle,               // candidate device
+                  &gVirtioDeviceProtocolGuid, // for generic VirtIo access
+                  (VOID **)&VirtIo,           // handle to instantiate
+                  This->DriverBindingHandle,  // requestor driver identity
+                  DeviceHandle,               // ControllerHandle, according to
+                                              // the UEFI Driver Model
+                  EFI_OPEN_PROTOCOL_BY_DRIVER // get exclusive VirtIo access to
+                                              // the device; to be released
+                  );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (VirtIo->SubSystemDeviceId != VIRTIO_SUBSYSTEM_BLOCK_DEVICE) {
+    Status = EFI_UNSUPPORTED;
+  }
+
+  //
+  // We needed VirtIo access only transitorily, to see whether we support the
+  // device or not.
+  //
+  gBS->CloseProtocol (
+         DeviceHandle,
+         &gVirtioDeviceProtocolGuid,
+         This->DriverBindingHandle,
+         DeviceHandle
+         );
+  return Status;
+}
+
+/**
+
+  Allocate, map and configure one request queue of a virtio-blk device, as
+  part of virtio-0.9.5, 2.2.1 Device Initialization Sequence, step 4b-4c.
+
+  @param[in out] Dev         The driver instance being configured.
+
+  @param[in]     QueueIndex  The virtqueue to set up; the index also selects
+                             the element of Dev->Queues to populate.
+
+  @retval EFI_SUCCESS      The queue is ready; the host knows its address.
+
+  @retval EFI_UNSUPPORTED  The host offers a queue too small for a request.
+
+  @return                  Error codes from the VirtIo protocol,
+                           VirtioRingInit(), VirtioPackedRingInit(),
+                           VirtioRingMap(),
+                           VirtioRequestQueueInit(),
+                           VirtioIndirectPoolInit() or VirtioDmaSlabInit().
+
+**/
+STATIC
+EFI_STATUS
+VirtioBlkInitQueue (
+  IN OUT VBLK_DEV  *Dev,
+  IN     UINT16    QueueIndex
+  )
+{
+  VBLK_QUEUE  *Queue;
+  UINT16      QueueSize;
+  UINT64      RingBaseShift;
+  EFI_STATUS  Status;
+
+  Queue = &Dev->Queues[QueueIndex];
+
+  Status = Dev->VirtIo->SetQueueSel (Dev->VirtIo, QueueIndex);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = Dev->VirtIo->GetQueueNumMax (Dev->VirtIo, &QueueSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (QueueSize < (Dev->IndirectDesc ? 1 : 3)) {
+    // SubmitRequest() uses at least three descriptors, or one indirect one
+    return EFI_UNSUPPORTED;
+  }
+
+  //
+  // A direct chain must fit in the ring, next to the header and the status.
+  //
+  if (!Dev->IndirectDesc) {
+    Dev->SegMax = MIN (Dev->SegMax, QueueSize - 2);
+  }
+
+  if (Dev->PackedRing) {
+    Status = VirtioPackedRingInit (Dev->VirtIo, QueueSize, &Queue->Ring);
+  } else {
+    Status = VirtioRingInit (Dev->VirtIo, QueueSize, &Queue->Ring);
+  }
+
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  //
+  // If anything fails from here on, we must release the ring resources
+  //
+  Status = VirtioRingMap (
+             Dev->VirtIo,
+             &Queue->Ring,
+             &RingBaseShift,
+             &Queue->RingMap
+             );
+  if (EFI_ERROR (Status)) {
+    goto ReleaseQueue;
+  }
+
+  //
+  // Additional steps for MMIO: align the queue appropriately, and set the
+  // size. If anything fails from here on, we must unmap the ring resources.
+  //
+  Status = Dev->VirtIo->SetQueueNum (Dev->VirtIo, QueueSize);
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
+  Status = Dev->VirtIo->SetQueueAlign (Dev->VirtIo, EFI_PAGE_SIZE);
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
+  //
+  // step 4c -- Report GPFN (guest-physical frame number) of queue.
+  //
+  Status = Dev->VirtIo->SetQueueAddress (
+                          Dev->VirtIo,
+                          &Queue->Ring,
+                          RingBaseShift
+                          );
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
+  //
+  // Set up tracking of in-flight requests, now that the ring is in place.
+  //
+  Status = VirtioRequestQueueInit (&Queue->Ring, &Queue->ReqQueue);
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
+  if (Dev->EventIdx) {
+    VirtioRequestEnableEventIdx (&Queue->ReqQueue);
+  }
+
+  //
+  // One indirect table per ring descriptor: the table of a request is the one
+  // matching its (single) ring descriptor.
+  //
+  if (Dev->IndirectDesc) {
+    Status = VirtioIndirectPoolInit (
+               Dev->VirtIo,
+               QueueSize,
+               (UINT16)(Dev->SegMax + 2),
+               &Queue->Indirect
+               );
+    if (EFI_ERROR (Status)) {
+      goto UninitReqQueue;
+    }
+  }
+
+  //
+  // Request headers and status bytes for as many requests as the ring can
+  // hold.
+  //
+  Status = VirtioDmaSlabInit (
+             Dev->VirtIo,
+             QueueSize,
+             sizeof (VBLK_SHARED_REQ),
+             &Queue->ReqSlab
+             );
+  if (EFI_ERROR (Status)) {
+    goto UninitIndirect;
   }
 
-  return SynchronousRequest (
-           Dev,
-           Lba,
-           BufferSize,
-           Buffer,
-           TRUE        // RequestIsWrite
-           );
-}
-
-/**
+  return EFI_SUCCESS;
 
-  FlushBlocks() operation for virtio-blk.
+UninitIndirect:
+  if (Dev->IndirectDesc) {
+    VirtioIndirectPoolUninit (Dev->VirtIo, &Queue->Indirect);
+  }
 
-  See
-  - UEFI Spec 2.3.1 + Errata C, 12.8 EFI Block I/O Protocol, 12.8 EFI Block I/O
-    Protocol, EFI_BLOCK_IO_PROTOCOL.FlushBlocks().
-  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.4 FlushBlocks() and
-    FlushBlocksEx() Implementation.
+UninitReqQueue:
+  VirtioRequestQueueUninit (&Queue->ReqQueue);
 
-  If the underlying virtio-blk device doesn't support flushing (ie.
-  write-caching), then this function should not be called by higher layers,
-  according to EFI_BLOCK_IO_MEDIA characteristics set in VirtioBlkInit().
-  Should they do nonetheless, we do nothing, successfully.
+UnmapQueue:
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Queue->RingMap);
 
-**/
-EFI_STATUS
-EFIAPI
-VirtioBlkFlushBlocks (
-  IN EFI_BLOCK_IO_PROTOCOL  *This
-  )
-{
-  VBLK_DEV  *Dev;
+ReleaseQueue:
+  VirtioRingUninit (Dev->VirtIo, &Queue->Ring);
 
-  Dev = VIRTIO_BLK_FROM_BLOCK_IO (This);
-  return Dev->BlockIoMedia.WriteCaching ?
-         SynchronousRequest (
-           Dev,
-           0,      // Lba
-           0,      // BufferSize
-           NULL,   // Buffer
-           TRUE    // RequestIsWrite
-           ) :
-         EFI_SUCCESS;
+  return Status;
 }
 
 /**
 
-  Device probe function for this driver.
-
-  The DXE core calls this function for any given device in order to see if the
-  driver can drive the device.
-
-  Specs relevant in the general sense:
-
-  - UEFI Spec 2.3.1 + Errata C:
-    - 6.3 Protocol Handler Services -- for accessing the underlying device
-    - 10.1 EFI Driver Binding Protocol -- for exporting ourselves
-
-  - Driver Writer's Guide for UEFI 2.3.1 v1.01:
-    - 5.1.3.4 OpenProtocol() and CloseProtocol() -- for accessing the
-      underlying device
-    - 9 Driver Binding Protocol -- for exporting ourselves
-
-  @param[in]  This                The EFI_DRIVER_BINDING_PROTOCOL object
-                                  incorporating this driver (independently of
-                                  any device).
-
-  @param[in] DeviceHandle         The device to probe.
-
-  @param[in] RemainingDevicePath  Relevant only for bus drivers, ignored.
-
+  Release the resources of a request queue set up with VirtioBlkInitQueue().
 
-  @retval EFI_SUCCESS      The driver supports the device being probed.
+  The caller is responsible for resetting the device first, so that the host
+  no longer accesses the ring.
 
-  @retval EFI_UNSUPPORTED  Based on virtio-blk discovery, we do not support
-                           the device.
+  @param[in out] Dev    The driver instance owning the queue.
 
-  @return                  Error codes from the OpenProtocol() boot service or
-                           the VirtIo protocol.
+  @param[in out] Queue  The queue to release.
 
 **/
-EFI_STATUS
-EFIAPI
-VirtioBlkDriverBindingSupported (
-  IN EFI_DRIVER_BINDING_PROTOCOL  *This,
-  IN EFI_HANDLE                   DeviceHandle,
-  IN EFI_DEVICE_PATH_PROTOCOL     *RemainingDevicePath
+STATIC
+VOID
+VirtioBlkUninitQueue (
+  IN OUT VBLK_DEV    *Dev,
+  IN OUT VBLK_QUEUE  *Queue
   )
 {
-  EFI_STATUS              Status;
-  VIRTIO_DEVICE_PROTOCOL  *VirtIo;
-
-  //
-  // Attempt to open the device with the VirtIo set of interfaces. On success,
-  // the protocol is "instantiated" for the VirtIo device. Covers duplicate
-  // open attempts (EFI_ALREADY_STARTED).
-  //
-  Status = gBS->OpenProtocol (
-                  DeviceHandle,               // candidate device
-                  &gVirtioDeviceProtocolGuid, // for generic VirtIo access
-                  (VOID **)&VirtIo,           // handle to instantiate
-                  This->DriverBindingHandle,  // requestor driver identity
-                  DeviceHandle,               // ControllerHandle, according to
-                                              // the UEFI Driver Model
-                  EFI_OPEN_PROTOCOL_BY_DRIVER // get exclusive VirtIo access to
-                                              // the device; to be released
-                  );
-  if (EFI_ERROR (Status)) {
-    return Status;
-  }
+  VirtioDmaSlabUninit (Dev->VirtIo, &Queue->ReqSlab);
 
-  if (VirtIo->SubSystemDeviceId != VIRTIO_SUBSYSTEM_BLOCK_DEVICE) {
-    Status = EFI_UNSUPPORTED;
+  if (Dev->IndirectDesc) {
+    VirtioIndirectPoolUninit (Dev->VirtIo, &Queue->Indirect);
   }
 
-  //
-  // We needed VirtIo access only transitorily, to see whether we support the
-  // device or not.
-  //
-  gBS->CloseProtocol (
-         DeviceHandle,
-         &gVirtioDeviceProtocolGuid,
-         This->DriverBindingHandle,
-         DeviceHandle
-         );
-  return Status;
+  VirtioRequestQueueUninit (&Queue->ReqQueue);
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Queue->RingMap);
+  VirtioRingUninit (Dev->VirtIo, &Queue->Ring);
 }
 
 /**
@@ -698,9 +1812,10 @@ VirtioBlkDriverBindingSupported (
   @retval EFI_UNSUPPORTED  The driver is unable to work with the virtio ring or
                            virtio-blk attributes the host provides.
 
-  @return                  Error codes from VirtioRingInit() or
-                           VIRTIO_CFG_READ() / VIRTIO_CFG_WRITE or
-                           VirtioRingMap().
+  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
+
+  @return                  Error codes from VirtioBlkInitQueue() or
+                           VIRTIO_CFG_READ() / VIRTIO_CFG_WRITE.
 
 **/
 STATIC
@@ -719,12 +1834,27 @@ VirtioBlkInit (
   UINT8   PhysicalBlockExp;
   UINT8   AlignmentOffset;
   UINT32  OptIoSize;
-  UINT16  QueueSize;
-  UINT64  RingBaseShift;
+  UINT16  NumQueues;
+  UINT16  QueueIndex;
+  UINT32  SizeMax;
+  UINT32  SegMax;
+  UINT64  MaxTransfer;
+  UINT64  MaxErase;
+  UINT32  EraseSectors;
+  UINT32  EraseAlignment;
+  UINT32  EraseGranularity;
+  UINT8   MayUnmap;
 
   PhysicalBlockExp = 0;
   AlignmentOffset  = 0;
   OptIoSize        = 0;
+  NumQueues        = 1;
+  SizeMax          = 0;
+  SegMax           = 0;
+  EraseSectors     = 0;
+  EraseAlignment   = 0;
+  EraseGranularity = 1;
+  MayUnmap         = 0;
 
   //
   // Execute virtio-0.9.5, 2.2.1 Device Initialization Sequence.
@@ -819,82 +1949,174 @@ VirtioBlkInit (
     }
   }
 
-  Features &= VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_TOPOLOGY | VIRTIO_BLK_F_RO |
-              VIRTIO_BLK_F_FLUSH | VIRTIO_F_VERSION_1 |
-              VIRTIO_F_IOMMU_PLATFORM;
+  if (Features & VIRTIO_BLK_F_MQ) {
+    Status = VIRTIO_CFG_READ (Dev, NumQueues, &NumQueues);
+    if (EFI_ERROR (Status)) {
+      goto Failed;
+    }
 
-  //
-  // In virtio-1.0, feature negotiation is expected to complete before queue
-  // discovery, and the device can also reject the selected set of features.
-  //
-  if (Dev->VirtIo->Revision >= VIRTIO_SPEC_REVISION (1, 0, 0)) {
-    Status = Virtio10WriteFeatures (Dev->VirtIo, Features, &NextDevStat);
+    //
+    // Using fewer queues than the device offers is permitted; the rest stay
+    // unused.
+    //
+    NumQueues = MIN (NumQueues, PcdGet16 (PcdVirtioBlkMaxQueues));
+    NumQueues = MAX (NumQueues, 1);
+  }
+
+  if (Features & VIRTIO_BLK_F_SIZE_MAX) {
+    Status = VIRTIO_CFG_READ (Dev, SizeMax, &SizeMax);
+    if (EFI_ERROR (Status)) {
+      goto Failed;
+    }
+  }
+
+  if (Features & VIRTIO_BLK_F_SEG_MAX) {
+    Status = VIRTIO_CFG_READ (Dev, SegMax, &SegMax);
     if (EFI_ERROR (Status)) {
       goto Failed;
     }
   }
 
   //
-  // step 4b -- allocate virtqueue
-  //
-  Status = Dev->VirtIo->SetQueueSel (Dev->VirtIo, 0);
-  if (EFI_ERROR (Status)) {
-    goto Failed;
+  // Without SIZE_MAX, a segment is only bounded by the 1 GB request limit;
+  // without SEG_MAX, the data goes in a single segment. VirtioBlkInitQueue()
+  // may lower Dev->SegMax further to fit the ring.
+  //
+  Dev->SizeMax = (SizeMax == 0) ? SIZE_1GB : MIN (SizeMax, SIZE_1GB);
+  Dev->SegMax  = (UINT16)MIN (MAX (SegMax, 1), VBLK_MAX_SEGMENTS);
+
+  //
+  // Erase with write zeroes if possible, so that the range reads back as
+  // zeroes; the host may deallocate the range meanwhile if it can still
+  // guarantee that. Otherwise fall back to discard. Either way, each request
+  // carries a single range, so the segment limits are irrelevant. A zero
+  // Dev->EraseType means that erasing is not supported, which is always the
+  // case for a read-only device.
+  //
+  Dev->EraseType = 0;
+  if ((Features & VIRTIO_BLK_F_RO) == 0) {
+    if ((Features & VIRTIO_BLK_F_WRITE_ZEROES) != 0) {
+      Status = VIRTIO_CFG_READ (Dev, MaxWriteZeroesSectors, &EraseSectors);
+      if (EFI_ERROR (Status)) {
+        goto Failed;
+      }
+
+      Status = VIRTIO_CFG_READ (Dev, WriteZeroesMayUnmap, &MayUnmap);
+      if (EFI_ERROR (Status)) {
+        goto Failed;
+      }
+
+      Dev->EraseType  = VIRTIO_BLK_T_WRITE_ZEROES;
+      Dev->EraseFlags = (MayUnmap != 0) ? VIRTIO_BLK_WRITE_ZEROES_F_UNMAP : 0;
+    } else if ((Features & VIRTIO_BLK_F_DISCARD) != 0) {
+      Status = VIRTIO_CFG_READ (Dev, MaxDiscardSectors, &EraseSectors);
+      if (EFI_ERROR (Status)) {
+        goto Failed;
+      }
+
+      Status = VIRTIO_CFG_READ (Dev, DiscardSectorAlignment, &EraseAlignment);
+      if (EFI_ERROR (Status)) {
+        goto Failed;
+      }
+
+      Dev->EraseType  = VIRTIO_BLK_T_DISCARD;
+      Dev->EraseFlags = 0;
+    }
   }
 
-  Status = Dev->VirtIo->GetQueueNumMax (Dev->VirtIo, &QueueSize);
-  if (EFI_ERROR (Status)) {
-    goto Failed;
+  if (Dev->EraseType != 0) {
+    //
+    // Keep each request a multiple of the erase granularity (in logical
+    // blocks), and its byte count representable in UINT32.
+    //
+    EraseGranularity = (UINT32)DivU64x32 (MultU64x32 (EraseAlignment, 512), BlockSize);
+    EraseGranularity = MAX (EraseGranularity, 1);
+    MaxErase         = MIN (MultU64x32 (EraseSectors, 512), MAX_UINT32);
+    MaxErase        -= ModU64x32 (MaxErase, EraseGranularity * BlockSize);
+    Dev->MaxErase    = (UINT32)MaxErase;
+    if (Dev->MaxErase == 0) {
+      Dev->EraseType = 0;
+    }
   }
 
-  if (QueueSize < 3) {
-    // SynchronousRequest() uses at most three descriptors
-    Status = EFI_UNSUPPORTED;
-    goto Failed;
+  Features &= VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_TOPOLOGY | VIRTIO_BLK_F_RO |
+              VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_MQ | VIRTIO_BLK_F_SIZE_MAX |
+              VIRTIO_BLK_F_SEG_MAX | VIRTIO_F_RING_INDIRECT_DESC |
+              VIRTIO_F_RING_EVENT_IDX | VIRTIO_F_VERSION_1 |
+              VIRTIO_F_IOMMU_PLATFORM | VIRTIO_F_RING_PACKED;
+
+  //
+  // The packed ring needs a virtio-1.0 transport, which reports the
+  // descriptor, driver and device areas separately. VirtioLib builds indirect
+  // tables in the split format only, so the packed ring, when available, takes
+  // precedence over indirect descriptors.
+  //
+  if (Dev->VirtIo->Revision < VIRTIO_SPEC_REVISION (1, 0, 0)) {
+    Features &= ~(UINT64)VIRTIO_F_RING_PACKED;
   }
 
-  Status = VirtioRingInit (Dev->VirtIo, QueueSize, &Dev->Ring);
-  if (EFI_ERROR (Status)) {
-    goto Failed;
+  if (Features & VIRTIO_F_RING_PACKED) {
+    Features &= ~(UINT64)VIRTIO_F_RING_INDIRECT_DESC;
+  }
+
+  if (Dev->EraseType == VIRTIO_BLK_T_WRITE_ZEROES) {
+    Features |= VIRTIO_BLK_F_WRITE_ZEROES;
+  } else if (Dev->EraseType == VIRTIO_BLK_T_DISCARD) {
+    Features |= VIRTIO_BLK_F_DISCARD;
   }
 
+  Dev->PackedRing   = (BOOLEAN)((Features & VIRTIO_F_RING_PACKED) != 0);
+  Dev->IndirectDesc = (BOOLEAN)((Features & VIRTIO_F_RING_INDIRECT_DESC) != 0);
+  Dev->EventIdx     = (BOOLEAN)((Features & VIRTIO_F_RING_EVENT_IDX) != 0);
+
   //
-  // If anything fails from here on, we must release the ring resources
+  // In virtio-1.0, feature negotiation is expected to complete before queue
+  // discovery, and the device can also reject the selected set of features.
   //
-  Status = VirtioRingMap (
-             Dev->VirtIo,
-             &Dev->Ring,
-             &RingBaseShift,
-             &Dev->RingMap
-             );
-  if (EFI_ERROR (Status)) {
-    goto ReleaseQueue;
+  if (Dev->VirtIo->Revision >= VIRTIO_SPEC_REVISION (1, 0, 0)) {
+    Status = Virtio10WriteFeatures (Dev->VirtIo, Features, &NextDevStat);
+    if (EFI_ERROR (Status)) {
+      goto Failed;
+    }
   }
 
   //
-  // Additional steps for MMIO: align the queue appropriately, and set the
-  // size. If anything fails from here on, we must unmap the ring resources.
+  // step 4b, 4c -- allocate and report the virtqueues
   //
-  Status = Dev->VirtIo->SetQueueNum (Dev->VirtIo, QueueSize);
-  if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+  Dev->Queues = AllocateZeroPool (NumQueues * sizeof *Dev->Queues);
+  if (Dev->Queues == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto Failed;
   }
 
-  Status = Dev->VirtIo->SetQueueAlign (Dev->VirtIo, EFI_PAGE_SIZE);
-  if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+  for (QueueIndex = 0; QueueIndex < NumQueues; QueueIndex++) {
+    Status = VirtioBlkInitQueue (Dev, QueueIndex);
+    if (EFI_ERROR (Status)) {
+      goto UninitQueues;
+    }
   }
 
+  Dev->NumQueues = NumQueues;
+  VirtioRequestQueueSetInit (
+    &Dev->Requests,
+    &Dev->Queues[0].ReqQueue,
+    sizeof *Dev->Queues,
+    NumQueues,
+    &Dev->WaitPolicy,
+    CompleteRequest,
+    Dev
+    );
+
   //
-  // step 4c -- Report GPFN (guest-physical frame number) of queue.
+  // Larger transfers are split by SubmitIo(). Keep requests whole blocks, and
+  // within the 1 GB that virtio-0.9.5, 2.3.2 allows for a descriptor chain.
   //
-  Status = Dev->VirtIo->SetQueueAddress (
-                          Dev->VirtIo,
-                          &Dev->Ring,
-                          RingBaseShift
-                          );
-  if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+  MaxTransfer      = MultU64x32 (Dev->SizeMax, Dev->SegMax);
+  MaxTransfer      = MIN (MaxTransfer, SIZE_1GB);
+  Dev->MaxTransfer = (UINT32)MaxTransfer - (UINT32)MaxTransfer % BlockSize;
+  if (Dev->MaxTransfer == 0) {
+    Status = EFI_UNSUPPORTED;
+    goto UninitQueues;
   }
 
   //
@@ -904,7 +2126,7 @@ VirtioBlkInit (
     Features &= ~(UINT64)(VIRTIO_F_VERSION_1 | VIRTIO_F_IOMMU_PLATFORM);
     Status    = Dev->VirtIo->SetGuestFeatures (Dev->VirtIo, Features);
     if (EFI_ERROR (Status)) {
-      goto UnmapQueue;
+      goto UninitQueues;
     }
   }
 
@@ -914,7 +2136,7 @@ VirtioBlkInit (
   NextDevStat |= VSTAT_DRIVER_OK;
   Status       = Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, NextDevStat);
   if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+    goto UninitQueues;
   }
 
   //
@@ -940,12 +2162,56 @@ VirtioBlkInit (
                                          BlockSize / 512
                                          ) - 1;
 
+  //
+  // The Block I/O 2 interface shares the media with the Block I/O interface.
+  //
+  Dev->BlockIo2.Media         = &Dev->BlockIoMedia;
+  Dev->BlockIo2.Reset         = &VirtioBlkResetEx;
+  Dev->BlockIo2.ReadBlocksEx  = &VirtioBlkReadBlocksEx;
+  Dev->BlockIo2.WriteBlocksEx = &VirtioBlkWriteBlocksEx;
+  Dev->BlockIo2.FlushBlocksEx = &VirtioBlkFlushBlocksEx;
+
+  if (Dev->EraseType != 0) {
+    Dev->EraseBlock.Revision               = EFI_ERASE_BLOCK_PROTOCOL_REVISION;
+    Dev->EraseBlock.EraseLengthGranularity = EraseGranularity;
+    Dev->EraseBlock.EraseBlocks            = &VirtioBlkEraseBlocks;
+
+    DEBUG ((
+      DEBUG_INFO,
+      "%a: EraseType=%u EraseFlags=0x%x MaxErase=0x%x[B] Granularity=0x%x[Lba]\n",
+      __FUNCTION__,
+      Dev->EraseType,
+      Dev->EraseFlags,
+      Dev->MaxErase,
+      EraseGranularity
+      ));
+  }
+
+  VirtioWaitPolicyInit (&Dev->WaitPolicy, PcdGet32 (PcdVirtioPollSpinUsecs));
+
+  //
+  // Read-ahead only pays off if it fetches several blocks at once. It is an
+  // optimization, so do without it if memory is short.
+  //
+  Dev->ReadAhead.Size  = PcdGet32 (PcdVirtioBlkReadAheadSize);
+  Dev->ReadAhead.Size -= Dev->ReadAhead.Size % BlockSize;
+  if (Dev->ReadAhead.Size / BlockSize >= 2) {
+    Dev->ReadAhead.Buffer = AllocatePool (Dev->ReadAhead.Size);
+  }
+
+  if (Dev->ReadAhead.Buffer == NULL) {
+    Dev->ReadAhead.Size = 0;
+  }
+
   DEBUG ((
     DEBUG_INFO,
-    "%a: LbaSize=0x%x[B] NumBlocks=0x%Lx[Lba]\n",
+    "%a: LbaSize=0x%x[B] NumBlocks=0x%Lx[Lba] NumQueues=%u MaxTransfer=0x%x[B] ReadAhead=0x%x[B]\n",
     __FUNCTION__,
     Dev->BlockIoMedia.BlockSize,
-    Dev->BlockIoMedia.LastBlock + 1
+    Dev->BlockIoMedia.LastBlock + 1,
+    Dev->NumQueues,
+    Dev->MaxTransfer,
+    Dev->ReadAhead.Size
     ));
 
   if (Features & VIRTIO_BLK_F_TOPOLOGY) {
@@ -972,11 +2238,15 @@ VirtioBlkInit (
 
   return EFI_SUCCESS;
 
-UnmapQueue:
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
+UninitQueues:
+  while (QueueIndex > 0) {
+    QueueIndex--;
+    VirtioBlkUninitQueue (Dev, &Dev->Queues[QueueIndex]);
+  }
 
-ReleaseQueue:
-  VirtioRingUninit (Dev->VirtIo, &Dev->Ring);
+  FreePool (Dev->Queues);
+  Dev->Queues    = NULL;
+  Dev->NumQueues = 0;
 
 Failed:
   //
@@ -1004,6 +2274,8 @@ VirtioBlkUninit (
   IN OUT VBLK_DEV  *Dev
   )
 {
+  UINT16  QueueIndex;
+
   //
   // Reset the virtual device -- see virtio-0.9.5, 2.2.2.1 Device Status. When
   // VIRTIO_CFG_WRITE() returns, the host will have learned to stay away from
@@ -1011,11 +2283,26 @@ VirtioBlkUninit (
   //
   Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, 0);
 
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
-  VirtioRingUninit (Dev->VirtIo, &Dev->Ring);
+  for (QueueIndex = 0; QueueIndex < Dev->NumQueues; QueueIndex++) {
+    VirtioBlkUninitQueue (Dev, &Dev->Queues[QueueIndex]);
+  }
+
+  FreePool (Dev->Queues);
+  Dev->Queues    = NULL;
+  Dev->NumQueues = 0;
 
+  VirtioWaitPolicyLogStats (__FUNCTION__, &Dev->WaitPolicy);
+  ReadAheadLogStats (__FUNCTION__, Dev);
+
+  if (Dev->ReadAhead.Buffer != NULL) {
+    FreePool (Dev->ReadAhead.Buffer);
+  }
+
+  SetMem (&Dev->ReadAhead, sizeof Dev->ReadAhead, 0x00);
   SetMem (&Dev->BlockIo, sizeof Dev->BlockIo, 0x00);
+  SetMem (&Dev->BlockIo2, sizeof Dev->BlockIo2, 0x00);
   SetMem (&Dev->BlockIoMedia, sizeof Dev->BlockIoMedia, 0x00);
+  SetMem (&Dev->EraseBlock, sizeof Dev->EraseBlock, 0x00);
 }
 
 /**
@@ -1047,6 +2334,11 @@ VirtioBlkExitBoot (
   //
   Dev = Context;
   Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, 0);
+
+  //
+  // The OS owns the disk from now on; whatever we cached may go stale.
+  //
+  ReadAheadInvalidate (Dev);
 }
 
 /**
@@ -1068,13 +2360,15 @@ VirtioBlkExitBoot (
 
   @retval EFI_SUCCESS           Driver instance has been created and
                                 initialized  for the virtio-blk device, it
-                                is now accessible via EFI_BLOCK_IO_PROTOCOL.
+                                is now accessible via EFI_BLOCK_IO_PROTOCOL
+                                and EFI_BLOCK_IO2_PROTOCOL.
 
   @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
 
   @return                       Error codes from the OpenProtocol() boot
                                 service, the VirtIo protocol, VirtioBlkInit(),
-                                or the InstallProtocolInterface() boot service.
+                                or the InstallMultipleProtocolInterfaces()
+                                boot service.
 
 **/
 EFI_STATUS
@@ -1125,21 +2419,67 @@ VirtioBlkDriverBindingStart (
   }
 
   //
-  // Setup complete, attempt to export the driver instance's BlockIo interface.
+  // Completions of non-blocking requests are reaped periodically, while any
+  // are in flight.
+  //
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_NOTIFY,
+                  &VirtioBlkPollTimer,
+                  Dev,
+                  &Dev->PollTimer
+                  );
+  if (EFI_ERROR (Status)) {
+    goto CloseExitBoot;
+  }
+
+  VirtioRequestPollTimerInit (&Dev->Requests, Dev->PollTimer, VBLK_POLL_PERIOD);
+
+  //
+  // Setup complete, attempt to export the driver instance's BlockIo and
+  // BlockIo2 interfaces, plus the EraseBlock interface if the device can
+  // erase.
   //
   Dev->Signature = VBLK_SIG;
-  Status         = gBS->InstallProtocolInterface (
+  Status         = gBS->InstallMultipleProtocolInterfaces (
                           &DeviceHandle,
                           &gEfiBlockIoProtocolGuid,
-                          EFI_NATIVE_INTERFACE,
-                          &Dev->BlockIo
+                          &Dev->BlockIo,
+                          &gEfiBlockIo2ProtocolGuid,
+                          &Dev->BlockIo2,
+                          NULL
                           );
   if (EFI_ERROR (Status)) {
-    goto CloseExitBoot;
+    goto ClosePollTimer;
+  }
+
+  if (Dev->EraseBlock.EraseBlocks != NULL) {
+    Status = gBS->InstallProtocolInterface (
+                    &DeviceHandle,
+                    &gEfiEraseBlockProtocolGuid,
+                    EFI_NATIVE_INTERFACE,
+                    &Dev->EraseBlock
+                    );
+    if (EFI_ERROR (Status)) {
+      goto UninstallBlockIo;
+    }
   }
 
   return EFI_SUCCESS;
 
+UninstallBlockIo:
+  gBS->UninstallMultipleProtocolInterfaces (
+         DeviceHandle,
+         &gEfiBlockIoProtocolGuid,
+         &Dev->BlockIo,
+         &gEfiBlockIo2ProtocolGuid,
+         &Dev->BlockIo2,
+         NULL
+         );
+
+ClosePollTimer:
+  gBS->CloseEvent (Dev->PollTimer);
+
 CloseExitBoot:
   gBS->CloseEvent (Dev->ExitBoot);
 
@@ -1162,7 +2502,8 @@ FreeVirtioBlk:
 
 /**
 
-  Stop driving a virtio-blk device and remove its BlockIo interface.
+  Stop driving a virtio-blk device and remove its BlockIo and BlockIo2
+  interfaces.
 
   This function replays the success path of DriverBindingStart() in reverse.
   The host side virtio-blk device is reset, so that the OS boot loader or the
@@ -1194,6 +2535,7 @@ VirtioBlkDriverBindingStop (
   EFI_STATUS             Status;
   EFI_BLOCK_IO_PROTOCOL  *BlockIo;
   VBLK_DEV               *Dev;
+  EFI_TPL                OldTpl;
 
   Status = gBS->OpenProtocol (
                   DeviceHandle,                  // candidate device
@@ -1212,15 +2554,47 @@ VirtioBlkDriverBindingStop (
   //
   // Handle Stop() requests for in-use driver instances gracefully.
   //
-  Status = gBS->UninstallProtocolInterface (
+  if (Dev->EraseBlock.EraseBlocks != NULL) {
+    Status = gBS->UninstallProtocolInterface (
+                    DeviceHandle,
+                    &gEfiEraseBlockProtocolGuid,
+                    &Dev->EraseBlock
+                    );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  Status = gBS->UninstallMultipleProtocolInterfaces (
                   DeviceHandle,
                   &gEfiBlockIoProtocolGuid,
-                  &Dev->BlockIo
+                  &Dev->BlockIo,
+                  &gEfiBlockIo2ProtocolGuid,
+                  &Dev->BlockIo2,
+                  NULL
                   );
   if (EFI_ERROR (Status)) {
+    if (Dev->EraseBlock.EraseBlocks != NULL) {
+      gBS->InstallProtocolInterface (
+             &DeviceHandle,
+             &gEfiEraseBlockProtocolGuid,
+             EFI_NATIVE_INTERFACE,
+             &Dev->EraseBlock
+             );
+    }
+
     return Status;
   }
 
+  //
+  // Complete any non-blocking requests still in flight, and signal their
+  // tokens, before the ring goes away. This also cancels the poll timer.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  VirtioRequestDrain (&Dev->Requests, OldTpl);
+  gBS->RestoreTPL (OldTpl);
+  gBS->CloseEvent (Dev->PollTimer);
+
   gBS->CloseEvent (Dev->ExitBoot);
 
   VirtioBlkUninit (Dev);
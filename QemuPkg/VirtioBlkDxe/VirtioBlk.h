@@ -13,12 +13,71 @@
 #define _VIRTIO_BLK_DXE_H_
 
 #include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
 #include <Protocol/ComponentName.h>
 #include <Protocol/DriverBinding.h>
+#include <Protocol/EraseBlock.h>
 
-#include <IndustryStandard/Virtio.h>
+#include <IndustryStandard/VirtioBlk.h>
+#include <Library/VirtioLib.h>
 
-#define VBLK_SIG  SIGNATURE_32 ('V', 'B', 'L', 'K')
+#define VBLK_SIG      SIGNATURE_32 ('V', 'B', 'L', 'K')
+#define VBLK_REQ_SIG  SIGNATURE_32 ('V', 'B', 'R', 'Q')
+#define VBLK_IO_SIG   SIGNATURE_32 ('V', 'B', 'I', 'O')
+
+//
+// Period of the timer event that reaps completed non-blocking requests, in
+// 100ns units.
+//
+#define VBLK_POLL_PERIOD  EFI_TIMER_PERIOD_MILLISECONDS (1)
+
+//
+// The most data segments we place in one request, if the device limits the
+// segment size (VIRTIO_BLK_F_SIZE_MAX). The descriptor chain of a request is
+// header, data segments, status.
+//
+#define VBLK_MAX_SEGMENTS  32
+
+//
+// One virtio-blk request queue, with the tracking of its in-flight requests.
+//
+typedef struct {
+  //
+  //                     field                    init function       init dpth
+  //                     ---------------------    ------------------  ---------
+  VRING                   Ring;                // VirtioRingInit      3
+  VOID                    *RingMap;            // VirtioRingMap       3
+  VIRTIO_REQUEST_QUEUE    ReqQueue;            // VirtioBlkInitQueue  2
+  VIRTIO_INDIRECT_POOL    Indirect;            // VirtioBlkInitQueue  2
+  VIRTIO_DMA_SLAB         ReqSlab;             // VirtioBlkInitQueue  2
+} VBLK_QUEUE;
+
+//
+// The parts of a request that the host accesses, apart from the data buffer.
+// They are taken from VBLK_QUEUE.ReqSlab, which is mapped once for the
+// lifetime of the queue.
+//
+typedef struct {
+  VIRTIO_BLK_REQ                     Request;
+  VIRTIO_BLK_DISCARD_WRITE_ZEROES    Range;     // discard / write zeroes only
+  UINT8                              HostStatus;
+} VBLK_SHARED_REQ;
+
+//
+// Read-ahead cache of the blocking ReadBlocks() interface. Buffer holds
+// Length bytes of the disk, starting at block Lba.
+//
+typedef struct {
+  UINT8      *Buffer;    // NULL if read-ahead is disabled
+  UINT32     Size;       // capacity of Buffer, in bytes
+  EFI_LBA    Lba;
+  UINTN      Length;
+  EFI_LBA    NextLba;    // where a sequential read would continue
+  UINT32     Generation; // bumped whenever the disk contents change
+  BOOLEAN    Filling;    // Buffer is being filled from the disk
+  UINT64     Hits;
+  UINT64     Misses;
+} VBLK_READ_AHEAD;
 
 typedef struct {
   //
@@ -31,15 +90,67 @@ typedef struct {
   UINT32                    Signature;         // DriverBindingStart  0
   VIRTIO_DEVICE_PROTOCOL    *VirtIo;           // DriverBindingStart  0
   EFI_EVENT                 ExitBoot;          // DriverBindingStart  0
-  VRING                     Ring;              // VirtioRingInit      2
+  EFI_EVENT                 PollTimer;         // DriverBindingStart  0
+  BOOLEAN                   IndirectDesc;      // VirtioBlkInit       1
+  BOOLEAN                   PackedRing;        // VirtioBlkInit       1
+  BOOLEAN                   EventIdx;          // VirtioBlkInit       1
+  UINT16                    SegMax;            // VirtioBlkInit       1
+  UINT32                    SizeMax;           // VirtioBlkInit       1
+  UINT32                    MaxTransfer;       // VirtioBlkInit       1
+  UINT32                    EraseType;         // VirtioBlkInit       1
+  UINT32                    EraseFlags;        // VirtioBlkInit       1
+  UINT32                    MaxErase;          // VirtioBlkInit       1
+  UINT16                    NumQueues;         // VirtioBlkInit       1
+  VBLK_QUEUE                *Queues;           // VirtioBlkInit       1
+  VIRTIO_REQUEST_QUEUE_SET  Requests;          // VirtioBlkInit       1
   EFI_BLOCK_IO_PROTOCOL     BlockIo;           // VirtioBlkInit       1
+  EFI_BLOCK_IO2_PROTOCOL    BlockIo2;          // VirtioBlkInit       1
   EFI_BLOCK_IO_MEDIA        BlockIoMedia;      // VirtioBlkInit       1
-  VOID                      *RingMap;          // VirtioRingMap       2
+  EFI_ERASE_BLOCK_PROTOCOL  EraseBlock;        // VirtioBlkInit       1
+  VIRTIO_WAIT_POLICY        WaitPolicy;        // VirtioBlkInit       1
+  VBLK_READ_AHEAD           ReadAhead;         // VirtioBlkInit       1
 } VBLK_DEV;
 
 #define VIRTIO_BLK_FROM_BLOCK_IO(BlockIoPointer) \
         CR (BlockIoPointer, VBLK_DEV, BlockIo, VBLK_SIG)
 
+#define VIRTIO_BLK_FROM_BLOCK_IO2(BlockIo2Pointer) \
+        CR (BlockIo2Pointer, VBLK_DEV, BlockIo2, VBLK_SIG)
+
+#define VIRTIO_BLK_FROM_ERASE_BLOCK(EraseBlockPointer) \
+        CR (EraseBlockPointer, VBLK_DEV, EraseBlock, VBLK_SIG)
+
+//
+// Tracking structure for one Block I/O (2) read / write / flush call, or
+// Erase Block call. A transfer larger than VBLK_DEV.MaxTransfer (an erase
+// larger than VBLK_DEV.MaxErase) is carried out as several VBLK_REQ requests
+// in flight at the same time; the call completes when the last of them does.
+//
+typedef struct {
+  UINT32                 Signature;
+  EFI_BLOCK_IO2_TOKEN    *Token;  // NULL for blocking calls; may also be an
+                                  // EFI_ERASE_BLOCK_TOKEN
+  UINTN                  Pending; // requests in flight, plus one while
+                                  // submitting
+  EFI_STATUS             Status;  // first error, or EFI_SUCCESS
+} VBLK_IO;
+
+//
+// Tracking structure for one virtio-blk request that has been submitted to
+// the host. Its address is the token of the descriptor chain in the ReqQueue
+// of VBLK_DEV.Queues[QueueIndex].
+//
+typedef struct {
+  UINT32                     Signature;
+  VBLK_IO                    *Io;
+  UINT16                     QueueIndex;
+  BOOLEAN                    RequestIsWrite;
+  UINTN                      BufferSize;
+  volatile VBLK_SHARED_REQ   *Shared;         // in VBLK_QUEUE.ReqSlab
+  EFI_PHYSICAL_ADDRESS       SharedDeviceAddress;
+  VOID                       *BufferMapping;
+} VBLK_REQ;
+
 /**
 
   Device probe function for this driver.
@@ -244,6 +355,115 @@ VirtioBlkFlushBlocks (
   IN EFI_BLOCK_IO_PROTOCOL  *This
   );
 
+//
+// UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol
+// Driver Writer's Guide for UEFI 2.3.1 v1.01,
+//   24.3 Block I/O 2 Protocol Implementations
+//
+EFI_STATUS
+EFIAPI
+VirtioBlkResetEx (
+  IN EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN BOOLEAN                 ExtendedVerification
+  );
+
+/**
+
+  ReadBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.ReadBlocksEx().
+  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.2. ReadBlocks() and
+    ReadBlocksEx() Implementation.
+
+  If Token is NULL, or Token->Event is NULL, the request is blocking, as with
+  ReadBlocks(). Otherwise the request is queued to the host, and Token->Event
+  is signaled from a periodic timer event once the host completes it.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkReadBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  OUT    VOID                    *Buffer
+  );
+
+/**
+
+  WriteBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.WriteBlocksEx().
+  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.3 WriteBlocks() and
+    WriteBlockEx() Implementation.
+
+  Blocking and non-blocking operation is selected as in
+  VirtioBlkReadBlocksEx().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkWriteBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN     UINT32                  MediaId,
+  IN     EFI_LBA                 Lba,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token,
+  IN     UINTN                   BufferSize,
+  IN     VOID                    *Buffer
+  );
+
+/**
+
+  FlushBlocksEx() operation for virtio-blk.
+
+  See
+  - UEFI Spec 2.3.1 + Errata C, 12.9 EFI Block I/O 2 Protocol,
+    EFI_BLOCK_IO2_PROTOCOL.FlushBlocksEx().
+  - Driver Writer's Guide for UEFI 2.3.1 v1.01, 24.2.4 FlushBlocks() and
+    FlushBlocksEx() Implementation.
+
+  All requests in flight are completed before the flush is submitted, so
+  that the flush covers every write queued earlier.
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkFlushBlocksEx (
+  IN     EFI_BLOCK_IO2_PROTOCOL  *This,
+  IN OUT EFI_BLOCK_IO2_TOKEN     *Token
+  );
+
+/**
+
+  EraseBlocks() operation for virtio-blk.
+
+  See UEFI Spec 2.6, EFI Erase Block Protocol,
+  EFI_ERASE_BLOCK_PROTOCOL.EraseBlocks().
+
+  The range is erased with VIRTIO_BLK_T_WRITE_ZEROES requests if the device
+  supports them, so that it reads back as zeroes; otherwise with
+  VIRTIO_BLK_T_DISCARD requests, after which its contents are up to the host.
+
+  Blocking and non-blocking operation is selected as in
+  VirtioBlkReadBlocksEx().
+
+**/
+EFI_STATUS
+EFIAPI
+VirtioBlkEraseBlocks (
+  IN     EFI_ERASE_BLOCK_PROTOCOL  *This,
+  IN     UINT32                    MediaId,
+  IN     EFI_LBA                   Lba,
+  IN OUT EFI_ERASE_BLOCK_TOKEN     *Token,
+  IN     UINTN                     Size
+  );
+
 //
 // The purpose of the following scaffolding (EFI_COMPONENT_NAME_PROTOCOL and
 // EFI_COMPONENT_NAME2_PROTOCOL implementation) is to format the driver's name
@@ -41,6 +41,8 @@
                                     host, the current link status is stored in
                                     *MediaPresent. Otherwise MediaPresent is
                                     unused.
+  param[out] OffloadCapabilities    The VIRTIO_NET_OFFLOAD_* capabilities that
+                                    the host offers features for.
 
   @retval EFI_UNSUPPORTED           The host doesn't supply a MAC address.
   @return                           Status codes from VirtIo protocol members.
@@ -53,7 +55,8 @@ VirtioNetGetFeatures (
   IN OUT  VNET_DEV         *Dev,
   OUT     EFI_MAC_ADDRESS  *MacAddress,
   OUT     BOOLEAN          *MediaPresentSupported,
-  OUT     BOOLEAN          *MediaPresent
+  OUT     BOOLEAN          *MediaPresent,
+  OUT     UINT32           *OffloadCapabilities
   )
 {
   EFI_STATUS  Status;
@@ -128,6 +131,28 @@ VirtioNetGetFeatures (
     *MediaPresent = (BOOLEAN)((LinkStatus & VIRTIO_NET_S_LINK_UP) != 0);
   }
 
+  //
+  // Checksum and segmentation offloads; VirtioNetInitialize() negotiates the
+  // same set.
+  //
+  Features             = VirtioNetOffloadFeatures (Features);
+  *OffloadCapabilities = 0;
+  if ((Features & VIRTIO_NET_F_CSUM) != 0) {
+    *OffloadCapabilities |= VIRTIO_NET_OFFLOAD_TX_CSUM;
+  }
+
+  if ((Features & VIRTIO_NET_F_HOST_TSO4) != 0) {
+    *OffloadCapabilities |= VIRTIO_NET_OFFLOAD_TSO4;
+  }
+
+  if ((Features & VIRTIO_NET_F_HOST_TSO6) != 0) {
+    *OffloadCapabilities |= VIRTIO_NET_OFFLOAD_TSO6;
+  }
+
+  if ((Features & VIRTIO_NET_F_GUEST_CSUM) != 0) {
+    *OffloadCapabilities |= VIRTIO_NET_OFFLOAD_RX_CSUM;
+  }
+
 YieldDevice:
   Dev->VirtIo->SetDeviceStatus (
                  Dev->VirtIo,
@@ -229,12 +254,25 @@ VirtioNetSnpPopulate (
              Dev,
              &Dev->Snm.CurrentAddress,
              &Dev->Snm.MediaPresentSupported,
-             &Dev->Snm.MediaPresent
+             &Dev->Snm.MediaPresent,
+             &Dev->Offload.Capabilities
              );
   if (EFI_ERROR (Status)) {
     goto CloseWaitForPacket;
   }
 
+  //
+  // With TSO, a packet may carry up to 64KB of IP payload.
+  //
+  Dev->Offload.MaxTransmitSize = Dev->Snm.MediaHeaderSize +
+                                 (((Dev->Offload.Capabilities &
+                                    (VIRTIO_NET_OFFLOAD_TSO4 |
+                                     VIRTIO_NET_OFFLOAD_TSO6)) != 0) ?
+                                  MAX_UINT16 :
+                                  Dev->Snm.MaxPacketSize);
+  Dev->Offload.Transmit = &VirtioNetOffloadTransmit;
+  Dev->Offload.Receive  = &VirtioNetOffloadReceive;
+
   CopyMem (
     &Dev->Snm.PermanentAddress,
     &Dev->Snm.CurrentAddress,
@@ -531,6 +569,8 @@ VirtioNetDriverBindingStart (
                   &Dev->MacHandle,
                   &gEfiSimpleNetworkProtocolGuid,
                   &Dev->Snp,
+                  &gVirtioNetOffloadProtocolGuid,
+                  &Dev->Offload,
                   &gEfiDevicePathProtocolGuid,
                   Dev->MacDevicePath,
                   NULL
@@ -562,6 +602,8 @@ UninstallMultiple:
          Dev->MacHandle,
          &gEfiDevicePathProtocolGuid,
          Dev->MacDevicePath,
+         &gVirtioNetOffloadProtocolGuid,
+         &Dev->Offload,
          &gEfiSimpleNetworkProtocolGuid,
          &Dev->Snp,
          NULL
@@ -675,6 +717,8 @@ VirtioNetDriverBindingStop (
              Dev->MacHandle,
              &gEfiDevicePathProtocolGuid,
              Dev->MacDevicePath,
+             &gVirtioNetOffloadProtocolGuid,
+             &Dev->Offload,
              &gEfiSimpleNetworkProtocolGuid,
              &Dev->Snp,
              NULL
@@ -2,7 +2,8 @@
 
   Implements
   - the SNM.WaitForPacket EVT_NOTIFY_WAIT event,
-  - the EVT_SIGNAL_EXIT_BOOT_SERVICES event
+  - the EVT_SIGNAL_EXIT_BOOT_SERVICES event,
+  - the TX flush EVT_TIMER event
   for the virtio-net driver.
 
   Copyright (C) 2013, Red Hat, Inc.
@@ -83,3 +84,30 @@ VirtioNetExitBoot (
     Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, 0);
   }
 }
+
+/**
+  Flush the TX packets that have been queued, but not exposed to the host,
+  when the window that started with the first of them expires.
+
+  @param  Event                 The TX flush timer.
+  @param  Context               The VNET_DEV driver instance.
+
+**/
+VOID
+EFIAPI
+VirtioNetTxFlushTimer (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  //
+  // This callback runs at TPL_CALLBACK, like the SNP and offload protocol
+  // member functions, so it cannot interrupt them.
+  //
+  VNET_DEV  *Dev;
+
+  Dev = Context;
+  if (Dev->Snm.State == EfiSimpleNetworkInitialized) {
+    VirtioNetFlushTx (Dev);
+  }
+}
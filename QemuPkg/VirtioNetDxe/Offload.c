@@ -0,0 +1,138 @@
+/** @file
+
+  Implementation of the VIRTIO_NET_OFFLOAD_PROTOCOL member functions.
+
+  Copyright (c) Microsoft Corporation.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "VirtioNet.h"
+
+/**
+  Place a packet, with offload requests, in the transmit queue.
+
+  See VIRTIO_NET_OFFLOAD_TRANSMIT in <Protocol/VirtioNetOffload.h> for the
+  interface documentation.
+**/
+EFI_STATUS
+EFIAPI
+VirtioNetOffloadTransmit (
+  IN VIRTIO_NET_OFFLOAD_PROTOCOL  *This,
+  IN CONST VIRTIO_NET_REQ         *Offload,
+  IN UINTN                        BufferSize,
+  IN VOID                         *Buffer
+  )
+{
+  VNET_DEV    *Dev;
+  EFI_TPL     OldTpl;
+  EFI_STATUS  Status;
+  UINT32      Required;
+  UINTN       MaxSize;
+
+  if ((This == NULL) || (Offload == NULL) || (Buffer == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Dev = VIRTIO_NET_FROM_OFFLOAD (This);
+
+  //
+  // Collect the capabilities that the request depends on.
+  //
+  if ((Offload->Flags & ~VIRTIO_NET_HDR_F_NEEDS_CSUM) != 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Required = 0;
+  MaxSize  = Dev->Snm.MediaHeaderSize + Dev->Snm.MaxPacketSize;
+  if ((Offload->Flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) != 0) {
+    Required |= VIRTIO_NET_OFFLOAD_TX_CSUM;
+    if ((UINTN)Offload->CsumStart + Offload->CsumOffset + 2 > BufferSize) {
+      return EFI_INVALID_PARAMETER;
+    }
+  }
+
+  switch (Offload->GsoType) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+      break;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+      Required |= VIRTIO_NET_OFFLOAD_TSO4;
+      break;
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+      Required |= VIRTIO_NET_OFFLOAD_TSO6;
+      break;
+    default:
+      return EFI_UNSUPPORTED;
+  }
+
+  if (Offload->GsoType != VIRTIO_NET_HDR_GSO_NONE) {
+    //
+    // virtio-1.0, 5.1.6.2.1 Driver Requirements: Packet Transmission
+    //
+    if (((Offload->Flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) == 0) ||
+        (Offload->GsoSize == 0) || (Offload->HdrLen > BufferSize))
+    {
+      return EFI_INVALID_PARAMETER;
+    }
+
+    MaxSize = This->MaxTransmitSize;
+  }
+
+  if ((Required & ~This->Capabilities) != 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if ((BufferSize < Dev->Snm.MediaHeaderSize) || (BufferSize > MaxSize)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  if (Dev->Snm.State != EfiSimpleNetworkInitialized) {
+    Status = EFI_NOT_STARTED;
+  } else {
+    Status = VirtioNetTransmitPacket (Dev, Offload, BufferSize, Buffer);
+  }
+
+  gBS->RestoreTPL (OldTpl);
+  return Status;
+}
+
+/**
+  Receive a packet, and learn whether its checksums need verification.
+
+  See VIRTIO_NET_OFFLOAD_RECEIVE in <Protocol/VirtioNetOffload.h> for the
+  interface documentation.
+**/
+EFI_STATUS
+EFIAPI
+VirtioNetOffloadReceive (
+  IN     VIRTIO_NET_OFFLOAD_PROTOCOL  *This,
+  IN OUT UINTN                        *BufferSize,
+  OUT    VOID                         *Buffer,
+  OUT    BOOLEAN                      *ChecksumValid
+  )
+{
+  VNET_DEV    *Dev;
+  EFI_TPL     OldTpl;
+  EFI_STATUS  Status;
+
+  if ((This == NULL) || (BufferSize == NULL) || (Buffer == NULL) ||
+      (ChecksumValid == NULL))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Dev    = VIRTIO_NET_FROM_OFFLOAD (This);
+  OldTpl = gBS->RaiseTPL (TPL_CALLBACK);
+  if (Dev->Snm.State != EfiSimpleNetworkInitialized) {
+    Status = EFI_NOT_STARTED;
+  } else {
+    Status = VirtioNetReceivePacket (Dev, BufferSize, Buffer, ChecksumValid);
+  }
+
+  gBS->RestoreTPL (OldTpl);
+  return Status;
+}
@@ -59,7 +59,6 @@ VirtioNetGetStatus (
   EFI_STATUS            Status;
   UINT16                RxCurUsed;
   UINT16                TxCurUsed;
-  EFI_PHYSICAL_ADDRESS  DeviceAddress;
 
   if (This == NULL) {
     return EFI_INVALID_PARAMETER;
@@ -78,6 +77,15 @@ VirtioNetGetStatus (
       break;
   }
 
+  //
+  // Packets that are still held back for batching would never be reported
+  // transmitted to a caller that waits for them.
+  //
+  Status = VirtioNetFlushTx (Dev);
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
   //
   // update link status
   //
@@ -121,8 +129,9 @@ VirtioNetGetStatus (
     if (Dev->TxLastUsed == TxCurUsed) {
       *TxBuf = NULL;
     } else {
-      UINT16  UsedElemIdx;
-      UINT32  DescIdx;
+      UINT16        UsedElemIdx;
+      UINT32        DescIdx;
+      VNET_TX_SLOT  *Slot;
 
       //
       // fetch the first descriptor among those that the hypervisor reports
@@ -133,37 +142,27 @@ VirtioNetGetStatus (
 
       UsedElemIdx = Dev->TxLastUsed++ % Dev->TxRing.QueueSize;
       DescIdx     = Dev->TxRing.Used.UsedElem[UsedElemIdx].Id;
-      ASSERT (DescIdx < (UINT32)(2 * Dev->TxMaxPending - 1));
+      ASSERT (
+        Dev->TxIndirectDesc ?
+        DescIdx < Dev->TxMaxPending :
+        DescIdx < (UINT32)(2 * Dev->TxMaxPending - 1)
+        );
 
       //
-      // get the device address that has been enqueued for the caller's
-      // transmit buffer
+      // The slot of the descriptor chain remembers the caller's transmit
+      // buffer, and its mapping unless the packet has been bounced.
       //
-      DeviceAddress = Dev->TxRing.Desc[DescIdx + 1].Addr;
+      Slot   = &Dev->TxSlots[VirtioNetTxPktIdx (Dev, (UINT16)DescIdx)];
+      *TxBuf = Slot->Buffer;
+      if (Slot->BufMap != NULL) {
+        Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Slot->BufMap);
+        Slot->BufMap = NULL;
+      }
 
       //
       // now this descriptor can be used again to enqueue a transmit buffer
       //
       Dev->TxFreeStack[--Dev->TxCurPending] = (UINT16)DescIdx;
-
-      //
-      // Unmap the device address and perform the reverse mapping to find the
-      // caller buffer address.
-      //
-      Status = VirtioNetUnmapTxBuf (
-                 Dev,
-                 TxBuf,
-                 DeviceAddress
-                 );
-      if (EFI_ERROR (Status)) {
-        //
-        // VirtioNetUnmapTxBuf should never fail, if we have reached here
-        // that means our internal state has been corrupted
-        //
-        ASSERT (FALSE);
-        Status = EFI_DEVICE_ERROR;
-        goto Exit;
-      }
     }
   }
 
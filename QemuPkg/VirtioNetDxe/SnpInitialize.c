@@ -14,6 +14,7 @@
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 
 #include "VirtioNet.h"
@@ -133,19 +134,23 @@ ReleaseQueue:
   - fully populate the TX queue with a static pattern of virtio descriptor
     chains,
   - tracking of heads of free descriptor chains from the above,
-  - one common virtio-net request header (never modified by the host) for all
-    pending TX packets,
+  - a slot for each descriptor chain, tracking the caller's buffer of the
+    pending TX packet,
+  - a virtio-net request header (never modified by the host) for each
+    pending TX packet,
+  - a pre-mapped bounce buffer for each pending TX packet,
+  - a timer that flushes incomplete batches of TX packets,
   - select polling over TX interrupt.
 
   @param[in,out] Dev       The VNET_DEV driver instance about to enter the
                            EfiSimpleNetworkInitialized state.
 
   @retval EFI_OUT_OF_RESOURCES  Failed to allocate the stack to track the heads
-                                of free descriptor chains or failed to init
-                                TxBufCollection.
+                                of free descriptor chains or the slots.
   @return                       Status codes from VIRTIO_DEVICE_PROTOCOL.
-                                AllocateSharedPages() or
-                                VirtioMapAllBytesInSharedBuffer()
+                                AllocateSharedPages(),
+                                VirtioMapAllBytesInSharedBuffer() or
+                                gBS->CreateEvent()
   @retval EFI_SUCCESS           TX setup successful.
 */
 STATIC
@@ -155,104 +160,191 @@ VirtioNetInitTx (
   IN OUT VNET_DEV  *Dev
   )
 {
-  UINTN                 TxSharedReqSize;
+  UINTN                 TxReqSize;
   UINTN                 PktIdx;
   EFI_STATUS            Status;
   EFI_PHYSICAL_ADDRESS  DeviceAddress;
-  VOID                  *TxSharedReqBuffer;
+  VOID                  *TxReqBuffer;
+  VOID                  *TxBounceBuffer;
 
+  //
+  // With indirect descriptors, each pending packet takes up a single
+  // descriptor of the TX ring, rather than two.
+  //
   Dev->TxMaxPending = (UINT16)MIN (
+                                Dev->TxIndirectDesc ?
+                                Dev->TxRing.QueueSize :
                                 Dev->TxRing.QueueSize / 2,
                                 VNET_MAX_PENDING
                                 );
   Dev->TxCurPending = 0;
-  Dev->TxFreeStack  = AllocatePool (
-                        Dev->TxMaxPending *
-                        sizeof *Dev->TxFreeStack
-                        );
+
+  //
+  // A full queue is always flushed, so a batch never exceeds it.
+  //
+  Dev->TxBatch = (UINT16)MIN (
+                           MAX (PcdGet16 (PcdVirtioNetTxBatchSize), 1),
+                           Dev->TxMaxPending
+                           );
+  Dev->TxFlushTimer = NULL;
+  if (Dev->TxBatch > 1) {
+    Status = gBS->CreateEvent (
+                    EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                    TPL_CALLBACK,
+                    &VirtioNetTxFlushTimer,
+                    Dev,
+                    &Dev->TxFlushTimer
+                    );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  Dev->TxFreeStack = AllocatePool (
+                       Dev->TxMaxPending *
+                       sizeof *Dev->TxFreeStack
+                       );
   if (Dev->TxFreeStack == NULL) {
-    return EFI_OUT_OF_RESOURCES;
+    Status = EFI_OUT_OF_RESOURCES;
+    goto CloseTxFlushTimer;
   }
 
-  Dev->TxBufCollection = OrderedCollectionInit (
-                           VirtioNetTxBufMapInfoCompare,
-                           VirtioNetTxBufDeviceAddressCompare
-                           );
-  if (Dev->TxBufCollection == NULL) {
+  Dev->TxSlots = AllocateZeroPool (Dev->TxMaxPending * sizeof *Dev->TxSlots);
+  if (Dev->TxSlots == NULL) {
     Status = EFI_OUT_OF_RESOURCES;
     goto FreeTxFreeStack;
   }
 
   //
-  // Allocate TxSharedReq header and map with BusMasterCommonBuffer so that it
-  // can be accessed equally by both processor and device.
+  // Allocate one virtio-net request header per possibly pending packet, so
+  // that each packet can carry its own offload request, and map the headers
+  // with BusMasterCommonBuffer so that they can be accessed equally by both
+  // processor and device.
   //
   Status = Dev->VirtIo->AllocateSharedPages (
                           Dev->VirtIo,
-                          EFI_SIZE_TO_PAGES (sizeof *Dev->TxSharedReq),
-                          &TxSharedReqBuffer
+                          EFI_SIZE_TO_PAGES (
+                            Dev->TxMaxPending * sizeof *Dev->TxReq
+                            ),
+                          &TxReqBuffer
                           );
   if (EFI_ERROR (Status)) {
-    goto UninitTxBufCollection;
+    goto FreeTxSlots;
   }
 
-  ZeroMem (TxSharedReqBuffer, sizeof *Dev->TxSharedReq);
+  //
+  // virtio-0.9.5, Appendix C, Packet Transmission: no offload (Flags = 0,
+  // GsoType = VIRTIO_NET_HDR_GSO_NONE). The NumBuffers field exists for
+  // VirtIo 1.0 and VIRTIO_NET_F_MRG_RXBUF only, and it is unused.
+  //
+  ZeroMem (TxReqBuffer, Dev->TxMaxPending * sizeof *Dev->TxReq);
 
   Status = VirtioMapAllBytesInSharedBuffer (
              Dev->VirtIo,
              VirtioOperationBusMasterCommonBuffer,
-             TxSharedReqBuffer,
-             sizeof *(Dev->TxSharedReq),
+             TxReqBuffer,
+             Dev->TxMaxPending * sizeof *Dev->TxReq,
              &DeviceAddress,
-             &Dev->TxSharedReqMap
+             &Dev->TxReqMap
              );
   if (EFI_ERROR (Status)) {
-    goto FreeTxSharedReqBuffer;
+    goto FreeTxReqBuffer;
   }
 
-  Dev->TxSharedReq = TxSharedReqBuffer;
+  Dev->TxReq = TxReqBuffer;
+
+  //
+  // Frames up to VNET_TX_BOUNCE_SIZE bytes are copied to the bounce buffer of
+  // their slot, rather than mapped and unmapped one by one. The bounce buffers
+  // are only read by the device, but BusMasterCommonBuffer lets us map them
+  // once, in advance.
+  //
+  Status = Dev->VirtIo->AllocateSharedPages (
+                          Dev->VirtIo,
+                          EFI_SIZE_TO_PAGES (
+                            Dev->TxMaxPending * VNET_TX_BOUNCE_SIZE
+                            ),
+                          &TxBounceBuffer
+                          );
+  if (EFI_ERROR (Status)) {
+    goto UnmapTxReqBuffer;
+  }
+
+  Status = VirtioMapAllBytesInSharedBuffer (
+             Dev->VirtIo,
+             VirtioOperationBusMasterCommonBuffer,
+             TxBounceBuffer,
+             Dev->TxMaxPending * VNET_TX_BOUNCE_SIZE,
+             &Dev->TxBounceDeviceBase,
+             &Dev->TxBounceMap
+             );
+  if (EFI_ERROR (Status)) {
+    goto FreeTxBounceBuffer;
+  }
+
+  Dev->TxBounce = TxBounceBuffer;
+
+  if (Dev->TxIndirectDesc) {
+    Status = VirtioIndirectPoolInit (
+               Dev->VirtIo,
+               Dev->TxMaxPending,
+               2,
+               &Dev->TxIndirectPool
+               );
+    if (EFI_ERROR (Status)) {
+      goto UnmapTxBounceBuffer;
+    }
+  }
 
   //
   // In VirtIo 1.0, the NumBuffers field is mandatory. In 0.9.5, it depends on
-  // VIRTIO_NET_F_MRG_RXBUF, which we never negotiate.
+  // VIRTIO_NET_F_MRG_RXBUF.
   //
-  TxSharedReqSize = (Dev->VirtIo->Revision < VIRTIO_SPEC_REVISION (1, 0, 0)) ?
-                    sizeof (Dev->TxSharedReq->V0_9_5) :
-                    sizeof *Dev->TxSharedReq;
+  TxReqSize = ((Dev->VirtIo->Revision < VIRTIO_SPEC_REVISION (1, 0, 0)) &&
+               !Dev->RxMergeable) ?
+              sizeof (Dev->TxReq->V0_9_5) :
+              sizeof *Dev->TxReq;
 
   for (PktIdx = 0; PktIdx < Dev->TxMaxPending; ++PktIdx) {
-    UINT16  DescIdx;
+    UINT16               DescIdx;
+    volatile VRING_DESC  *Chain;
+
+    if (Dev->TxIndirectDesc) {
+      //
+      // The ring descriptor of each possibly pending packet permanently
+      // refers to the two-element indirect table of the packet.
+      //
+      DescIdx = (UINT16)PktIdx;
+      Chain   = &Dev->TxIndirectPool.Desc[2 * PktIdx];
+
+      Dev->TxRing.Desc[DescIdx].Addr  = Dev->TxIndirectPool.DeviceAddress +
+                                        2 * PktIdx * sizeof *Chain;
+      Dev->TxRing.Desc[DescIdx].Len   = (UINT32)(2 * sizeof *Chain);
+      Dev->TxRing.Desc[DescIdx].Flags = VRING_DESC_F_INDIRECT;
+    } else {
+      DescIdx = (UINT16)(2 * PktIdx);
+      Chain   = &Dev->TxRing.Desc[DescIdx];
+    }
 
-    DescIdx                  = (UINT16)(2 * PktIdx);
     Dev->TxFreeStack[PktIdx] = DescIdx;
 
     //
-    // For each possibly pending packet, lay out the descriptor for the common
-    // (unmodified by the host) virtio-net request header.
+    // For each possibly pending packet, lay out the descriptor for its own
+    // (unmodified by the host) virtio-net request header. Links between the
+    // descriptors of an indirect table are relative to the table.
     //
-    Dev->TxRing.Desc[DescIdx].Addr  = DeviceAddress;
-    Dev->TxRing.Desc[DescIdx].Len   = (UINT32)TxSharedReqSize;
-    Dev->TxRing.Desc[DescIdx].Flags = VRING_DESC_F_NEXT;
-    Dev->TxRing.Desc[DescIdx].Next  = (UINT16)(DescIdx + 1);
+    Chain[0].Addr  = DeviceAddress + PktIdx * sizeof *Dev->TxReq;
+    Chain[0].Len   = (UINT32)TxReqSize;
+    Chain[0].Flags = VRING_DESC_F_NEXT;
+    Chain[0].Next  = (UINT16)(Dev->TxIndirectDesc ? 1 : DescIdx + 1);
 
     //
     // The second descriptor of each pending TX packet is updated on the fly,
     // but it always terminates the descriptor chain of the packet.
     //
-    Dev->TxRing.Desc[DescIdx + 1].Flags = 0;
+    Chain[1].Flags = 0;
   }
 
-  //
-  // virtio-0.9.5, Appendix C, Packet Transmission
-  //
-  Dev->TxSharedReq->V0_9_5.Flags   = 0;
-  Dev->TxSharedReq->V0_9_5.GsoType = VIRTIO_NET_HDR_GSO_NONE;
-
-  //
-  // For VirtIo 1.0 only -- the field exists, but it is unused
-  //
-  Dev->TxSharedReq->NumBuffers = 0;
-
   //
   // virtio-0.9.5, 2.4.2 Receiving Used Buffers From the Device
   //
@@ -260,6 +352,11 @@ VirtioNetInitTx (
   Dev->TxLastUsed = *Dev->TxRing.Used.Idx;
   ASSERT (Dev->TxLastUsed == 0);
 
+  Dev->TxNextAvail = *Dev->TxRing.Avail.Idx;
+  Dev->TxFrames    = 0;
+  Dev->TxFlushes   = 0;
+  Dev->TxKicks     = 0;
+
   //
   // want no interrupt when a transmit completes
   //
@@ -267,19 +364,37 @@ VirtioNetInitTx (
 
   return EFI_SUCCESS;
 
-FreeTxSharedReqBuffer:
+UnmapTxBounceBuffer:
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->TxBounceMap);
+
+FreeTxBounceBuffer:
   Dev->VirtIo->FreeSharedPages (
                  Dev->VirtIo,
-                 EFI_SIZE_TO_PAGES (sizeof *(Dev->TxSharedReq)),
-                 TxSharedReqBuffer
+                 EFI_SIZE_TO_PAGES (Dev->TxMaxPending * VNET_TX_BOUNCE_SIZE),
+                 TxBounceBuffer
                  );
 
-UninitTxBufCollection:
-  OrderedCollectionUninit (Dev->TxBufCollection);
+UnmapTxReqBuffer:
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->TxReqMap);
+
+FreeTxReqBuffer:
+  Dev->VirtIo->FreeSharedPages (
+                 Dev->VirtIo,
+                 EFI_SIZE_TO_PAGES (Dev->TxMaxPending * sizeof *Dev->TxReq),
+                 TxReqBuffer
+                 );
+
+FreeTxSlots:
+  FreePool (Dev->TxSlots);
 
 FreeTxFreeStack:
   FreePool (Dev->TxFreeStack);
 
+CloseTxFlushTimer:
+  if (Dev->TxFlushTimer != NULL) {
+    gBS->CloseEvent (Dev->TxFlushTimer);
+  }
+
   return Status;
 }
 
@@ -316,6 +431,7 @@ VirtioNetInitRx (
   UINTN                 VirtioNetReqSize;
   UINTN                 RxBufSize;
   UINT16                RxAlwaysPending;
+  UINT16                DescPerBuf;
   UINTN                 PktIdx;
   UINT16                DescIdx;
   UINTN                 NumBytes;
@@ -324,26 +440,38 @@ VirtioNetInitRx (
 
   //
   // In VirtIo 1.0, the NumBuffers field is mandatory. In 0.9.5, it depends on
-  // VIRTIO_NET_F_MRG_RXBUF, which we never negotiate.
+  // VIRTIO_NET_F_MRG_RXBUF.
   //
-  VirtioNetReqSize = (Dev->VirtIo->Revision < VIRTIO_SPEC_REVISION (1, 0, 0)) ?
+  VirtioNetReqSize = ((Dev->VirtIo->Revision < VIRTIO_SPEC_REVISION (1, 0, 0)) &&
+                      !Dev->RxMergeable) ?
                      sizeof (VIRTIO_NET_REQ) :
                      sizeof (VIRTIO_1_0_NET_REQ);
 
   //
-  // For each incoming packet we must supply two descriptors:
+  // Each buffer accommodates the virtio-net request header, plus the network
+  // data (which consists of Ethernet header and Ethernet payload) of a full
+  // size packet. Without VIRTIO_NET_F_MRG_RXBUF, we must supply two
+  // descriptors per buffer:
   // - the recipient for the virtio-net request header, plus
-  // - the recipient for the network data (which consists of Ethernet header
-  //   and Ethernet payload).
+  // - the recipient for the network data.
+  // With VIRTIO_NET_F_MRG_RXBUF, the host places the header at the start of
+  // the (first) buffer of each packet, so one descriptor per buffer suffices.
   //
   RxBufSize = VirtioNetReqSize +
               (Dev->Snm.MediaHeaderSize + Dev->Snm.MaxPacketSize);
+  DescPerBuf = (UINT16)(Dev->RxMergeable ? 1 : 2);
 
   //
-  // Limit the number of pending RX packets if the queue is big. The division
-  // by two is due to the above "two descriptors per packet" trait.
+  // Limit the number of pending RX buffers to what the queue can hold with
+  // the above descriptor usage, and to the configured pool size.
   //
-  RxAlwaysPending = (UINT16)MIN (Dev->RxRing.QueueSize / 2, VNET_MAX_PENDING);
+  RxAlwaysPending = (UINT16)MIN (
+                              Dev->RxRing.QueueSize / DescPerBuf,
+                              MAX (PcdGet16 (PcdVirtioNetRxBufferCount), 1)
+                              );
+
+  Dev->RxReqSize = (UINT32)VirtioNetReqSize;
+  Dev->RxBufSize = (UINT32)RxBufSize;
 
   //
   // The RxBuf is shared between guest and hypervisor, use
@@ -393,8 +521,8 @@ VirtioNetInitRx (
   *Dev->RxRing.Avail.Flags = (UINT16)VRING_AVAIL_F_NO_INTERRUPT;
 
   //
-  // now set up a separate, two-part descriptor chain for each RX packet, and
-  // link each chain into (from) the available ring as well
+  // now set up a separate, one- or two-part descriptor chain for each RX
+  // buffer, and link each chain into (from) the available ring as well
   //
   DescIdx            = 0;
   RxBufDeviceAddress = Dev->RxBufDeviceBase;
@@ -405,6 +533,17 @@ VirtioNetInitRx (
     //
     Dev->RxRing.Avail.Ring[PktIdx] = DescIdx;
 
+    if (Dev->RxMergeable) {
+      //
+      // virtio-1.0, 5.1.6.3 Setting Up Receive Buffers
+      //
+      Dev->RxRing.Desc[DescIdx].Addr  = RxBufDeviceAddress;
+      Dev->RxRing.Desc[DescIdx].Len   = (UINT32)RxBufSize;
+      Dev->RxRing.Desc[DescIdx].Flags = VRING_DESC_F_WRITE;
+      RxBufDeviceAddress             += Dev->RxRing.Desc[DescIdx++].Len;
+      continue;
+    }
+
     //
     // virtio-0.9.5, 2.4.1.1 Placing Buffers into the Descriptor Table
     //
@@ -426,6 +565,19 @@ VirtioNetInitRx (
   MemoryFence ();
   *Dev->RxRing.Avail.Idx = RxAlwaysPending;
 
+  //
+  // VirtioNetReceive() recycles descriptor chains to the Available Ring, but
+  // exposes them to the host, and kicks the host, only in batches: when fewer
+  // than RxWatermark chains remain available to the host. Keep at least one
+  // chain available at all times, so that reception never stalls.
+  //
+  Dev->RxNextAvail = RxAlwaysPending;
+  Dev->RxWatermark = (UINT16)(RxAlwaysPending - RxAlwaysPending / 4);
+  Dev->RxFrames    = 0;
+  Dev->RxBytes     = 0;
+  Dev->RxFlushes   = 0;
+  Dev->RxKicks     = 0;
+
   //
   // At this point reception may already be running. In order to make it sure,
   // kick the hypervisor. If we fail to kick it, we must first abort reception
@@ -557,8 +709,18 @@ VirtioNetInitialize (
     !!(Features & VIRTIO_NET_F_STATUS)
     );
 
-  Features &= VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS | VIRTIO_F_VERSION_1 |
-              VIRTIO_F_IOMMU_PLATFORM;
+  //
+  // The resultant offloads are the ones that VirtioNetGetFeatures() has
+  // published in Dev->Offload.Capabilities.
+  //
+  Features = (Features & (VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS |
+                          VIRTIO_NET_F_MRG_RXBUF |
+                          VIRTIO_F_RING_INDIRECT_DESC |
+                          VIRTIO_F_VERSION_1 | VIRTIO_F_IOMMU_PLATFORM)) |
+             VirtioNetOffloadFeatures (Features);
+
+  Dev->TxIndirectDesc = (BOOLEAN)((Features & VIRTIO_F_RING_INDIRECT_DESC) != 0);
+  Dev->RxMergeable    = (BOOLEAN)((Features & VIRTIO_NET_F_MRG_RXBUF) != 0);
 
   //
   // In virtio-1.0, feature negotiation is expected to complete before queue
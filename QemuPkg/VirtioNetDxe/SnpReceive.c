@@ -15,6 +15,314 @@
 
 #include "VirtioNet.h"
 
+/**
+  Expose the descriptor chains that VirtioNetReceive() has recycled to the
+  Available Ring since the last call to the host, and notify the host unless
+  it has asked not to be notified.
+
+  @param[in,out] Dev  The VNET_DEV driver instance, in
+                      EfiSimpleNetworkInitialized state.
+
+  @retval EFI_SUCCESS  The recycled chains are available to the host.
+
+  @return              Error codes from VirtIo->SetQueueNotify().
+**/
+STATIC
+EFI_STATUS
+VirtioNetFlushRx (
+  IN OUT VNET_DEV  *Dev
+  )
+{
+  EFI_STATUS  Status;
+
+  //
+  // virtio-0.9.5, 2.4.1.3 Updating the Index Field
+  //
+  MemoryFence ();
+  *Dev->RxRing.Avail.Idx = Dev->RxNextAvail;
+  ++Dev->RxFlushes;
+
+  //
+  // virtio-0.9.5, 2.4.1.4 Notifying the Device -- the index update must be
+  // visible to the host before we look at its suppression flag.
+  //
+  VirtioMb ();
+  if ((*Dev->RxRing.Used.Flags & VRING_USED_F_NO_NOTIFY) != 0) {
+    return EFI_SUCCESS;
+  }
+
+  Status = Dev->VirtIo->SetQueueNotify (Dev->VirtIo, VIRTIO_NET_Q_RX);
+  ++Dev->RxKicks;
+  return Status;
+}
+
+/**
+  Locate a buffer that the host has returned on the Used Ring.
+
+  @param[in]  Dev      The VNET_DEV driver instance, in
+                       EfiSimpleNetworkInitialized state.
+  @param[in]  UsedIdx  The free-running Used Ring index of the element that
+                       returned the buffer.
+  @param[out] Len      The number of bytes the host has written to the buffer,
+                       including the virtio-net request header, if any.
+
+  @return  The start of the buffer in Dev->RxBuf. If the buffer begins with a
+           virtio-net request header, the packet data immediately follow it.
+**/
+STATIC
+UINT8 *
+VirtioNetRxUsedBuf (
+  IN  VNET_DEV  *Dev,
+  IN  UINT16    UsedIdx,
+  OUT UINT32    *Len
+  )
+{
+  volatile VRING_USED_ELEM  *UsedElem;
+  UINT32                    DescIdx;
+
+  UsedElem = &Dev->RxRing.Used.UsedElem[UsedIdx % Dev->RxRing.QueueSize];
+  DescIdx  = UsedElem->Id;
+  *Len     = UsedElem->Len;
+
+  //
+  // the host must not have filled in more data than requested
+  //
+  ASSERT (*Len <= Dev->RxBufSize);
+
+  return Dev->RxBuf + (UINTN)(Dev->RxRing.Desc[DescIdx].Addr -
+                              Dev->RxBufDeviceBase);
+}
+
+/**
+  Complete the partial checksum of a packet that the host has delivered with
+  VIRTIO_NET_HDR_F_NEEDS_CSUM.
+
+  The checksum field already holds the sum of the pseudo header; the Internet
+  checksum over the rest of the packet, starting at CsumStart, is stored in
+  the field.
+
+  @param[in,out] Packet      The packet, starting with the media header.
+  @param[in]     Length      The size of the packet.
+  @param[in]     CsumStart   The offset where checksumming starts.
+  @param[in]     CsumOffset  The offset of the checksum field, relative to
+                             CsumStart.
+**/
+STATIC
+VOID
+VirtioNetCompleteChecksum (
+  IN OUT UINT8   *Packet,
+  IN     UINTN   Length,
+  IN     UINT16  CsumStart,
+  IN     UINT16  CsumOffset
+  )
+{
+  UINT32  Sum;
+  UINTN   Idx;
+  UINT8   *Field;
+
+  Sum = 0;
+  for (Idx = CsumStart; Idx + 1 < Length; Idx += 2) {
+    Sum += ((UINT32)Packet[Idx] << 8) | Packet[Idx + 1];
+  }
+
+  if (Idx < Length) {
+    Sum += (UINT32)Packet[Idx] << 8;
+  }
+
+  while ((Sum >> 16) != 0) {
+    Sum = (Sum & 0xFFFF) + (Sum >> 16);
+  }
+
+  //
+  // A UDP checksum field of zero means "no checksum" (RFC 768), so complete
+  // the received frame with the one's complement equivalent 0xFFFF instead.
+  // That is equally valid for TCP, and the virtio-net header doesn't tell
+  // which protocol the field belongs to.
+  //
+  Sum = ~Sum & 0xFFFF;
+  if (Sum == 0) {
+    Sum = 0xFFFF;
+  }
+
+  Field    = Packet + CsumStart + CsumOffset;
+  Field[0] = (UINT8)(Sum >> 8);
+  Field[1] = (UINT8)Sum;
+}
+
+/**
+  Fetch the next packet from the RX queue, and recycle its buffers.
+
+  This function is shared by VirtioNetReceive() and VirtioNetOffloadReceive(),
+  which raise the TPL to TPL_CALLBACK and check the state of the driver
+  instance.
+
+  @param[in,out] Dev            The VNET_DEV driver instance, in
+                                EfiSimpleNetworkInitialized state.
+  @param[in,out] BufferSize     On entry, the size of Buffer. On exit, the
+                                size of the packet, including the media
+                                header.
+  @param[out]    Buffer         The buffer to copy the packet to.
+  @param[out]    ChecksumValid  If not NULL, set to TRUE if the host has
+                                validated the checksums of the packet, or
+                                left it for us to complete them.
+
+  @retval EFI_SUCCESS           The packet has been copied to Buffer.
+  @retval EFI_NOT_READY         No packet has been received.
+  @retval EFI_BUFFER_TOO_SMALL  BufferSize is too small; the packet is kept.
+  @retval EFI_DEVICE_ERROR      The packet is malformed, and has been
+                                dropped.
+  @return                       Status codes from VirtIo->SetQueueNotify().
+**/
+EFI_STATUS
+EFIAPI
+VirtioNetReceivePacket (
+  IN OUT VNET_DEV  *Dev,
+  IN OUT UINTN     *BufferSize,
+  OUT    VOID      *Buffer,
+  OUT    BOOLEAN   *ChecksumValid OPTIONAL
+  )
+{
+  EFI_STATUS      Status;
+  UINT16          RxCurUsed;
+  UINT16          UsedElemIdx;
+  UINT16          NumBuffers;
+  UINT16          BufIdx;
+  UINT32          RxLen;
+  UINT32          FragLen;
+  UINTN           OrigBufferSize;
+  UINT8           *RxPtr;
+  UINT8           *Dest;
+  VIRTIO_NET_REQ  RxReq;
+  EFI_STATUS      NotifyStatus;
+
+  //
+  // virtio-0.9.5, 2.4.2 Receiving Used Buffers From the Device
+  //
+  MemoryFence ();
+  RxCurUsed = *Dev->RxRing.Used.Idx;
+  MemoryFence ();
+
+  if (Dev->RxLastUsed == RxCurUsed) {
+    return EFI_NOT_READY;
+  }
+
+  //
+  // the virtio-net request header must be complete; we skip it
+  //
+  NumBuffers = 1;
+  RxPtr      = VirtioNetRxUsedBuf (Dev, Dev->RxLastUsed, &RxLen);
+  ASSERT (RxLen >= Dev->RxReqSize);
+  RxLen -= Dev->RxReqSize;
+  CopyMem (&RxReq, RxPtr, sizeof RxReq);
+
+  if (Dev->RxMergeable) {
+    //
+    // virtio-1.0, 5.1.6.4 Processing of Incoming Packets: the packet may span
+    // several buffers, which the host returns together, and only the first of
+    // which starts with the request header.
+    //
+    NumBuffers = ((VIRTIO_1_0_NET_REQ *)RxPtr)->NumBuffers;
+    if ((NumBuffers == 0) ||
+        (NumBuffers > (UINT16)(RxCurUsed - Dev->RxLastUsed)))
+    {
+      NumBuffers = 1;
+      Status     = EFI_DEVICE_ERROR;
+      goto RecycleDesc; // drop malformed packet
+    }
+
+    for (BufIdx = 1; BufIdx < NumBuffers; ++BufIdx) {
+      VirtioNetRxUsedBuf (Dev, (UINT16)(Dev->RxLastUsed + BufIdx), &FragLen);
+      RxLen += FragLen;
+    }
+  }
+
+  OrigBufferSize = *BufferSize;
+  *BufferSize    = RxLen;
+
+  if (OrigBufferSize < RxLen) {
+    return EFI_BUFFER_TOO_SMALL; // keep the packet
+  }
+
+  if (RxLen < Dev->Snm.MediaHeaderSize) {
+    Status = EFI_DEVICE_ERROR;
+    goto RecycleDesc; // drop useless short packet
+  }
+
+  //
+  // With VIRTIO_NET_F_GUEST_CSUM, the host may leave the checksum of a packet
+  // partial, for us to complete.
+  //
+  if (((RxReq.Flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) != 0) &&
+      ((UINT32)RxReq.CsumStart + RxReq.CsumOffset + 2 > RxLen))
+  {
+    Status = EFI_DEVICE_ERROR;
+    goto RecycleDesc; // drop malformed packet
+  }
+
+  Dest = Buffer;
+  for (BufIdx = 0; BufIdx < NumBuffers; ++BufIdx) {
+    RxPtr = VirtioNetRxUsedBuf (
+              Dev,
+              (UINT16)(Dev->RxLastUsed + BufIdx),
+              &FragLen
+              );
+    if (BufIdx == 0) {
+      RxPtr   += Dev->RxReqSize;
+      FragLen -= Dev->RxReqSize;
+    }
+
+    CopyMem (Dest, RxPtr, FragLen);
+    Dest += FragLen;
+  }
+
+  if ((RxReq.Flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) != 0) {
+    VirtioNetCompleteChecksum (
+      Buffer,
+      RxLen,
+      RxReq.CsumStart,
+      RxReq.CsumOffset
+      );
+  }
+
+  if (ChecksumValid != NULL) {
+    *ChecksumValid = (BOOLEAN)((RxReq.Flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM |
+                                               VIRTIO_NET_HDR_F_DATA_VALID)) != 0);
+  }
+
+  ++Dev->RxFrames;
+  Dev->RxBytes += RxLen;
+  Status        = EFI_SUCCESS;
+
+RecycleDesc:
+  //
+  // virtio-0.9.5, 2.4.1 Supplying Buffers to The Device
+  //
+  // There are no more descriptor chains than Available Ring entries, so
+  // filling in an entry past the Index Field never clobbers an entry that the
+  // host has yet to consume. The host only learns about the recycled chains
+  // in VirtioNetFlushRx().
+  //
+  for (BufIdx = 0; BufIdx < NumBuffers; ++BufIdx) {
+    UsedElemIdx = Dev->RxLastUsed++ % Dev->RxRing.QueueSize;
+    Dev->RxRing.Avail.Ring[Dev->RxNextAvail++ % Dev->RxRing.QueueSize] =
+      (UINT16)Dev->RxRing.Used.UsedElem[UsedElemIdx].Id;
+  }
+
+  //
+  // The chains between RxCurUsed and the Index Field are still available to
+  // the host. Only when they run low, return the recycled ones in a batch.
+  //
+  if ((UINT16)(*Dev->RxRing.Avail.Idx - RxCurUsed) < Dev->RxWatermark) {
+    NotifyStatus = VirtioNetFlushRx (Dev);
+    if (!EFI_ERROR (Status)) {
+      // earlier error takes precedence
+      Status = NotifyStatus;
+    }
+  }
+
+  return Status;
+}
+
 /**
   Receives a packet from a network interface.
 
@@ -67,15 +375,7 @@ VirtioNetReceive (
   VNET_DEV    *Dev;
   EFI_TPL     OldTpl;
   EFI_STATUS  Status;
-  UINT16      RxCurUsed;
-  UINT16      UsedElemIdx;
-  UINT32      DescIdx;
-  UINT32      RxLen;
-  UINTN       OrigBufferSize;
   UINT8       *RxPtr;
-  UINT16      AvailIdx;
-  EFI_STATUS  NotifyStatus;
-  UINTN       RxBufOffset;
 
   if ((This == NULL) || (BufferSize == NULL) || (Buffer == NULL)) {
     return EFI_INVALID_PARAMETER;
@@ -94,53 +394,19 @@ VirtioNetReceive (
       break;
   }
 
-  //
-  // virtio-0.9.5, 2.4.2 Receiving Used Buffers From the Device
-  //
-  MemoryFence ();
-  RxCurUsed = *Dev->RxRing.Used.Idx;
-  MemoryFence ();
-
-  if (Dev->RxLastUsed == RxCurUsed) {
-    Status = EFI_NOT_READY;
+  Status = VirtioNetReceivePacket (Dev, BufferSize, Buffer, NULL);
+  if (EFI_ERROR (Status)) {
     goto Exit;
   }
 
-  UsedElemIdx = Dev->RxLastUsed % Dev->RxRing.QueueSize;
-  DescIdx     = Dev->RxRing.Used.UsedElem[UsedElemIdx].Id;
-  RxLen       = Dev->RxRing.Used.UsedElem[UsedElemIdx].Len;
-
-  //
-  // the virtio-net request header must be complete; we skip it
-  //
-  ASSERT (RxLen >= Dev->RxRing.Desc[DescIdx].Len);
-  RxLen -= Dev->RxRing.Desc[DescIdx].Len;
-  //
-  // the host must not have filled in more data than requested
-  //
-  ASSERT (RxLen <= Dev->RxRing.Desc[DescIdx + 1].Len);
-
-  OrigBufferSize = *BufferSize;
-  *BufferSize    = RxLen;
-
-  if (OrigBufferSize < RxLen) {
-    Status = EFI_BUFFER_TOO_SMALL;
-    goto Exit; // keep the packet
-  }
-
-  if (RxLen < Dev->Snm.MediaHeaderSize) {
-    Status = EFI_DEVICE_ERROR;
-    goto RecycleDesc; // drop useless short packet
-  }
-
   if (HeaderSize != NULL) {
     *HeaderSize = Dev->Snm.MediaHeaderSize;
   }
 
-  RxBufOffset = (UINTN)(Dev->RxRing.Desc[DescIdx + 1].Addr -
-                        Dev->RxBufDeviceBase);
-  RxPtr = Dev->RxBuf + RxBufOffset;
-  CopyMem (Buffer, RxPtr, RxLen);
+  //
+  // The media header may straddle buffers; parse it from the caller's copy.
+  //
+  RxPtr = Buffer;
 
   if (DestAddr != NULL) {
     CopyMem (DestAddr, RxPtr, SIZE_OF_VNET (Mac));
@@ -158,30 +424,6 @@ VirtioNetReceive (
     *Protocol = (UINT16)((RxPtr[0] << 8) | RxPtr[1]);
   }
 
-  RxPtr += sizeof (UINT16);
-
-  Status = EFI_SUCCESS;
-
-RecycleDesc:
-  ++Dev->RxLastUsed;
-
-  //
-  // virtio-0.9.5, 2.4.1 Supplying Buffers to The Device
-  //
-  AvailIdx                                                   = *Dev->RxRing.Avail.Idx;
-  Dev->RxRing.Avail.Ring[AvailIdx++ % Dev->RxRing.QueueSize] =
-    (UINT16)DescIdx;
-
-  MemoryFence ();
-  *Dev->RxRing.Avail.Idx = AvailIdx;
-
-  MemoryFence ();
-  NotifyStatus = Dev->VirtIo->SetQueueNotify (Dev->VirtIo, VIRTIO_NET_Q_RX);
-  if (!EFI_ERROR (Status)) {
-    // earlier error takes precedence
-    Status = NotifyStatus;
-  }
-
 Exit:
   gBS->RestoreTPL (OldTpl);
   return Status;
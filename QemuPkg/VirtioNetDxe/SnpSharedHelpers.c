@@ -8,20 +8,13 @@
 
 **/
 
+#include <Library/BaseLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
+#include <Library/UefiBootServicesTableLib.h>
 
 #include "VirtioNet.h"
 
-//
-// The user structure for the ordered collection that will track the mapping
-// info of the packets queued in TxRing
-//
-typedef struct {
-  VOID                    *Buffer;
-  EFI_PHYSICAL_ADDRESS    DeviceAddress; // lookup key for reverse mapping
-  VOID                    *BufMap;
-} TX_BUF_MAP_INFO;
-
 /**
   Release RX and TX resources on the boundary of the
   EfiSimpleNetworkInitialized state.
@@ -56,247 +49,212 @@ VirtioNetShutdownTx (
   IN OUT VNET_DEV  *Dev
   )
 {
-  ORDERED_COLLECTION_ENTRY  *Entry, *Entry2;
-  TX_BUF_MAP_INFO           *TxBufMapInfo;
-  VOID                      *UserStruct;
+  UINT16  PktIdx;
+
+  //
+  // Unmap the caller buffers of the packets still pending; the bounced ones
+  // have no mapping of their own.
+  //
+  for (PktIdx = 0; PktIdx < Dev->TxMaxPending; ++PktIdx) {
+    if (Dev->TxSlots[PktIdx].BufMap != NULL) {
+      Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->TxSlots[PktIdx].BufMap);
+    }
+  }
+
+  if (Dev->TxIndirectDesc) {
+    VirtioIndirectPoolUninit (Dev->VirtIo, &Dev->TxIndirectPool);
+  }
 
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->TxSharedReqMap);
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->TxBounceMap);
   Dev->VirtIo->FreeSharedPages (
                  Dev->VirtIo,
-                 EFI_SIZE_TO_PAGES (sizeof *(Dev->TxSharedReq)),
-                 Dev->TxSharedReq
+                 EFI_SIZE_TO_PAGES (Dev->TxMaxPending * VNET_TX_BOUNCE_SIZE),
+                 Dev->TxBounce
                  );
 
-  for (Entry = OrderedCollectionMin (Dev->TxBufCollection);
-       Entry != NULL;
-       Entry = Entry2)
-  {
-    Entry2 = OrderedCollectionNext (Entry);
-    OrderedCollectionDelete (Dev->TxBufCollection, Entry, &UserStruct);
-    TxBufMapInfo = UserStruct;
-    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, TxBufMapInfo->BufMap);
-    FreePool (TxBufMapInfo);
-  }
-
-  OrderedCollectionUninit (Dev->TxBufCollection);
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->TxReqMap);
+  Dev->VirtIo->FreeSharedPages (
+                 Dev->VirtIo,
+                 EFI_SIZE_TO_PAGES (Dev->TxMaxPending * sizeof *Dev->TxReq),
+                 Dev->TxReq
+                 );
 
+  FreePool (Dev->TxSlots);
   FreePool (Dev->TxFreeStack);
+
+  if (Dev->TxFlushTimer != NULL) {
+    gBS->CloseEvent (Dev->TxFlushTimer);
+  }
 }
 
 /**
-  Release TX and RX VRING resources.
+  Log the RX statistics collected since VirtioNetInitRx(), so that the number
+  of RX notifications (VM exits) per MB received can be checked.
 
-  @param[in,out] Dev       The VNET_DEV driver instance which was using
-                           the ring.
-  @param[in,out] Ring      The virtio ring to clean up.
-  @param[in]     RingMap   A token return from the VirtioRingMap()
+  @param[in] Dev  The VNET_DEV driver instance, in EfiSimpleNetworkInitialized
+                  state.
 */
 VOID
 EFIAPI
-VirtioNetUninitRing (
-  IN OUT VNET_DEV  *Dev,
-  IN OUT VRING     *Ring,
-  IN     VOID      *RingMap
+VirtioNetRxLogStats (
+  IN VNET_DEV  *Dev
   )
 {
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, RingMap);
-  VirtioRingUninit (Dev->VirtIo, Ring);
+  UINT64  KicksPerMb;
+
+  KicksPerMb = 0;
+  if (Dev->RxBytes > 0) {
+    KicksPerMb = DivU64x64Remainder (
+                   MultU64x32 (Dev->RxKicks, SIZE_1MB),
+                   Dev->RxBytes,
+                   NULL
+                   );
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: frames=%Lu bytes=%Lu flushes=%Lu kicks=%Lu kicks/MB=%Lu\n",
+    __FUNCTION__,
+    Dev->RxFrames,
+    Dev->RxBytes,
+    Dev->RxFlushes,
+    Dev->RxKicks,
+    KicksPerMb
+    ));
 }
 
 /**
-  Map Caller-supplied TxBuf buffer to the device-mapped address
-
-  @param[in]    Dev               The VNET_DEV driver instance which wants to
-                                  map the Tx packet.
-  @param[in]    Buffer            The system physical address of TxBuf
-  @param[in]    NumberOfBytes     Number of bytes to map
-  @param[out]   DeviceAddress     The resulting device address for the bus
-                                  master access.
-
-  @retval EFI_OUT_OF_RESOURCES    The request could not be completed due to
-                                  a lack of resources.
-  @return                         Status codes from
-                                  VirtioMapAllBytesInSharedBuffer()
-  @retval EFI_SUCCESS             Caller-supplied buffer is successfully mapped.
+  Log the TX statistics collected since VirtioNetInitTx(), so that the effect
+  of batching TX notifications can be checked.
+
+  @param[in] Dev  The VNET_DEV driver instance, in EfiSimpleNetworkInitialized
+                  state.
 */
-EFI_STATUS
+VOID
 EFIAPI
-VirtioNetMapTxBuf (
-  IN  VNET_DEV              *Dev,
-  IN  VOID                  *Buffer,
-  IN  UINTN                 NumberOfBytes,
-  OUT EFI_PHYSICAL_ADDRESS  *DeviceAddress
+VirtioNetTxLogStats (
+  IN VNET_DEV  *Dev
   )
 {
-  EFI_STATUS            Status;
-  TX_BUF_MAP_INFO       *TxBufMapInfo;
-  EFI_PHYSICAL_ADDRESS  Address;
-  VOID                  *Mapping;
-
-  TxBufMapInfo = AllocatePool (sizeof (*TxBufMapInfo));
-  if (TxBufMapInfo == NULL) {
-    return EFI_OUT_OF_RESOURCES;
-  }
-
-  Status = VirtioMapAllBytesInSharedBuffer (
-             Dev->VirtIo,
-             VirtioOperationBusMasterRead,
-             Buffer,
-             NumberOfBytes,
-             &Address,
-             &Mapping
-             );
-  if (EFI_ERROR (Status)) {
-    goto FreeTxBufMapInfo;
-  }
-
-  TxBufMapInfo->Buffer        = Buffer;
-  TxBufMapInfo->DeviceAddress = Address;
-  TxBufMapInfo->BufMap        = Mapping;
-
-  Status = OrderedCollectionInsert (
-             Dev->TxBufCollection,
-             NULL,
-             TxBufMapInfo
-             );
-  switch (Status) {
-    case EFI_OUT_OF_RESOURCES:
-      goto UnmapTxBuf;
-    case EFI_ALREADY_STARTED:
-      //
-      // This should never happen: it implies
-      //
-      // - an identity-mapping VIRTIO_DEVICE_PROTOCOL.MapSharedBuffer()
-      //   implementation -- which is fine,
-      //
-      // - and an SNP client that queues multiple instances of the exact same
-      //   buffer address with SNP.Transmit() -- which is undefined behavior,
-      //   based on the TxBuf language in UEFI-2.7,
-      //   EFI_SIMPLE_NETWORK.GetStatus().
-      //
-      ASSERT (FALSE);
-      Status = EFI_INVALID_PARAMETER;
-      goto UnmapTxBuf;
-    default:
-      ASSERT_EFI_ERROR (Status);
-      break;
-  }
-
-  *DeviceAddress = Address;
-  return EFI_SUCCESS;
-
-UnmapTxBuf:
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Mapping);
-
-FreeTxBufMapInfo:
-  FreePool (TxBufMapInfo);
-  return Status;
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: frames=%Lu flushes=%Lu kicks=%Lu batch=%u\n",
+    __FUNCTION__,
+    Dev->TxFrames,
+    Dev->TxFlushes,
+    Dev->TxKicks,
+    Dev->TxBatch
+    ));
 }
 
 /**
-  Unmap (aka reverse mapping) device mapped TxBuf buffer to the system
-  physical address
+  Select the checksum and segmentation offload features to negotiate.
 
-  @param[in]    Dev               The VNET_DEV driver instance which wants to
-                                  reverse- and unmap the Tx packet.
-  @param[out]   Buffer            The system physical address of TxBuf
-  @param[in]    DeviceAddress     The device address for the TxBuf
+  VirtioNetGetFeatures() publishes the resultant offloads, and
+  VirtioNetInitialize() negotiates them, so both must use this function.
 
-  @retval EFI_INVALID_PARAMETER   The DeviceAddress is not mapped
-  @retval EFI_SUCCESS             The TxBuf at DeviceAddress has been unmapped,
-                                  and Buffer has been set to TxBuf's system
-                                  physical address.
+  @param[in] Features  The features offered by the device.
 
+  @return  The offload features to negotiate; a subset of Features.
 */
-EFI_STATUS
+UINT64
 EFIAPI
-VirtioNetUnmapTxBuf (
-  IN  VNET_DEV              *Dev,
-  OUT VOID                  **Buffer,
-  IN  EFI_PHYSICAL_ADDRESS  DeviceAddress
+VirtioNetOffloadFeatures (
+  IN UINT64  Features
   )
 {
-  ORDERED_COLLECTION_ENTRY  *Entry;
-  TX_BUF_MAP_INFO           *TxBufMapInfo;
-  VOID                      *UserStruct;
-
-  Entry = OrderedCollectionFind (Dev->TxBufCollection, &DeviceAddress);
-  if (Entry == NULL) {
-    return EFI_INVALID_PARAMETER;
+  //
+  // Without a consumer of VIRTIO_NET_OFFLOAD_PROTOCOL, the offloads would only
+  // make us complete the partial checksums of received packets in software.
+  //
+  if (!FeaturePcdGet (PcdVirtioNetOffloads)) {
+    return 0;
   }
 
-  OrderedCollectionDelete (Dev->TxBufCollection, Entry, &UserStruct);
-
-  TxBufMapInfo = UserStruct;
+  Features &= VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |
+              VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6;
 
-  *Buffer = TxBufMapInfo->Buffer;
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, TxBufMapInfo->BufMap);
-  FreePool (TxBufMapInfo);
+  //
+  // The host TSO features must not be negotiated without VIRTIO_NET_F_CSUM.
+  //
+  if ((Features & VIRTIO_NET_F_CSUM) == 0) {
+    Features &= ~(UINT64)(VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6);
+  }
 
-  return EFI_SUCCESS;
+  return Features;
 }
 
 /**
-  Comparator function for two TX_BUF_MAP_INFO objects.
-
-  @param[in] UserStruct1  Pointer to the first TX_BUF_MAP_INFO object.
+  Locate the descriptor that carries the packet of a pending TX request.
 
-  @param[in] UserStruct2  Pointer to the second TX_BUF_MAP_INFO object.
+  Each TX request is a two-element chain: the virtio-net header of the packet,
+  followed by the caller's packet. The header is not shared; like the
+  VNET_TX_SLOT of the packet, it is indexed by VirtioNetTxPktIdx() in
+  Dev->TxReq, so that VirtioNetOffloadTransmit() can fill it in per packet.
+  The chain lives either in the TX ring itself, starting at DescIdx, or in the
+  indirect descriptor table that the ring descriptor DescIdx refers to.
 
-  @retval <0  If UserStruct1 compares less than UserStruct2.
+  @param[in] Dev      The VNET_DEV driver instance.
+  @param[in] DescIdx  The head descriptor of the TX request in the TX ring, as
+                      stored in Dev->TxFreeStack.
 
-  @retval  0  If UserStruct1 compares equal to UserStruct2.
-
-  @retval >0  If UserStruct1 compares greater than UserStruct2.
+  @return  The descriptor whose Addr and Len fields describe the packet.
 */
-INTN
+volatile VRING_DESC *
 EFIAPI
-VirtioNetTxBufMapInfoCompare (
-  IN CONST VOID  *UserStruct1,
-  IN CONST VOID  *UserStruct2
+VirtioNetTxDataDesc (
+  IN VNET_DEV  *Dev,
+  IN UINT16    DescIdx
   )
 {
-  CONST TX_BUF_MAP_INFO  *MapInfo1;
-  CONST TX_BUF_MAP_INFO  *MapInfo2;
-
-  MapInfo1 = UserStruct1;
-  MapInfo2 = UserStruct2;
+  if (Dev->TxIndirectDesc) {
+    return &Dev->TxIndirectPool.Desc[(UINTN)DescIdx * 2 + 1];
+  }
 
-  return MapInfo1->DeviceAddress < MapInfo2->DeviceAddress ? -1 :
-         MapInfo1->DeviceAddress > MapInfo2->DeviceAddress ?  1 :
-         0;
+  return &Dev->TxRing.Desc[DescIdx + 1];
 }
 
 /**
-  Compare a standalone DeviceAddress against a TX_BUF_MAP_INFO object
-  containing an embedded DeviceAddress.
+  Map the head descriptor of a TX request to the index of its packet, which
+  selects the request header in Dev->TxReq, the slot in Dev->TxSlots, and the
+  bounce buffer in Dev->TxBounce.
 
-  @param[in] StandaloneKey  Pointer to DeviceAddress, which has type
-                            EFI_PHYSICAL_ADDRESS.
+  @param[in] Dev      The VNET_DEV driver instance.
+  @param[in] DescIdx  The head descriptor of the TX request in the TX ring, as
+                      stored in Dev->TxFreeStack.
 
-  @param[in] UserStruct     Pointer to the TX_BUF_MAP_INFO object with the
-                            embedded DeviceAddress.
+  @return  The packet index, less than Dev->TxMaxPending.
+*/
+UINT16
+EFIAPI
+VirtioNetTxPktIdx (
+  IN VNET_DEV  *Dev,
+  IN UINT16    DescIdx
+  )
+{
+  if (Dev->TxIndirectDesc) {
+    return DescIdx;
+  }
 
-  @retval <0  If StandaloneKey compares less than UserStruct's key.
+  return DescIdx / 2;
+}
 
-  @retval  0  If StandaloneKey compares equal to UserStruct's key.
+/**
+  Release TX and RX VRING resources.
 
-  @retval >0  If StandaloneKey compares greater than UserStruct's key.
-**/
-INTN
+  @param[in,out] Dev       The VNET_DEV driver instance which was using
+                           the ring.
+  @param[in,out] Ring      The virtio ring to clean up.
+  @param[in]     RingMap   A token return from the VirtioRingMap()
+*/
+VOID
 EFIAPI
-VirtioNetTxBufDeviceAddressCompare (
-  IN CONST VOID  *StandaloneKey,
-  IN CONST VOID  *UserStruct
+VirtioNetUninitRing (
+  IN OUT VNET_DEV  *Dev,
+  IN OUT VRING     *Ring,
+  IN     VOID      *RingMap
   )
 {
-  CONST EFI_PHYSICAL_ADDRESS  *DeviceAddress;
-  CONST TX_BUF_MAP_INFO       *MapInfo;
-
-  DeviceAddress = StandaloneKey;
-  MapInfo       = UserStruct;
-
-  return *DeviceAddress < MapInfo->DeviceAddress ? -1 :
-         *DeviceAddress > MapInfo->DeviceAddress ?  1 :
-         0;
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, RingMap);
+  VirtioRingUninit (Dev->VirtIo, Ring);
 }
@@ -58,6 +58,8 @@ VirtioNetShutdown (
   }
 
   Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, 0);
+  VirtioNetRxLogStats (Dev);
+  VirtioNetTxLogStats (Dev);
   VirtioNetShutdownRx (Dev);
   VirtioNetShutdownTx (Dev);
   VirtioNetUninitRing (Dev, &Dev->TxRing, Dev->TxRingMap);
@@ -11,10 +11,208 @@
 
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
+#include <Library/PcdLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 
 #include "VirtioNet.h"
 
+/**
+  Expose the packets that VirtioNetTransmitPacket() has queued since the last
+  flush to the host, and notify the host unless it has asked not to be
+  notified.
+
+  This function is called when a batch of Dev->TxBatch packets is complete,
+  when the host has returned all earlier packets, from VirtioNetGetStatus(),
+  and from the TX flush timer, at TPL_CALLBACK.
+
+  @param[in,out] Dev  The VNET_DEV driver instance, in
+                      EfiSimpleNetworkInitialized state.
+
+  @retval EFI_SUCCESS  The queued packets are available to the host.
+
+  @return              Error codes from VirtIo->SetQueueNotify().
+**/
+EFI_STATUS
+EFIAPI
+VirtioNetFlushTx (
+  IN OUT VNET_DEV  *Dev
+  )
+{
+  EFI_STATUS  Status;
+
+  //
+  // the available index is never written by the host, we can read it back
+  // without a barrier
+  //
+  if (*Dev->TxRing.Avail.Idx == Dev->TxNextAvail) {
+    return EFI_SUCCESS;
+  }
+
+  if (Dev->TxFlushTimer != NULL) {
+    gBS->SetTimer (Dev->TxFlushTimer, TimerCancel, 0);
+  }
+
+  //
+  // virtio-0.9.5, 2.4.1.3 Updating the Index Field
+  //
+  MemoryFence ();
+  *Dev->TxRing.Avail.Idx = Dev->TxNextAvail;
+  ++Dev->TxFlushes;
+
+  //
+  // virtio-0.9.5, 2.4.1.4 Notifying the Device -- the index update must be
+  // visible to the host before we look at its suppression flag.
+  //
+  VirtioMb ();
+  if ((*Dev->TxRing.Used.Flags & VRING_USED_F_NO_NOTIFY) != 0) {
+    return EFI_SUCCESS;
+  }
+
+  Status = Dev->VirtIo->SetQueueNotify (Dev->VirtIo, VIRTIO_NET_Q_TX);
+  ++Dev->TxKicks;
+  return Status;
+}
+
+/**
+  Place a packet, with its media header filled in, on the TX queue.
+
+  This function is shared by VirtioNetTransmit() and
+  VirtioNetOffloadTransmit(), which validate the packet and raise the TPL to
+  TPL_CALLBACK.
+
+  Frames that fit in VNET_TX_BOUNCE_SIZE bytes are copied to the pre-mapped
+  bounce buffer of the slot; larger ones are mapped for the device.
+
+  The host is notified at once if it has returned every packet exposed to it
+  so far. Otherwise the packet is only exposed once Dev->TxBatch packets have
+  been queued, or the queue is full, and the TX flush timer is armed for the
+  first packet of the batch.
+
+  @param[in,out] Dev         The VNET_DEV driver instance, in
+                             EfiSimpleNetworkInitialized state.
+  @param[in]     Offload     The checksum and segmentation offload request for
+                             the packet, or NULL for none.
+  @param[in]     BufferSize  The size of the packet, including the media
+                             header.
+  @param[in]     Buffer      The packet. The caller is responsible for leaving
+                             it intact until VirtioNetGetStatus() reports it.
+
+  @retval EFI_SUCCESS       The packet was placed on the transmit queue.
+  @retval EFI_NOT_READY     The transmit queue is full.
+  @retval EFI_DEVICE_ERROR  Mapping the packet for the device failed.
+  @return                   Status codes from VirtioNetFlushTx().
+**/
+EFI_STATUS
+EFIAPI
+VirtioNetTransmitPacket (
+  IN OUT VNET_DEV              *Dev,
+  IN     CONST VIRTIO_NET_REQ  *Offload OPTIONAL,
+  IN     UINTN                 BufferSize,
+  IN     VOID                  *Buffer
+  )
+{
+  EFI_STATUS            Status;
+  UINT16                DescIdx;
+  UINT16                PktIdx;
+  UINT16                Unflushed;
+  EFI_PHYSICAL_ADDRESS  DeviceAddress;
+  VNET_TX_SLOT          *Slot;
+  VIRTIO_1_0_NET_REQ    *TxReq;
+
+  //
+  // check if we have room for transmission
+  //
+  ASSERT (Dev->TxCurPending <= Dev->TxMaxPending);
+  if (Dev->TxCurPending == Dev->TxMaxPending) {
+    return EFI_NOT_READY;
+  }
+
+  DescIdx = Dev->TxFreeStack[Dev->TxCurPending];
+  PktIdx  = VirtioNetTxPktIdx (Dev, DescIdx);
+  Slot    = &Dev->TxSlots[PktIdx];
+
+  if (BufferSize <= VNET_TX_BOUNCE_SIZE) {
+    CopyMem (Dev->TxBounce + PktIdx * VNET_TX_BOUNCE_SIZE, Buffer, BufferSize);
+    DeviceAddress = Dev->TxBounceDeviceBase + PktIdx * VNET_TX_BOUNCE_SIZE;
+    Slot->BufMap  = NULL;
+  } else {
+    //
+    // Map the transmit buffer system physical address to device address.
+    //
+    Status = VirtioMapAllBytesInSharedBuffer (
+               Dev->VirtIo,
+               VirtioOperationBusMasterRead,
+               Buffer,
+               BufferSize,
+               &DeviceAddress,
+               &Slot->BufMap
+               );
+    if (EFI_ERROR (Status)) {
+      Slot->BufMap = NULL;
+      return EFI_DEVICE_ERROR;
+    }
+  }
+
+  //
+  // GetStatus() returns the caller's buffer from the slot, whether or not it
+  // has been bounced.
+  //
+  Slot->Buffer = Buffer;
+
+  //
+  // virtio-0.9.5, 2.4.1 Supplying Buffers to The Device
+  //
+  Dev->TxCurPending++;
+  VirtioNetTxDataDesc (Dev, DescIdx)->Addr = DeviceAddress;
+  VirtioNetTxDataDesc (Dev, DescIdx)->Len  = (UINT32)BufferSize;
+
+  //
+  // virtio-0.9.5, Appendix C, Packet Transmission -- the header of the chain
+  // may still carry the offload request of an earlier packet
+  //
+  TxReq = &Dev->TxReq[PktIdx];
+  if (Offload == NULL) {
+    ZeroMem (&TxReq->V0_9_5, sizeof TxReq->V0_9_5);
+  } else {
+    CopyMem (&TxReq->V0_9_5, Offload, sizeof TxReq->V0_9_5);
+  }
+
+  //
+  // The Available Ring entry is only published by VirtioNetFlushTx().
+  //
+  Dev->TxRing.Avail.Ring[Dev->TxNextAvail++ % Dev->TxRing.QueueSize] = DescIdx;
+  ++Dev->TxFrames;
+
+  //
+  // Batch only behind packets that the host is still transmitting. An idle
+  // host would leave the packet waiting for the flush timer, which cannot
+  // fire before the next tick of the platform timer; lock-step protocols
+  // would be slowed down to one packet per tick.
+  //
+  Unflushed = (UINT16)(Dev->TxNextAvail - *Dev->TxRing.Avail.Idx);
+  MemoryFence ();
+  if ((Unflushed >= Dev->TxBatch) ||
+      (Dev->TxCurPending == Dev->TxMaxPending) ||
+      (*Dev->TxRing.Used.Idx == *Dev->TxRing.Avail.Idx))
+  {
+    return VirtioNetFlushTx (Dev);
+  }
+
+  //
+  // The first packet of a batch starts the window after which the batch is
+  // flushed anyway.
+  //
+  if (Unflushed == 1) {
+    gBS->SetTimer (
+           Dev->TxFlushTimer,
+           TimerRelative,
+           MultU64x32 (PcdGet32 (PcdVirtioNetTxFlushTimeout), 10)
+           );
+  }
+
+  return EFI_SUCCESS;
+}
+
 /**
   Places a packet in the transmit queue of a network interface.
 
@@ -66,12 +264,9 @@ VirtioNetTransmit (
   IN UINT16                       *Protocol OPTIONAL
   )
 {
-  VNET_DEV              *Dev;
-  EFI_TPL               OldTpl;
-  EFI_STATUS            Status;
-  UINT16                DescIdx;
-  UINT16                AvailIdx;
-  EFI_PHYSICAL_ADDRESS  DeviceAddress;
+  VNET_DEV    *Dev;
+  EFI_TPL     OldTpl;
+  EFI_STATUS  Status;
 
   if ((This == NULL) || (BufferSize == 0) || (Buffer == NULL)) {
     return EFI_INVALID_PARAMETER;
@@ -101,9 +296,8 @@ VirtioNetTransmit (
   }
 
   //
-  // check if we have room for transmission
+  // check if we have room for transmission, before touching the packet
   //
-  ASSERT (Dev->TxCurPending <= Dev->TxMaxPending);
   if (Dev->TxCurPending == Dev->TxMaxPending) {
     Status = EFI_NOT_READY;
     goto Exit;
@@ -142,39 +336,7 @@ VirtioNetTransmit (
     ASSERT ((UINTN)(Ptr - (UINT8 *)Buffer) == Dev->Snm.MediaHeaderSize);
   }
 
-  //
-  // Map the transmit buffer system physical address to device address.
-  //
-  Status = VirtioNetMapTxBuf (
-             Dev,
-             Buffer,
-             BufferSize,
-             &DeviceAddress
-             );
-  if (EFI_ERROR (Status)) {
-    Status = EFI_DEVICE_ERROR;
-    goto Exit;
-  }
-
-  //
-  // virtio-0.9.5, 2.4.1 Supplying Buffers to The Device
-  //
-  DescIdx                            = Dev->TxFreeStack[Dev->TxCurPending++];
-  Dev->TxRing.Desc[DescIdx + 1].Addr = DeviceAddress;
-  Dev->TxRing.Desc[DescIdx + 1].Len  = (UINT32)BufferSize;
-
-  //
-  // the available index is never written by the host, we can read it back
-  // without a barrier
-  //
-  AvailIdx                                                   = *Dev->TxRing.Avail.Idx;
-  Dev->TxRing.Avail.Ring[AvailIdx++ % Dev->TxRing.QueueSize] = DescIdx;
-
-  MemoryFence ();
-  *Dev->TxRing.Avail.Idx = AvailIdx;
-
-  MemoryFence ();
-  Status = Dev->VirtIo->SetQueueNotify (Dev->VirtIo, VIRTIO_NET_Q_TX);
+  Status = VirtioNetTransmitPacket (Dev, NULL, BufferSize, Buffer);
 
 Exit:
   gBS->RestoreTPL (OldTpl);
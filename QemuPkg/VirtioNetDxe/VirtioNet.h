@@ -20,15 +20,32 @@
 #include <Protocol/DevicePath.h>
 #include <Protocol/DriverBinding.h>
 #include <Protocol/SimpleNetwork.h>
-#include <Library/OrderedCollectionLib.h>
+#include <Protocol/VirtioNetOffload.h>
 
 #define VNET_SIG  SIGNATURE_32 ('V', 'N', 'E', 'T')
 
 //
-// maximum number of pending packets, separately for each direction
+// maximum number of pending TX packets; the number of RX buffers is set with
+// PcdVirtioNetRxBufferCount
 //
 #define VNET_MAX_PENDING  64
 
+//
+// size of the pre-mapped bounce buffer of each pending TX packet; frames that
+// fit (all full size Ethernet frames) are copied rather than mapped
+//
+#define VNET_TX_BOUNCE_SIZE  1536
+
+//
+// Tracks the caller's buffer of a pending TX packet, in a table indexed by
+// descriptor chain (see VirtioNetTxPktIdx()). BufMap is NULL if the packet has
+// been copied to the bounce buffer of the slot.
+//
+typedef struct {
+  VOID    *Buffer;
+  VOID    *BufMap;
+} VNET_TX_SLOT;
+
 //
 // State diagram:
 //
@@ -73,6 +90,7 @@ typedef struct {
   VIRTIO_DEVICE_PROTOCOL         *VirtIo;        // VirtioNetDriverBindingStart
   EFI_SIMPLE_NETWORK_PROTOCOL    Snp;            // VirtioNetSnpPopulate
   EFI_SIMPLE_NETWORK_MODE        Snm;            // VirtioNetSnpPopulate
+  VIRTIO_NET_OFFLOAD_PROTOCOL    Offload;        // VirtioNetSnpPopulate
   EFI_EVENT                      ExitBoot;       // VirtioNetSnpPopulate
   EFI_DEVICE_PATH_PROTOCOL       *MacDevicePath; // VirtioNetDriverBindingStart
   EFI_HANDLE                     MacHandle;      // VirtioNetDriverBindingStart
@@ -80,22 +98,42 @@ typedef struct {
   VRING                          RxRing;          // VirtioNetInitRing
   VOID                           *RxRingMap;      // VirtioRingMap and
                                                   // VirtioNetInitRing
+  BOOLEAN                        RxMergeable;     // VirtioNetInitialize
   UINT8                          *RxBuf;          // VirtioNetInitRx
+  UINT32                         RxReqSize;       // VirtioNetInitRx
+  UINT32                         RxBufSize;       // VirtioNetInitRx
   UINT16                         RxLastUsed;      // VirtioNetInitRx
   UINTN                          RxBufNrPages;    // VirtioNetInitRx
   EFI_PHYSICAL_ADDRESS           RxBufDeviceBase; // VirtioNetInitRx
   VOID                           *RxBufMap;       // VirtioNetInitRx
-
-  VRING                          TxRing;           // VirtioNetInitRing
-  VOID                           *TxRingMap;       // VirtioRingMap and
-                                                   // VirtioNetInitRing
-  UINT16                         TxMaxPending;     // VirtioNetInitTx
-  UINT16                         TxCurPending;     // VirtioNetInitTx
-  UINT16                         *TxFreeStack;     // VirtioNetInitTx
-  VIRTIO_1_0_NET_REQ             *TxSharedReq;     // VirtioNetInitTx
-  VOID                           *TxSharedReqMap;  // VirtioNetInitTx
-  UINT16                         TxLastUsed;       // VirtioNetInitTx
-  ORDERED_COLLECTION             *TxBufCollection; // VirtioNetInitTx
+  UINT16                         RxNextAvail;     // VirtioNetInitRx
+  UINT16                         RxWatermark;     // VirtioNetInitRx
+  UINT64                         RxFrames;        // VirtioNetInitRx
+  UINT64                         RxBytes;         // VirtioNetInitRx
+  UINT64                         RxFlushes;       // VirtioNetInitRx
+  UINT64                         RxKicks;         // VirtioNetInitRx
+
+  VRING                          TxRing;              // VirtioNetInitRing
+  VOID                           *TxRingMap;          // VirtioRingMap and
+                                                      // VirtioNetInitRing
+  BOOLEAN                        TxIndirectDesc;      // VirtioNetInitialize
+  VIRTIO_INDIRECT_POOL           TxIndirectPool;      // VirtioNetInitTx
+  UINT16                         TxMaxPending;        // VirtioNetInitTx
+  UINT16                         TxCurPending;        // VirtioNetInitTx
+  UINT16                         *TxFreeStack;        // VirtioNetInitTx
+  VNET_TX_SLOT                   *TxSlots;            // VirtioNetInitTx
+  VIRTIO_1_0_NET_REQ             *TxReq;              // VirtioNetInitTx
+  VOID                           *TxReqMap;           // VirtioNetInitTx
+  UINT8                          *TxBounce;           // VirtioNetInitTx
+  EFI_PHYSICAL_ADDRESS           TxBounceDeviceBase;  // VirtioNetInitTx
+  VOID                           *TxBounceMap;        // VirtioNetInitTx
+  UINT16                         TxLastUsed;          // VirtioNetInitTx
+  UINT16                         TxNextAvail;         // VirtioNetInitTx
+  UINT16                         TxBatch;             // VirtioNetInitTx
+  EFI_EVENT                      TxFlushTimer;        // VirtioNetInitTx
+  UINT64                         TxFrames;            // VirtioNetInitTx
+  UINT64                         TxFlushes;           // VirtioNetInitTx
+  UINT64                         TxKicks;             // VirtioNetInitTx
 } VNET_DEV;
 
 //
@@ -111,6 +149,9 @@ typedef struct {
 #define VIRTIO_NET_FROM_SNP(SnpPointer) \
         CR (SnpPointer, VNET_DEV, Snp, VNET_SIG)
 
+#define VIRTIO_NET_FROM_OFFLOAD(OffloadPointer) \
+        CR (OffloadPointer, VNET_DEV, Offload, VNET_SIG)
+
 #define VIRTIO_CFG_WRITE(Dev, Field, Value)  ((Dev)->VirtIo->WriteDevice (  \
                                                 (Dev)->VirtIo,              \
                                                 OFFSET_OF_VNET (Field),     \
@@ -252,6 +293,27 @@ VirtioNetReceive (
   OUT UINT16                      *Protocol   OPTIONAL
   );
 
+//
+// member functions implementing the Virtio-net Offload Protocol
+//
+EFI_STATUS
+EFIAPI
+VirtioNetOffloadTransmit (
+  IN VIRTIO_NET_OFFLOAD_PROTOCOL  *This,
+  IN CONST VIRTIO_NET_REQ         *Offload,
+  IN UINTN                        BufferSize,
+  IN VOID                         *Buffer
+  );
+
+EFI_STATUS
+EFIAPI
+VirtioNetOffloadReceive (
+  IN     VIRTIO_NET_OFFLOAD_PROTOCOL  *This,
+  IN OUT UINTN                        *BufferSize,
+  OUT    VOID                         *Buffer,
+  OUT    BOOLEAN                      *ChecksumValid
+  );
+
 //
 // utility functions shared by various SNP member functions
 //
@@ -267,6 +329,24 @@ VirtioNetShutdownTx (
   IN OUT VNET_DEV  *Dev
   );
 
+VOID
+EFIAPI
+VirtioNetRxLogStats (
+  IN VNET_DEV  *Dev
+  );
+
+VOID
+EFIAPI
+VirtioNetTxLogStats (
+  IN VNET_DEV  *Dev
+  );
+
+UINT64
+EFIAPI
+VirtioNetOffloadFeatures (
+  IN UINT64  Features
+  );
+
 VOID
 EFIAPI
 VirtioNetUninitRing (
@@ -275,39 +355,42 @@ VirtioNetUninitRing (
   IN     VOID      *RingMap
   );
 
-//
-// utility functions to map caller-supplied Tx buffer system physical address
-// to a device address and vice versa
-//
-EFI_STATUS
+volatile VRING_DESC *
 EFIAPI
-VirtioNetMapTxBuf (
-  IN  VNET_DEV              *Dev,
-  IN  VOID                  *Buffer,
-  IN  UINTN                 NumberOfBytes,
-  OUT EFI_PHYSICAL_ADDRESS  *DeviceAddress
+VirtioNetTxDataDesc (
+  IN VNET_DEV  *Dev,
+  IN UINT16    DescIdx
+  );
+
+UINT16
+EFIAPI
+VirtioNetTxPktIdx (
+  IN VNET_DEV  *Dev,
+  IN UINT16    DescIdx
   );
 
 EFI_STATUS
 EFIAPI
-VirtioNetUnmapTxBuf (
-  IN  VNET_DEV              *Dev,
-  OUT VOID                  **Buffer,
-  IN  EFI_PHYSICAL_ADDRESS  DeviceAddress
+VirtioNetTransmitPacket (
+  IN OUT VNET_DEV              *Dev,
+  IN     CONST VIRTIO_NET_REQ  *Offload OPTIONAL,
+  IN     UINTN                 BufferSize,
+  IN     VOID                  *Buffer
   );
 
-INTN
+EFI_STATUS
 EFIAPI
-VirtioNetTxBufMapInfoCompare (
-  IN CONST VOID  *UserStruct1,
-  IN CONST VOID  *UserStruct2
+VirtioNetFlushTx (
+  IN OUT VNET_DEV  *Dev
   );
 
-INTN
+EFI_STATUS
 EFIAPI
-VirtioNetTxBufDeviceAddressCompare (
-  IN CONST VOID  *StandaloneKey,
-  IN CONST VOID  *UserStruct
+VirtioNetReceivePacket (
+  IN OUT VNET_DEV  *Dev,
+  IN OUT UINTN     *BufferSize,
+  OUT    VOID      *Buffer,
+  OUT    BOOLEAN   *ChecksumValid OPTIONAL
   );
 
 //
@@ -327,4 +410,11 @@ VirtioNetExitBoot (
   IN  VOID       *Context
   );
 
+VOID
+EFIAPI
+VirtioNetTxFlushTimer (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  );
+
 #endif // _VIRTIO_NET_DXE_H_
@@ -19,6 +19,7 @@
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiLib.h>
 #include <Library/VirtioLib.h>
@@ -88,10 +89,169 @@ VirtioRngGetInfo (
   return EFI_SUCCESS;
 }
 
+/**
+  Collect the chunks of the entropy pool that the device has filled since the
+  last call.
+
+  @param[in,out] Dev  The virtio-rng device.
+**/
+STATIC
+VOID
+VirtioRngReapPool (
+  IN OUT VIRTIO_RNG_DEV  *Dev
+  )
+{
+  EFI_STATUS        Status;
+  VOID              *Token;
+  UINT32            Len;
+  VIRTIO_RNG_CHUNK  *Chunk;
+
+  for ( ; ;) {
+    Status = VirtioRequestPoll (&Dev->ReqQueue, &Token, &Len);
+    if (Status == EFI_NOT_READY) {
+      return;
+    }
+
+    //
+    // A bogus used element has been skipped; its chunk, if any, stays in
+    // flight.
+    //
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    Chunk         = Token;
+    Chunk->Len    = MIN (Len, VIRTIO_RNG_CHUNK_SIZE);
+    Chunk->Offset = 0;
+    if (Chunk->Len == 0) {
+      Chunk->State = VirtioRngChunkEmpty;
+    } else {
+      Chunk->State    = VirtioRngChunkReady;
+      Dev->Available += Chunk->Len;
+    }
+  }
+}
+
+/**
+  Submit the empty chunks of the entropy pool to the device for filling, and
+  notify the device. The chunks are filled asynchronously.
+
+  @param[in,out] Dev  The virtio-rng device.
+
+  @retval EFI_SUCCESS  Every empty chunk has been submitted.
+
+  @return              Error codes from VirtioRequestNotify().
+**/
+STATIC
+EFI_STATUS
+VirtioRngRefillPool (
+  IN OUT VIRTIO_RNG_DEV  *Dev
+  )
+{
+  UINT16        Idx;
+  BOOLEAN       Submitted;
+  DESC_INDICES  Indices;
+
+  Submitted = FALSE;
+  for (Idx = 0; Idx < Dev->NumChunks; ++Idx) {
+    if (Dev->Chunks[Idx].State != VirtioRngChunkEmpty) {
+      continue;
+    }
+
+    //
+    // There are no more chunks than ring descriptors, so this never fails in
+    // practice.
+    //
+    if (EFI_ERROR (VirtioRequestReserve (&Dev->ReqQueue, 1, &Indices))) {
+      break;
+    }
+
+    VirtioRequestAppendDesc (
+      &Dev->ReqQueue,
+      Dev->PoolDeviceBase + Idx * VIRTIO_RNG_CHUNK_SIZE,
+      VIRTIO_RNG_CHUNK_SIZE,
+      VRING_DESC_F_WRITE,
+      &Indices
+      );
+    VirtioRequestSubmit (&Dev->ReqQueue, &Indices, &Dev->Chunks[Idx]);
+    Dev->Chunks[Idx].State = VirtioRngChunkInFlight;
+    Submitted              = TRUE;
+  }
+
+  if (!Submitted) {
+    return EFI_SUCCESS;
+  }
+
+  return VirtioRequestNotify (Dev->VirtIo, 0, &Dev->ReqQueue);
+}
+
+/**
+  Hand out entropy from the filled chunks of the pool.
+
+  Every byte that is copied to the caller is wiped from the pool, and its
+  chunk is only submitted for refilling once all of it has been handed out,
+  so no byte is returned twice.
+
+  @param[in,out] Dev     The virtio-rng device.
+
+  @param[in]     Length  The number of bytes wanted.
+
+  @param[out]    Buffer  The buffer to copy the bytes to.
+
+  @return  The number of bytes copied; less than Length if the pool has run
+           dry.
+**/
+STATIC
+UINTN
+VirtioRngDrainPool (
+  IN OUT VIRTIO_RNG_DEV  *Dev,
+  IN     UINTN           Length,
+  OUT    UINT8           *Buffer
+  )
+{
+  UINTN             Copied;
+  UINT32            Size;
+  UINT8             *Data;
+  VIRTIO_RNG_CHUNK  *Chunk;
+
+  Copied = 0;
+  while ((Copied < Length) && (Dev->Available > 0)) {
+    Chunk = &Dev->Chunks[Dev->NextChunk];
+    if (Chunk->State == VirtioRngChunkReady) {
+      Data = Dev->Pool + Dev->NextChunk * VIRTIO_RNG_CHUNK_SIZE + Chunk->Offset;
+      Size = (UINT32)MIN (Chunk->Len - Chunk->Offset, Length - Copied);
+      CopyMem (Buffer + Copied, Data, Size);
+      ZeroMem (Data, Size);
+
+      Chunk->Offset  += Size;
+      Dev->Available -= Size;
+      Copied         += Size;
+
+      //
+      // Keep serving from a partially consumed chunk next time.
+      //
+      if (Chunk->Offset < Chunk->Len) {
+        break;
+      }
+
+      Chunk->State = VirtioRngChunkEmpty;
+    }
+
+    Dev->NextChunk = (UINT16)((Dev->NextChunk + 1) % Dev->NumChunks);
+  }
+
+  return Copied;
+}
+
 /**
   Produces and returns an RNG value using either the default or specified RNG
   algorithm.
 
+  Requests are served from a pre-mapped entropy pool. When the bytes left in
+  the pool drop below PcdVirtioRngPoolLowWater, the consumed chunks are
+  submitted to the device, which refills them while the caller carries on.
+  Only requests that the pool cannot satisfy wait for the device.
+
   @param[in]  This                    A pointer to the EFI_RNG_PROTOCOL
                                       instance.
   @param[in]  RNGAlgorithm            A pointer to the EFI_RNG_ALGORITHM that
@@ -127,15 +287,11 @@ VirtioRngGetRNG (
   OUT UINT8             *RNGValue
   )
 {
-  VIRTIO_RNG_DEV        *Dev;
-  DESC_INDICES          Indices;
-  volatile UINT8        *Buffer;
-  UINTN                 Index;
-  UINT32                Len;
-  UINT32                BufferSize;
-  EFI_STATUS            Status;
-  EFI_PHYSICAL_ADDRESS  DeviceAddress;
-  VOID                  *Mapping;
+  VIRTIO_RNG_DEV       *Dev;
+  EFI_TPL              OldTpl;
+  UINTN                Index;
+  VIRTIO_REQUEST_MARK  Mark;
+  EFI_STATUS           Status;
 
   if ((This == NULL) || (RNGValueLength == 0) || (RNGValue == NULL)) {
     return EFI_INVALID_PARAMETER;
@@ -150,83 +306,156 @@ VirtioRngGetRNG (
     return EFI_UNSUPPORTED;
   }
 
-  Buffer = (volatile UINT8 *)AllocatePool (RNGValueLength);
-  if (Buffer == NULL) {
-    return EFI_DEVICE_ERROR;
-  }
-
   Dev = VIRTIO_ENTROPY_SOURCE_FROM_RNG (This);
+
   //
-  // Map Buffer's system physical address to device address
+  // The pool is shared by all callers.
   //
-  Status = VirtioMapAllBytesInSharedBuffer (
-             Dev->VirtIo,
-             VirtioOperationBusMasterWrite,
-             (VOID *)Buffer,
-             RNGValueLength,
-             &DeviceAddress,
-             &Mapping
-             );
-  if (EFI_ERROR (Status)) {
-    Status = EFI_DEVICE_ERROR;
-    goto FreeBuffer;
-  }
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
 
   //
-  // The Virtio RNG device may return less data than we asked it to, and can
-  // only return MAX_UINT32 bytes per invocation. So loop as long as needed to
-  // get all the entropy we were asked for.
+  // The Virtio RNG device may return less data than we asked it to, and a
+  // request may exceed the pool. So loop as long as needed to get all the
+  // entropy we were asked for.
   //
-  for (Index = 0; Index < RNGValueLength; Index += Len) {
-    BufferSize = (UINT32)MIN (RNGValueLength - Index, (UINTN)MAX_UINT32);
+  Index = 0;
+  for ( ; ;) {
+    VirtioRngReapPool (Dev);
+    Index += VirtioRngDrainPool (
+               Dev,
+               RNGValueLength - Index,
+               RNGValue + Index
+               );
 
-    VirtioPrepare (&Dev->Ring, &Indices);
-    VirtioAppendDesc (
-      &Dev->Ring,
-      DeviceAddress + Index,
-      BufferSize,
-      VRING_DESC_F_WRITE,
-      &Indices
-      );
+    if ((Index < RNGValueLength) || (Dev->Available < Dev->LowWater)) {
+      Status = VirtioRngRefillPool (Dev);
+      if (EFI_ERROR (Status)) {
+        Status = EFI_DEVICE_ERROR;
+        break;
+      }
+    }
+
+    if (Index == RNGValueLength) {
+      Status = EFI_SUCCESS;
+      break;
+    }
 
-    if (VirtioFlush (Dev->VirtIo, 0, &Dev->Ring, &Indices, &Len) !=
-        EFI_SUCCESS)
-    {
+    //
+    // Only the pool and the ring need TPL_NOTIFY; wait for the host at the
+    // caller's TPL. Another caller may reap the completion in the meantime,
+    // which the mark also covers.
+    //
+    Status = VirtioRequestMark (&Dev->ReqQueue, &Mark);
+    if (EFI_ERROR (Status)) {
       Status = EFI_DEVICE_ERROR;
-      goto UnmapBuffer;
+      break;
     }
 
-    ASSERT (Len > 0);
-    ASSERT (Len <= BufferSize);
+    gBS->RestoreTPL (OldTpl);
+    VirtioRequestWaitMark (&Mark, &Dev->WaitPolicy);
+    gBS->RaiseTPL (TPL_NOTIFY);
   }
 
-  //
-  // Unmap the device buffer before accessing it.
-  //
-  Status = Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Mapping);
+  gBS->RestoreTPL (OldTpl);
+  return Status;
+}
+
+/**
+  Allocate and map the entropy pool, and carve it into chunks.
+
+  The pool is sized by PcdVirtioRngPoolSize, rounded up to whole chunks, and
+  limited to one chunk per ring descriptor. It is mapped with
+  BusMasterCommonBuffer, so that it can be filled and read repeatedly without
+  remapping.
+
+  @param[in,out] Dev  The virtio-rng device, with its ring set up.
+
+  @retval EFI_SUCCESS           The pool is ready to be filled.
+
+  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
+
+  @return                       Error codes from AllocateSharedPages() or
+                                VirtioMapAllBytesInSharedBuffer().
+**/
+STATIC
+EFI_STATUS
+VirtioRngInitPool (
+  IN OUT VIRTIO_RNG_DEV  *Dev
+  )
+{
+  UINT32      NumChunks;
+  VOID        *Pool;
+  EFI_STATUS  Status;
+
+  NumChunks = (PcdGet32 (PcdVirtioRngPoolSize) + VIRTIO_RNG_CHUNK_SIZE - 1) /
+              VIRTIO_RNG_CHUNK_SIZE;
+  NumChunks = MIN (MAX (NumChunks, 1), Dev->Ring.QueueSize);
+
+  Dev->NumChunks = (UINT16)NumChunks;
+  Dev->Chunks    = AllocateZeroPool (NumChunks * sizeof *Dev->Chunks);
+  if (Dev->Chunks == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Dev->PoolPages = EFI_SIZE_TO_PAGES (NumChunks * VIRTIO_RNG_CHUNK_SIZE);
+  Status         = Dev->VirtIo->AllocateSharedPages (
+                                  Dev->VirtIo,
+                                  Dev->PoolPages,
+                                  &Pool
+                                  );
   if (EFI_ERROR (Status)) {
-    Status = EFI_DEVICE_ERROR;
-    goto FreeBuffer;
+    goto FreeChunks;
   }
 
-  for (Index = 0; Index < RNGValueLength; Index++) {
-    RNGValue[Index] = Buffer[Index];
+  Status = VirtioMapAllBytesInSharedBuffer (
+             Dev->VirtIo,
+             VirtioOperationBusMasterCommonBuffer,
+             Pool,
+             NumChunks * VIRTIO_RNG_CHUNK_SIZE,
+             &Dev->PoolDeviceBase,
+             &Dev->PoolMap
+             );
+  if (EFI_ERROR (Status)) {
+    goto FreeSharedPages;
   }
 
-  Status = EFI_SUCCESS;
+  Dev->Pool      = Pool;
+  Dev->NextChunk = 0;
+  Dev->Available = 0;
+  Dev->LowWater  = MIN (
+                     PcdGet32 (PcdVirtioRngPoolLowWater),
+                     NumChunks * VIRTIO_RNG_CHUNK_SIZE
+                     );
+  return EFI_SUCCESS;
+
+FreeSharedPages:
+  Dev->VirtIo->FreeSharedPages (Dev->VirtIo, Dev->PoolPages, Pool);
+
+FreeChunks:
+  FreePool (Dev->Chunks);
 
-UnmapBuffer:
+  return Status;
+}
+
+/**
+  Wipe and release the entropy pool. The device must have been reset.
+
+  @param[in,out] Dev  The virtio-rng device.
+**/
+STATIC
+VOID
+VirtioRngUninitPool (
+  IN OUT VIRTIO_RNG_DEV  *Dev
+  )
+{
   //
-  // If we are reached here due to the error then unmap the buffer otherwise
-  // the buffer is already unmapped after VirtioFlush().
+  // Don't leave unused entropy behind in free memory.
   //
-  if (EFI_ERROR (Status)) {
-    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Mapping);
-  }
+  ZeroMem (Dev->Pool, Dev->NumChunks * VIRTIO_RNG_CHUNK_SIZE);
 
-FreeBuffer:
-  FreePool ((VOID *)Buffer);
-  return Status;
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->PoolMap);
+  Dev->VirtIo->FreeSharedPages (Dev->VirtIo, Dev->PoolPages, Dev->Pool);
+  FreePool (Dev->Chunks);
 }
 
 STATIC
@@ -306,7 +535,7 @@ VirtioRngInit (
   }
 
   //
-  // VirtioRngGetRNG() uses one descriptor
+  // VirtioRngRefillPool() uses one descriptor per chunk
   //
   if (QueueSize < 1) {
     Status = EFI_UNSUPPORTED;
@@ -357,6 +586,19 @@ VirtioRngInit (
     goto UnmapQueue;
   }
 
+  //
+  // The chunks of the entropy pool are filled concurrently.
+  //
+  Status = VirtioRequestQueueInit (&Dev->Ring, &Dev->ReqQueue);
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
+  Status = VirtioRngInitPool (Dev);
+  if (EFI_ERROR (Status)) {
+    goto UninitReqQueue;
+  }
+
   //
   // step 5 -- Report understood features and guest-tuneables.
   //
@@ -364,7 +606,7 @@ VirtioRngInit (
     Features &= ~(UINT64)(VIRTIO_F_VERSION_1 | VIRTIO_F_IOMMU_PLATFORM);
     Status    = Dev->VirtIo->SetGuestFeatures (Dev->VirtIo, Features);
     if (EFI_ERROR (Status)) {
-      goto UnmapQueue;
+      goto UninitPool;
     }
   }
 
@@ -374,7 +616,23 @@ VirtioRngInit (
   NextDevStat |= VSTAT_DRIVER_OK;
   Status       = Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, NextDevStat);
   if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+    goto UninitPool;
+  }
+
+  VirtioWaitPolicyInit (&Dev->WaitPolicy, PcdGet32 (PcdVirtioPollSpinUsecs));
+
+  //
+  // Fill the pool before the first request arrives.
+  //
+  Status = VirtioRngRefillPool (Dev);
+  if (EFI_ERROR (Status)) {
+    //
+    // The device may be filling chunks already; stop it before the pool is
+    // released.
+    //
+    NextDevStat = 0;
+    Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, NextDevStat);
+    goto UninitPool;
   }
 
   //
@@ -385,6 +643,12 @@ VirtioRngInit (
 
   return EFI_SUCCESS;
 
+UninitPool:
+  VirtioRngUninitPool (Dev);
+
+UninitReqQueue:
+  VirtioRequestQueueUninit (&Dev->ReqQueue);
+
 UnmapQueue:
   Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
 
@@ -416,9 +680,14 @@ VirtioRngUninit (
   //
   Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, 0);
 
+  VirtioRngUninitPool (Dev);
+  VirtioRequestQueueUninit (&Dev->ReqQueue);
+
   Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
 
   VirtioRingUninit (Dev->VirtIo, &Dev->Ring);
+
+  VirtioWaitPolicyLogStats (__FUNCTION__, &Dev->WaitPolicy);
 }
 
 //
@@ -16,9 +16,28 @@
 #include <Protocol/Rng.h>
 
 #include <IndustryStandard/Virtio.h>
+#include <Library/VirtioLib.h>
 
 #define VIRTIO_RNG_SIG  SIGNATURE_32 ('V', 'R', 'N', 'G')
 
+//
+// The entropy pool is carved into chunks of this size; each chunk is filled by
+// one request to the device.
+//
+#define VIRTIO_RNG_CHUNK_SIZE  512
+
+typedef enum {
+  VirtioRngChunkEmpty,    // consumed, may be submitted for refill
+  VirtioRngChunkInFlight, // submitted to the device
+  VirtioRngChunkReady     // filled by the device, Offset < Len
+} VIRTIO_RNG_CHUNK_STATE;
+
+typedef struct {
+  VIRTIO_RNG_CHUNK_STATE    State;
+  UINT32                    Len;    // bytes the device has written
+  UINT32                    Offset; // bytes handed out so far
+} VIRTIO_RNG_CHUNK;
+
 typedef struct {
   //
   // Parts of this structure are initialized / torn down in various functions
@@ -33,6 +52,17 @@ typedef struct {
   VRING                     Ring;           // VirtioRingInit       2
   EFI_RNG_PROTOCOL          Rng;            // VirtioRngInit        1
   VOID                      *RingMap;       // VirtioRingMap        2
+  VIRTIO_WAIT_POLICY        WaitPolicy;     // VirtioRngInit        1
+  VIRTIO_REQUEST_QUEUE      ReqQueue;       // VirtioRngInit        1
+  UINT8                     *Pool;          // VirtioRngInitPool    2
+  UINTN                     PoolPages;      // VirtioRngInitPool    2
+  EFI_PHYSICAL_ADDRESS      PoolDeviceBase; // VirtioRngInitPool    2
+  VOID                      *PoolMap;       // VirtioRngInitPool    2
+  VIRTIO_RNG_CHUNK          *Chunks;        // VirtioRngInitPool    2
+  UINT16                    NumChunks;      // VirtioRngInitPool    2
+  UINT16                    NextChunk;      // VirtioRngInitPool    2
+  UINT32                    Available;      // VirtioRngInitPool    2
+  UINT32                    LowWater;       // VirtioRngInitPool    2
 } VIRTIO_RNG_DEV;
 
 #define VIRTIO_ENTROPY_SOURCE_FROM_RNG(RngPointer) \
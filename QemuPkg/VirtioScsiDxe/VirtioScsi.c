@@ -5,18 +5,21 @@
 
   The implementation is basic:
 
-  - No hotplug / hot-unplug.
+  - No hotplug / hot-unplug. The populated target / LUN pairs are found with
+    REPORT LUNS on the first enumeration, and cached from then on.
 
-  - Although EFI_EXT_SCSI_PASS_THRU_PROTOCOL.PassThru() could be a good match
-    for multiple in-flight virtio-scsi requests, we stick to synchronous
-    requests for now.
+  - EFI_EXT_SCSI_PASS_THRU_PROTOCOL.PassThru() supports non-blocking
+    requests; any number of them may be in flight, up to the size of the
+    request queue. Completions are reaped by a periodic timer, which signals
+    the caller's event.
 
   - Timeouts are not supported for EFI_EXT_SCSI_PASS_THRU_PROTOCOL.PassThru().
 
   - Only one channel is supported. (At the time of this writing, host-side
     virtio-scsi supports a single channel too.)
 
-  - Only one request queue is used (for the one synchronous request).
+  - Commands are spread over as many request queues as the device offers,
+    up to PcdVirtioScsiMaxQueues.
 
   - The ResetChannel() and ResetTargetLun() functions of
     EFI_EXT_SCSI_PASS_THRU_PROTOCOL are not supported (which is allowed by the
@@ -33,6 +36,7 @@
 
 **/
 
+#include <IndustryStandard/Scsi.h>
 #include <IndustryStandard/VirtioScsi.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
@@ -410,298 +414,879 @@ ReportHostAdapterError (
   return EFI_DEVICE_ERROR;
 }
 
-//
-// The next seven functions implement EFI_EXT_SCSI_PASS_THRU_PROTOCOL
-// for the virtio-scsi HBA. Refer to UEFI Spec 2.3.1 + Errata C, sections
-// - 14.1 SCSI Driver Model Overview,
-// - 14.7 Extended SCSI Pass Thru Protocol.
-//
+/**
+
+  Release the resources of a request that the host has completed, and report
+  its outcome in the Extended SCSI Pass Thru Protocol packet.
+
+  @param[in] Dev  The virtio-scsi host device the request was targeted at.
+
+  @param[in] Req  The request to finalize.
+
+  @return  PassThru() status codes mandated by UEFI Spec 2.3.1 + Errata C, 14.7
+           Extended SCSI Pass Thru Protocol.
 
+**/
+STATIC
 EFI_STATUS
+FinalizeRequest (
+  IN VSCSI_DEV  *Dev,
+  IN VSCSI_REQ  *Req
+  )
+{
+  EFI_STATUS  Status;
+  EFI_STATUS  UnmapStatus;
+
+  Status = ParseResponse (Req->Packet, &Req->Shared->Response);
+
+  if (Req->OutTransferLength > 0) {
+    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Req->OutDataMapping);
+  }
+
+  if (Req->InTransferLength > 0) {
+    UnmapStatus = Dev->VirtIo->UnmapSharedBuffer (
+                                 Dev->VirtIo,
+                                 Req->InDataMapping
+                                 );
+    if (EFI_ERROR (UnmapStatus)) {
+      //
+      // Data from the bus master may not reach the caller; report the full
+      // loss of the incoming transfer.
+      //
+      Status = ReportHostAdapterError (Req->Packet);
+    }
+  }
+
+  VirtioDmaSlabFree (
+    &Dev->Queues[Req->QueueIndex].ReqSlab,
+    (VOID *)Req->Shared
+    );
+  return Status;
+}
+
+/**
+
+  Finalize a request that the host has completed. A non-blocking request has
+  its event signaled and is released, and stops holding the poll timer; a
+  blocking request is marked completed, to be released by its submitter.
+
+  Called by VirtioRequestProcessCompletions() at TPL_NOTIFY.
+
+  @param[in] Context     The virtio-scsi host device (VSCSI_DEV).
+
+  @param[in] QueueIndex  The request queue the request was submitted to.
+
+  @param[in] Token       The completed request (VSCSI_REQ).
+
+**/
+STATIC
+VOID
 EFIAPI
-VirtioScsiPassThru (
-  IN     EFI_EXT_SCSI_PASS_THRU_PROTOCOL             *This,
-  IN     UINT8                                       *Target,
+CompleteRequest (
+  IN VOID    *Context,
+  IN UINT16  QueueIndex,
+  IN VOID    *Token
+  )
+{
+  VSCSI_DEV   *Dev;
+  VSCSI_REQ   *Req;
+  EFI_STATUS  Status;
+
+  Dev = Context;
+  Req = Token;
+  ASSERT (Req->Signature == VSCSI_REQ_SIG);
+  ASSERT (Req->QueueIndex == QueueIndex);
+
+  Status = FinalizeRequest (Dev, Req);
+  if (Req->Event == NULL) {
+    Req->Status    = Status;
+    Req->Completed = TRUE;
+    return;
+  }
+
+  gBS->SignalEvent (Req->Event);
+  FreePool (Req);
+
+  VirtioRequestPollTimerRelease (&Dev->Requests);
+}
+
+/**
+
+  Translate an Extended SCSI Pass Thru Protocol packet to a virtio-scsi
+  request, and submit it to the host without waiting for completion.
+
+  The caller's data buffers are mapped for the bus master directly; they must
+  stay valid until the request completes.
+
+  The caller is responsible for running at TPL_NOTIFY.
+
+  @param[in]     Dev     The virtio-scsi host device the packet targets.
+
+  @param[in]     Target  The SCSI target controlled by the virtio-scsi host
+                         device.
+
+  @param[in]     Lun     The Logical Unit Number under the SCSI target.
+
+  @param[in,out] Packet  The Extended SCSI Pass Thru Protocol packet to
+                         submit. On failure this parameter relays error
+                         contents.
+
+  @param[in]     Event   If NULL, the caller will wait for (*Req)->Completed,
+                         and release *Req. Otherwise, Event is signaled and
+                         the request is released when the host completes it;
+                         *Req must not be accessed.
+
+  @param[in]     WaitTpl The TPL to wait at if the ring is full, see
+                         VirtioRequestWaitForQueue().
+
+  @param[out]    Req     On success, the tracking structure of the request.
+
+  @retval EFI_SUCCESS  The request has been submitted.
+
+  @return              Otherwise, the request has not been submitted. Status
+                       codes are meant for direct forwarding by the
+                       EFI_EXT_SCSI_PASS_THRU_PROTOCOL.PassThru()
+                       implementation.
+
+**/
+STATIC
+EFI_STATUS
+SubmitRequest (
+  IN     VSCSI_DEV                                   *Dev,
+  IN     UINT16                                      Target,
   IN     UINT64                                      Lun,
   IN OUT EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET  *Packet,
-  IN     EFI_EVENT                                   Event   OPTIONAL
+  IN     EFI_EVENT                                   Event   OPTIONAL,
+  IN     EFI_TPL                                     WaitTpl,
+  OUT    VSCSI_REQ                                   **Req
   )
 {
-  VSCSI_DEV                  *Dev;
-  UINT16                     TargetValue;
-  EFI_STATUS                 Status;
-  volatile VIRTIO_SCSI_REQ   Request;
-  volatile VIRTIO_SCSI_RESP  *Response;
-  VOID                       *ResponseBuffer;
-  DESC_INDICES               Indices;
-  VOID                       *RequestMapping;
-  VOID                       *ResponseMapping;
-  VOID                       *InDataMapping;
-  VOID                       *OutDataMapping;
-  EFI_PHYSICAL_ADDRESS       RequestDeviceAddress;
-  EFI_PHYSICAL_ADDRESS       ResponseDeviceAddress;
-  EFI_PHYSICAL_ADDRESS       InDataDeviceAddress;
-  EFI_PHYSICAL_ADDRESS       OutDataDeviceAddress;
-  VOID                       *InDataBuffer;
-  UINTN                      InDataNumPages;
-  BOOLEAN                    OutDataBufferIsMapped;
-
-  //
-  // Set InDataMapping,OutDataMapping,InDataDeviceAddress and OutDataDeviceAddress to
-  // suppress incorrect compiler/analyzer warnings.
-  //
-  InDataMapping        = NULL;
-  OutDataMapping       = NULL;
+  VSCSI_REQ             *NewReq;
+  VSCSI_QUEUE           *Queue;
+  VIRTIO_INDIRECT_POOL  *Pool;
+  VOID                  *Shared;
+  UINT16                NumDesc;
+  DESC_INDICES          Indices;
+  DESC_INDICES          ChainIndices;
+  EFI_PHYSICAL_ADDRESS  InDataDeviceAddress;
+  EFI_PHYSICAL_ADDRESS  OutDataDeviceAddress;
+  EFI_STATUS            Status;
+
+  //
+  // Set InDataDeviceAddress and OutDataDeviceAddress to suppress incorrect
+  // compiler/analyzer warnings.
+  //
   InDataDeviceAddress  = 0;
   OutDataDeviceAddress = 0;
 
-  ZeroMem ((VOID *)&Request, sizeof (Request));
+  NewReq = AllocateZeroPool (sizeof *NewReq);
+  if (NewReq == NULL) {
+    return ReportHostAdapterError (Packet);
+  }
 
-  Dev = VIRTIO_SCSI_FROM_PASS_THRU (This);
-  CopyMem (&TargetValue, Target, sizeof TargetValue);
+  NewReq->Signature = VSCSI_REQ_SIG;
+  NewReq->Packet    = Packet;
+  NewReq->Event     = Event;
+
+  //
+  // Reserve the descriptors (request, dataout, response, datain); if the ring
+  // is full, make room by reaping completions. VirtioScsiInitQueue() ensures
+  // each ring fits at least one chain.
+  //
+  NumDesc = 2;
+  if (Packet->OutTransferLength > 0) {
+    NumDesc++;
+  }
 
-  InDataBuffer          = NULL;
-  OutDataBufferIsMapped = FALSE;
-  InDataNumPages        = 0;
+  if (Packet->InTransferLength > 0) {
+    NumDesc++;
+  }
 
-  Status = PopulateRequest (Dev, TargetValue, Lun, Packet, &Request);
-  if (EFI_ERROR (Status)) {
-    return Status;
+  NewReq->QueueIndex = VirtioRequestSelectQueue (&Dev->Requests);
+  Queue              = &Dev->Queues[NewReq->QueueIndex];
+  Pool               = Dev->IndirectDesc ? &Queue->Indirect : NULL;
+  for ( ; ;) {
+    Status = VirtioRequestReserve (
+               &Queue->ReqQueue,
+               (Pool != NULL) ? 1 : NumDesc,
+               &Indices
+               );
+    if (Status != EFI_OUT_OF_RESOURCES) {
+      break;
+    }
+
+    VirtioRequestWaitForQueue (&Dev->Requests, NewReq->QueueIndex, WaitTpl);
   }
 
+  ASSERT_EFI_ERROR (Status);
+
   //
-  // Map the virtio-scsi Request header buffer
+  // The request header and the response live in the pre-mapped slab. The
+  // slab has an element per ring descriptor, and each request in flight
+  // holds at least one descriptor, so an element is free now.
   //
-  Status = VirtioMapAllBytesInSharedBuffer (
-             Dev->VirtIo,
-             VirtioOperationBusMasterRead,
-             (VOID *)&Request,
-             sizeof Request,
-             &RequestDeviceAddress,
-             &RequestMapping
+  Status = VirtioDmaSlabAlloc (
+             &Queue->ReqSlab,
+             &Shared,
+             &NewReq->SharedDeviceAddress
+             );
+  ASSERT_EFI_ERROR (Status);
+  NewReq->Shared = Shared;
+
+  Status = PopulateRequest (
+             Dev,
+             Target,
+             Lun,
+             Packet,
+             &NewReq->Shared->Request
              );
   if (EFI_ERROR (Status)) {
-    return ReportHostAdapterError (Packet);
+    goto FreeShared;
   }
 
+  NewReq->InTransferLength  = Packet->InTransferLength;
+  NewReq->OutTransferLength = Packet->OutTransferLength;
+
   //
   // Map the input buffer
   //
-  if (Packet->InTransferLength > 0) {
-    //
-    // Allocate a intermediate input buffer. This is mainly to handle the
-    // following case:
-    //  * caller submits a bi-directional request
-    //  * we perform the request fine
-    //  * but we fail to unmap the "InDataMapping"
-    //
-    // In that case simply returning the EFI_DEVICE_ERROR is not sufficient. In
-    // addition to the error code we also need to update Packet fields
-    // accordingly so that we report the full loss of the incoming transfer.
-    //
-    // We allocate a temporary buffer and map it with BusMasterCommonBuffer. If
-    // the Virtio request is successful then we copy the data from temporary
-    // buffer into Packet->InDataBuffer.
-    //
-    InDataNumPages = EFI_SIZE_TO_PAGES ((UINTN)Packet->InTransferLength);
-    Status         = Dev->VirtIo->AllocateSharedPages (
-                                    Dev->VirtIo,
-                                    InDataNumPages,
-                                    &InDataBuffer
-                                    );
-    if (EFI_ERROR (Status)) {
-      Status = ReportHostAdapterError (Packet);
-      goto UnmapRequestBuffer;
-    }
-
-    ZeroMem (InDataBuffer, Packet->InTransferLength);
-
+  if (NewReq->InTransferLength > 0) {
     Status = VirtioMapAllBytesInSharedBuffer (
                Dev->VirtIo,
-               VirtioOperationBusMasterCommonBuffer,
-               InDataBuffer,
-               Packet->InTransferLength,
+               VirtioOperationBusMasterWrite,
+               Packet->InDataBuffer,
+               NewReq->InTransferLength,
                &InDataDeviceAddress,
-               &InDataMapping
+               &NewReq->InDataMapping
                );
     if (EFI_ERROR (Status)) {
       Status = ReportHostAdapterError (Packet);
-      goto FreeInDataBuffer;
+      goto FreeShared;
     }
   }
 
   //
   // Map the output buffer
   //
-  if (Packet->OutTransferLength > 0) {
+  if (NewReq->OutTransferLength > 0) {
     Status = VirtioMapAllBytesInSharedBuffer (
                Dev->VirtIo,
                VirtioOperationBusMasterRead,
                Packet->OutDataBuffer,
-               Packet->OutTransferLength,
+               NewReq->OutTransferLength,
                &OutDataDeviceAddress,
-               &OutDataMapping
+               &NewReq->OutDataMapping
                );
     if (EFI_ERROR (Status)) {
       Status = ReportHostAdapterError (Packet);
       goto UnmapInDataBuffer;
     }
-
-    OutDataBufferIsMapped = TRUE;
   }
 
-  //
-  // Response header is bi-direction (we preset with host status and expect
-  // the device to update it). Allocate a response buffer which can be mapped
-  // to access equally by both processor and device.
-  //
-  Status = Dev->VirtIo->AllocateSharedPages (
-                          Dev->VirtIo,
-                          EFI_SIZE_TO_PAGES (sizeof *Response),
-                          &ResponseBuffer
-                          );
-  if (EFI_ERROR (Status)) {
-    Status = ReportHostAdapterError (Packet);
-    goto UnmapOutDataBuffer;
-  }
-
-  Response = ResponseBuffer;
-
-  ZeroMem ((VOID *)Response, sizeof (*Response));
-
   //
   // preset a host status for ourselves that we do not accept as success
   //
-  Response->Response = VIRTIO_SCSI_S_FAILURE;
+  NewReq->Shared->Response.Response = VIRTIO_SCSI_S_FAILURE;
 
   //
-  // Map the response buffer with BusMasterCommonBuffer so that response
-  // buffer can be accessed by both host and device.
+  // With indirect descriptors, the chain is built in the table that belongs
+  // to the single reserved ring descriptor.
   //
-  Status = VirtioMapAllBytesInSharedBuffer (
-             Dev->VirtIo,
-             VirtioOperationBusMasterCommonBuffer,
-             ResponseBuffer,
-             sizeof (*Response),
-             &ResponseDeviceAddress,
-             &ResponseMapping
-             );
-  if (EFI_ERROR (Status)) {
-    Status = ReportHostAdapterError (Packet);
-    goto FreeResponseBuffer;
+  if (Pool != NULL) {
+    VirtioIndirectPrepare (Pool, Indices.HeadDescIdx, &ChainIndices);
+  } else {
+    ChainIndices = Indices;
   }
 
-  VirtioPrepare (&Dev->Ring, &Indices);
-
-  //
-  // ensured by VirtioScsiInit() -- this predicate, in combination with the
-  // lock-step progress, ensures we don't have to track free descriptors.
-  //
-  ASSERT (Dev->Ring.QueueSize >= 4);
-
   //
   // enqueue Request
   //
-  VirtioAppendDesc (
-    &Dev->Ring,
-    RequestDeviceAddress,
-    sizeof Request,
+  VirtioRequestAppendChainDesc (
+    &Queue->ReqQueue,
+    Pool,
+    NewReq->SharedDeviceAddress + OFFSET_OF (VSCSI_SHARED_REQ, Request),
+    sizeof NewReq->Shared->Request,
     VRING_DESC_F_NEXT,
-    &Indices
+    &ChainIndices
     );
 
   //
   // enqueue "dataout" if any
   //
-  if (Packet->OutTransferLength > 0) {
-    VirtioAppendDesc (
-      &Dev->Ring,
+  if (NewReq->OutTransferLength > 0) {
+    VirtioRequestAppendChainDesc (
+      &Queue->ReqQueue,
+      Pool,
       OutDataDeviceAddress,
-      Packet->OutTransferLength,
+      NewReq->OutTransferLength,
       VRING_DESC_F_NEXT,
-      &Indices
+      &ChainIndices
       );
   }
 
   //
   // enqueue Response, to be written by the host
   //
-  VirtioAppendDesc (
-    &Dev->Ring,
-    ResponseDeviceAddress,
-    sizeof *Response,
-    VRING_DESC_F_WRITE | (Packet->InTransferLength > 0 ? VRING_DESC_F_NEXT : 0),
-    &Indices
+  VirtioRequestAppendChainDesc (
+    &Queue->ReqQueue,
+    Pool,
+    NewReq->SharedDeviceAddress + OFFSET_OF (VSCSI_SHARED_REQ, Response),
+    sizeof NewReq->Shared->Response,
+    VRING_DESC_F_WRITE |
+    (NewReq->InTransferLength > 0 ? VRING_DESC_F_NEXT : 0),
+    &ChainIndices
     );
 
   //
   // enqueue "datain" if any, to be written by the host
   //
-  if (Packet->InTransferLength > 0) {
-    VirtioAppendDesc (
-      &Dev->Ring,
+  if (NewReq->InTransferLength > 0) {
+    VirtioRequestAppendChainDesc (
+      &Queue->ReqQueue,
+      Pool,
       InDataDeviceAddress,
-      Packet->InTransferLength,
+      NewReq->InTransferLength,
       VRING_DESC_F_WRITE,
+      &ChainIndices
+      );
+  }
+
+  if (Pool != NULL) {
+    VirtioRequestAppendIndirect (
+      &Queue->ReqQueue,
+      Pool,
+      &ChainIndices,
       &Indices
       );
   }
 
-  // If kicking the host fails, we must fake a host adapter error.
-  // EFI_NOT_READY would save us the effort, but it would also suggest that the
-  // caller retry.
+  VirtioRequestSubmit (&Queue->ReqQueue, &Indices, NewReq);
+
   //
-  if (VirtioFlush (
-        Dev->VirtIo,
-        VIRTIO_SCSI_REQUEST_QUEUE,
-        &Dev->Ring,
-        &Indices,
-        NULL
-        ) != EFI_SUCCESS)
-  {
-    Status = ReportHostAdapterError (Packet);
-    goto UnmapResponseBuffer;
+  // Nobody waits for a non-blocking request; the poll timer reaps it.
+  //
+  if (Event != NULL) {
+    VirtioRequestPollTimerHold (&Dev->Requests);
+  }
+
+  //
+  // The request queues follow the control queue and the event queue. Once
+  // the chain is visible to the host, it may complete at any time, so it is
+  // reaped (and never unwound here) even if the notification fails.
+  //
+  Status = VirtioRequestNotify (
+             Dev->VirtIo,
+             VIRTIO_SCSI_REQUEST_QUEUE + NewReq->QueueIndex,
+             &Queue->ReqQueue
+             );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a: SetQueueNotify: %r\n", __FUNCTION__, Status));
+  }
+
+  *Req = NewReq;
+  return EFI_SUCCESS;
+
+UnmapInDataBuffer:
+  if (NewReq->InTransferLength > 0) {
+    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, NewReq->InDataMapping);
+  }
+
+FreeShared:
+  VirtioDmaSlabFree (&Queue->ReqSlab, Shared);
+  VirtioRequestCancel (&Queue->ReqQueue, &Indices);
+  FreePool (NewReq);
+
+  return Status;
+}
+
+/**
+
+  Periodic timer callback reaping the non-blocking requests that the host has
+  completed.
+
+  @param[in] Event    Event whose notification function is being invoked.
+
+  @param[in] Context  Pointer to the VSCSI_DEV structure.
+
+**/
+STATIC
+VOID
+EFIAPI
+VirtioScsiPollTimer (
+  IN  EFI_EVENT  Event,
+  IN  VOID       *Context
+  )
+{
+  VSCSI_DEV  *Dev;
+
+  Dev = Context;
+  VirtioRequestProcessCompletions (&Dev->Requests);
+}
+
+/**
+
+  Send REPORT LUNS to LUN 0 of a target, and retrieve the parameter data.
+
+  A target may report a unit attention condition on the first command it
+  receives after a reset, therefore a CHECK CONDITION status is retried once.
+
+  @param[in]     Dev         The virtio-scsi host device.
+
+  @param[in]     Target      The target to query.
+
+  @param[out]    Buffer      The buffer to receive the parameter data.
+
+  @param[in,out] BufferSize  On input, the size of Buffer, in bytes. On
+                             successful output, the number of bytes received.
+
+  @retval EFI_SUCCESS       The target returned its LUN list.
+
+  @retval EFI_TIMEOUT       There is no target at the address.
+
+  @retval EFI_DEVICE_ERROR  The target failed the command.
+
+  @return                   Other error codes from VirtioScsiPassThru().
+
+**/
+STATIC
+EFI_STATUS
+ReportLuns (
+  IN     VSCSI_DEV  *Dev,
+  IN     UINT16     Target,
+  OUT    VOID       *Buffer,
+  IN OUT UINT32     *BufferSize
+  )
+{
+  UINT8                                       TargetBytes[TARGET_MAX_BYTES];
+  UINT8                                       Cdb[12];
+  EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET  Packet;
+  UINTN                                       Attempt;
+  EFI_STATUS                                  Status;
+
+  //
+  // see the TARGET_MAX_BYTES check in "VirtioScsi.h"
+  //
+  SetMem (TargetBytes, sizeof TargetBytes, 0x00);
+  CopyMem (TargetBytes, &Target, sizeof Target);
+
+  //
+  // SELECT REPORT 0: all logical units, except the well known ones. The
+  // allocation length is big endian.
+  //
+  ZeroMem (Cdb, sizeof Cdb);
+  Cdb[0] = EFI_SCSI_OP_REPORT_LUNS;
+  Cdb[6] = (UINT8)(*BufferSize >> 24);
+  Cdb[7] = (UINT8)(*BufferSize >> 16);
+  Cdb[8] = (UINT8)(*BufferSize >> 8);
+  Cdb[9] = (UINT8)*BufferSize;
+
+  for (Attempt = 0; Attempt < 2; Attempt++) {
+    ZeroMem (&Packet, sizeof Packet);
+    Packet.InDataBuffer     = Buffer;
+    Packet.Cdb              = Cdb;
+    Packet.InTransferLength = *BufferSize;
+    Packet.CdbLength        = sizeof Cdb;
+    Packet.DataDirection    = EFI_EXT_SCSI_DATA_DIRECTION_READ;
+
+    Status = VirtioScsiPassThru (&Dev->PassThru, TargetBytes, 0, &Packet, NULL);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    if (Packet.TargetStatus == EFI_EXT_SCSI_STATUS_TARGET_GOOD) {
+      *BufferSize = Packet.InTransferLength;
+      return EFI_SUCCESS;
+    }
+
+    if (Packet.TargetStatus != EFI_EXT_SCSI_STATUS_TARGET_CHECK_CONDITION) {
+      break;
+    }
+  }
+
+  return EFI_DEVICE_ERROR;
+}
+
+/**
+
+  Decode one entry of the REPORT LUNS parameter data.
+
+  Only single level LUNs in the peripheral device (bus 0) and flat space
+  addressing methods are recognized; these are the ones PopulateRequest() can
+  encode for the host.
+
+  @param[in]  Entry  The eight byte LUN entry.
+
+  @param[out] Lun    On success, the decoded LUN.
+
+  @retval TRUE   Entry has been decoded.
+
+  @retval FALSE  Entry uses an unsupported addressing method.
+
+**/
+STATIC
+BOOLEAN
+DecodeLun (
+  IN  CONST UINT8  *Entry,
+  OUT UINT16       *Lun
+  )
+{
+  UINTN  Idx;
+
+  for (Idx = 2; Idx < 8; ++Idx) {
+    if (Entry[Idx] != 0) {
+      return FALSE;
+    }
   }
 
-  Status = ParseResponse (Packet, Response);
+  switch (Entry[0] >> 6) {
+    case 0:
+      if ((Entry[0] & 0x3F) != 0) {
+        return FALSE;
+      }
+
+      *Lun = Entry[1];
+      return TRUE;
+
+    case 1:
+      *Lun = (UINT16)(((Entry[0] & 0x3F) << 8) | Entry[1]);
+      return TRUE;
+
+    default:
+      return FALSE;
+  }
+}
+
+/**
+
+  Append an encoded target / LUN pair to a growing list.
+
+  @param[in,out] List       The list to append to; reallocated as needed.
+
+  @param[in,out] Count      The number of pairs in List.
+
+  @param[in,out] Capacity   The number of pairs List can hold.
+
+  @param[in]     TargetLun  The pair to append, encoded with
+                            VSCSI_TARGET_LUN().
+
+  @retval EFI_SUCCESS           The pair has been appended.
+
+  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed; List is unchanged.
+
+**/
+STATIC
+EFI_STATUS
+AppendTargetLun (
+  IN OUT UINT32  **List,
+  IN OUT UINTN   *Count,
+  IN OUT UINTN   *Capacity,
+  IN     UINT32  TargetLun
+  )
+{
+  UINT32  *NewList;
+  UINTN   NewCapacity;
+
+  if (*Count == *Capacity) {
+    NewCapacity = MAX (*Capacity * 2, 16);
+    NewList     = ReallocatePool (
+                    *Capacity * sizeof **List,
+                    NewCapacity * sizeof **List,
+                    *List
+                    );
+    if (NewList == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    *List     = NewList;
+    *Capacity = NewCapacity;
+  }
+
+  (*List)[(*Count)++] = TargetLun;
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Find the populated target / LUN pairs of the HBA, unless already done.
+
+  Rather than leaving the probing of every target / LUN address to the SCSI
+  bus driver, each target is asked for its LUN list with REPORT LUNS. A
+  missing target is rejected by the host immediately, so the scan costs one
+  command per target address, and the bus driver only probes the LUNs that
+  exist. A LUN list longer than the buffer is used as far as it has been
+  received. Targets that fail REPORT LUNS, or return malformed parameter data,
+  have LUNs 0 to VSCSI_FALLBACK_MAX_LUN listed instead, so that a misbehaving
+  target cannot multiply the number of INQUIRY commands by the size of the LUN
+  space.
+
+  Hotplug is not supported, so the result is kept for the lifetime of the
+  driver instance.
+
+  @param[in,out] Dev  The virtio-scsi host device to scan.
+
+  @retval EFI_SUCCESS           Dev->TargetLuns and Dev->NumTargetLuns are
+                                valid.
+
+  @retval EFI_OUT_OF_RESOURCES  Memory allocation failed.
+
+**/
+STATIC
+EFI_STATUS
+ScanTargetLuns (
+  IN OUT VSCSI_DEV  *Dev
+  )
+{
+  UINT32      NumLuns;
+  UINT32      NumFallbackLuns;
+  UINT32      BufferSize;
+  UINT8       *Buffer;
+  UINT32      *List;
+  UINTN       Count;
+  UINTN       Capacity;
+  UINT16      Target;
+  UINT16      MaxTarget;
+  UINT32      ReceivedSize;
+  UINT32      ListLength;
+  UINT32      Offset;
+  UINT16      Lun;
+  UINT32      Value;
+  UINTN       Idx;
+  UINTN       Pos;
+  EFI_STATUS  Status;
+
+  if (Dev->LunsScanned) {
+    return EFI_SUCCESS;
+  }
 
   //
-  // If virtio request was successful and it was a CPU read request then we
-  // have used an intermediate buffer. Copy the data from intermediate buffer
-  // to the final buffer.
+  // PopulateRequest() can only encode targets up to 0xFF, and LUNs below
+  // 0x4000. Make room for the eight byte header and as many LUNs as we
+  // accept, within the transfer limit of the host.
   //
-  if (InDataBuffer != NULL) {
-    CopyMem (Packet->InDataBuffer, InDataBuffer, Packet->InTransferLength);
+  MaxTarget       = MIN (Dev->MaxTarget, 0xFF);
+  NumLuns         = MIN (Dev->MaxLun, 0x3FFF) + 1;
+  NumFallbackLuns = MIN (NumLuns, VSCSI_FALLBACK_MAX_LUN + 1);
+  BufferSize      = MIN (8 + 8 * NumLuns, (Dev->MaxSectors / 2) * 512);
+  Buffer          = AllocatePool (BufferSize);
+  if (Buffer == NULL) {
+    return EFI_OUT_OF_RESOURCES;
   }
 
-UnmapResponseBuffer:
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, ResponseMapping);
+  List     = NULL;
+  Count    = 0;
+  Capacity = 0;
+  Status   = EFI_SUCCESS;
 
-FreeResponseBuffer:
-  Dev->VirtIo->FreeSharedPages (
-                 Dev->VirtIo,
-                 EFI_SIZE_TO_PAGES (sizeof *Response),
-                 ResponseBuffer
+  for (Target = 0; Target <= MaxTarget; ++Target) {
+    ReceivedSize = BufferSize;
+    Status       = ReportLuns (Dev, Target, Buffer, &ReceivedSize);
+    if (Status == EFI_TIMEOUT) {
+      Status = EFI_SUCCESS;
+      continue;
+    }
+
+    if (!EFI_ERROR (Status)) {
+      if (ReceivedSize < 8) {
+        Status = EFI_PROTOCOL_ERROR;
+      } else {
+        ListLength = ((UINT32)Buffer[0] << 24) | ((UINT32)Buffer[1] << 16) |
+                     ((UINT32)Buffer[2] << 8) | Buffer[3];
+
+        //
+        // The target truncates the list to the allocation length, which only
+        // accounts for the LUNs we accept. Use the entries that did arrive.
+        //
+        if (ListLength > ReceivedSize - 8) {
+          DEBUG ((
+            DEBUG_VERBOSE,
+            "%a: target %u: LUN list truncated from %u to %u bytes\n",
+            __FUNCTION__,
+            Target,
+            ListLength,
+            ReceivedSize - 8
+            ));
+          ListLength = ReceivedSize - 8;
+        }
+      }
+    }
+
+    if (!EFI_ERROR (Status)) {
+      for (Offset = 0; Offset + 8 <= ListLength; Offset += 8) {
+        if (!DecodeLun (Buffer + 8 + Offset, &Lun) || (Lun >= NumLuns)) {
+          continue;
+        }
+
+        Status = AppendTargetLun (
+                   &List,
+                   &Count,
+                   &Capacity,
+                   VSCSI_TARGET_LUN (Target, Lun)
+                   );
+        if (EFI_ERROR (Status)) {
+          goto FreeList;
+        }
+      }
+
+      continue;
+    }
+
+    DEBUG ((
+      DEBUG_WARN,
+      "%a: target %u: REPORT LUNS: %r, listing LUNs 0-%u\n",
+      __FUNCTION__,
+      Target,
+      Status,
+      NumFallbackLuns - 1
+      ));
+
+    for (Lun = 0; Lun < NumFallbackLuns; ++Lun) {
+      Status = AppendTargetLun (
+                 &List,
+                 &Count,
+                 &Capacity,
+                 VSCSI_TARGET_LUN (Target, Lun)
                  );
+      if (EFI_ERROR (Status)) {
+        goto FreeList;
+      }
+    }
+  }
 
-UnmapOutDataBuffer:
-  if (OutDataBufferIsMapped) {
-    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, OutDataMapping);
+  //
+  // Targets are scanned in ascending order, and hosts usually report LUNs in
+  // ascending order too, so an insertion sort is cheap. Drop duplicates on
+  // the way.
+  //
+  for (Idx = 1; Idx < Count; ++Idx) {
+    Value = List[Idx];
+    for (Pos = Idx; Pos > 0 && List[Pos - 1] > Value; --Pos) {
+      List[Pos] = List[Pos - 1];
+    }
+
+    List[Pos] = Value;
   }
 
-UnmapInDataBuffer:
-  if (InDataBuffer != NULL) {
-    Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, InDataMapping);
+  Pos = 0;
+  for (Idx = 0; Idx < Count; ++Idx) {
+    if ((Pos == 0) || (List[Pos - 1] != List[Idx])) {
+      List[Pos++] = List[Idx];
+    }
+  }
+
+  Dev->TargetLuns    = List;
+  Dev->NumTargetLuns = Pos;
+  Dev->LunsScanned   = TRUE;
+
+  DEBUG ((
+    DEBUG_INFO,
+    "%a: %Lu LUN(s) found\n",
+    __FUNCTION__,
+    (UINT64)Dev->NumTargetLuns
+    ));
+  FreePool (Buffer);
+  return EFI_SUCCESS;
+
+FreeList:
+  if (List != NULL) {
+    FreePool (List);
+  }
+
+  FreePool (Buffer);
+  return Status;
+}
+
+/**
+
+  Look up the first populated target / LUN pair that follows a given pair.
+
+  @param[in] Dev        The virtio-scsi host device, scanned with
+                        ScanTargetLuns().
+
+  @param[in] TargetLun  The pair to search after, encoded with
+                        VSCSI_TARGET_LUN().
+
+  @return  The index of the pair found in Dev->TargetLuns, or
+           Dev->NumTargetLuns if no pair follows TargetLun.
+
+**/
+STATIC
+UINTN
+FindNextTargetLun (
+  IN VSCSI_DEV  *Dev,
+  IN UINT32     TargetLun
+  )
+{
+  UINTN  Low;
+  UINTN  High;
+  UINTN  Mid;
+
+  Low  = 0;
+  High = Dev->NumTargetLuns;
+  while (Low < High) {
+    Mid = Low + (High - Low) / 2;
+    if (Dev->TargetLuns[Mid] <= TargetLun) {
+      Low = Mid + 1;
+    } else {
+      High = Mid;
+    }
   }
 
-FreeInDataBuffer:
-  if (InDataBuffer != NULL) {
-    Dev->VirtIo->FreeSharedPages (Dev->VirtIo, InDataNumPages, InDataBuffer);
+  return Low;
+}
+
+//
+// The next seven functions implement EFI_EXT_SCSI_PASS_THRU_PROTOCOL
+// for the virtio-scsi HBA. Refer to UEFI Spec 2.3.1 + Errata C, sections
+// - 14.1 SCSI Driver Model Overview,
+// - 14.7 Extended SCSI Pass Thru Protocol.
+//
+
+EFI_STATUS
+EFIAPI
+VirtioScsiPassThru (
+  IN     EFI_EXT_SCSI_PASS_THRU_PROTOCOL             *This,
+  IN     UINT8                                       *Target,
+  IN     UINT64                                      Lun,
+  IN OUT EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET  *Packet,
+  IN     EFI_EVENT                                   Event   OPTIONAL
+  )
+{
+  VSCSI_DEV   *Dev;
+  UINT16      TargetValue;
+  EFI_TPL     OldTpl;
+  VSCSI_REQ   *Req;
+  EFI_STATUS  Status;
+
+  Dev = VIRTIO_SCSI_FROM_PASS_THRU (This);
+  CopyMem (&TargetValue, Target, sizeof TargetValue);
+
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+
+  Status = SubmitRequest (Dev, TargetValue, Lun, Packet, Event, OldTpl, &Req);
+  if (EFI_ERROR (Status) || (Event != NULL)) {
+    //
+    // A non-blocking request is reported through Packet and Event from now
+    // on.
+    //
+    gBS->RestoreTPL (OldTpl);
+    return Status;
   }
 
-UnmapRequestBuffer:
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, RequestMapping);
+  //
+  // Other requests in flight may complete before ours; CompleteRequest()
+  // retires them on the way. Our request keeps its own queue busy until it
+  // completes, so waiting on that queue always makes progress. The host is
+  // waited for at the caller's TPL.
+  //
+  VirtioRequestProcessCompletions (&Dev->Requests);
+  while (!Req->Completed) {
+    VirtioRequestWaitForQueue (&Dev->Requests, Req->QueueIndex, OldTpl);
+  }
 
+  gBS->RestoreTPL (OldTpl);
+
+  Status = Req->Status;
+  FreePool (Req);
   return Status;
 }
 
@@ -713,16 +1298,27 @@ VirtioScsiGetNextTargetLun (
   IN OUT UINT64                           *Lun
   )
 {
-  UINT8      *Target;
-  UINTN      Idx;
-  UINT16     LastTarget;
-  VSCSI_DEV  *Dev;
+  UINT8       *Target;
+  UINTN       Idx;
+  UINT16      LastTarget;
+  VSCSI_DEV   *Dev;
+  UINTN       Next;
+  EFI_STATUS  Status;
 
   //
   // the TargetPointer input parameter is unnecessarily a pointer-to-pointer
   //
   Target = *TargetPointer;
 
+  //
+  // only populated (target, LUN) pairs are reported, see ScanTargetLuns()
+  //
+  Dev    = VIRTIO_SCSI_FROM_PASS_THRU (This);
+  Status = ScanTargetLuns (Dev);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
   //
   // Search for first non-0xFF byte. If not found, return first target & LUN.
   //
@@ -730,37 +1326,35 @@ VirtioScsiGetNextTargetLun (
   }
 
   if (Idx == TARGET_MAX_BYTES) {
-    SetMem (Target, TARGET_MAX_BYTES, 0x00);
-    *Lun = 0;
-    return EFI_SUCCESS;
-  }
-
-  //
-  // see the TARGET_MAX_BYTES check in "VirtioScsi.h"
-  //
-  CopyMem (&LastTarget, Target, sizeof LastTarget);
+    Next = 0;
+  } else {
+    //
+    // see the TARGET_MAX_BYTES check in "VirtioScsi.h"
+    //
+    CopyMem (&LastTarget, Target, sizeof LastTarget);
 
-  //
-  // increment (target, LUN) pair if valid on input
-  //
-  Dev = VIRTIO_SCSI_FROM_PASS_THRU (This);
-  if ((LastTarget > Dev->MaxTarget) || (*Lun > Dev->MaxLun)) {
-    return EFI_INVALID_PARAMETER;
-  }
+    //
+    // advance to the next (target, LUN) pair if valid on input
+    //
+    if ((LastTarget > Dev->MaxTarget) || (*Lun > Dev->MaxLun)) {
+      return EFI_INVALID_PARAMETER;
+    }
 
-  if (*Lun < Dev->MaxLun) {
-    ++*Lun;
-    return EFI_SUCCESS;
+    Next = FindNextTargetLun (
+             Dev,
+             VSCSI_TARGET_LUN (LastTarget, MIN (*Lun, MAX_UINT16))
+             );
   }
 
-  if (LastTarget < Dev->MaxTarget) {
-    *Lun = 0;
-    ++LastTarget;
-    CopyMem (Target, &LastTarget, sizeof LastTarget);
-    return EFI_SUCCESS;
+  if (Next == Dev->NumTargetLuns) {
+    return EFI_NOT_FOUND;
   }
 
-  return EFI_NOT_FOUND;
+  LastTarget = VSCSI_TARGET_OF (Dev->TargetLuns[Next]);
+  SetMem (Target, TARGET_MAX_BYTES, 0x00);
+  CopyMem (Target, &LastTarget, sizeof LastTarget);
+  *Lun = VSCSI_LUN_OF (Dev->TargetLuns[Next]);
+  return EFI_SUCCESS;
 }
 
 EFI_STATUS
@@ -875,16 +1469,27 @@ VirtioScsiGetNextTarget (
   IN OUT UINT8                        **TargetPointer
   )
 {
-  UINT8      *Target;
-  UINTN      Idx;
-  UINT16     LastTarget;
-  VSCSI_DEV  *Dev;
+  UINT8       *Target;
+  UINTN       Idx;
+  UINT16      LastTarget;
+  VSCSI_DEV   *Dev;
+  UINTN       Next;
+  EFI_STATUS  Status;
 
   //
   // the TargetPointer input parameter is unnecessarily a pointer-to-pointer
   //
   Target = *TargetPointer;
 
+  //
+  // only targets with populated LUNs are reported, see ScanTargetLuns()
+  //
+  Dev    = VIRTIO_SCSI_FROM_PASS_THRU (This);
+  Status = ScanTargetLuns (Dev);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
   //
   // Search for first non-0xFF byte. If not found, return first target.
   //
@@ -892,30 +1497,225 @@ VirtioScsiGetNextTarget (
   }
 
   if (Idx == TARGET_MAX_BYTES) {
-    SetMem (Target, TARGET_MAX_BYTES, 0x00);
-    return EFI_SUCCESS;
+    Next = 0;
+  } else {
+    //
+    // see the TARGET_MAX_BYTES check in "VirtioScsi.h"
+    //
+    CopyMem (&LastTarget, Target, sizeof LastTarget);
+
+    //
+    // advance to the next target if valid on input
+    //
+    if (LastTarget > Dev->MaxTarget) {
+      return EFI_INVALID_PARAMETER;
+    }
+
+    Next = FindNextTargetLun (Dev, VSCSI_TARGET_LUN (LastTarget, MAX_UINT16));
+  }
+
+  if (Next == Dev->NumTargetLuns) {
+    return EFI_NOT_FOUND;
+  }
+
+  LastTarget = VSCSI_TARGET_OF (Dev->TargetLuns[Next]);
+  SetMem (Target, TARGET_MAX_BYTES, 0x00);
+  CopyMem (Target, &LastTarget, sizeof LastTarget);
+  return EFI_SUCCESS;
+}
+
+/**
+
+  Set up one request queue of a virtio-scsi device: allocate, map and report
+  its ring, and allocate the tracking structures, indirect descriptor tables
+  and request headers / responses of its in-flight requests.
+
+  @param[in out] Dev         The driver instance being configured. Feature
+                             negotiation must have been completed (for
+                             virtio-1.0 devices), and Dev->Queues allocated.
+
+  @param[in]     QueueIndex  The index of the request queue to set up, and of
+                             the element of Dev->Queues to populate.
+
+  @retval EFI_SUCCESS      The queue is ready for use.
+
+  @retval EFI_UNSUPPORTED  The host offers a queue too small for a request.
+
+  @return                  Error codes from the VirtIo protocol,
+                           VirtioRingInit(), VirtioRingMap(),
+                           VirtioRequestQueueInit(),
+                           VirtioIndirectPoolInit() or VirtioDmaSlabInit().
+
+**/
+STATIC
+EFI_STATUS
+VirtioScsiInitQueue (
+  IN OUT VSCSI_DEV  *Dev,
+  IN     UINT16     QueueIndex
+  )
+{
+  VSCSI_QUEUE  *Queue;
+  UINT16       QueueSize;
+  UINT64       RingBaseShift;
+  EFI_STATUS   Status;
+
+  Queue = &Dev->Queues[QueueIndex];
+
+  //
+  // The request queues follow the control queue and the event queue.
+  //
+  Status = Dev->VirtIo->SetQueueSel (
+                          Dev->VirtIo,
+                          VIRTIO_SCSI_REQUEST_QUEUE + QueueIndex
+                          );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = Dev->VirtIo->GetQueueNumMax (Dev->VirtIo, &QueueSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
   }
 
   //
-  // see the TARGET_MAX_BYTES check in "VirtioScsi.h"
+  // SubmitRequest() uses at most four descriptors, or one indirect one
   //
-  CopyMem (&LastTarget, Target, sizeof LastTarget);
+  if (QueueSize < (Dev->IndirectDesc ? 1 : VSCSI_MAX_CHAIN_DESC)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Status = VirtioRingInit (Dev->VirtIo, QueueSize, &Queue->Ring);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
 
   //
-  // increment target if valid on input
+  // If anything fails from here on, we must release the ring resources
   //
-  Dev = VIRTIO_SCSI_FROM_PASS_THRU (This);
-  if (LastTarget > Dev->MaxTarget) {
-    return EFI_INVALID_PARAMETER;
+  Status = VirtioRingMap (
+             Dev->VirtIo,
+             &Queue->Ring,
+             &RingBaseShift,
+             &Queue->RingMap
+             );
+  if (EFI_ERROR (Status)) {
+    goto ReleaseQueue;
   }
 
-  if (LastTarget < Dev->MaxTarget) {
-    ++LastTarget;
-    CopyMem (Target, &LastTarget, sizeof LastTarget);
-    return EFI_SUCCESS;
+  //
+  // Additional steps for MMIO: align the queue appropriately, and set the
+  // size. If anything fails from here on, we must unmap the ring resources.
+  //
+  Status = Dev->VirtIo->SetQueueNum (Dev->VirtIo, QueueSize);
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
+  Status = Dev->VirtIo->SetQueueAlign (Dev->VirtIo, EFI_PAGE_SIZE);
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
+  //
+  // step 4c -- Report GPFN (guest-physical frame number) of queue.
+  //
+  Status = Dev->VirtIo->SetQueueAddress (
+                          Dev->VirtIo,
+                          &Queue->Ring,
+                          RingBaseShift
+                          );
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
+  }
+
+  //
+  // Set up tracking of in-flight requests, now that the ring is in place.
+  //
+  Status = VirtioRequestQueueInit (&Queue->Ring, &Queue->ReqQueue);
+  if (EFI_ERROR (Status)) {
+    goto UnmapQueue;
   }
 
-  return EFI_NOT_FOUND;
+  if (Dev->EventIdx) {
+    VirtioRequestEnableEventIdx (&Queue->ReqQueue);
+  }
+
+  //
+  // One indirect table per ring descriptor: the table of a request is the one
+  // matching its (single) ring descriptor.
+  //
+  if (Dev->IndirectDesc) {
+    Status = VirtioIndirectPoolInit (
+               Dev->VirtIo,
+               QueueSize,
+               VSCSI_MAX_CHAIN_DESC,
+               &Queue->Indirect
+               );
+    if (EFI_ERROR (Status)) {
+      goto UninitReqQueue;
+    }
+  }
+
+  //
+  // Request headers and responses for as many requests as the ring can hold.
+  //
+  Status = VirtioDmaSlabInit (
+             Dev->VirtIo,
+             QueueSize,
+             sizeof (VSCSI_SHARED_REQ),
+             &Queue->ReqSlab
+             );
+  if (EFI_ERROR (Status)) {
+    goto UninitIndirect;
+  }
+
+  return EFI_SUCCESS;
+
+UninitIndirect:
+  if (Dev->IndirectDesc) {
+    VirtioIndirectPoolUninit (Dev->VirtIo, &Queue->Indirect);
+  }
+
+UninitReqQueue:
+  VirtioRequestQueueUninit (&Queue->ReqQueue);
+
+UnmapQueue:
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Queue->RingMap);
+
+ReleaseQueue:
+  VirtioRingUninit (Dev->VirtIo, &Queue->Ring);
+
+  return Status;
+}
+
+/**
+
+  Release the resources of a request queue set up with VirtioScsiInitQueue().
+
+  The caller is responsible for resetting the device first, so that the host
+  no longer accesses the ring.
+
+  @param[in out] Dev    The driver instance owning the queue.
+
+  @param[in out] Queue  The queue to release.
+
+**/
+STATIC
+VOID
+VirtioScsiUninitQueue (
+  IN OUT VSCSI_DEV    *Dev,
+  IN OUT VSCSI_QUEUE  *Queue
+  )
+{
+  VirtioDmaSlabUninit (Dev->VirtIo, &Queue->ReqSlab);
+
+  if (Dev->IndirectDesc) {
+    VirtioIndirectPoolUninit (Dev->VirtIo, &Queue->Indirect);
+  }
+
+  VirtioRequestQueueUninit (&Queue->ReqQueue);
+  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Queue->RingMap);
+  VirtioRingUninit (Dev->VirtIo, &Queue->Ring);
 }
 
 STATIC
@@ -927,11 +1727,10 @@ VirtioScsiInit (
 {
   UINT8       NextDevStat;
   EFI_STATUS  Status;
-  UINT64      RingBaseShift;
   UINT64      Features;
   UINT16      MaxChannel; // for validation only
-  UINT32      NumQueues;  // for validation only
-  UINT16      QueueSize;
+  UINT32      NumQueues;
+  UINT16      QueueIndex;
 
   //
   // Execute virtio-0.9.5, 2.2.1 Device Initialization Sequence.
@@ -995,6 +1794,13 @@ VirtioScsiInit (
     goto Failed;
   }
 
+  //
+  // Using fewer request queues than the device offers is permitted; the rest
+  // stay unused.
+  //
+  NumQueues = MIN (NumQueues, PcdGet16 (PcdVirtioScsiMaxQueues));
+  NumQueues = MAX (NumQueues, 1);
+
   Status = VIRTIO_CFG_READ (Dev, MaxTarget, &Dev->MaxTarget);
   if (EFI_ERROR (Status)) {
     goto Failed;
@@ -1027,8 +1833,11 @@ VirtioScsiInit (
     goto Failed;
   }
 
-  Features &= VIRTIO_SCSI_F_INOUT | VIRTIO_F_VERSION_1 |
+  Features &= VIRTIO_SCSI_F_INOUT | VIRTIO_F_RING_INDIRECT_DESC |
+              VIRTIO_F_RING_EVENT_IDX | VIRTIO_F_VERSION_1 |
               VIRTIO_F_IOMMU_PLATFORM;
+  Dev->IndirectDesc = (BOOLEAN)((Features & VIRTIO_F_RING_INDIRECT_DESC) != 0);
+  Dev->EventIdx     = (BOOLEAN)((Features & VIRTIO_F_RING_EVENT_IDX) != 0);
 
   //
   // In virtio-1.0, feature negotiation is expected to complete before queue
@@ -1042,69 +1851,31 @@ VirtioScsiInit (
   }
 
   //
-  // step 4b -- allocate request virtqueue
-  //
-  Status = Dev->VirtIo->SetQueueSel (Dev->VirtIo, VIRTIO_SCSI_REQUEST_QUEUE);
-  if (EFI_ERROR (Status)) {
-    goto Failed;
-  }
-
-  Status = Dev->VirtIo->GetQueueNumMax (Dev->VirtIo, &QueueSize);
-  if (EFI_ERROR (Status)) {
-    goto Failed;
-  }
-
-  //
-  // VirtioScsiPassThru() uses at most four descriptors
+  // step 4b, 4c -- allocate and report the request virtqueues
   //
-  if (QueueSize < 4) {
-    Status = EFI_UNSUPPORTED;
-    goto Failed;
-  }
-
-  Status = VirtioRingInit (Dev->VirtIo, QueueSize, &Dev->Ring);
-  if (EFI_ERROR (Status)) {
+  Dev->Queues = AllocateZeroPool (NumQueues * sizeof *Dev->Queues);
+  if (Dev->Queues == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
     goto Failed;
   }
 
-  //
-  // If anything fails from here on, we must release the ring resources
-  //
-  Status = VirtioRingMap (
-             Dev->VirtIo,
-             &Dev->Ring,
-             &RingBaseShift,
-             &Dev->RingMap
-             );
-  if (EFI_ERROR (Status)) {
-    goto ReleaseQueue;
-  }
-
-  //
-  // Additional steps for MMIO: align the queue appropriately, and set the
-  // size. If anything fails from here on, we must unmap the ring resources.
-  //
-  Status = Dev->VirtIo->SetQueueNum (Dev->VirtIo, QueueSize);
-  if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
-  }
-
-  Status = Dev->VirtIo->SetQueueAlign (Dev->VirtIo, EFI_PAGE_SIZE);
-  if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+  for (QueueIndex = 0; QueueIndex < NumQueues; QueueIndex++) {
+    Status = VirtioScsiInitQueue (Dev, QueueIndex);
+    if (EFI_ERROR (Status)) {
+      goto UninitQueues;
+    }
   }
 
-  //
-  // step 4c -- Report GPFN (guest-physical frame number) of queue.
-  //
-  Status = Dev->VirtIo->SetQueueAddress (
-                          Dev->VirtIo,
-                          &Dev->Ring,
-                          RingBaseShift
-                          );
-  if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
-  }
+  Dev->NumQueues = (UINT16)NumQueues;
+  VirtioRequestQueueSetInit (
+    &Dev->Requests,
+    &Dev->Queues[0].ReqQueue,
+    sizeof *Dev->Queues,
+    Dev->NumQueues,
+    &Dev->WaitPolicy,
+    CompleteRequest,
+    Dev
+    );
 
   //
   // step 5 -- Report understood features and guest-tuneables.
@@ -1113,7 +1884,7 @@ VirtioScsiInit (
     Features &= ~(UINT64)(VIRTIO_F_VERSION_1 | VIRTIO_F_IOMMU_PLATFORM);
     Status    = Dev->VirtIo->SetGuestFeatures (Dev->VirtIo, Features);
     if (EFI_ERROR (Status)) {
-      goto UnmapQueue;
+      goto UninitQueues;
     }
   }
 
@@ -1123,12 +1894,12 @@ VirtioScsiInit (
   //
   Status = VIRTIO_CFG_WRITE (Dev, CdbSize, VIRTIO_SCSI_CDB_SIZE);
   if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+    goto UninitQueues;
   }
 
   Status = VIRTIO_CFG_WRITE (Dev, SenseSize, VIRTIO_SCSI_SENSE_SIZE);
   if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+    goto UninitQueues;
   }
 
   //
@@ -1137,9 +1908,11 @@ VirtioScsiInit (
   NextDevStat |= VSTAT_DRIVER_OK;
   Status       = Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, NextDevStat);
   if (EFI_ERROR (Status)) {
-    goto UnmapQueue;
+    goto UninitQueues;
   }
 
+  VirtioWaitPolicyInit (&Dev->WaitPolicy, PcdGet32 (PcdVirtioPollSpinUsecs));
+
   //
   // populate the exported interface's attributes
   //
@@ -1164,7 +1937,8 @@ VirtioScsiInit (
   // SCSI Pass Thru Protocol.
   //
   Dev->PassThruMode.Attributes = EFI_EXT_SCSI_PASS_THRU_ATTRIBUTES_PHYSICAL |
-                                 EFI_EXT_SCSI_PASS_THRU_ATTRIBUTES_LOGICAL;
+                                 EFI_EXT_SCSI_PASS_THRU_ATTRIBUTES_LOGICAL |
+                                 EFI_EXT_SCSI_PASS_THRU_ATTRIBUTES_NONBLOCKIO;
 
   //
   // no restriction on transfer buffer alignment
@@ -1173,11 +1947,15 @@ VirtioScsiInit (
 
   return EFI_SUCCESS;
 
-UnmapQueue:
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
+UninitQueues:
+  while (QueueIndex > 0) {
+    QueueIndex--;
+    VirtioScsiUninitQueue (Dev, &Dev->Queues[QueueIndex]);
+  }
 
-ReleaseQueue:
-  VirtioRingUninit (Dev->VirtIo, &Dev->Ring);
+  FreePool (Dev->Queues);
+  Dev->Queues    = NULL;
+  Dev->NumQueues = 0;
 
 Failed:
   //
@@ -1188,6 +1966,8 @@ Failed:
   Dev->VirtIo->SetDeviceStatus (Dev->VirtIo, NextDevStat);
 
   Dev->InOutSupported = FALSE;
+  Dev->IndirectDesc   = FALSE;
+  Dev->EventIdx       = FALSE;
   Dev->MaxTarget      = 0;
   Dev->MaxLun         = 0;
   Dev->MaxSectors     = 0;
@@ -1202,6 +1982,8 @@ VirtioScsiUninit (
   IN OUT VSCSI_DEV  *Dev
   )
 {
+  UINT16  QueueIndex;
+
   //
   // Reset the virtual device -- see virtio-0.9.5, 2.2.2.1 Device Status. When
   // VIRTIO_CFG_WRITE() returns, the host will have learned to stay away from
@@ -1214,8 +1996,25 @@ VirtioScsiUninit (
   Dev->MaxLun         = 0;
   Dev->MaxSectors     = 0;
 
-  Dev->VirtIo->UnmapSharedBuffer (Dev->VirtIo, Dev->RingMap);
-  VirtioRingUninit (Dev->VirtIo, &Dev->Ring);
+  if (Dev->TargetLuns != NULL) {
+    FreePool (Dev->TargetLuns);
+    Dev->TargetLuns = NULL;
+  }
+
+  Dev->NumTargetLuns = 0;
+  Dev->LunsScanned   = FALSE;
+
+  for (QueueIndex = 0; QueueIndex < Dev->NumQueues; QueueIndex++) {
+    VirtioScsiUninitQueue (Dev, &Dev->Queues[QueueIndex]);
+  }
+
+  FreePool (Dev->Queues);
+  Dev->Queues       = NULL;
+  Dev->NumQueues    = 0;
+  Dev->IndirectDesc = FALSE;
+  Dev->EventIdx     = FALSE;
+
+  VirtioWaitPolicyLogStats (__FUNCTION__, &Dev->WaitPolicy);
 
   SetMem (&Dev->PassThru, sizeof Dev->PassThru, 0x00);
   SetMem (&Dev->PassThruMode, sizeof Dev->PassThruMode, 0x00);
@@ -1356,6 +2155,27 @@ VirtioScsiDriverBindingStart (
     goto UninitDev;
   }
 
+  //
+  // Completions of non-blocking requests are reaped periodically, while any
+  // are in flight.
+  //
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_NOTIFY,
+                  &VirtioScsiPollTimer,
+                  Dev,
+                  &Dev->PollTimer
+                  );
+  if (EFI_ERROR (Status)) {
+    goto CloseExitBoot;
+  }
+
+  VirtioRequestPollTimerInit (
+    &Dev->Requests,
+    Dev->PollTimer,
+    VSCSI_POLL_PERIOD
+    );
+
   //
   // Setup complete, attempt to export the driver instance's PassThru
   // interface.
@@ -1368,11 +2188,14 @@ VirtioScsiDriverBindingStart (
                           &Dev->PassThru
                           );
   if (EFI_ERROR (Status)) {
-    goto CloseExitBoot;
+    goto ClosePollTimer;
   }
 
   return EFI_SUCCESS;
 
+ClosePollTimer:
+  gBS->CloseEvent (Dev->PollTimer);
+
 CloseExitBoot:
   gBS->CloseEvent (Dev->ExitBoot);
 
@@ -1405,6 +2228,7 @@ VirtioScsiDriverBindingStop (
   EFI_STATUS                       Status;
   EFI_EXT_SCSI_PASS_THRU_PROTOCOL  *PassThru;
   VSCSI_DEV                        *Dev;
+  EFI_TPL                          OldTpl;
 
   Status = gBS->OpenProtocol (
                   DeviceHandle,                     // candidate device
@@ -1432,6 +2256,15 @@ VirtioScsiDriverBindingStop (
     return Status;
   }
 
+  //
+  // Complete any non-blocking requests still in flight, and signal their
+  // events, before the ring goes away. This also cancels the poll timer.
+  //
+  OldTpl = gBS->RaiseTPL (TPL_NOTIFY);
+  VirtioRequestDrain (&Dev->Requests, OldTpl);
+  gBS->RestoreTPL (OldTpl);
+  gBS->CloseEvent (Dev->PollTimer);
+
   gBS->CloseEvent (Dev->ExitBoot);
 
   VirtioScsiUninit (Dev);
@@ -17,6 +17,8 @@
 #include <Protocol/ScsiPassThruExt.h>
 
 #include <IndustryStandard/Virtio.h>
+#include <IndustryStandard/VirtioScsi.h>
+#include <Library/VirtioLib.h>
 
 //
 // This driver supports 2-byte target identifiers and 4-byte LUN identifiers.
@@ -32,7 +34,43 @@
   #error "virtio-scsi requires TARGET_MAX_BYTES >= 4"
 #endif
 
-#define VSCSI_SIG  SIGNATURE_32 ('V', 'S', 'C', 'S')
+#define VSCSI_SIG      SIGNATURE_32 ('V', 'S', 'C', 'S')
+#define VSCSI_REQ_SIG  SIGNATURE_32 ('V', 'S', 'R', 'Q')
+
+//
+// Period of the timer event that reaps completed non-blocking requests, in
+// 100ns units.
+//
+#define VSCSI_POLL_PERIOD  EFI_TIMER_PERIOD_MILLISECONDS (1)
+
+//
+// The longest descriptor chain of a request: request, dataout, response,
+// datain.
+//
+#define VSCSI_MAX_CHAIN_DESC  4
+
+//
+// One virtio-scsi request queue, with the tracking of its in-flight requests.
+//
+typedef struct {
+  //
+  //                     field                    init function        init dpth
+  //                     ---------------------    -------------------  ---------
+  VRING                   Ring;                // VirtioRingInit       3
+  VOID                    *RingMap;            // VirtioRingMap        3
+  VIRTIO_REQUEST_QUEUE    ReqQueue;            // VirtioScsiInitQueue  2
+  VIRTIO_INDIRECT_POOL    Indirect;            // VirtioScsiInitQueue  2
+  VIRTIO_DMA_SLAB         ReqSlab;             // VirtioScsiInitQueue  2
+} VSCSI_QUEUE;
+
+//
+// The request header and the response of a request, taken from
+// VSCSI_QUEUE.ReqSlab, which is mapped once for the lifetime of the queue.
+//
+typedef struct {
+  VIRTIO_SCSI_REQ     Request;
+  VIRTIO_SCSI_RESP    Response;
+} VSCSI_SHARED_REQ;
 
 typedef struct {
   //
@@ -45,19 +83,63 @@ typedef struct {
   UINT32                             Signature;      // DriverBindingStart  0
   VIRTIO_DEVICE_PROTOCOL             *VirtIo;        // DriverBindingStart  0
   EFI_EVENT                          ExitBoot;       // DriverBindingStart  0
+  EFI_EVENT                          PollTimer;      // DriverBindingStart  0
   BOOLEAN                            InOutSupported; // VirtioScsiInit      1
+  BOOLEAN                            IndirectDesc;   // VirtioScsiInit      1
+  BOOLEAN                            EventIdx;       // VirtioScsiInit      1
   UINT16                             MaxTarget;      // VirtioScsiInit      1
   UINT32                             MaxLun;         // VirtioScsiInit      1
   UINT32                             MaxSectors;     // VirtioScsiInit      1
-  VRING                              Ring;           // VirtioRingInit      2
+  UINT16                             NumQueues;      // VirtioScsiInit      1
+  VSCSI_QUEUE                        *Queues;        // VirtioScsiInit      1
+  VIRTIO_REQUEST_QUEUE_SET           Requests;       // VirtioScsiInit      1
   EFI_EXT_SCSI_PASS_THRU_PROTOCOL    PassThru;       // VirtioScsiInit      1
   EFI_EXT_SCSI_PASS_THRU_MODE        PassThruMode;   // VirtioScsiInit      1
-  VOID                               *RingMap;       // VirtioRingMap       2
+  VIRTIO_WAIT_POLICY                 WaitPolicy;     // VirtioScsiInit      1
+  BOOLEAN                            LunsScanned;    // ScanTargetLuns      1
+  UINT32                             *TargetLuns;    // ScanTargetLuns      1
+  UINTN                              NumTargetLuns;  // ScanTargetLuns      1
 } VSCSI_DEV;
 
 #define VIRTIO_SCSI_FROM_PASS_THRU(PassThruPointer) \
         CR (PassThruPointer, VSCSI_DEV, PassThru, VSCSI_SIG)
 
+//
+// VSCSI_DEV.TargetLuns holds the populated (target, LUN) pairs of the HBA in
+// ascending order, each encoded in a UINT32 with the following macros.
+//
+#define VSCSI_TARGET_LUN(Target, Lun)  (((UINT32)(Target) << 16) | (UINT32)(Lun))
+#define VSCSI_TARGET_OF(TargetLun)     ((UINT16)((TargetLun) >> 16))
+#define VSCSI_LUN_OF(TargetLun)        ((UINT16)(TargetLun))
+
+//
+// The highest LUN listed for a target that fails REPORT LUNS, so that such a
+// target costs no more probing than with the default PcdVirtioScsiMaxLunLimit.
+//
+#define VSCSI_FALLBACK_MAX_LUN  7
+
+//
+// Tracking structure for one PassThru() call that has been submitted to the
+// host. Its address is the token of the descriptor chain in the ReqQueue of
+// VSCSI_DEV.Queues[QueueIndex]. Event is NULL for blocking calls; Completed
+// and Status are used by blocking calls only. Shared is taken from the
+// ReqSlab of the same queue.
+//
+typedef struct {
+  UINT32                                        Signature;
+  EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET    *Packet;
+  EFI_EVENT                                     Event;
+  UINT16                                        QueueIndex;
+  BOOLEAN                                       Completed;
+  EFI_STATUS                                    Status;
+  UINT32                                        InTransferLength;
+  UINT32                                        OutTransferLength;
+  volatile VSCSI_SHARED_REQ                     *Shared;
+  EFI_PHYSICAL_ADDRESS                          SharedDeviceAddress;
+  VOID                                          *InDataMapping;
+  VOID                                          *OutDataMapping;
+} VSCSI_REQ;
+
 //
 // Probe, start and stop functions of this driver, called by the DXE core for
 // specific devices.